@@ -0,0 +1,815 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Synthetic aged-image generator.
+ *
+ * Builds a VSFS image with a configurable number of inodes, directory
+ * fan-out and file size distribution.  Data blocks are handed out by a
+ * first-fit allocator while short-lived "ghost" files are created and
+ * deleted around the real ones, so the final layout carries the kind of
+ * fragmentation an image picks up after months of churn.  Optionally the
+ * journal is left holding N committed-but-not-installed transactions.
+ *
+ * Metadata is assembled in memory and the image is written front to back
+ * in large sequential chunks, so multi-GB fixtures build at disk speed.
+ */
+
+#define FS_MAGIC 0x56534653U
+#define JOURNAL_MAGIC 0x4A524E4CU
+
+#define BLOCK_SIZE        4096U
+#define INODE_SIZE         128U
+#define JOURNAL_BLOCK_IDX    1U
+#define JOURNAL_BLOCKS      16U
+#define DIRECT_POINTERS     8U
+#define NAME_LEN           28U
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+#define DIRENTS_PER_BLOCK  (BLOCK_SIZE / 32U)
+#define MAX_FILE_SIZE      (DIRECT_POINTERS * BLOCK_SIZE)
+#define DEFAULT_IMAGE "vsfs.img"
+
+enum RecordType { REC_DATA = 1, REC_COMMIT = 2 };
+
+struct superblock {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+
+    uint32_t journal_block;
+    uint32_t inode_bitmap;
+    uint32_t data_bitmap;
+    uint32_t inode_start;
+    uint32_t data_start;
+
+    uint8_t  _pad[128 - 9 * 4];
+};
+
+struct inode {
+    uint16_t type;
+    uint16_t links;
+    uint32_t size;
+
+    uint32_t direct[DIRECT_POINTERS];
+
+    uint32_t ctime;
+    uint32_t mtime;
+
+    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4)];
+};
+
+struct dirent {
+    uint32_t inode;
+    char name[NAME_LEN];
+};
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t nbytes_used;
+} __attribute__((packed));
+
+struct rec_header {
+    uint16_t type;
+    uint16_t size;
+} __attribute__((packed));
+
+struct data_record {
+    struct rec_header hdr;
+    uint32_t block_no;
+    uint8_t data[BLOCK_SIZE];
+} __attribute__((packed));
+
+struct commit_record {
+    struct rec_header hdr;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
+_Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
+_Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
+
+enum SizeDist { DIST_FIXED, DIST_UNIFORM, DIST_EXP };
+
+struct options {
+    const char *image_path;
+    uint32_t objects;        // files + directories below the root
+    uint32_t inode_count;    // 0 = derive from objects
+    uint32_t fanout;         // entries per directory
+    uint32_t subdirs;        // how many of those entries are directories
+    enum SizeDist dist;
+    uint32_t size_a;
+    uint32_t size_b;
+    uint32_t churn_pct;      // chance per object of ghost create/delete
+    uint32_t free_pct;       // spare data blocks on top of what is used
+    uint32_t data_blocks;    // 0 = derive
+    uint32_t pending;        // committed transactions left in the journal
+    uint32_t journal_blocks; // 0 = derive
+    uint32_t chunk_mb;
+    uint64_t seed;
+};
+
+struct object {
+    uint32_t parent;
+    uint16_t type;   // 1=file, 2=dir
+    uint32_t size;
+    uint32_t entries; // directories only: children, not counting "." / ".."
+    uint32_t subdirs;
+};
+
+struct ghost {
+    uint32_t blocks[DIRECT_POINTERS];
+    uint32_t count;
+};
+
+struct image {
+    struct superblock sb;
+    uint32_t inode_bmap_blocks;
+    uint32_t data_bmap_blocks;
+    uint32_t inode_blocks;
+    uint32_t data_blocks;
+    uint32_t journal_blocks;
+
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+    struct inode *inodes;
+    uint32_t *owner;        // data block index -> inode + 1, 0 when free
+    uint8_t **dir_blocks;   // inode -> DIRECT_POINTERS block buffers (dirs only)
+    uint32_t alloc_hint;
+    uint32_t used_blocks;
+};
+
+#define GHOST_OWNER 0xFFFFFFFFU
+
+static uint64_t rng_state;
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void fail(const char *msg) {
+    fprintf(stderr, "genimg: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static void *xcalloc(size_t n, size_t size, const char *what) {
+    void *p = calloc(n ? n : 1, size);
+    if (!p) {
+        die(what);
+    }
+    return p;
+}
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t rng_below(uint32_t bound) {
+    return bound ? (uint32_t)(rng_next() % bound) : 0;
+}
+
+static uint32_t div_round_up(uint64_t n, uint64_t d) {
+    return (uint32_t)((n + d - 1) / d);
+}
+
+static void set_bitmap(uint8_t *bitmap, uint32_t index) {
+    bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
+}
+
+static void clear_bitmap(uint8_t *bitmap, uint32_t index) {
+    bitmap[index / 8] &= (uint8_t)~(1U << (index % 8));
+}
+
+static int test_bitmap(const uint8_t *bitmap, uint32_t index) {
+    return (bitmap[index / 8] >> (index % 8)) & 0x1;
+}
+
+/* -ln(U) for U uniform on (0, 1], without pulling in libm. */
+static double neg_log_uniform(void) {
+    uint64_t r = rng_next() | 1;
+    int shift = __builtin_clzll(r);
+    double m = (double)(r << shift) / 18446744073709551616.0; // [0.5, 1)
+    double t = (m - 1.0) / (m + 1.0);
+    double t2 = t * t;
+    double ln_m = 2.0 * t * (1.0 + t2 / 3.0 + t2 * t2 / 5.0 + t2 * t2 * t2 / 7.0);
+    return -(ln_m - (double)shift * 0.69314718055994530942);
+}
+
+static uint32_t draw_file_size(const struct options *opt) {
+    uint64_t size;
+    switch (opt->dist) {
+    case DIST_UNIFORM:
+        size = opt->size_a + rng_below(opt->size_b - opt->size_a + 1);
+        break;
+    case DIST_EXP: {
+        // Inverse-CDF sample; mean is size_a.
+        size = (uint64_t)((double)opt->size_a * neg_log_uniform());
+        break;
+    }
+    case DIST_FIXED:
+    default:
+        size = opt->size_a;
+        break;
+    }
+    return size > MAX_FILE_SIZE ? MAX_FILE_SIZE : (uint32_t)size;
+}
+
+/* First-fit data block allocation; whole bitmap words are skipped while full. */
+static int alloc_data_block(struct image *img, uint32_t owner, uint32_t *out) {
+    uint32_t idx = img->alloc_hint;
+    while (idx < img->data_blocks) {
+        if ((idx % 64) == 0 && idx + 64 <= img->data_blocks) {
+            uint64_t word;
+            memcpy(&word, img->data_bitmap + idx / 8, sizeof(word));
+            if (word == ~0ULL) {
+                idx += 64;
+                continue;
+            }
+        }
+        if (!test_bitmap(img->data_bitmap, idx)) {
+            set_bitmap(img->data_bitmap, idx);
+            img->owner[idx] = owner;
+            img->alloc_hint = idx + 1;
+            img->used_blocks++;
+            *out = idx;
+            return 0;
+        }
+        idx++;
+    }
+    img->alloc_hint = img->data_blocks;
+    return -1;
+}
+
+static void free_data_block(struct image *img, uint32_t idx) {
+    clear_bitmap(img->data_bitmap, idx);
+    img->owner[idx] = 0;
+    img->used_blocks--;
+    if (idx < img->alloc_hint) {
+        img->alloc_hint = idx;
+    }
+}
+
+static void free_ghost(struct image *img, struct ghost *ghosts, uint32_t *ghost_count, uint32_t which) {
+    for (uint32_t b = 0; b < ghosts[which].count; ++b) {
+        free_data_block(img, ghosts[which].blocks[b]);
+    }
+    ghosts[which] = ghosts[--(*ghost_count)];
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [image]\n"
+            "  -n objects      files and directories to create below the root (default 1000)\n"
+            "  -i inodes       inode count (default: objects + pending + 12%% headroom)\n"
+            "  -f fanout       entries per directory, at most %u (default 64)\n"
+            "  -d subdirs      directories among each directory's entries (default fanout/16, min 1)\n"
+            "  -s dist         file sizes: fixed:N, uniform:MIN:MAX or exp:MEAN bytes (default exp:8192)\n"
+            "  -a churn%%       ghost create/delete probability per object, ages the layout (default 0)\n"
+            "  -F free%%        spare data blocks beyond those in use (default 10)\n"
+            "  -B blocks       data block count, overrides -F\n"
+            "  -j txns         committed transactions to leave pending in the journal (default 0)\n"
+            "  -J blocks       journal blocks (default %u, grown to fit -j)\n"
+            "  -w MiB          sequential write chunk size (default 8)\n"
+            "  -r seed         PRNG seed (default 1)\n",
+            prog, DIRECT_POINTERS * DIRENTS_PER_BLOCK - 2, JOURNAL_BLOCKS);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t parse_u32(const char *s, const char *prog) {
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(s, &end, 0);
+    if (errno || *end != '\0' || v > UINT32_MAX) {
+        usage(prog);
+    }
+    return (uint32_t)v;
+}
+
+static void parse_dist(struct options *opt, const char *s, const char *prog) {
+    unsigned long a = 0, b = 0;
+    if (sscanf(s, "fixed:%lu", &a) == 1) {
+        opt->dist = DIST_FIXED;
+    } else if (sscanf(s, "uniform:%lu:%lu", &a, &b) == 2 && a <= b) {
+        opt->dist = DIST_UNIFORM;
+    } else if (sscanf(s, "exp:%lu", &a) == 1) {
+        opt->dist = DIST_EXP;
+    } else {
+        usage(prog);
+    }
+    opt->size_a = a > MAX_FILE_SIZE ? MAX_FILE_SIZE : (uint32_t)a;
+    opt->size_b = b > MAX_FILE_SIZE ? MAX_FILE_SIZE : (uint32_t)b;
+}
+
+static void parse_options(struct options *opt, int argc, char *argv[]) {
+    memset(opt, 0, sizeof(*opt));
+    opt->image_path = DEFAULT_IMAGE;
+    opt->objects = 1000;
+    opt->fanout = 64;
+    opt->dist = DIST_EXP;
+    opt->size_a = 8192;
+    opt->free_pct = 10;
+    opt->chunk_mb = 8;
+    opt->seed = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:i:f:d:s:a:F:B:j:J:w:r:h")) != -1) {
+        switch (c) {
+        case 'n': opt->objects = parse_u32(optarg, argv[0]); break;
+        case 'i': opt->inode_count = parse_u32(optarg, argv[0]); break;
+        case 'f': opt->fanout = parse_u32(optarg, argv[0]); break;
+        case 'd': opt->subdirs = parse_u32(optarg, argv[0]); break;
+        case 's': parse_dist(opt, optarg, argv[0]); break;
+        case 'a': opt->churn_pct = parse_u32(optarg, argv[0]); break;
+        case 'F': opt->free_pct = parse_u32(optarg, argv[0]); break;
+        case 'B': opt->data_blocks = parse_u32(optarg, argv[0]); break;
+        case 'j': opt->pending = parse_u32(optarg, argv[0]); break;
+        case 'J': opt->journal_blocks = parse_u32(optarg, argv[0]); break;
+        case 'w': opt->chunk_mb = parse_u32(optarg, argv[0]); break;
+        case 'r': opt->seed = parse_u32(optarg, argv[0]); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        opt->image_path = argv[optind];
+    }
+
+    uint32_t max_fanout = DIRECT_POINTERS * DIRENTS_PER_BLOCK - 2;
+    if (opt->fanout == 0 || opt->fanout > max_fanout) {
+        fail("fanout must be between 1 and 1022");
+    }
+    if (opt->subdirs == 0) {
+        opt->subdirs = opt->fanout / 16 ? opt->fanout / 16 : 1;
+    }
+    if (opt->subdirs > opt->fanout) {
+        opt->subdirs = opt->fanout;
+    }
+    if (opt->churn_pct > 100) {
+        opt->churn_pct = 100;
+    }
+    if (opt->chunk_mb == 0) {
+        opt->chunk_mb = 1;
+    }
+    rng_state = opt->seed ? opt->seed * 0x9E3779B97F4A7C15ULL : 0x9E3779B97F4A7C15ULL;
+}
+
+/*
+ * Breadth-first tree: each directory takes up to `fanout` children, the
+ * first `subdirs` of which are directories that are queued for filling.
+ */
+static struct object *build_tree(const struct options *opt) {
+    uint32_t n = opt->objects;
+    struct object *objs = xcalloc((size_t)n + 1, sizeof(*objs), "calloc objects");
+    uint32_t *queue = xcalloc((size_t)n + 1, sizeof(uint32_t), "calloc dir queue");
+    uint32_t head = 0, tail = 0;
+
+    objs[0].type = 2;
+    objs[0].parent = 0;
+    queue[tail++] = 0;
+
+    uint32_t next = 1;
+    while (next <= n) {
+        if (head == tail) {
+            fail("directory tree ran out of parents (raise -d)");
+        }
+        uint32_t dir = queue[head++];
+        for (uint32_t k = 0; k < opt->fanout && next <= n; ++k, ++next) {
+            objs[next].parent = dir;
+            objs[dir].entries++;
+            if (k < opt->subdirs) {
+                objs[next].type = 2;
+                objs[dir].subdirs++;
+                queue[tail++] = next;
+            } else {
+                objs[next].type = 1;
+                objs[next].size = draw_file_size(opt);
+            }
+        }
+    }
+    free(queue);
+    return objs;
+}
+
+static uint32_t object_blocks(const struct object *obj) {
+    if (obj->type == 2) {
+        return div_round_up(((uint64_t)obj->entries + 2) * sizeof(struct dirent), BLOCK_SIZE);
+    }
+    return div_round_up(obj->size, BLOCK_SIZE);
+}
+
+static void compute_geometry(struct image *img, const struct options *opt, const struct object *objs) {
+    uint64_t used = 0;
+    for (uint32_t i = 0; i <= opt->objects; ++i) {
+        used += object_blocks(&objs[i]);
+    }
+    // Pending creates may spill the root directory into fresh blocks.
+    used += div_round_up(opt->pending, DIRENTS_PER_BLOCK);
+
+    uint32_t inode_count = opt->inode_count;
+    if (inode_count == 0) {
+        uint64_t want = (uint64_t)opt->objects + 1 + opt->pending;
+        want += want / 8;
+        inode_count = div_round_up(want, INODES_PER_BLOCK) * INODES_PER_BLOCK;
+    }
+    if ((uint64_t)inode_count < (uint64_t)opt->objects + 1 + opt->pending) {
+        fail("inode count too small for requested objects");
+    }
+
+    uint64_t data_blocks = opt->data_blocks;
+    if (data_blocks == 0) {
+        data_blocks = used + used * opt->free_pct / 100;
+        if (data_blocks < 64) {
+            data_blocks = 64;
+        }
+    }
+    if (data_blocks < used) {
+        fail("data region too small for requested objects");
+    }
+
+    uint64_t journal_need = sizeof(struct journal_header) +
+        (uint64_t)opt->pending * (6 * sizeof(struct data_record) + sizeof(struct commit_record));
+    uint32_t journal_blocks = opt->journal_blocks ? opt->journal_blocks : JOURNAL_BLOCKS;
+    if (journal_blocks < div_round_up(journal_need, BLOCK_SIZE)) {
+        journal_blocks = div_round_up(journal_need, BLOCK_SIZE);
+    }
+    if (journal_need > UINT32_MAX) {
+        fail("too many pending transactions for the journal header");
+    }
+
+    img->journal_blocks = journal_blocks;
+    img->inode_bmap_blocks = div_round_up(inode_count, BITS_PER_BLOCK);
+    img->inode_blocks = div_round_up(inode_count, INODES_PER_BLOCK);
+    img->data_bmap_blocks = div_round_up(data_blocks, BITS_PER_BLOCK);
+
+    uint64_t data_start = (uint64_t)JOURNAL_BLOCK_IDX + journal_blocks + img->inode_bmap_blocks +
+                          img->data_bmap_blocks + img->inode_blocks;
+    if (data_start + data_blocks > UINT32_MAX) {
+        fail("image exceeds 2^32 blocks");
+    }
+    img->data_blocks = (uint32_t)data_blocks;
+
+    struct superblock *sb = &img->sb;
+    memset(sb, 0, sizeof(*sb));
+    sb->magic = FS_MAGIC;
+    sb->block_size = BLOCK_SIZE;
+    sb->inode_count = inode_count;
+    sb->journal_block = JOURNAL_BLOCK_IDX;
+    sb->inode_bitmap = JOURNAL_BLOCK_IDX + journal_blocks;
+    sb->data_bitmap = sb->inode_bitmap + img->inode_bmap_blocks;
+    sb->inode_start = sb->data_bitmap + img->data_bmap_blocks;
+    sb->data_start = sb->inode_start + img->inode_blocks;
+    sb->total_blocks = sb->data_start + img->data_blocks;
+}
+
+static void allocate_object(struct image *img, struct ghost *ghosts, uint32_t *ghost_count,
+                            uint32_t ino, uint32_t nblocks) {
+    struct inode *node = &img->inodes[ino];
+    for (uint32_t b = 0; b < nblocks; ++b) {
+        uint32_t idx;
+        while (alloc_data_block(img, ino + 1, &idx) != 0) {
+            if (*ghost_count == 0) {
+                fail("data region exhausted");
+            }
+            free_ghost(img, ghosts, ghost_count, rng_below(*ghost_count));
+        }
+        node->direct[b] = img->sb.data_start + idx;
+    }
+}
+
+static void populate(struct image *img, const struct options *opt, const struct object *objs) {
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t max_ghosts = opt->objects / 4 + 16;
+    struct ghost *ghosts = xcalloc(max_ghosts, sizeof(*ghosts), "calloc ghosts");
+    uint32_t ghost_count = 0;
+
+    for (uint32_t ino = 0; ino <= opt->objects; ++ino) {
+        if (opt->churn_pct && rng_below(100) < opt->churn_pct) {
+            if (ghost_count < max_ghosts) {
+                struct ghost *g = &ghosts[ghost_count];
+                uint32_t want = 1 + rng_below(DIRECT_POINTERS);
+                g->count = 0;
+                while (g->count < want && alloc_data_block(img, GHOST_OWNER, &g->blocks[g->count]) == 0) {
+                    g->count++;
+                }
+                ghost_count++;
+            }
+            if (ghost_count && rng_below(100) < opt->churn_pct) {
+                free_ghost(img, ghosts, &ghost_count, rng_below(ghost_count));
+            }
+        }
+
+        const struct object *obj = &objs[ino];
+        struct inode *node = &img->inodes[ino];
+        set_bitmap(img->inode_bitmap, ino);
+        node->type = obj->type;
+        node->ctime = now;
+        node->mtime = now;
+        if (obj->type == 2) {
+            node->links = (uint16_t)(2 + obj->subdirs);
+            node->size = (obj->entries + 2) * (uint32_t)sizeof(struct dirent);
+            img->dir_blocks[ino] = xcalloc(DIRECT_POINTERS, BLOCK_SIZE, "calloc dir blocks");
+        } else {
+            node->links = 1;
+            node->size = obj->size;
+        }
+        allocate_object(img, ghosts, &ghost_count, ino, object_blocks(obj));
+    }
+
+    while (ghost_count > 0) {
+        free_ghost(img, ghosts, &ghost_count, ghost_count - 1);
+    }
+    free(ghosts);
+
+    // Fill directory blocks now that every child has its inode number.
+    uint32_t *fill = xcalloc((size_t)opt->objects + 1, sizeof(uint32_t), "calloc dir fill");
+    for (uint32_t ino = 0; ino <= opt->objects; ++ino) {
+        const struct object *obj = &objs[ino];
+        if (obj->type != 2) {
+            continue;
+        }
+        struct dirent *de = (struct dirent *)img->dir_blocks[ino];
+        de[0].inode = ino;
+        strcpy(de[0].name, ".");
+        de[1].inode = obj->parent;
+        strcpy(de[1].name, "..");
+        fill[ino] = 2;
+    }
+    for (uint32_t ino = 1; ino <= opt->objects; ++ino) {
+        uint32_t parent = objs[ino].parent;
+        struct dirent *de = (struct dirent *)img->dir_blocks[parent] + fill[parent]++;
+        de->inode = ino;
+        snprintf(de->name, NAME_LEN, "%c%u", objs[ino].type == 2 ? 'd' : 'f', ino);
+    }
+    free(fill);
+}
+
+/* Sequential writer: blocks are staged into one large buffer and written in chunks. */
+struct writer {
+    int fd;
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    uint64_t total;
+};
+
+static void writer_flush(struct writer *w) {
+    size_t off = 0;
+    while (off < w->len) {
+        ssize_t n = write(w->fd, w->buf + off, w->len - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("write");
+        }
+        off += (size_t)n;
+    }
+    w->total += w->len;
+    w->len = 0;
+}
+
+static uint8_t *writer_next(struct writer *w) {
+    if (w->len == w->cap) {
+        writer_flush(w);
+    }
+    uint8_t *blk = w->buf + w->len;
+    w->len += BLOCK_SIZE;
+    return blk;
+}
+
+static void writer_put(struct writer *w, const void *data, uint32_t nblocks) {
+    const uint8_t *src = data;
+    for (uint32_t i = 0; i < nblocks; ++i) {
+        memcpy(writer_next(w), src + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+}
+
+static void fill_file_block(uint8_t *blk, uint32_t ino, uint32_t fblk) {
+    uint64_t pattern = ((uint64_t)ino << 32) | fblk;
+    for (uint32_t off = 0; off < BLOCK_SIZE; off += sizeof(pattern)) {
+        memcpy(blk + off, &pattern, sizeof(pattern));
+    }
+}
+
+static void write_home(struct image *img, struct writer *w) {
+    uint8_t *blk = writer_next(w);
+    memset(blk, 0, BLOCK_SIZE);
+    memcpy(blk, &img->sb, sizeof(img->sb));
+
+    // The journal region is rewritten once pending transactions are known.
+    for (uint32_t i = 0; i < img->journal_blocks; ++i) {
+        memset(writer_next(w), 0, BLOCK_SIZE);
+    }
+    writer_put(w, img->inode_bitmap, img->inode_bmap_blocks);
+    writer_put(w, img->data_bitmap, img->data_bmap_blocks);
+    writer_put(w, img->inodes, img->inode_blocks);
+
+    for (uint32_t idx = 0; idx < img->data_blocks; ++idx) {
+        blk = writer_next(w);
+        uint32_t owner = img->owner[idx];
+        if (owner == 0) {
+            memset(blk, 0, BLOCK_SIZE);
+            continue;
+        }
+        uint32_t ino = owner - 1;
+        const struct inode *node = &img->inodes[ino];
+        uint32_t home = img->sb.data_start + idx;
+        uint32_t slot = 0;
+        while (slot < DIRECT_POINTERS && node->direct[slot] != home) {
+            slot++;
+        }
+        if (node->type == 2) {
+            memcpy(blk, img->dir_blocks[ino] + (size_t)slot * BLOCK_SIZE, BLOCK_SIZE);
+        } else {
+            fill_file_block(blk, ino, slot);
+        }
+    }
+    writer_flush(w);
+}
+
+/* Journal staging buffer, laid out exactly as journal.c reads it back. */
+struct journal_buf {
+    uint8_t *data;
+    size_t cap;
+    size_t used;
+};
+
+static void journal_log_block(struct journal_buf *jb, uint32_t block_no, const void *src) {
+    struct data_record *r = (struct data_record *)(jb->data + jb->used);
+    r->hdr.type = REC_DATA;
+    r->hdr.size = sizeof(struct data_record);
+    r->block_no = block_no;
+    memcpy(r->data, src, BLOCK_SIZE);
+    jb->used += sizeof(struct data_record);
+}
+
+static void journal_commit(struct journal_buf *jb) {
+    struct commit_record *c = (struct commit_record *)(jb->data + jb->used);
+    c->hdr.type = REC_COMMIT;
+    c->hdr.size = sizeof(struct commit_record);
+    jb->used += sizeof(struct commit_record);
+}
+
+/*
+ * One create in the root directory, logged the way journal.c logs it:
+ * every block the create touches goes into the transaction as a full image.
+ */
+static void pending_create(struct image *img, struct journal_buf *jb, uint32_t seq) {
+    uint32_t ino = 0;
+    while (ino < img->sb.inode_count && test_bitmap(img->inode_bitmap, ino)) {
+        ino++;
+    }
+    if (ino == img->sb.inode_count) {
+        fail("no free inode for pending transaction");
+    }
+
+    struct inode *root = &img->inodes[0];
+    uint32_t slot = root->size / sizeof(struct dirent);
+    uint32_t dslot = slot / DIRENTS_PER_BLOCK;
+    if (dslot >= DIRECT_POINTERS) {
+        fail("root directory full, cannot stage pending transactions");
+    }
+
+    uint32_t new_dir_idx = UINT32_MAX;
+    if (root->direct[dslot] == 0) {
+        if (alloc_data_block(img, 1, &new_dir_idx) != 0) {
+            fail("data region exhausted while staging pending transactions");
+        }
+        root->direct[dslot] = img->sb.data_start + new_dir_idx;
+    }
+
+    uint32_t now = (uint32_t)time(NULL);
+    set_bitmap(img->inode_bitmap, ino);
+    struct inode *node = &img->inodes[ino];
+    memset(node, 0, sizeof(*node));
+    node->type = 1;
+    node->links = 1;
+    node->ctime = now;
+    node->mtime = now;
+
+    struct dirent *de = (struct dirent *)img->dir_blocks[0] + slot;
+    de->inode = ino;
+    snprintf(de->name, NAME_LEN, "pending%u", seq);
+    root->size += sizeof(struct dirent);
+    root->mtime = now;
+
+    uint32_t ibmap_blk = ino / BITS_PER_BLOCK;
+    uint32_t itab_blk = ino / INODES_PER_BLOCK;
+    journal_log_block(jb, img->sb.inode_bitmap + ibmap_blk, img->inode_bitmap + (size_t)ibmap_blk * BLOCK_SIZE);
+    journal_log_block(jb, img->sb.inode_start + itab_blk, (uint8_t *)img->inodes + (size_t)itab_blk * BLOCK_SIZE);
+    if (itab_blk != 0) {
+        journal_log_block(jb, img->sb.inode_start, img->inodes);
+    }
+    if (new_dir_idx != UINT32_MAX) {
+        uint32_t dbmap_blk = new_dir_idx / BITS_PER_BLOCK;
+        journal_log_block(jb, img->sb.data_bitmap + dbmap_blk, img->data_bitmap + (size_t)dbmap_blk * BLOCK_SIZE);
+    }
+    journal_log_block(jb, root->direct[dslot], img->dir_blocks[0] + (size_t)dslot * BLOCK_SIZE);
+    journal_commit(jb);
+}
+
+static void write_journal(struct image *img, int fd, uint32_t pending) {
+    struct journal_buf jb;
+    jb.cap = (size_t)img->journal_blocks * BLOCK_SIZE;
+    jb.data = xcalloc(1, jb.cap, "calloc journal");
+    jb.used = sizeof(struct journal_header);
+
+    for (uint32_t t = 0; t < pending; ++t) {
+        pending_create(img, &jb, t);
+    }
+
+    struct journal_header *jh = (struct journal_header *)jb.data;
+    jh->magic = JOURNAL_MAGIC;
+    jh->nbytes_used = (uint32_t)jb.used;
+
+    size_t off = 0;
+    while (off < jb.cap) {
+        ssize_t n = pwrite(fd, jb.data + off, jb.cap - off,
+                           (off_t)JOURNAL_BLOCK_IDX * BLOCK_SIZE + (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("pwrite journal");
+        }
+        off += (size_t)n;
+    }
+    free(jb.data);
+}
+
+int main(int argc, char *argv[]) {
+    struct options opt;
+    parse_options(&opt, argc, argv);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    struct object *objs = build_tree(&opt);
+
+    struct image img;
+    memset(&img, 0, sizeof(img));
+    compute_geometry(&img, &opt, objs);
+
+    img.inode_bitmap = xcalloc(img.inode_bmap_blocks, BLOCK_SIZE, "calloc inode bitmap");
+    img.data_bitmap = xcalloc(img.data_bmap_blocks, BLOCK_SIZE, "calloc data bitmap");
+    img.inodes = xcalloc(img.inode_blocks, BLOCK_SIZE, "calloc inode table");
+    img.owner = xcalloc(img.data_blocks, sizeof(uint32_t), "calloc owner map");
+    img.dir_blocks = xcalloc(img.sb.inode_count, sizeof(uint8_t *), "calloc dir index");
+
+    populate(&img, &opt, objs);
+
+    int fd = open(opt.image_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        die("open");
+    }
+
+    struct writer w;
+    w.fd = fd;
+    w.cap = (size_t)opt.chunk_mb << 20;
+    w.cap -= w.cap % BLOCK_SIZE;
+    w.buf = malloc(w.cap);
+    if (!w.buf) {
+        die("malloc write buffer");
+    }
+    w.len = 0;
+    w.total = 0;
+    write_home(&img, &w);
+    write_journal(&img, fd, opt.pending);
+
+    if (fsync(fd) < 0) {
+        die("fsync");
+    }
+    if (close(fd) < 0) {
+        die("close");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("Created VSFS image '%s': %u blocks, %u inodes (%u used), %u/%u data blocks used, "
+           "%u pending transactions, %.1f MiB in %.2fs\n",
+           opt.image_path, img.sb.total_blocks, img.sb.inode_count, opt.objects + 1 + opt.pending,
+           img.used_blocks, img.data_blocks, opt.pending,
+           (double)w.total / (1024.0 * 1024.0), secs);
+
+    for (uint32_t i = 0; i < img.sb.inode_count; ++i) {
+        free(img.dir_blocks[i]);
+    }
+    free(img.dir_blocks);
+    free(img.owner);
+    free(img.inodes);
+    free(img.data_bitmap);
+    free(img.inode_bitmap);
+    free(w.buf);
+    free(objs);
+    return 0;
+}
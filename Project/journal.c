@@ -1,18 +1,38 @@
+#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
 
+#include "perfctr.h"
+#include "vsfs_heat.h"
+#include "vsfs_overlay.h"
+
 
 #define BLOCK_SIZE 4096
 #define FS_MAGIC 0x56534653      // "VSFS"
 #define JOURNAL_MAGIC 0x4A524E4C // "JRNL"
 #define NAME_LEN 28
-#define JOURNAL_BLOCKS 16
-
+#define FS_MODE_JOURNAL 0
+#define FS_MODE_COW 1
+#define COW_MAP_MAGIC 0x434D4150 // "CMAP"
+#define FS_FEAT_SNAPSHOT 0x2
+#define SNAP_MAGIC 0x534E4150    // "SNAP"
+#define SNAP_NAME_LEN 24
+#define REFS_PER_BLOCK (BLOCK_SIZE / 2)
+
+
+// One of the two root pointers of a copy-on-write image
+struct cow_root {
+    uint32_t map_block;
+    uint32_t gen;
+    uint32_t csum;
+} __attribute__((packed));
 
 // Strictly 128 bytes 
 struct superblock {
@@ -25,7 +45,11 @@ struct superblock {
     uint32_t data_bitmap;
     uint32_t inode_start;
     uint32_t data_start;
-    uint8_t _pad[128 - 9*4]; 
+    uint32_t mode;              // FS_MODE_JOURNAL or FS_MODE_COW
+    struct cow_root roots[2];   // CoW: the valid root with the higher gen is current
+    uint32_t features;
+    uint32_t refcount_start;    // snapshots: first block of the refcount table
+    uint8_t _pad[128 - 12*4 - 2*12]; 
 } __attribute__((packed));
 
 struct inode {
@@ -66,23 +90,86 @@ struct commit_record {
     struct rec_header hdr;
 } __attribute__((packed));
 
+// Head of a CoW map block; the entries that follow give the physical
+// location of each metadata block from the inode bitmap to the inode table
+// end, then in a snapshot image of the snapshot and refcount tables.
+struct cow_map_header {
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t count;
+    uint32_t csum;
+} __attribute__((packed));
+
+#define COW_MAP_MAX ((BLOCK_SIZE - sizeof(struct cow_map_header)) / sizeof(uint32_t))
+
+// The snapshot table, in the block before the refcount table.  A snapshot
+// is a map block kept out of the shadow pool's free space, along with every
+// shadow block it maps.
+struct snap_table_header {
+    uint32_t magic;
+    uint32_t count;
+} __attribute__((packed));
+
+struct snap_entry {
+    char name[SNAP_NAME_LEN];
+    uint32_t map_block;
+    uint32_t gen;
+    uint32_t ctime;
+    uint32_t _reserved;
+} __attribute__((packed));
+
+#define SNAP_MAX ((BLOCK_SIZE - sizeof(struct snap_table_header)) / sizeof(struct snap_entry))
+
 
 
-int fd;
+// vsfs.img, which may be an overlay of a read-only base image
+struct vsfs_image img;
 struct superblock sb;
 
+// -n: journaled creates are not flushed; a later `sync` makes them durable
+int durable = 1;
 
-void read_block(uint32_t block_num, void *buf) {
-    off_t offset = block_num * BLOCK_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        perror("lseek failed");
-        exit(1);
+// VSFS_HEAT=<buckets>: block reads and writes, printed on stderr at exit
+struct vsfs_heat heat;
+
+// CoW mode: the current map block and the root slot it came from
+uint8_t cow_mapbuf[BLOCK_SIZE];
+uint32_t *cow_map = (uint32_t *)(cow_mapbuf + sizeof(struct cow_map_header));
+int cow_slot = -1;
+
+// Snapshot images: the committed snapshot table and the map of each snapshot
+uint8_t snap_tablebuf[BLOCK_SIZE];
+struct snap_table_header *snap_hdr = (struct snap_table_header *)snap_tablebuf;
+struct snap_entry *snap_ents = (struct snap_entry *)(snap_tablebuf + sizeof(struct snap_table_header));
+uint8_t (*snap_maps)[BLOCK_SIZE];
+
+// Journal spans everything between its first block and the inode bitmap
+static uint32_t journal_blocks(void) {
+    return sb.inode_bitmap - sb.journal_block;
+}
+
+
+static void heat_bytes(off_t offset, size_t len, int write) {
+    if (heat.count && len) {
+        uint32_t first = (uint32_t)(offset / BLOCK_SIZE);
+        uint32_t last = (uint32_t)((offset + (off_t)len - 1) / BLOCK_SIZE);
+        vsfs_heat_note(&heat, first, last - first + 1, VSFS_HEAT_DIR, write);
     }
+}
+
+static void heat_report(void) {
+    fprintf(stderr, "heatmap of vsfs.img, %u block(s) per range\n", 1U << heat.shift);
+    vsfs_heat_dump(&heat, stderr);
+    vsfs_heat_free(&heat);
+}
+
+void read_block(uint32_t block_num, void *buf) {
+    off_t offset = (off_t)block_num * BLOCK_SIZE;
 
     size_t total_read = 0;
     char *ptr = (char *)buf; 
     while (total_read < BLOCK_SIZE) {
-        ssize_t bytes = read(fd, ptr + total_read, BLOCK_SIZE - total_read);
+        ssize_t bytes = vsfs_image_pread(&img, ptr + total_read, BLOCK_SIZE - total_read, offset + total_read);
         if (bytes < 0) { 
             perror("Read failed");
             exit(1);
@@ -93,17 +180,22 @@ void read_block(uint32_t block_num, void *buf) {
         }
         total_read += bytes;
     }
+    heat_bytes(offset, BLOCK_SIZE, 0);
 }
 
 
 void write_block(uint32_t block_num, void *buf) {
-    off_t offset = block_num * BLOCK_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == -1) {
-        perror("lseek failed");
+    off_t offset = (off_t)block_num * BLOCK_SIZE;
+    if (vsfs_image_pwrite(&img, buf, BLOCK_SIZE, offset) != BLOCK_SIZE) {
+        perror("Write failed");
         exit(1);
     }
-    if (write(fd, buf, BLOCK_SIZE) != BLOCK_SIZE) {
-        perror("Write failed");
+    heat_bytes(offset, BLOCK_SIZE, 1);
+}
+
+void sync_image() {
+    if (vsfs_image_sync(&img) < 0) {
+        perror("Sync failed");
         exit(1);
     }
 }
@@ -111,9 +203,325 @@ void write_block(uint32_t block_num, void *buf) {
 
 
 
+// FNV-1a, used for the root pointers and map blocks
+static uint32_t cow_csum(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t cow_map_csum(const uint8_t *map_block) {
+    const struct cow_map_header *mh = (const struct cow_map_header *)map_block;
+    uint32_t h = cow_csum(mh, offsetof(struct cow_map_header, csum));
+    return h ^ cow_csum(map_block + sizeof(*mh), mh->count * sizeof(uint32_t));
+}
+
+// Snapshot images map the snapshot and refcount tables after the metadata
+static int snapshots(void) {
+    return sb.mode == FS_MODE_COW && (sb.features & FS_FEAT_SNAPSHOT);
+}
+
+static uint32_t snap_table_block(void) {
+    return sb.refcount_start - 1;
+}
+
+static uint32_t cow_count(void) {
+    uint32_t count = sb.data_start - sb.inode_bitmap;
+    if (snapshots()) {
+        count += sb.total_blocks - snap_table_block();
+    }
+    return count;
+}
+
+// Position of a block in the CoW map, or -1 if it is never shadowed
+static int cow_index(uint32_t block_num) {
+    if (block_num >= sb.inode_bitmap && block_num < sb.data_start) {
+        return (int)(block_num - sb.inode_bitmap);
+    }
+    if (snapshots() && block_num >= snap_table_block() && block_num < sb.total_blocks) {
+        return (int)(sb.data_start - sb.inode_bitmap + block_num - snap_table_block());
+    }
+    return -1;
+}
+
+static int cow_map_valid(const uint8_t *map_block, uint32_t gen) {
+    const struct cow_map_header *mh = (const struct cow_map_header *)map_block;
+    return mh->magic == COW_MAP_MAGIC && mh->gen == gen && mh->count == cow_count() &&
+           mh->csum == cow_map_csum(map_block);
+}
+
+// Picks the newest root whose pointer and map block both check out.
+// Recovery in CoW mode is nothing more than this.
+int cow_load() {
+    if (snapshots() && (sb.refcount_start <= sb.data_start + 1 || sb.refcount_start >= sb.total_blocks)) {
+        fprintf(stderr, "Error: damaged snapshot table location\n");
+        return -1;
+    }
+    if (cow_count() > COW_MAP_MAX) {
+        fprintf(stderr, "Error: too many metadata blocks for a CoW map\n");
+        return -1;
+    }
+    int order[2] = { 0, 1 };
+    if (sb.roots[1].gen > sb.roots[0].gen) {
+        order[0] = 1;
+        order[1] = 0;
+    }
+    for (int k = 0; k < 2; k++) {
+        struct cow_root *r = &sb.roots[order[k]];
+        if (r->gen == 0 || r->csum != cow_csum(r, offsetof(struct cow_root, csum)) ||
+            r->map_block < sb.journal_block || r->map_block >= sb.inode_bitmap) {
+            continue;
+        }
+        read_block(r->map_block, cow_mapbuf);
+        if (!cow_map_valid(cow_mapbuf, r->gen)) {
+            continue;
+        }
+        cow_slot = order[k];
+        return 0;
+    }
+    fprintf(stderr, "Error: no valid copy-on-write root\n");
+    return -1;
+}
+
+// Reads a block through the given CoW map
+static void map_read(const uint32_t *map, uint32_t block_num, void *buf) {
+    int idx = cow_index(block_num);
+    if (idx >= 0) {
+        block_num = map[idx];
+    }
+    read_block(block_num, buf);
+}
+
+// Reads a metadata block through the CoW map when the image has one
+void meta_read(uint32_t block_num, void *buf) {
+    if (sb.mode == FS_MODE_COW) {
+        map_read(cow_map, block_num, buf);
+        return;
+    }
+    read_block(block_num, buf);
+}
+
+static const uint32_t *snap_map(uint32_t s) {
+    return (const uint32_t *)(snap_maps[s] + sizeof(struct cow_map_header));
+}
+
+// Loads the snapshot table of the current root and every snapshot's map
+int snap_load() {
+    free(snap_maps);
+    meta_read(snap_table_block(), snap_tablebuf);
+    if (snap_hdr->magic != SNAP_MAGIC || snap_hdr->count > SNAP_MAX) {
+        fprintf(stderr, "Error: damaged snapshot table\n");
+        return -1;
+    }
+    snap_maps = malloc((snap_hdr->count ? snap_hdr->count : 1) * sizeof(*snap_maps));
+    if (!snap_maps) {
+        perror("malloc");
+        exit(1);
+    }
+    for (uint32_t s = 0; s < snap_hdr->count; s++) {
+        struct snap_entry *e = &snap_ents[s];
+        if (e->map_block < sb.journal_block || e->map_block >= sb.inode_bitmap) {
+            fprintf(stderr, "Error: snapshot '%.*s' has a damaged root\n", SNAP_NAME_LEN, e->name);
+            return -1;
+        }
+        read_block(e->map_block, snap_maps[s]);
+        if (!cow_map_valid(snap_maps[s], e->gen)) {
+            fprintf(stderr, "Error: snapshot '%.*s' has a damaged map\n", SNAP_NAME_LEN, e->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Publishes a transaction in CoW mode: each modified metadata block is
+// written once, to a shadow block not referenced by the current root or
+// by any snapshot, then a new map block, and finally the root pointer in
+// the superblock.  The spare root slot is overwritten, so a torn
+// superblock write leaves the current root intact.  `reserve` pool blocks
+// must stay free afterwards.
+int cow_commit(int n, const uint32_t *logical, uint8_t *const *bufs, uint32_t reserve) {
+    uint32_t pool = sb.inode_bitmap - sb.journal_block;
+    uint8_t *busy = calloc(pool, 1);
+    if (!busy) {
+        perror("calloc");
+        exit(1);
+    }
+    struct cow_map_header *mh = (struct cow_map_header *)cow_mapbuf;
+    busy[sb.roots[cow_slot].map_block - sb.journal_block] = 1;
+    for (uint32_t i = 0; i < mh->count; i++) {
+        if (cow_map[i] >= sb.journal_block && cow_map[i] < sb.inode_bitmap) {
+            busy[cow_map[i] - sb.journal_block] = 1;
+        }
+    }
+    for (uint32_t s = 0; snapshots() && s < snap_hdr->count; s++) {
+        busy[snap_ents[s].map_block - sb.journal_block] = 1;
+        for (uint32_t i = 0; i < mh->count; i++) {
+            uint32_t phys = snap_map(s)[i];
+            if (phys >= sb.journal_block && phys < sb.inode_bitmap) {
+                busy[phys - sb.journal_block] = 1;
+            }
+        }
+    }
+
+    uint32_t nfree = 0;
+    for (uint32_t i = 0; i < pool; i++) {
+        nfree += !busy[i];
+    }
+    if (nfree < (uint32_t)n + 1 + reserve) {
+        printf("Error: shadow pool exhausted%s\n", reserve ? "; delete a snapshot first" : "");
+        free(busy);
+        return -1;
+    }
+
+    uint8_t newmap[BLOCK_SIZE];
+    memcpy(newmap, cow_mapbuf, BLOCK_SIZE);
+    uint32_t *entries = (uint32_t *)(newmap + sizeof(struct cow_map_header));
+    uint32_t next = 0;
+    for (int i = 0; i <= n; i++) {
+        while (busy[next]) {
+            next++;
+        }
+        uint32_t phys = sb.journal_block + next;
+        busy[next] = 1;
+        if (i == n) {
+            struct cow_map_header *nh = (struct cow_map_header *)newmap;
+            nh->gen = mh->gen + 1;
+            nh->csum = cow_map_csum(newmap);
+            write_block(phys, newmap);
+            sync_image();
+
+            int slot = 1 - cow_slot;
+            struct cow_root r = { phys, nh->gen, 0 };
+            r.csum = cow_csum(&r, offsetof(struct cow_root, csum));
+            sb.roots[slot] = r;
+            uint8_t sb_block[BLOCK_SIZE];
+            read_block(0, sb_block);
+            memcpy(sb_block, &sb, sizeof(sb));
+            write_block(0, sb_block);
+            sync_image();
+
+            memcpy(cow_mapbuf, newmap, BLOCK_SIZE);
+            cow_slot = slot;
+        } else {
+            write_block(phys, bufs[i]);
+            entries[cow_index(logical[i])] = phys;
+        }
+    }
+    free(busy);
+    return 0;
+}
+
+
+/*
+ * Data blocks of a snapshot image carry a reference count: the number of
+ * pointers to the block from distinct inode table blocks reachable from
+ * the current root or any snapshot.  Taking a snapshot shares every block
+ * without touching a count.  Counts move when sharing ends: the first
+ * time the current root shadows an inode table block that a snapshot
+ * still maps, both copies point at the same data, so each of its blocks
+ * gains a reference; deleting a snapshot drops the references of the
+ * inode table blocks only it maps.  A data block stays marked in the
+ * current data bitmap until its count reaches zero.
+ */
+uint16_t *refs;          // the whole refcount table, loaded by refs_load()
+uint32_t ref_blocks;
+uint8_t *refs_dirty;     // refcount table blocks changed by this transaction
+
+// Loads the committed counts, dropping any left by a failed transaction
+void refs_load() {
+    free(refs);
+    free(refs_dirty);
+    ref_blocks = sb.total_blocks - sb.refcount_start;
+    refs = malloc((size_t)ref_blocks * BLOCK_SIZE);
+    refs_dirty = calloc(ref_blocks, 1);
+    if (!refs || !refs_dirty) {
+        perror("malloc");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < ref_blocks; i++) {
+        meta_read(sb.refcount_start + i, (uint8_t *)refs + (size_t)i * BLOCK_SIZE);
+    }
+}
+
+// Adjusts the count of one data block; returns the new count
+static uint16_t ref_add(uint32_t block_num, int delta) {
+    uint32_t idx = block_num - sb.data_start;
+    refs[idx] = (uint16_t)(refs[idx] + delta);
+    refs_dirty[idx / REFS_PER_BLOCK] = 1;
+    return refs[idx];
+}
+
+// Adds every data pointer in an inode table block to the counts
+static void ref_children(const uint8_t *inode_block, int delta, uint32_t *freed, int *nfreed) {
+    const struct inode *inodes = (const struct inode *)inode_block;
+    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(struct inode); i++) {
+        for (int d = 0; inodes[i].type != 0 && d < 8; d++) {
+            uint32_t b = inodes[i].direct[d];
+            if (b < sb.data_start || b >= snap_table_block()) {
+                continue;
+            }
+            if (ref_add(b, delta) == 0 && freed) {
+                freed[(*nfreed)++] = b;
+            }
+        }
+    }
+}
+
+// Whether a snapshot maps this physical block at this map position
+static int snap_shares(uint32_t idx, uint32_t phys, int skip) {
+    for (uint32_t s = 0; s < snap_hdr->count; s++) {
+        if ((int)s != skip && snap_map(s)[idx] == phys) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Called before the current root shadows an inode table block
+static void snap_unshare(uint32_t block_num) {
+    int idx = cow_index(block_num);
+    if (!snap_shares((uint32_t)idx, cow_map[idx], -1)) {
+        return;
+    }
+    uint8_t old[BLOCK_SIZE];
+    read_block(cow_map[idx], old);
+    ref_children(old, 1, NULL, NULL);
+}
+
+// Pool blocks a snapshot deletion may need: the snapshot table, the data
+// bitmap, the refcount table and a new map.  Other transactions leave this
+// many free so that a full pool can always be drained.
+static uint32_t snap_reserve(void) {
+    if (!snapshots()) {
+        return 0;
+    }
+    return 1 + (sb.inode_start - sb.data_bitmap) + (sb.total_blocks - sb.refcount_start) + 1;
+}
+
+// Appends the refcount table blocks this transaction changed
+static int refs_log(int n, uint32_t *logical, uint8_t **bufs) {
+    for (uint32_t i = 0; i < ref_blocks; i++) {
+        if (refs_dirty[i]) {
+            logical[n] = sb.refcount_start + i;
+            bufs[n++] = (uint8_t *)refs + (size_t)i * BLOCK_SIZE;
+            refs_dirty[i] = 0;
+        }
+    }
+    return n;
+}
+
+
 void do_install() {
+    if (sb.mode == FS_MODE_COW) {
+        // Nothing is ever pending: the current root is always consistent.
+        return;
+    }
+
     uint8_t *jbuf = NULL;
-    size_t jsize = JOURNAL_BLOCKS * BLOCK_SIZE;
+    size_t jsize = (size_t)journal_blocks() * BLOCK_SIZE;
 
     jbuf = malloc(jsize);
     if (!jbuf) {
@@ -122,7 +530,7 @@ void do_install() {
     }
 
     
-    for (int i = 0; i < JOURNAL_BLOCKS; i++) {
+    for (uint32_t i = 0; i < journal_blocks(); i++) {
         read_block(sb.journal_block + i, jbuf + i * BLOCK_SIZE);
     }
 
@@ -141,6 +549,14 @@ void do_install() {
 
     size_t pos = sizeof(struct journal_header);
 
+    // VSFS_PERF=1 reports hardware counters for the record scan and replay
+    struct perfctr pc;
+    memset(&pc, -1, sizeof(pc));
+    if (getenv("VSFS_PERF")) {
+        perfctr_open(&pc, 0, 0);
+        perfctr_enable(&pc);
+    }
+
     
     struct {
         uint32_t block_no;
@@ -191,6 +607,15 @@ void do_install() {
         pos += rh->size;
     }
 
+    if (getenv("VSFS_PERF")) {
+        struct perfctr_values pv;
+        char line[256];
+        perfctr_read(&pc, &pv);
+        perfctr_format(&pv, line, sizeof(line));
+        fprintf(stderr, "perf replay %s\n", line);
+        perfctr_close(&pc);
+    }
+
    
     memset(jbuf, 0, jsize);
     jh = (struct journal_header *)jbuf;
@@ -198,7 +623,7 @@ void do_install() {
     jh->nbytes_used = sizeof(struct journal_header);
 
     // Write cleared journal blocks back to disk
-    for (int i = 0; i < JOURNAL_BLOCKS; i++) {
+    for (uint32_t i = 0; i < journal_blocks(); i++) {
         write_block(sb.journal_block + i, jbuf + i * BLOCK_SIZE);
     }
 
@@ -209,6 +634,110 @@ void do_install() {
 
 
 
+// Journaled mode: the last committed copy of each block logged but not yet
+// installed.  Loaded from the journal on first use, then kept up to date
+// by do_create as it appends transactions.
+struct logged_block {
+    uint32_t block_no;
+    uint8_t data[BLOCK_SIZE];
+};
+struct logged_block *logged;
+size_t logged_cnt, logged_cap;
+int logged_loaded;
+
+static struct logged_block *logged_find(uint32_t block_num) {
+    for (size_t i = 0; i < logged_cnt; i++) {
+        if (logged[i].block_no == block_num) {
+            return &logged[i];
+        }
+    }
+    return NULL;
+}
+
+static void logged_put(uint32_t block_num, const void *data) {
+    struct logged_block *lb = logged_find(block_num);
+    if (!lb) {
+        if (logged_cnt == logged_cap) {
+            size_t newcap = logged_cap ? logged_cap * 2 : 8;
+            logged = realloc(logged, newcap * sizeof(*logged));
+            if (!logged) { perror("realloc"); exit(1); }
+            logged_cap = newcap;
+        }
+        lb = &logged[logged_cnt++];
+        lb->block_no = block_num;
+    }
+    memcpy(lb->data, data, BLOCK_SIZE);
+}
+
+// Same walk as do_install, over one read of the used part of the journal
+static void logged_load(void) {
+    logged_loaded = 1;
+    off_t base = (off_t)sb.journal_block * BLOCK_SIZE;
+    struct journal_header jh;
+    if (vsfs_image_pread(&img, &jh, sizeof(jh), base) != sizeof(jh)) {
+        return;
+    }
+    heat_bytes(base, sizeof(jh), 0);
+    if (jh.magic != JOURNAL_MAGIC || jh.nbytes_used <= sizeof(jh) ||
+        jh.nbytes_used > (size_t)journal_blocks() * BLOCK_SIZE) {
+        return;
+    }
+
+    uint8_t *jbuf = malloc(jh.nbytes_used);
+    if (!jbuf) {
+        perror("malloc");
+        exit(1);
+    }
+    if (vsfs_image_pread(&img, jbuf, jh.nbytes_used, base) != (ssize_t)jh.nbytes_used) {
+        free(jbuf);
+        return;
+    }
+    heat_bytes(base, jh.nbytes_used, 0);
+
+    size_t *recs = NULL, recs_cap = 0, pending = 0;   // DATA records of the open transaction
+    size_t pos = sizeof(struct journal_header);
+    while (pos + sizeof(struct rec_header) <= jh.nbytes_used) {
+        struct rec_header *rh = (struct rec_header *)(jbuf + pos);
+        if (rh->size == 0 || pos + rh->size > jh.nbytes_used) break;
+
+        if (rh->type == REC_DATA && rh->size == sizeof(struct data_record)) {
+            if (pending == recs_cap) {
+                recs_cap = recs_cap ? recs_cap * 2 : 16;
+                recs = realloc(recs, recs_cap * sizeof(*recs));
+                if (!recs) { perror("realloc"); exit(1); }
+            }
+            recs[pending++] = pos;
+        } else if (rh->type == REC_COMMIT) {
+            for (size_t i = 0; i < pending; i++) {
+                struct data_record *r = (struct data_record *)(jbuf + recs[i]);
+                logged_put(r->block_no, r->data);
+            }
+            pending = 0;
+        }
+
+        pos += rh->size;
+    }
+
+    free(recs);
+    free(jbuf);
+}
+
+// Reads a block as the next transaction sees it: through the CoW map, or
+// with the last copy logged by a committed but not yet installed transaction
+static void logged_read(uint32_t block_num, void *buf) {
+    if (sb.mode != FS_MODE_COW) {
+        if (!logged_loaded) {
+            logged_load();
+        }
+        struct logged_block *lb = logged_find(block_num);
+        if (lb) {
+            memcpy(buf, lb->data, BLOCK_SIZE);
+            return;
+        }
+    }
+    meta_read(block_num, buf);
+}
+
 void do_create(char *filename) {
     uint8_t ibmap[BLOCK_SIZE];
     uint8_t dblock[BLOCK_SIZE];
@@ -216,7 +745,7 @@ void do_create(char *filename) {
     uint8_t root_inode_block[BLOCK_SIZE]; // Might be needed separately
 
     // 1. Read Inode Bitmap
-    read_block(sb.inode_bitmap, ibmap);
+    logged_read(sb.inode_bitmap, ibmap);
     
     // Find free inode
     int chosen_inode = -1;
@@ -239,7 +768,7 @@ void do_create(char *filename) {
     uint32_t new_inode_blk_offset = chosen_inode / inodes_per_block;
     uint32_t new_inode_real_block = sb.inode_start + new_inode_blk_offset;
     
-    read_block(new_inode_real_block, new_inode_block);
+    logged_read(new_inode_real_block, new_inode_block);
     
     struct inode *inodes_arr = (struct inode *)new_inode_block;
     int inode_idx_in_block = chosen_inode % inodes_per_block;
@@ -257,7 +786,7 @@ void do_create(char *filename) {
         inodes_arr[0].size += sizeof(struct dirent);
     } else {
       
-        read_block(sb.inode_start, root_inode_block);
+        logged_read(sb.inode_start, root_inode_block);
         struct inode *root_ptr = (struct inode *)root_inode_block;
         root_ptr[0].size += sizeof(struct dirent);
         root_inode_needs_log = 1;
@@ -266,11 +795,11 @@ void do_create(char *filename) {
 
    
     uint8_t temp_root[BLOCK_SIZE];
-    read_block(sb.inode_start, temp_root);
+    logged_read(sb.inode_start, temp_root);
     struct inode *root_node = (struct inode *)temp_root;
     uint32_t root_dir_data_block = root_node->direct[0]; 
 
-    read_block(root_dir_data_block, dblock);
+    logged_read(root_dir_data_block, dblock);
     struct dirent *d = (struct dirent *)dblock;
     
     int dir_index = -1;
@@ -289,13 +818,72 @@ void do_create(char *filename) {
     d[dir_index].inode = chosen_inode;
     strncpy(d[dir_index].name, filename, NAME_LEN);
 
+    if (sb.mode == FS_MODE_COW) {
+        // The directory block is shadowed too: write it to a free data
+        // block, repoint the root inode and swap the bitmap bits.
+        uint8_t dbmap[BLOCK_SIZE];
+        uint32_t old_bit = root_dir_data_block - sb.data_start;
+        uint32_t dbmap_blk = sb.data_bitmap + old_bit / (BLOCK_SIZE * 8);
+        uint32_t data_blocks = sb.total_blocks - sb.data_start;
+        meta_read(dbmap_blk, dbmap);
+
+        uint32_t base = (dbmap_blk - sb.data_bitmap) * BLOCK_SIZE * 8;
+        int new_bit = -1;
+        for (uint32_t b = 0; b < BLOCK_SIZE * 8 && base + b < data_blocks; b++) {
+            if ((dbmap[b / 8] & (1 << (b % 8))) == 0) {
+                new_bit = b;
+                break;
+            }
+        }
+        if (new_bit < 0) {
+            printf("Error: No free data blocks\n");
+            return;
+        }
+        uint32_t new_dir_block = sb.data_start + base + new_bit;
+        dbmap[new_bit / 8] |= 1 << (new_bit % 8);
+        // With snapshots the old directory block is only freed once no
+        // snapshot points at it any more.
+        int free_old = 1;
+        if (snapshots()) {
+            refs_load();
+            snap_unshare(new_inode_real_block);
+            if (root_inode_needs_log) {
+                snap_unshare(sb.inode_start);
+            }
+            ref_add(new_dir_block, 1);
+            free_old = ref_add(root_dir_data_block, -1) == 0;
+        }
+        if (free_old) {
+            dbmap[(old_bit - base) / 8] &= ~(1 << ((old_bit - base) % 8));
+        }
+        write_block(new_dir_block, dblock);
+
+        struct inode *root_ptr = root_inode_needs_log ? (struct inode *)root_inode_block : inodes_arr;
+        root_ptr->direct[0] = new_dir_block;
+
+        uint32_t logical[6];
+        uint8_t *bufs[6];
+        int n = 0;
+        logical[n] = sb.inode_bitmap;       bufs[n++] = ibmap;
+        logical[n] = new_inode_real_block;  bufs[n++] = new_inode_block;
+        if (root_inode_needs_log) {
+            logical[n] = sb.inode_start;    bufs[n++] = root_inode_block;
+        }
+        logical[n] = dbmap_blk;             bufs[n++] = dbmap;
+        if (snapshots()) {
+            n = refs_log(n, logical, bufs);
+        }
+        cow_commit(n, logical, bufs, snap_reserve());
+        return;
+    }
+
 
     // 5. Journaling
     struct journal_header jh;
-    lseek(fd, sb.journal_block * BLOCK_SIZE, SEEK_SET);
-    if (read(fd, &jh, sizeof(struct journal_header)) != sizeof(struct journal_header)) {
+    if (vsfs_image_pread(&img, &jh, sizeof(jh), (off_t)sb.journal_block * BLOCK_SIZE) != sizeof(jh)) {
         return;
     }
+    heat_bytes((off_t)sb.journal_block * BLOCK_SIZE, sizeof(jh), 0);
 
     if (jh.magic != JOURNAL_MAGIC) {
         jh.magic = JOURNAL_MAGIC;
@@ -306,7 +894,7 @@ void do_create(char *filename) {
     int blocks_to_log = 3 + root_inode_needs_log;
     size_t transaction_size = blocks_to_log * sizeof(struct data_record) + sizeof(struct commit_record);
     
-    if (jh.nbytes_used + transaction_size > JOURNAL_BLOCKS * BLOCK_SIZE) {
+    if (jh.nbytes_used + transaction_size > (size_t)journal_blocks() * BLOCK_SIZE) {
         printf("Journal full. Please run install.\n");
         return;
     }
@@ -320,8 +908,8 @@ void do_create(char *filename) {
         r.hdr.size = sizeof(struct data_record); \
         r.block_no = (target_blk); \
         memcpy(r.data, (src_buf), BLOCK_SIZE); \
-        lseek(fd, write_pos, SEEK_SET); \
-        write(fd, &r, sizeof(struct data_record)); \
+        vsfs_image_pwrite(&img, &r, sizeof(struct data_record), write_pos); \
+        heat_bytes(write_pos, sizeof(struct data_record), 1); \
         write_pos += sizeof(struct data_record); \
     }
 
@@ -339,30 +927,209 @@ void do_create(char *filename) {
     c.hdr.type = REC_COMMIT;
     c.hdr.size = sizeof(struct commit_record);
     
-    lseek(fd, write_pos, SEEK_SET);
-    write(fd, &c, sizeof(struct commit_record));
+    vsfs_image_pwrite(&img, &c, sizeof(struct commit_record), write_pos);
+    heat_bytes(write_pos, sizeof(struct commit_record), 1);
     write_pos += sizeof(struct commit_record);
 
     // Update Header
     jh.nbytes_used = write_pos - (sb.journal_block * BLOCK_SIZE);
-    lseek(fd, sb.journal_block * BLOCK_SIZE, SEEK_SET);
-    write(fd, &jh, sizeof(struct journal_header));
+    vsfs_image_pwrite(&img, &jh, sizeof(struct journal_header), (off_t)sb.journal_block * BLOCK_SIZE);
+    heat_bytes((off_t)sb.journal_block * BLOCK_SIZE, sizeof(struct journal_header), 1);
 
-    fsync(fd);
+    // The next create in this run sees this transaction without rereading the journal
+    logged_put(sb.inode_bitmap, ibmap);
+    logged_put(new_inode_real_block, new_inode_block);
+    if (root_inode_needs_log) {
+        logged_put(sb.inode_start, root_inode_block);
+    }
+    logged_put(root_dir_data_block, dblock);
 }
 
 
 
 
+static int snap_find(const char *name) {
+    for (uint32_t s = 0; s < snap_hdr->count; s++) {
+        if (strncmp(snap_ents[s].name, name, SNAP_NAME_LEN) == 0) {
+            return (int)s;
+        }
+    }
+    return -1;
+}
+
+// A snapshot is one new table entry holding on to the current root's map,
+// and through it to every block that map reaches.  Nothing is copied and
+// no reference count changes.
+void do_snap_create(const char *name) {
+    if (name[0] == '\0' || strlen(name) >= SNAP_NAME_LEN) {
+        printf("Error: snapshot names are 1 to %d characters\n", SNAP_NAME_LEN - 1);
+        return;
+    }
+    if (snap_find(name) >= 0) {
+        printf("Error: snapshot '%s' exists\n", name);
+        return;
+    }
+    if (snap_hdr->count == SNAP_MAX) {
+        printf("Error: snapshot table full\n");
+        return;
+    }
+    uint8_t table[BLOCK_SIZE];
+    memcpy(table, snap_tablebuf, BLOCK_SIZE);
+    struct snap_table_header *th = (struct snap_table_header *)table;
+    struct snap_entry *e = (struct snap_entry *)(table + sizeof(*th)) + th->count++;
+    memset(e, 0, sizeof(*e));
+    memcpy(e->name, name, strlen(name));
+    e->map_block = sb.roots[cow_slot].map_block;
+    e->gen = ((struct cow_map_header *)cow_mapbuf)->gen;
+    e->ctime = (uint32_t)time(NULL);
+
+    uint32_t logical[1] = { snap_table_block() };
+    uint8_t *bufs[1] = { table };
+    if (cow_commit(1, logical, bufs, snap_reserve()) == 0) {
+        snap_load();
+    }
+}
+
+// Drops a snapshot.  Inode table blocks that no other root maps take
+// their data references with them, and data blocks left with none are
+// freed in the current data bitmap.
+void do_snap_delete(const char *name) {
+    int s = snap_find(name);
+    if (s < 0) {
+        printf("Error: no snapshot '%s'\n", name);
+        return;
+    }
+    refs_load();
+    uint32_t data_blocks = sb.total_blocks - sb.data_start;
+    uint32_t dbmap_blocks = sb.inode_start - sb.data_bitmap;
+    uint32_t *freed = malloc(data_blocks * sizeof(uint32_t));
+    uint8_t *dbmap = malloc((size_t)dbmap_blocks * BLOCK_SIZE);
+    uint8_t *dbmap_dirty = calloc(dbmap_blocks, 1);
+    uint32_t *logical = malloc((1 + dbmap_blocks + ref_blocks + 1) * sizeof(uint32_t));
+    uint8_t **bufs = malloc((1 + dbmap_blocks + ref_blocks + 1) * sizeof(uint8_t *));
+    if (!freed || !dbmap || !dbmap_dirty || !logical || !bufs) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int nfreed = 0;
+    uint8_t blk[BLOCK_SIZE];
+    for (uint32_t b = sb.inode_start; b < sb.data_start; b++) {
+        uint32_t idx = (uint32_t)cow_index(b);
+        uint32_t phys = snap_map((uint32_t)s)[idx];
+        if (phys == cow_map[idx] || snap_shares(idx, phys, s)) {
+            continue;
+        }
+        read_block(phys, blk);
+        ref_children(blk, -1, freed, &nfreed);
+    }
+    for (uint32_t i = 0; i < dbmap_blocks; i++) {
+        meta_read(sb.data_bitmap + i, dbmap + (size_t)i * BLOCK_SIZE);
+    }
+    for (int i = 0; i < nfreed; i++) {
+        uint32_t bit = freed[i] - sb.data_start;
+        dbmap[bit / 8] &= ~(1 << (bit % 8));
+        dbmap_dirty[bit / (BLOCK_SIZE * 8)] = 1;
+    }
+
+    uint8_t table[BLOCK_SIZE];
+    memcpy(table, snap_tablebuf, BLOCK_SIZE);
+    struct snap_table_header *th = (struct snap_table_header *)table;
+    struct snap_entry *ents = (struct snap_entry *)(table + sizeof(*th));
+    memmove(&ents[s], &ents[s + 1], (th->count - (uint32_t)s - 1) * sizeof(*ents));
+    th->count--;
+    memset(&ents[th->count], 0, sizeof(*ents));
+
+    int n = 0;
+    logical[n] = snap_table_block();
+    bufs[n++] = table;
+    for (uint32_t i = 0; i < dbmap_blocks; i++) {
+        if (dbmap_dirty[i]) {
+            logical[n] = sb.data_bitmap + i;
+            bufs[n++] = dbmap + (size_t)i * BLOCK_SIZE;
+        }
+    }
+    n = refs_log(n, logical, bufs);
+    if (cow_commit(n, logical, bufs, 0) == 0) {
+        snap_load();
+        printf("Deleted snapshot '%s', %d data blocks freed\n", name, nfreed);
+    }
+    free(bufs);
+    free(logical);
+    free(dbmap_dirty);
+    free(dbmap);
+    free(freed);
+}
+
+void do_snap_list() {
+    for (uint32_t s = 0; s < snap_hdr->count; s++) {
+        const struct snap_entry *e = &snap_ents[s];
+        time_t t = e->ctime;
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("%-*.*s  gen %-6u  %s\n", SNAP_NAME_LEN - 1, SNAP_NAME_LEN, e->name, e->gen, when);
+    }
+}
+
+// Lists the root directory, of the current root or read-only of a snapshot
+void do_ls(const char *snap_name) {
+    const uint32_t *map = sb.mode == FS_MODE_COW ? cow_map : NULL;
+    if (snap_name) {
+        int s = snapshots() ? snap_find(snap_name) : -1;
+        if (s < 0) {
+            printf("Error: no snapshot '%s'\n", snap_name);
+            return;
+        }
+        map = snap_map((uint32_t)s);
+    }
+    uint8_t iblk[BLOCK_SIZE];
+    uint8_t dblk[BLOCK_SIZE];
+    if (map) {
+        map_read(map, sb.inode_start, iblk);
+    } else {
+        read_block(sb.inode_start, iblk);
+    }
+    const struct inode *root = (const struct inode *)iblk;
+    uint32_t remaining = root->size;
+    for (int d = 0; d < 8 && remaining > 0 && root->direct[d] != 0; d++) {
+        read_block(root->direct[d], dblk);
+        uint32_t chunk = remaining > BLOCK_SIZE ? BLOCK_SIZE : remaining;
+        const struct dirent *de = (const struct dirent *)dblk;
+        for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(*de); i++) {
+            if (de[i].inode != 0 || de[i].name[0] != '\0') {
+                printf("%8u  %.*s\n", de[i].inode, NAME_LEN, de[i].name);
+            }
+        }
+        remaining -= chunk;
+    }
+}
+
+
 int main(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    if (argc > 1 && strcmp(argv[1], "-n") == 0) {
+        durable = 0;
+        argv++;
+        argc--;
+    }
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <command> [args]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-n] <command> [args]\n", prog);
+        fprintf(stderr, "  install               apply committed transactions and empty the journal\n");
+        fprintf(stderr, "  create <name>...      create files in the root directory, one transaction each,\n");
+        fprintf(stderr, "                        flushed together (with -n, not flushed)\n");
+        fprintf(stderr, "  sync                  flush everything written so far\n");
+        fprintf(stderr, "  ls [snapshot]         list the root directory, or read-only that of a snapshot\n");
+        fprintf(stderr, "  snapshot create <name> | delete <name> | list\n");
+        fprintf(stderr, "                        manage snapshots of an image made with mkfs -s\n");
         return 1;
     }
 
-    fd = open("vsfs.img", O_RDWR);
-    if (fd < 0) {
-        perror("vsfs.img not found");
+    if (vsfs_image_open(&img, "vsfs.img", O_RDWR) < 0) {
+        if (errno == ENOENT) {
+            perror("vsfs.img not found");
+        } else {
+            fprintf(stderr, "vsfs.img: %s\n", vsfs_image_strerror(errno));
+        }
         return 1;
     }
 
@@ -372,7 +1139,28 @@ int main(int argc, char *argv[]) {
 
     if (sb.magic != FS_MAGIC) {
         fprintf(stderr, "Invalid VSFS image\n");
-        close(fd);
+        vsfs_image_close(&img);
+        return 1;
+    }
+
+    const char *heat_buckets = getenv("VSFS_HEAT");
+    if (heat_buckets) {
+        struct vsfs_heat_layout hl = {
+            sb.total_blocks, sb.journal_block, sb.inode_bitmap, sb.inode_start, sb.data_start,
+            sb.refcount_start > sb.data_start ? sb.refcount_start : 0,
+        };
+        if (vsfs_heat_init(&heat, &hl, (uint32_t)strtoul(heat_buckets, NULL, 0)) == 0) {
+            heat_bytes(0, BLOCK_SIZE, 0);   // the superblock, read above
+            atexit(heat_report);
+        }
+    }
+
+    if (sb.mode == FS_MODE_COW && cow_load() < 0) {
+        vsfs_image_close(&img);
+        return 1;
+    }
+    if (snapshots() && snap_load() < 0) {
+        vsfs_image_close(&img);
         return 1;
     }
 
@@ -380,14 +1168,38 @@ int main(int argc, char *argv[]) {
         do_install();
     } else if (strcmp(argv[1], "create") == 0) {
         if (argc < 3) {
-            fprintf(stderr, "Usage: %s create <filename>\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-n] create <filename>...\n", prog);
+            return 1;
+        }
+        for (int i = 2; i < argc; i++) {
+            do_create(argv[i]);
+        }
+        // Copy-on-write commits flush as they go; journaled ones share this flush.
+        if (durable) {
+            sync_image();
+        }
+    } else if (strcmp(argv[1], "sync") == 0) {
+        sync_image();
+    } else if (strcmp(argv[1], "ls") == 0) {
+        do_ls(argc > 2 ? argv[2] : NULL);
+    } else if (strcmp(argv[1], "snapshot") == 0) {
+        const char *sub = argc > 2 ? argv[2] : "";
+        if (!snapshots()) {
+            fprintf(stderr, "Error: image was not made with snapshot support (mkfs -s)\n");
+        } else if (strcmp(sub, "create") == 0 && argc > 3) {
+            do_snap_create(argv[3]);
+        } else if (strcmp(sub, "delete") == 0 && argc > 3) {
+            do_snap_delete(argv[3]);
+        } else if (strcmp(sub, "list") == 0) {
+            do_snap_list();
+        } else {
+            fprintf(stderr, "Usage: %s snapshot create <name> | delete <name> | list\n", prog);
             return 1;
         }
-        do_create(argv[2]);
     } else {
         fprintf(stderr, "Unknown command: %s\n", argv[1]);
     }
 
-    close(fd);
+    vsfs_image_close(&img);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,1050 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+#include "vsfs_ring.h"
+#include "vsfs_trace.h"
+
+/*
+ * Load generator for vsfsd.
+ *
+ * Runs a number of client threads, each attached to its own ring slot,
+ * issuing a weighted mix of operations against a namespace of
+ * `dirs` x `files` names.  Every operation's latency goes into a
+ * log-linear histogram; each report interval prints throughput, latency
+ * percentiles and the daemon's journal and checkpoint counters, so
+ * saturation points and tail-latency cliffs show up over time.
+ *
+ * With a target rate the clients are paced open-loop and latency is
+ * measured from the time an operation was due rather than when it was
+ * sent, so a stalled daemon shows up as queueing delay instead of hiding
+ * behind fewer samples.
+ *
+ * Against a daemon serving several images, -V spreads the clients over
+ * the first `vols` of them round-robin, each image with its own copy of
+ * the namespace.
+ *
+ * With -P each client thread and the daemon's main thread (its first
+ * worker) are counted with perf_event_open (see perfctr.h), and the
+ * counters are reported per interval and per phase next to the latencies.
+ *
+ * With -R it replays a trace recorded by vsfsd -R instead, normally
+ * against a daemon serving freshly made images: one client per slot of
+ * the trace issues that slot's operations in order, each only once every
+ * operation that completed before it started in the recording has
+ * completed again.  Without -T they go as fast as that allows; with -T
+ * each also waits for its original start time, so idle gaps and bursts
+ * are kept.  Latency counts from when an operation could be issued.
+ * Results that differ from the recorded ones are counted.
+ */
+
+#define MAX_CLIENTS    1024U
+#define MAX_FILES      1020U  // entries a directory can hold besides "." and ".."
+#define HIST_SUB         16U  // buckets per power of two (about 6% resolution)
+#define HIST_BUCKETS   (64U * HIST_SUB)
+#define DEFAULT_PREFIX "/lg"
+
+enum op_kind { K_CREATE, K_LOOKUP, K_LS, K_WRITE, K_READ, K_UNLINK, K_MKDIR, K_SYNC, K_FSYNC, K_COUNT };
+
+static const char *const kind_names[K_COUNT] = { "create", "lookup", "ls", "write", "read", "unlink", "mkdir",
+                                                 "sync", "fsync" };
+
+enum name_dist { DIST_SEQ, DIST_RANDOM, DIST_ZIPF };
+
+struct options {
+    const char *shm_name;
+    const char *prefix;
+    uint32_t clients;
+    double duration;
+    double rate;
+    double interval;
+    uint32_t weights[K_COUNT];
+    enum name_dist dist;
+    double zipf_theta;
+    uint32_t dirs;
+    uint32_t files;
+    uint32_t io_size;
+    uint32_t vols;
+    uint64_t seed;
+    uint16_t create_flags;
+    uint16_t durable;
+    int json;
+    int perf;
+    uint16_t scan_flags;    // VSFS_NOCACHE on lookups, ls and reads with -N
+    const char *replay;     // trace file, or NULL for the synthetic mix
+    int replay_timed;
+};
+
+struct hist {
+    _Atomic uint64_t counts[HIST_BUCKETS];
+};
+
+/* Per-client state; the counters are read by the reporter while the client runs. */
+struct client {
+    pthread_t thread;
+    uint32_t id;
+    uint64_t rng;
+    uint64_t seq;
+    struct vsfs_client cli;
+    struct hist lat[K_COUNT];
+    _Atomic uint64_t errors[K_COUNT];
+    struct perfctr pc;
+    uint64_t *recs;                  // replay: this client's trace records, in order
+    uint64_t nrecs;
+    _Atomic uint64_t mismatches;     // replay: results that differ from the trace
+};
+
+struct interval_sample {
+    double t;
+    double ops_per_sec;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    double commits_per_sec;
+    double journal_mib_per_sec;
+    uint64_t checkpoints;
+    uint64_t checkpoint_blocks;
+    struct perfctr_values client_pv;
+    struct perfctr_values daemon_pv;
+};
+
+static struct options opt;
+static struct client *clients;
+static double *zipf_cdf;
+static _Atomic int running;
+static struct timespec start_ts;
+static pthread_barrier_t start_barrier;
+static struct perfctr main_pc;
+static struct perfctr daemon_pc;
+static struct vsfs_trace trace;
+static _Atomic uint8_t *rec_done;
+static _Atomic uint64_t watermark;   // every trace record below it has been replayed
+static _Atomic uint32_t watermark_gen;   // futex word, bumped when the watermark moves with sleepers
+static _Atomic uint32_t sleepers;
+static _Atomic uint32_t active;      // replay clients still running
+static uint64_t replay_first;        // start time of the earliest trace record
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void fail(const char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rng_next(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(uint64_t *s) {
+    return (double)(rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* ---- latency histogram ---- */
+
+static uint32_t hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) {
+        return (uint32_t)v;
+    }
+    uint32_t e = 63U - (uint32_t)__builtin_clzll(v);  // e >= 4
+    uint32_t sub = (uint32_t)(v >> (e - 4)) & (HIST_SUB - 1);
+    return (e - 3) * HIST_SUB + sub;
+}
+
+/* Upper edge of a bucket, so reported percentiles never understate. */
+static uint64_t hist_value(uint32_t b) {
+    if (b < HIST_SUB) {
+        return b;
+    }
+    uint32_t e = b / HIST_SUB + 3;
+    uint64_t sub = b % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << (e - 4)) - 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v) {
+    atomic_fetch_add_explicit(&h->counts[hist_bucket(v)], 1, memory_order_relaxed);
+}
+
+static uint64_t hist_total(const uint64_t *counts) {
+    uint64_t n = 0;
+    for (uint32_t b = 0; b < HIST_BUCKETS; ++b) {
+        n += counts[b];
+    }
+    return n;
+}
+
+static uint64_t hist_percentile(const uint64_t *counts, double p) {
+    uint64_t total = hist_total(counts);
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(p * (double)total);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < HIST_BUCKETS; ++b) {
+        seen += counts[b];
+        if (seen >= rank) {
+            return hist_value(b);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+/* Sums the histograms of every client for one kind, or for all kinds if kind == K_COUNT. */
+static void hist_collect(uint64_t *out, uint32_t kind) {
+    memset(out, 0, HIST_BUCKETS * sizeof(*out));
+    for (uint32_t c = 0; c < opt.clients; ++c) {
+        for (uint32_t k = 0; k < K_COUNT; ++k) {
+            if (kind != K_COUNT && k != kind) {
+                continue;
+            }
+            for (uint32_t b = 0; b < HIST_BUCKETS; ++b) {
+                out[b] += atomic_load_explicit(&clients[c].lat[k].counts[b], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+/* ---- names ---- */
+
+static void build_zipf(void) {
+    zipf_cdf = calloc(opt.dirs, sizeof(*zipf_cdf));
+    if (!zipf_cdf) {
+        die("calloc");
+    }
+    double sum = 0.0;
+    for (uint32_t i = 0; i < opt.dirs; ++i) {
+        sum += 1.0 / pow((double)(i + 1), opt.zipf_theta);
+        zipf_cdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < opt.dirs; ++i) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static uint32_t zipf_pick(uint64_t *rng) {
+    double u = rng_unit(rng);
+    uint32_t lo = 0;
+    uint32_t hi = opt.dirs - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Picks a directory and file index according to the name distribution. */
+static void pick_name(struct client *c, uint32_t *dir, uint32_t *file) {
+    switch (opt.dist) {
+    case DIST_SEQ: {
+        // Clients walk disjoint strides of the namespace.
+        uint64_t n = (c->seq++ * opt.clients + c->id) % ((uint64_t)opt.dirs * opt.files);
+        *dir = (uint32_t)(n / opt.files);
+        *file = (uint32_t)(n % opt.files);
+        break;
+    }
+    case DIST_RANDOM:
+        *dir = (uint32_t)(rng_next(&c->rng) % opt.dirs);
+        *file = (uint32_t)(rng_next(&c->rng) % opt.files);
+        break;
+    case DIST_ZIPF:
+        *dir = zipf_pick(&c->rng);
+        *file = (uint32_t)(rng_next(&c->rng) % opt.files);
+        break;
+    }
+}
+
+static void dir_path(char *buf, uint32_t dir) {
+    snprintf(buf, VSFS_PATH_MAX, "%s/d%u", opt.prefix, dir);
+}
+
+static void file_path(char *buf, uint32_t dir, uint32_t file) {
+    snprintf(buf, VSFS_PATH_MAX, "%s/d%u/f%u", opt.prefix, dir, file);
+}
+
+/* ---- clients ---- */
+
+static uint32_t pick_kind(struct client *c) {
+    uint32_t total = 0;
+    for (uint32_t k = 0; k < K_COUNT; ++k) {
+        total += opt.weights[k];
+    }
+    uint32_t r = (uint32_t)(rng_next(&c->rng) % total);
+    for (uint32_t k = 0; k < K_COUNT; ++k) {
+        if (r < opt.weights[k]) {
+            return k;
+        }
+        r -= opt.weights[k];
+    }
+    return K_LOOKUP;
+}
+
+/*
+ * Runs one operation synchronously.  Errors the mix itself produces
+ * (creating a name that exists, reading one that was never created) are
+ * counted but are not fatal.
+ */
+static int run_op(struct client *c, uint32_t kind, uint8_t *payload, uint8_t *result) {
+    char path[VSFS_PATH_MAX];
+    uint32_t dir = 0, file = 0;
+    pick_name(c, &dir, &file);
+    struct vsfs_cqe cqe;
+    switch (kind) {
+    case K_CREATE:
+        file_path(path, dir, file);
+        return vsfs_client_call(&c->cli, VSFS_OP_CREATE, opt.create_flags | opt.durable, path, 0, 0, NULL, 0, &cqe,
+                                NULL);
+    case K_LOOKUP:
+        file_path(path, dir, file);
+        return vsfs_client_call(&c->cli, VSFS_OP_LOOKUP, opt.scan_flags, path, 0, 0, NULL, 0, &cqe, NULL);
+    case K_LS: {
+        dir_path(path, dir);
+        uint64_t next = 0;
+        for (;;) {
+            int rc = vsfs_client_call(&c->cli, VSFS_OP_READDIR, opt.scan_flags, path, 0, next, NULL, 0, &cqe, result);
+            if (rc < 0 || cqe.len == 0) {
+                return rc;
+            }
+            next = cqe.size;
+        }
+    }
+    case K_WRITE:
+        file_path(path, dir, file);
+        return vsfs_client_call(&c->cli, VSFS_OP_WRITE, 0, path, 0, 0, payload, opt.io_size, &cqe, NULL);
+    case K_READ:
+        file_path(path, dir, file);
+        return vsfs_client_call(&c->cli, VSFS_OP_READ, opt.scan_flags, path, 0, 0, NULL, opt.io_size, &cqe, result);
+    case K_UNLINK:
+        file_path(path, dir, file);
+        return vsfs_client_call(&c->cli, VSFS_OP_UNLINK, opt.durable, path, 0, 0, NULL, 0, &cqe, NULL);
+    case K_MKDIR:
+        file_path(path, dir, file);
+        return vsfs_client_call(&c->cli, VSFS_OP_MKDIR, opt.durable, path, 0, 0, NULL, 0, &cqe, NULL);
+    case K_SYNC:
+        return vsfs_client_call(&c->cli, VSFS_OP_SYNC, 0, NULL, 0, 0, NULL, 0, &cqe, NULL);
+    case K_FSYNC:
+        file_path(path, dir, file);
+        return vsfs_client_call(&c->cli, VSFS_OP_FSYNC, 0, path, 0, 0, NULL, 0, &cqe, NULL);
+    }
+    return -EINVAL;
+}
+
+static void *client_main(void *arg) {
+    struct client *c = arg;
+    static _Thread_local uint8_t payload[VSFS_RING_BUF];
+    static _Thread_local uint8_t result[VSFS_RING_BUF];
+    memset(payload, 'a' + (int)(c->id % 26), sizeof(payload));
+    if (opt.perf) {
+        perfctr_open(&c->pc, 0, 0);
+        perfctr_enable(&c->pc);
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    uint64_t period = opt.rate > 0 ? (uint64_t)(1e9 * opt.clients / opt.rate) : 0;
+    uint64_t due = now_ns() + (period ? rng_next(&c->rng) % period : 0);
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (period) {
+            uint64_t now = now_ns();
+            if (now < due) {
+                struct timespec ts = { (time_t)((due - now) / 1000000000ULL), (long)((due - now) % 1000000000ULL) };
+                nanosleep(&ts, NULL);
+            }
+        } else {
+            due = now_ns();
+        }
+        uint32_t kind = pick_kind(c);
+        int rc = run_op(c, kind, payload, result);
+        uint64_t done = now_ns();
+        if (rc == -ESHUTDOWN) {
+            fprintf(stderr, "client %u: daemon went away\n", c->id);
+            break;
+        }
+        if (rc < 0) {
+            atomic_fetch_add_explicit(&c->errors[kind], 1, memory_order_relaxed);
+        }
+        hist_add(&c->lat[kind], done - due);
+        due += period;
+    }
+    return NULL;
+}
+
+/* ---- trace replay ---- */
+
+static uint32_t replay_kind(uint16_t op) {
+    switch (op) {
+    case VSFS_OP_CREATE: return K_CREATE;
+    case VSFS_OP_MKDIR: return K_MKDIR;
+    case VSFS_OP_LOOKUP: return K_LOOKUP;
+    case VSFS_OP_SYNC: return K_SYNC;
+    case VSFS_OP_FSYNC: return K_FSYNC;
+    case VSFS_OP_WRITE: return K_WRITE;
+    case VSFS_OP_READ: return K_READ;
+    case VSFS_OP_UNLINK: return K_UNLINK;
+    case VSFS_OP_READDIR: return K_LS;
+    }
+    return K_COUNT;
+}
+
+static void sleep_until(uint64_t due) {
+    uint64_t now = now_ns();
+    if (now < due) {
+        struct timespec ts = { (time_t)((due - now) / 1000000000ULL), (long)((due - now) % 1000000000ULL) };
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * Waits until every trace record below `after` has been replayed; 0 if
+ * the run was stopped.  Sleepers announce themselves before they look at
+ * the watermark, so a move they missed always bumps the futex word.
+ */
+static int replay_wait(uint64_t after) {
+    for (uint32_t spins = 0; atomic_load(&watermark) < after; ++spins) {
+        if (!atomic_load_explicit(&running, memory_order_relaxed)) {
+            return 0;
+        }
+        if (spins < 64) {
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_add(&sleepers, 1);
+        uint32_t gen = atomic_load(&watermark_gen);
+        if (atomic_load(&watermark) < after) {
+            struct timespec ts = { 0, 10000000 };
+            vsfs_futex_wait(&watermark_gen, gen, &ts);
+        }
+        atomic_fetch_sub(&sleepers, 1);
+    }
+    return 1;
+}
+
+/*
+ * Marks record i replayed and moves the watermark over every finished
+ * record.  A record finished after the watermark stopped short of it is
+ * seen by whoever finishes the record the watermark stopped at.
+ */
+static void replay_done(uint64_t i) {
+    atomic_store(&rec_done[i], 1);
+    uint64_t w = atomic_load(&watermark);
+    int moved = 0;
+    while (w < trace.count && atomic_load(&rec_done[w])) {
+        if (atomic_compare_exchange_weak(&watermark, &w, w + 1)) {
+            w++;
+            moved = 1;
+        }
+    }
+    if (moved && atomic_load(&sleepers)) {
+        atomic_fetch_add(&watermark_gen, 1);
+        vsfs_futex_wake_all(&watermark_gen);
+    }
+}
+
+static void *replay_main(void *arg) {
+    struct client *c = arg;
+    static _Thread_local uint8_t payload[VSFS_RING_BUF];
+    static _Thread_local uint8_t result[VSFS_RING_BUF];
+    memset(payload, 'a' + (int)(c->id % 26), sizeof(payload));
+    if (opt.perf) {
+        perfctr_open(&c->pc, 0, 0);
+        perfctr_enable(&c->pc);
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    uint64_t t0 = (uint64_t)start_ts.tv_sec * 1000000000ULL + (uint64_t)start_ts.tv_nsec;
+    for (uint64_t n = 0; n < c->nrecs; ++n) {
+        uint64_t i = c->recs[n];
+        const struct vsfs_trace_rec *rec = &trace.recs[i];
+        if (opt.replay_timed) {
+            sleep_until(t0 + (rec->start_ns - replay_first));
+        }
+        if (!replay_wait(rec->after)) {
+            break;
+        }
+        uint64_t due = now_ns();
+        c->cli.vol = rec->vol;
+        uint32_t len = rec->len > VSFS_RING_BUF ? VSFS_RING_BUF : rec->len;
+        struct vsfs_cqe cqe;
+        int rc = vsfs_client_call(&c->cli, rec->op, rec->flags, rec->path_len ? trace.paths[i] : NULL, rec->ino,
+                                  rec->off, rec->op == VSFS_OP_WRITE ? payload : NULL, len, &cqe, result);
+        uint64_t done = now_ns();
+        if (rc == -ESHUTDOWN) {
+            fprintf(stderr, "client %u: daemon went away\n", c->id);
+            atomic_store(&running, 0);
+            break;
+        }
+        uint32_t kind = replay_kind(rec->op);
+        if (kind < K_COUNT) {
+            if (rc < 0) {
+                atomic_fetch_add_explicit(&c->errors[kind], 1, memory_order_relaxed);
+            }
+            hist_add(&c->lat[kind], done - due);
+        }
+        if (rc != rec->result) {
+            atomic_fetch_add_explicit(&c->mismatches, 1, memory_order_relaxed);
+        }
+        replay_done(i);
+    }
+    atomic_fetch_sub(&active, 1);
+    return NULL;
+}
+
+/* Loads the trace and gives each of its client slots a client of its own. */
+static void replay_load(uint32_t nvols) {
+    int rc = vsfs_trace_load(&trace, opt.replay);
+    if (rc < 0) {
+        fprintf(stderr, "%s: %s\n", opt.replay,
+                rc == -EPROTO ? "not a vsfsd trace" : rc == -EIO ? "trace is truncated" : strerror(-rc));
+        exit(EXIT_FAILURE);
+    }
+    uint32_t *client_of = calloc(65536, sizeof(*client_of));   // slot -> client + 1
+    rec_done = calloc(trace.count ? trace.count : 1, sizeof(*rec_done));
+    if (!client_of || !rec_done) {
+        die("calloc");
+    }
+    opt.clients = 0;
+    replay_first = trace.count ? trace.recs[0].start_ns : 0;
+    for (uint64_t i = 0; i < trace.count; ++i) {
+        const struct vsfs_trace_rec *rec = &trace.recs[i];
+        replay_first = rec->start_ns < replay_first ? rec->start_ns : replay_first;
+        if (rec->vol >= nvols) {
+            fprintf(stderr, "%s: the trace uses image %u; vsfsd serves %u\n", opt.replay, rec->vol, nvols);
+            exit(EXIT_FAILURE);
+        }
+        if (!client_of[rec->slot]) {
+            client_of[rec->slot] = ++opt.clients;
+        }
+    }
+    if (opt.clients == 0) {
+        fail("the trace holds no operations");
+    }
+    if (opt.clients > MAX_CLIENTS) {
+        fail("the trace uses too many client slots");
+    }
+    clients = calloc(opt.clients, sizeof(*clients));
+    if (!clients) {
+        die("calloc");
+    }
+    for (uint64_t i = 0; i < trace.count; ++i) {
+        clients[client_of[trace.recs[i].slot] - 1].nrecs++;
+    }
+    for (uint32_t c = 0; c < opt.clients; ++c) {
+        clients[c].recs = calloc(clients[c].nrecs, sizeof(*clients[c].recs));
+        if (!clients[c].recs) {
+            die("calloc");
+        }
+        clients[c].nrecs = 0;
+    }
+    for (uint64_t i = 0; i < trace.count; ++i) {
+        struct client *c = &clients[client_of[trace.recs[i].slot] - 1];
+        c->recs[c->nrecs++] = i;
+    }
+    free(client_of);
+}
+
+/* Creates the prefix and its directories; existing ones are reused. */
+static void prepare_namespace(struct vsfs_client *cli) {
+    char path[VSFS_PATH_MAX];
+    struct vsfs_cqe cqe;
+    int rc = vsfs_client_call(cli, VSFS_OP_MKDIR, 0, opt.prefix, 0, 0, NULL, 0, &cqe, NULL);
+    if (rc < 0 && rc != -EEXIST) {
+        fprintf(stderr, "mkdir %s: %s\n", opt.prefix, strerror(-rc));
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t d = 0; d < opt.dirs; ++d) {
+        dir_path(path, d);
+        rc = vsfs_client_call(cli, VSFS_OP_MKDIR, 0, path, 0, 0, NULL, 0, &cqe, NULL);
+        if (rc < 0 && rc != -EEXIST) {
+            fprintf(stderr, "mkdir %s: %s\n", path, strerror(-rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* ---- reporting ---- */
+
+/* Sum of every client's counters so far. */
+static void client_counters(struct perfctr_values *out) {
+    memset(out, 0, sizeof(*out));
+    for (uint32_t c = 0; c < opt.clients; ++c) {
+        struct perfctr_values pv;
+        perfctr_read(&clients[c].pc, &pv);
+        perfctr_add(out, &pv, c == 0);
+    }
+}
+
+static void print_counters(const char *what, const struct perfctr_values *pv) {
+    char buf[256];
+    perfctr_format(pv, buf, sizeof(buf));
+    fprintf(opt.json ? stderr : stdout, "%-16s %s\n", what, buf);
+}
+
+static double elapsed(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)(ts.tv_sec - start_ts.tv_sec) + (double)(ts.tv_nsec - start_ts.tv_nsec) / 1e9;
+}
+
+static void print_interval(const struct interval_sample *s) {
+    fprintf(opt.json ? stderr : stdout,
+            "%7.1fs  %9.0f ops/s  p50 %7.1fus  p99 %8.1fus  p999 %8.1fus  "
+            "%7.0f commits/s  %7.2f MiB/s journal  %llu ckpt (%llu blocks)\n",
+            s->t, s->ops_per_sec, (double)s->p50_ns / 1e3, (double)s->p99_ns / 1e3,
+            (double)s->p999_ns / 1e3, s->commits_per_sec, s->journal_mib_per_sec,
+            (unsigned long long)s->checkpoints, (unsigned long long)s->checkpoint_blocks);
+    if (opt.perf) {
+        print_counters("  clients", &s->client_pv);
+        print_counters("  daemon", &s->daemon_pv);
+    }
+}
+
+static void print_summary(double secs, const struct interval_sample *samples, uint32_t nsamples,
+                          const struct perfctr_values *setup_pv, const struct perfctr_values *run_client_pv,
+                          const struct perfctr_values *run_daemon_pv) {
+    static uint64_t counts[HIST_BUCKETS];
+    uint64_t errors[K_COUNT] = { 0 };
+    uint64_t mismatches = 0;
+    for (uint32_t c = 0; c < opt.clients; ++c) {
+        for (uint32_t k = 0; k < K_COUNT; ++k) {
+            errors[k] += atomic_load(&clients[c].errors[k]);
+        }
+        mismatches += atomic_load(&clients[c].mismatches);
+    }
+
+    if (!opt.json) {
+        printf("\n%-8s %12s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/s", "p50 us", "p99 us",
+               "p999 us");
+        for (uint32_t k = 0; k <= K_COUNT; ++k) {
+            hist_collect(counts, k);
+            uint64_t n = hist_total(counts);
+            if (n == 0 && k != K_COUNT) {
+                continue;
+            }
+            uint64_t e = 0;
+            for (uint32_t j = 0; j < K_COUNT; ++j) {
+                e += (k == K_COUNT || j == k) ? errors[j] : 0;
+            }
+            printf("%-8s %12llu %10llu %10.0f %10.1f %10.1f %10.1f\n", k == K_COUNT ? "total" : kind_names[k],
+                   (unsigned long long)n, (unsigned long long)e, (double)n / secs,
+                   (double)hist_percentile(counts, 0.50) / 1e3, (double)hist_percentile(counts, 0.99) / 1e3,
+                   (double)hist_percentile(counts, 0.999) / 1e3);
+        }
+        if (opt.replay) {
+            printf("\n%llu of %llu operations replayed; %llu results differ from the trace\n",
+                   (unsigned long long)atomic_load(&watermark), (unsigned long long)trace.count,
+                   (unsigned long long)mismatches);
+        }
+        if (opt.perf) {
+            printf("\n");
+            print_counters("setup", setup_pv);
+            print_counters("run clients", run_client_pv);
+            print_counters("run daemon", run_daemon_pv);
+        }
+        return;
+    }
+
+    printf("{\"clients\":%u,\"duration\":%.3f,\"rate\":%.1f,\"dirs\":%u,\"files\":%u,\"io_size\":%u,"
+           "\"dist\":\"%s\",",
+           opt.clients, secs, opt.rate, opt.dirs, opt.files, opt.io_size,
+           opt.dist == DIST_SEQ ? "seq" : opt.dist == DIST_RANDOM ? "random" : "zipf");
+    if (opt.replay) {
+        printf("\"replay\":{\"trace_ops\":%llu,\"replayed\":%llu,\"mismatches\":%llu,\"timed\":%s},",
+               (unsigned long long)trace.count, (unsigned long long)atomic_load(&watermark),
+               (unsigned long long)mismatches, opt.replay_timed ? "true" : "false");
+    }
+    printf("\"ops\":{");
+    int first = 1;
+    for (uint32_t k = 0; k <= K_COUNT; ++k) {
+        hist_collect(counts, k);
+        uint64_t n = hist_total(counts);
+        if (n == 0 && k != K_COUNT) {
+            continue;
+        }
+        uint64_t e = 0;
+        for (uint32_t j = 0; j < K_COUNT; ++j) {
+            e += (k == K_COUNT || j == k) ? errors[j] : 0;
+        }
+        printf("%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"ops_per_sec\":%.1f,\"p50_ns\":%llu,"
+               "\"p99_ns\":%llu,\"p999_ns\":%llu}",
+               first ? "" : ",", k == K_COUNT ? "total" : kind_names[k], (unsigned long long)n,
+               (unsigned long long)e, (double)n / secs, (unsigned long long)hist_percentile(counts, 0.50),
+               (unsigned long long)hist_percentile(counts, 0.99),
+               (unsigned long long)hist_percentile(counts, 0.999));
+        first = 0;
+    }
+    printf("},\"intervals\":[");
+    for (uint32_t i = 0; i < nsamples; ++i) {
+        const struct interval_sample *s = &samples[i];
+        printf("%s{\"t\":%.3f,\"ops_per_sec\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+               "\"commits_per_sec\":%.1f,\"journal_mib_per_sec\":%.3f,\"checkpoints\":%llu,"
+               "\"checkpoint_blocks\":%llu",
+               i ? "," : "", s->t, s->ops_per_sec, (unsigned long long)s->p50_ns,
+               (unsigned long long)s->p99_ns, (unsigned long long)s->p999_ns, s->commits_per_sec,
+               s->journal_mib_per_sec, (unsigned long long)s->checkpoints,
+               (unsigned long long)s->checkpoint_blocks);
+        if (opt.perf) {
+            printf(",\"counters\":{\"clients\":");
+            perfctr_json(stdout, &s->client_pv);
+            printf(",\"daemon\":");
+            perfctr_json(stdout, &s->daemon_pv);
+            printf("}");
+        }
+        printf("}");
+    }
+    printf("]");
+    if (opt.perf) {
+        printf(",\"counters\":{\"setup\":");
+        perfctr_json(stdout, setup_pv);
+        printf(",\"run_clients\":");
+        perfctr_json(stdout, run_client_pv);
+        printf(",\"run_daemon\":");
+        perfctr_json(stdout, run_daemon_pv);
+        printf("}");
+    }
+    printf("}\n");
+}
+
+/* ---- options ---- */
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -s name       daemon shared memory name (default %s)\n"
+            "  -c clients    concurrent clients, one ring slot each (default 8)\n"
+            "  -t seconds    run time (default 10)\n"
+            "  -r ops/s      total target rate, paced open-loop; 0 runs flat out (default 0)\n"
+            "  -m mix        weights, e.g. create=20,lookup=40,ls=5,write=20,read=10,unlink=5\n"
+            "                (mkdir, sync and fsync can be weighted too)\n"
+            "  -n dist       names: seq, random or zipf[:theta] over directories (default random)\n"
+            "  -D dirs       directories under the prefix (default 16)\n"
+            "  -F files      file names per directory, at most %u (default 256)\n"
+            "  -w bytes      write and read size, at most %u (default 4096)\n"
+            "  -p prefix     directory holding the working set (default %s)\n"
+            "  -i seconds    report interval (default 1)\n"
+            "  -S seed       PRNG seed (default 1)\n"
+            "  -V images     spread clients over this many of the daemon's images (default 1)\n"
+            "  -z            create files whose data is stored compressed\n"
+            "  -j            create files whose data is journaled with their metadata\n"
+            "  -d level      durability of creates and unlinks: sync, group or none\n"
+            "                (default: the daemon's)\n"
+            "  -N            mark lookups, ls and reads as a bulk scan (VSFS_NOCACHE)\n"
+            "  -P            count cycles, instructions, cache and branch misses and syscalls\n"
+            "                of the clients and the daemon's main thread (perf_event_open)\n"
+            "  -J            print the results as one JSON object; interval lines go to stderr\n"
+            "  -R trace      replay a trace recorded by vsfsd -R, one client per recorded slot,\n"
+            "                until it ends; -c, -t, -r and the namespace options do not apply\n"
+            "  -T            with -R, keep the recorded start times instead of running flat out\n",
+            prog, VSFS_DEFAULT_SHM, MAX_FILES, VSFS_RING_BUF, DEFAULT_PREFIX);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_mix(const char *s, const char *prog) {
+    memset(opt.weights, 0, sizeof(opt.weights));
+    char *copy = strdup(s);
+    if (!copy) {
+        die("strdup");
+    }
+    char *save = NULL;
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq) {
+            usage(prog);
+        }
+        *eq = '\0';
+        uint32_t k = 0;
+        while (k < K_COUNT && strcmp(tok, kind_names[k]) != 0) {
+            k++;
+        }
+        if (k == K_COUNT) {
+            fprintf(stderr, "Unknown operation in mix: %s\n", tok);
+            exit(EXIT_FAILURE);
+        }
+        opt.weights[k] = (uint32_t)strtoul(eq + 1, NULL, 0);
+    }
+    free(copy);
+}
+
+static void parse_options(int argc, char *argv[]) {
+    opt.shm_name = VSFS_DEFAULT_SHM;
+    opt.prefix = DEFAULT_PREFIX;
+    opt.clients = 8;
+    opt.duration = 10.0;
+    opt.interval = 1.0;
+    opt.dist = DIST_RANDOM;
+    opt.zipf_theta = 0.99;
+    opt.dirs = 16;
+    opt.files = 256;
+    opt.io_size = VSFS_RING_BUF;
+    opt.seed = 1;
+    opt.vols = 1;
+    parse_mix("create=20,lookup=40,ls=5,write=20,read=10,unlink=5", argv[0]);
+
+    int c;
+    while ((c = getopt(argc, argv, "s:c:t:r:m:n:D:F:w:p:i:S:V:zjd:NPJR:Th")) != -1) {
+        switch (c) {
+        case 's': opt.shm_name = optarg; break;
+        case 'c': opt.clients = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 't': opt.duration = strtod(optarg, NULL); break;
+        case 'r': opt.rate = strtod(optarg, NULL); break;
+        case 'm': parse_mix(optarg, argv[0]); break;
+        case 'n':
+            if (strcmp(optarg, "seq") == 0) {
+                opt.dist = DIST_SEQ;
+            } else if (strcmp(optarg, "random") == 0) {
+                opt.dist = DIST_RANDOM;
+            } else if (strncmp(optarg, "zipf", 4) == 0) {
+                opt.dist = DIST_ZIPF;
+                if (optarg[4] == ':') {
+                    opt.zipf_theta = strtod(optarg + 5, NULL);
+                }
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'D': opt.dirs = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'F': opt.files = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'w': opt.io_size = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'p': opt.prefix = optarg; break;
+        case 'i': opt.interval = strtod(optarg, NULL); break;
+        case 'S': opt.seed = strtoull(optarg, NULL, 0); break;
+        case 'V': opt.vols = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'z': opt.create_flags |= VSFS_CREATE_COMPRESS; break;
+        case 'j': opt.create_flags |= VSFS_CREATE_JOURNAL; break;
+        case 'd': {
+            int level = vsfs_durable_level(optarg);
+            if (level < 0) {
+                usage(argv[0]);
+            }
+            opt.durable = (uint16_t)level;
+            break;
+        }
+        case 'N': opt.scan_flags = VSFS_NOCACHE; break;
+        case 'P': opt.perf = 1; break;
+        case 'J': opt.json = 1; break;
+        case 'R': opt.replay = optarg; break;
+        case 'T': opt.replay_timed = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    uint32_t total = 0;
+    for (uint32_t k = 0; k < K_COUNT; ++k) {
+        total += opt.weights[k];
+    }
+    if (opt.clients == 0 || opt.clients > MAX_CLIENTS || opt.duration <= 0 || opt.interval <= 0 ||
+        opt.dirs == 0 || opt.files == 0 || opt.files > MAX_FILES || opt.io_size == 0 ||
+        opt.io_size > VSFS_RING_BUF || total == 0 || opt.rate < 0 || opt.vols == 0 ||
+        opt.vols > VSFS_MAX_VOLS || (opt.replay_timed && !opt.replay)) {
+        usage(argv[0]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+    build_zipf();
+
+    struct vsfs_client ctl;
+    int rc = vsfs_client_attach(&ctl, opt.shm_name);
+    if (rc < 0) {
+        fprintf(stderr, "cannot attach to vsfsd '%s': %s\n", opt.shm_name, strerror(-rc));
+        return 1;
+    }
+    if (opt.vols > ctl.hdr->nvols) {
+        fprintf(stderr, "vsfsd '%s' serves only %u image(s)\n", opt.shm_name, ctl.hdr->nvols);
+        return 1;
+    }
+    if (opt.replay) {
+        replay_load(ctl.hdr->nvols);
+    }
+    struct perfctr_values setup_pv;
+    memset(&main_pc, -1, sizeof(main_pc));
+    memset(&daemon_pc, -1, sizeof(daemon_pc));
+    if (opt.perf) {
+        if (perfctr_open(&main_pc, 0, 0) == 0) {
+            fprintf(stderr, "performance counters unavailable; reporting n/a\n");
+        }
+        perfctr_enable(&main_pc);
+    }
+    for (uint32_t v = 0; !opt.replay && v < opt.vols; ++v) {
+        ctl.vol = v;
+        prepare_namespace(&ctl);
+    }
+    perfctr_disable(&main_pc);
+    perfctr_read(&main_pc, &setup_pv);
+
+    if (!clients) {
+        clients = calloc(opt.clients, sizeof(*clients));
+    }
+    if (!clients) {
+        die("calloc");
+    }
+    for (uint32_t i = 0; i < opt.clients; ++i) {
+        memset(&clients[i].pc, -1, sizeof(clients[i].pc));
+        clients[i].id = i;
+        clients[i].rng = (opt.seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+        rc = vsfs_client_attach(&clients[i].cli, opt.shm_name);
+        if (rc < 0) {
+            fprintf(stderr, "client %u: cannot attach: %s (is vsfsd running with enough -c slots?)\n", i,
+                    strerror(-rc));
+            return 1;
+        }
+        clients[i].cli.vol = i % opt.vols;
+    }
+
+    uint32_t max_samples = opt.replay ? 64 : (uint32_t)(opt.duration / opt.interval) + 2;
+    struct interval_sample *samples = calloc(max_samples, sizeof(*samples));
+    static uint64_t prev_counts[HIST_BUCKETS];
+    static uint64_t cur_counts[HIST_BUCKETS];
+    static uint64_t delta[HIST_BUCKETS];
+    if (!samples) {
+        die("calloc");
+    }
+
+    const struct vsfs_ring_stats *st = &ctl.hdr->stats;
+    uint64_t prev_commits = atomic_load(&st->commits);
+    uint64_t prev_jbytes = atomic_load(&st->journal_bytes);
+    uint64_t prev_ckpt = atomic_load(&st->checkpoints);
+    uint64_t prev_ckpt_blocks = atomic_load(&st->checkpoint_blocks);
+
+    // The daemon's counters cover its main thread, which is its first
+    // worker; they need ptrace access to the daemon and are simply n/a
+    // without it.
+    if (opt.perf) {
+        pid_t dpid = (pid_t)atomic_load(&ctl.hdr->daemon_pid);
+        perfctr_open(&daemon_pc, dpid, 0);
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, opt.clients + 1);
+    atomic_store(&running, 1);
+    atomic_store(&active, opt.clients);
+    for (uint32_t i = 0; i < opt.clients; ++i) {
+        if (pthread_create(&clients[i].thread, NULL, opt.replay ? replay_main : client_main, &clients[i]) != 0) {
+            fail("pthread_create failed");
+        }
+    }
+    // Replay clients pace themselves from start_ts, so it is set before they are released.
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+    pthread_barrier_wait(&start_barrier);
+    perfctr_enable(&daemon_pc);
+    struct perfctr_values prev_client_pv, prev_daemon_pv;
+    client_counters(&prev_client_pv);
+    perfctr_read(&daemon_pc, &prev_daemon_pv);
+
+    uint32_t nsamples = 0;
+    double last = 0.0;
+    while (opt.replay ? atomic_load(&active) > 0 : last < opt.duration - 1e-9) {
+        double next = last + opt.interval;
+        if (!opt.replay && next > opt.duration) {
+            next = opt.duration;
+        }
+        // A replay ends when its clients do, so it is polled for that.
+        double wait;
+        while ((wait = next - elapsed()) > 0 && (!opt.replay || atomic_load(&active) > 0)) {
+            if (opt.replay && wait > 0.01) {
+                wait = 0.01;
+            }
+            struct timespec ts = { (time_t)wait, (long)((wait - (double)(time_t)wait) * 1e9) };
+            nanosleep(&ts, NULL);
+        }
+        if (nsamples == max_samples) {
+            max_samples *= 2;
+            samples = realloc(samples, max_samples * sizeof(*samples));
+            if (!samples) {
+                die("realloc");
+            }
+        }
+        double now = elapsed();
+        double span = now - last;
+
+        hist_collect(cur_counts, K_COUNT);
+        for (uint32_t b = 0; b < HIST_BUCKETS; ++b) {
+            delta[b] = cur_counts[b] - prev_counts[b];
+        }
+        memcpy(prev_counts, cur_counts, sizeof(prev_counts));
+
+        uint64_t commits = atomic_load(&st->commits);
+        uint64_t jbytes = atomic_load(&st->journal_bytes);
+        uint64_t ckpt = atomic_load(&st->checkpoints);
+        uint64_t ckpt_blocks = atomic_load(&st->checkpoint_blocks);
+
+        struct interval_sample *s = &samples[nsamples++];
+        s->t = now;
+        s->ops_per_sec = (double)hist_total(delta) / span;
+        s->p50_ns = hist_percentile(delta, 0.50);
+        s->p99_ns = hist_percentile(delta, 0.99);
+        s->p999_ns = hist_percentile(delta, 0.999);
+        s->commits_per_sec = (double)(commits - prev_commits) / span;
+        s->journal_mib_per_sec = (double)(jbytes - prev_jbytes) / span / (1024.0 * 1024.0);
+        s->checkpoints = ckpt - prev_ckpt;
+        s->checkpoint_blocks = ckpt_blocks - prev_ckpt_blocks;
+        if (opt.perf) {
+            struct perfctr_values cur;
+            client_counters(&cur);
+            s->client_pv = prev_client_pv;
+            perfctr_delta(&s->client_pv, &cur);
+            prev_client_pv = cur;
+            perfctr_read(&daemon_pc, &cur);
+            s->daemon_pv = prev_daemon_pv;
+            perfctr_delta(&s->daemon_pv, &cur);
+            prev_daemon_pv = cur;
+        }
+        print_interval(s);
+
+        prev_commits = commits;
+        prev_jbytes = jbytes;
+        prev_ckpt = ckpt;
+        prev_ckpt_blocks = ckpt_blocks;
+        last = now;
+    }
+
+    atomic_store(&running, 0);
+    for (uint32_t i = 0; i < opt.clients; ++i) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    double secs = elapsed();
+    struct perfctr_values run_client_pv, run_daemon_pv;
+    client_counters(&run_client_pv);
+    perfctr_read(&daemon_pc, &run_daemon_pv);
+    print_summary(secs, samples, nsamples, &setup_pv, &run_client_pv, &run_daemon_pv);
+
+    for (uint32_t i = 0; i < opt.clients; ++i) {
+        perfctr_close(&clients[i].pc);
+        vsfs_client_detach(&clients[i].cli);
+        free(clients[i].recs);
+    }
+    perfctr_close(&daemon_pc);
+    perfctr_close(&main_pc);
+    vsfs_client_detach(&ctl);
+    free(samples);
+    free(clients);
+    free(zipf_cdf);
+    free((void *)rec_done);
+    vsfs_trace_free(&trace);
+    return 0;
+}
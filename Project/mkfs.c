@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,21 +8,42 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "vsfs_overlay.h"
+
 #define FS_MAGIC 0x56534653U
+#define COW_MAP_MAGIC 0x434D4150U
+#define FS_MODE_JOURNAL 0U
+#define FS_MODE_COW     1U
+#define FS_FEAT_DEDUP   0x1U
+#define FS_FEAT_SNAPSHOT 0x2U
+#define SNAP_MAGIC 0x534E4150U
 
 #define BLOCK_SIZE        4096U
 #define INODE_SIZE         128U
 #define JOURNAL_BLOCK_IDX    1U
 #define JOURNAL_BLOCKS      16U
+#define SNAP_POOL_BLOCKS    64U   // shadow pool of an image that keeps snapshots
 #define INODE_BLOCKS         2U
 #define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
+#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + journal_blocks)
 #define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
 #define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
 #define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
 #define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
+#define REFS_PER_BLOCK     (BLOCK_SIZE / 2U)
+#define REFCOUNT_BLOCKS    ((DATA_BLOCKS + REFS_PER_BLOCK - 1U) / REFS_PER_BLOCK)
 #define DEFAULT_IMAGE "vsfs.img"
 
+// Blocks between the superblock and the inode bitmap: the journal, or the
+// shadow pool of a copy-on-write image.
+static uint32_t journal_blocks = JOURNAL_BLOCKS;
+
+struct cow_root {
+    uint32_t map_block;
+    uint32_t gen;
+    uint32_t csum;
+};
+
 struct superblock {
     uint32_t magic;
     uint32_t block_size;
@@ -34,7 +56,25 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t mode;
+    struct cow_root roots[2];
+    uint32_t features;
+    uint32_t refcount_start;   // first block of the refcount table (dedup)
+
+    uint8_t  _pad[128 - 12 * 4 - 2 * 12];
+};
+
+struct cow_map_header {
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t count;
+    uint32_t csum;
+};
+
+// A new snapshot table is just this header; journal.c adds the entries.
+struct snap_table_header {
+    uint32_t magic;
+    uint32_t count;
 };
 
 struct inode {
@@ -75,8 +115,85 @@ static void set_bitmap(uint8_t *bitmap, uint32_t index) {
     bitmap[index / 8] |= (uint8_t)(1U << (index % 8));
 }
 
+static uint32_t fnv1a(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    return h;
+}
+
+/*
+ * Copy-on-write images use the journal region as a pool of shadow blocks.
+ * The first map sends every metadata block to its home location and sits
+ * in the first pool block, published through root slot 0.  Blocks from
+ * tail_first to the end of the image (the snapshot and refcount tables)
+ * are mapped after the metadata blocks.
+ */
+static void build_cow_root(struct superblock *sb, uint8_t *map_block, uint32_t tail_first) {
+    struct cow_map_header *mh = (struct cow_map_header *)map_block;
+    uint32_t *entries = (uint32_t *)(map_block + sizeof(*mh));
+    uint32_t meta = DATA_START_IDX - INODE_BMAP_IDX;
+    mh->magic = COW_MAP_MAGIC;
+    mh->gen = 1;
+    mh->count = meta + (TOTAL_BLOCKS - tail_first);
+    for (uint32_t i = 0; i < meta; ++i) {
+        entries[i] = INODE_BMAP_IDX + i;
+    }
+    for (uint32_t i = meta; i < mh->count; ++i) {
+        entries[i] = tail_first + (i - meta);
+    }
+    mh->csum = fnv1a(mh, offsetof(struct cow_map_header, csum)) ^ fnv1a(entries, mh->count * sizeof(uint32_t));
+
+    sb->mode = FS_MODE_COW;
+    sb->roots[0].map_block = JOURNAL_BLOCK_IDX;
+    sb->roots[0].gen = 1;
+    sb->roots[0].csum = fnv1a(&sb->roots[0], offsetof(struct cow_root, csum));
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c | -s | -d] [image]\n"
+            "       %s -b base image\n"
+            "  -c        copy-on-write metadata instead of a journal\n"
+            "  -s        copy-on-write metadata that can keep snapshots\n"
+            "  -d        let files share identical data blocks (deduplication)\n"
+            "  -b base   make image a writable overlay of the read-only image base; only\n"
+            "            blocks written later are stored in it\n",
+            prog, prog);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
-    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+    int cow = 0;
+    int dedup = 0;
+    int snap = 0;
+    const char *base = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "csdb:h")) != -1) {
+        switch (c) {
+        case 'b': base = optarg; break;
+        case 'c': cow = 1; break;
+        case 's': cow = 1; snap = 1; break;
+        case 'd': dedup = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if ((cow && dedup) || (base && (cow || dedup || optind >= argc))) {
+        usage(argv[0]);
+    }
+    const char *image_path = (optind < argc) ? argv[optind] : DEFAULT_IMAGE;
+    if (base) {
+        if (vsfs_overlay_create(image_path, base) < 0) {
+            die(base);
+        }
+        printf("Created overlay '%s' of '%s'.\n", image_path, base);
+        return 0;
+    }
+    if (snap) {
+        journal_blocks = SNAP_POOL_BLOCKS;
+    }
 
     int fd = open(image_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
     if (fd < 0) {
@@ -98,12 +215,29 @@ int main(int argc, char *argv[]) {
         .data_start = DATA_START_IDX,
     };
 
+    // Deduplicating images count the references to every data block in a
+    // table carved from the end of the data region.  Its blocks are marked
+    // used so no allocator hands them out.  Snapshot images count
+    // references the same way and keep the snapshot table just before it.
+    uint32_t tail_first = TOTAL_BLOCKS;
+    if (dedup || snap) {
+        sb.features |= dedup ? FS_FEAT_DEDUP : FS_FEAT_SNAPSHOT;
+        sb.refcount_start = TOTAL_BLOCKS - REFCOUNT_BLOCKS;
+        tail_first = sb.refcount_start - (snap ? 1U : 0U);
+    }
+
+    uint8_t map_block[BLOCK_SIZE];
+    memset(map_block, 0, sizeof(map_block));
+    if (cow) {
+        build_cow_root(&sb, map_block, tail_first);
+    }
+
     memcpy(block, &sb, sizeof(sb));
     write_block(fd, block); // Superblock
 
     memset(block, 0, sizeof(block));
-    for (uint32_t i = 0; i < JOURNAL_BLOCKS; ++i) {
-        write_block(fd, block); // Journal blocks
+    for (uint32_t i = 0; i < journal_blocks; ++i) {
+        write_block(fd, (cow && i == 0) ? map_block : block); // Journal blocks, or the CoW shadow pool
     }
 
     memset(block, 0, sizeof(block));
@@ -112,6 +246,9 @@ int main(int argc, char *argv[]) {
 
     memset(block, 0, sizeof(block));
     set_bitmap(block, 0); // Reserve first data block for root directory
+    for (uint32_t i = tail_first; i < TOTAL_BLOCKS; ++i) {
+        set_bitmap(block, i - DATA_START_IDX);
+    }
     write_block(fd, block); // Data bitmap
 
     time_t now = time(NULL);
@@ -144,6 +281,22 @@ int main(int argc, char *argv[]) {
 
     memset(block, 0, sizeof(block));
     for (uint32_t i = 1; i < DATA_BLOCKS; ++i) {
+        if (snap && i == tail_first - DATA_START_IDX) {
+            uint8_t table[BLOCK_SIZE];
+            memset(table, 0, sizeof(table));
+            struct snap_table_header th = { SNAP_MAGIC, 0 };
+            memcpy(table, &th, sizeof(th));
+            write_block(fd, table);
+            continue;
+        }
+        if ((dedup || snap) && i == DATA_BLOCKS - REFCOUNT_BLOCKS) {
+            uint8_t table[BLOCK_SIZE];
+            memset(table, 0, sizeof(table));
+            uint16_t root_refs = 1;
+            memcpy(table, &root_refs, sizeof(root_refs)); // the root directory block
+            write_block(fd, table);
+            continue;
+        }
         write_block(fd, block);
     }
 
@@ -151,6 +304,7 @@ int main(int argc, char *argv[]) {
         die("close");
     }
 
-    printf("Created VSFS image '%s' (%u blocks).\n", image_path, TOTAL_BLOCKS);
+    printf("Created VSFS image '%s' (%u blocks%s).\n", image_path, TOTAL_BLOCKS,
+           snap ? ", copy-on-write with snapshots" : cow ? ", copy-on-write" : dedup ? ", deduplicating" : "");
     return 0;
 }
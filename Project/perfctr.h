@@ -0,0 +1,207 @@
+#ifndef VSFS_PERFCTR_H
+#define VSFS_PERFCTR_H
+
+/*
+ * Hardware and software event counters around measured phases.
+ *
+ * Opens cycles, instructions, cache misses, branch misses and a syscall
+ * count (the raw_syscalls:sys_enter tracepoint) with perf_event_open.
+ * Each counter is optional: a kernel without the PMU, a container without
+ * access, perf_event_paranoid or a missing tracefs just leave that counter
+ * unavailable, and it is reported as n/a (null in JSON) rather than
+ * failing the run.  Counters are opened separately, so the kernel may
+ * multiplex them; values are scaled by enabled/running time.
+ *
+ * A set counts one thread (pid 0), or a whole process when opened on its
+ * pid.  Sets can be read while the counted threads run, so a reporter can
+ * sum per-thread sets at every interval.
+ */
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum perfctr_event {
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_CACHE_MISSES,
+    PERFCTR_BRANCH_MISSES,
+    PERFCTR_SYSCALLS,
+    PERFCTR_COUNT
+};
+
+static const char *const perfctr_names[PERFCTR_COUNT] = {
+    "cycles", "instructions", "cache_misses", "branch_misses", "syscalls",
+};
+
+struct perfctr {
+    int fd[PERFCTR_COUNT];   // -1 when the event is unavailable
+};
+
+struct perfctr_values {
+    uint64_t v[PERFCTR_COUNT];
+    uint32_t valid;          // bit per event
+};
+
+/* Tracepoint id of raw_syscalls:sys_enter, or -1 when tracefs is not readable. */
+static inline long perfctr_syscall_tp(void) {
+    static const char *const paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+        FILE *f = fopen(paths[i], "r");
+        if (!f) {
+            continue;
+        }
+        long id = -1;
+        if (fscanf(f, "%ld", &id) != 1) {
+            id = -1;
+        }
+        fclose(f);
+        if (id >= 0) {
+            return id;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Opens the set for `pid` (0 = calling thread), disabled.  `inherit`
+ * also counts threads the target creates afterwards.  Returns how many
+ * events are available.
+ */
+static inline int perfctr_open(struct perfctr *pc, pid_t pid, int inherit) {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PERFCTR_COUNT - 1] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    };
+    int n = 0;
+    for (int e = 0; e < PERFCTR_COUNT; ++e) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        if (e == PERFCTR_SYSCALLS) {
+            long tp = perfctr_syscall_tp();
+            if (tp < 0) {
+                pc->fd[e] = -1;
+                continue;
+            }
+            attr.type = PERF_TYPE_TRACEPOINT;
+            attr.config = (uint64_t)tp;
+        } else {
+            attr.type = events[e].type;
+            attr.config = events[e].config;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+        }
+        attr.disabled = 1;
+        attr.inherit = inherit ? 1 : 0;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        pc->fd[e] = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+        if (pc->fd[e] >= 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static inline void perfctr_enable(struct perfctr *pc) {
+    for (int e = 0; e < PERFCTR_COUNT; ++e) {
+        if (pc->fd[e] >= 0) {
+            ioctl(pc->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+static inline void perfctr_disable(struct perfctr *pc) {
+    for (int e = 0; e < PERFCTR_COUNT; ++e) {
+        if (pc->fd[e] >= 0) {
+            ioctl(pc->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+/* Current totals since the set was opened, scaled for multiplexing. */
+static inline void perfctr_read(const struct perfctr *pc, struct perfctr_values *out) {
+    memset(out, 0, sizeof(*out));
+    for (int e = 0; e < PERFCTR_COUNT; ++e) {
+        uint64_t buf[3];
+        if (pc->fd[e] < 0 || read(pc->fd[e], buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+            continue;
+        }
+        uint64_t value = buf[0];
+        if (buf[2] != 0 && buf[2] < buf[1]) {
+            value = (uint64_t)((double)value * (double)buf[1] / (double)buf[2]);
+        }
+        out->v[e] = value;
+        out->valid |= 1U << e;
+    }
+}
+
+static inline void perfctr_close(struct perfctr *pc) {
+    for (int e = 0; e < PERFCTR_COUNT; ++e) {
+        if (pc->fd[e] >= 0) {
+            close(pc->fd[e]);
+            pc->fd[e] = -1;
+        }
+    }
+}
+
+/* Adds `b` into `a`; an event stays valid only if both sides have it. */
+static inline void perfctr_add(struct perfctr_values *a, const struct perfctr_values *b, int first) {
+    for (int e = 0; e < PERFCTR_COUNT; ++e) {
+        a->v[e] += b->v[e];
+    }
+    a->valid = first ? b->valid : (a->valid & b->valid);
+}
+
+/* a = b - a, for per-interval deltas. */
+static inline void perfctr_delta(struct perfctr_values *a, const struct perfctr_values *b) {
+    for (int e = 0; e < PERFCTR_COUNT; ++e) {
+        a->v[e] = b->v[e] - a->v[e];
+    }
+    a->valid &= b->valid;
+}
+
+/* "cycles 123 instructions 456 ipc 3.70 ..." with n/a for missing events. */
+static inline void perfctr_format(const struct perfctr_values *pv, char *buf, size_t len) {
+    size_t used = 0;
+    for (int e = 0; e < PERFCTR_COUNT && used < len; ++e) {
+        if (pv->valid & (1U << e)) {
+            used += (size_t)snprintf(buf + used, len - used, "%s%s %llu", e ? " " : "", perfctr_names[e],
+                                     (unsigned long long)pv->v[e]);
+        } else {
+            used += (size_t)snprintf(buf + used, len - used, "%s%s n/a", e ? " " : "", perfctr_names[e]);
+        }
+    }
+    uint32_t ipc_bits = (1U << PERFCTR_CYCLES) | (1U << PERFCTR_INSTRUCTIONS);
+    if (used < len && (pv->valid & ipc_bits) == ipc_bits && pv->v[PERFCTR_CYCLES]) {
+        snprintf(buf + used, len - used, " ipc %.2f",
+                 (double)pv->v[PERFCTR_INSTRUCTIONS] / (double)pv->v[PERFCTR_CYCLES]);
+    }
+}
+
+/* JSON object with one member per event; unavailable events are null. */
+static inline void perfctr_json(FILE *out, const struct perfctr_values *pv) {
+    fputc('{', out);
+    for (int e = 0; e < PERFCTR_COUNT; ++e) {
+        if (pv->valid & (1U << e)) {
+            fprintf(out, "%s\"%s\":%llu", e ? "," : "", perfctr_names[e], (unsigned long long)pv->v[e]);
+        } else {
+            fprintf(out, "%s\"%s\":null", e ? "," : "", perfctr_names[e]);
+        }
+    }
+    fputc('}', out);
+}
+
+#endif
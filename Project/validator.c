@@ -1,27 +1,58 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "perfctr.h"
+#include "vsfs_heat.h"
+#include "vsfs_lz.h"
+#include "vsfs_overlay.h"
+#include "vsfs_sched.h"
+
 #define FS_MAGIC 0x56534653U
+#define COW_MAP_MAGIC 0x434D4150U
+#define FS_MODE_JOURNAL 0U
+#define FS_MODE_COW     1U
+#define FS_FEAT_DEDUP   0x1U
+#define FS_FEAT_SNAPSHOT 0x2U
+#define FS_FEATURES     (FS_FEAT_DEDUP | FS_FEAT_SNAPSHOT)
+#define SNAP_MAGIC 0x534E4150U
+#define SNAP_NAME_LEN 24U
 
 #define BLOCK_SIZE        4096U
 #define INODE_SIZE         128U
 #define JOURNAL_BLOCK_IDX    1U
-#define JOURNAL_BLOCKS      16U
-#define INODE_BLOCKS         2U
-#define DATA_BLOCKS         64U
-#define INODE_BMAP_IDX     (JOURNAL_BLOCK_IDX + JOURNAL_BLOCKS)
-#define DATA_BMAP_IDX      (INODE_BMAP_IDX + 1U)
-#define INODE_START_IDX    (DATA_BMAP_IDX + 1U)
-#define DATA_START_IDX     (INODE_START_IDX + INODE_BLOCKS)
-#define TOTAL_BLOCKS       (DATA_START_IDX + DATA_BLOCKS)
 #define DIRECT_POINTERS     8U
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
+#define REFS_PER_BLOCK     (BLOCK_SIZE / 2U)
+#define INODE_COMPRESSED   0x1U
+#define INODE_JOURNAL_DATA 0x2U
+#define CLUSTER_BLOCKS      4U
+#define CLUSTER_SIZE       (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define CLUSTERS           (DIRECT_POINTERS / CLUSTER_BLOCKS)
+#define CLUSTER_RAW        0x8000U   // cluster map: stored uncompressed
+#define CLUSTER_LEN_MASK   0x7FFFU
 #define DEFAULT_IMAGE "vsfs.img"
+#define DEFAULT_REPORT_CAP 100U
+#define OUT_FLUSH_BYTES    (64U * 1024U)
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+#define FREE_BUCKETS       32U   // free extents of 2^k to 2^(k+1) - 1 blocks
+#define WORST_SHOWN         8U   // most fragmented files and emptiest directories listed
+
+struct cow_root {
+    uint32_t map_block;
+    uint32_t gen;
+    uint32_t csum;
+};
 
 struct superblock {
     uint32_t magic;
@@ -35,9 +66,39 @@ struct superblock {
     uint32_t inode_start;
     uint32_t data_start;
 
-    uint8_t  _pad[128 - 9 * 4];
+    uint32_t mode;
+    struct cow_root roots[2];
+    uint32_t features;
+    uint32_t refcount_start;   // first block of the refcount table (dedup)
+
+    uint8_t  _pad[128 - 12 * 4 - 2 * 12];
+};
+
+struct cow_map_header {
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t count;
+    uint32_t csum;
 };
 
+#define COW_MAP_MAX ((BLOCK_SIZE - sizeof(struct cow_map_header)) / sizeof(uint32_t))
+
+/* Snapshot table, in the block before the refcount table of a snapshot image. */
+struct snap_table_header {
+    uint32_t magic;
+    uint32_t count;
+};
+
+struct snap_entry {
+    char name[SNAP_NAME_LEN];
+    uint32_t map_block;
+    uint32_t gen;
+    uint32_t ctime;
+    uint32_t _reserved;
+};
+
+#define SNAP_MAX ((BLOCK_SIZE - sizeof(struct snap_table_header)) / sizeof(struct snap_entry))
+
 struct inode {
     uint16_t type;
     uint16_t links;
@@ -48,7 +109,11 @@ struct inode {
     uint32_t ctime;
     uint32_t mtime;
 
-    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4)];
+    uint16_t flags;
+    uint16_t cmap[CLUSTERS];   // bytes stored per cluster of a compressed file
+    uint8_t unwritten;         // bit k: direct[k] is preallocated and reads as zeros
+
+    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 2 + CLUSTERS * 2 + 1)];
 };
 
 struct dirent {
@@ -60,99 +125,746 @@ _Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes")
 _Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
 _Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
 
-static int error_count = 0;
+/* Kinds of inconsistency, counted separately and capped separately. */
+enum err_category {
+    ERR_SUPERBLOCK,
+    ERR_COW_MAP,
+    ERR_SNAPSHOT,
+    ERR_INODE,
+    ERR_DIRECTORY,
+    ERR_CLUSTER,
+    ERR_BLOCK_REF,
+    ERR_LINKS,
+    ERR_INODE_BITMAP,
+    ERR_DATA_BITMAP,
+    ERR_REFCOUNT,
+    ERR_CATEGORIES
+};
+
+static const char *const err_names[ERR_CATEGORIES] = {
+    "superblock", "cow_map", "snapshot", "inode", "directory", "cluster",
+    "block_ref", "links", "inode_bitmap", "data_bitmap", "refcount",
+};
+
+enum report_format { FORMAT_TEXT, FORMAT_JSON, FORMAT_NDJSON };
+
+/* Growable output buffer; a check's report is written out in large pieces. */
+struct outbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/* Region sizes, derived from the superblock so images of any size can be checked. */
+struct layout {
+    uint32_t journal_blocks;
+    uint32_t inode_bmap_blocks;
+    uint32_t data_bmap_blocks;
+    uint32_t inode_blocks;
+    uint32_t data_blocks;
+    uint32_t refcount_blocks;   // tail of the data region holding the refcount table
+    uint32_t tail_blocks;       // the refcount table and, with snapshots, the snapshot table
+    uint32_t map_count;         // entries of a copy-on-write map
+};
+
+/*
+ * Per-image checking state.  Everything one check needs lives here so that
+ * fleet mode can run many checks side by side on a thread pool.
+ */
+struct check {
+    const char *image_path;
+    struct vsfs_image img;      // the image, or an overlay and its base
+    int error_count;
+    uint32_t counts[ERR_CATEGORIES];
+    uint32_t shown;      // detailed messages in the report so far
+    struct outbuf out;   // report not written out yet
+    int failed;          // image could not be read far enough to judge
+    int tag_messages;    // prefix messages with the image path
+    jmp_buf abort;
+    struct perfctr pc;   // counters of the thread running this check, with -P
+    struct perfctr_values phase_start;
+
+    uint8_t *cow_map_block;
+    uint32_t *pool_role;        // what each shadow pool block holds, over all roots
+    uint8_t *snap_area;         // snapshot table and the map of each snapshot
+    uint32_t *shared_refs;      // references to each data block from every root
+    uint8_t *inode_bitmap;
+    uint8_t *data_bitmap;
+    uint8_t *inode_area;
+    uint8_t *inode_used;
+    uint32_t *link_refs;
+    int *data_owner;            // first inode referencing each data block
+    uint32_t *data_refs;        // references to each data block
+    uint16_t *refcounts;        // refcount table of a deduplicating image
+    uint32_t *dir_slots;        // -A: entry slots of each directory
+    uint32_t *dir_live;         // -A: entries in use
+    struct outbuf analysis;     // -A: the image's analysis object
+    struct vsfs_heat heat;      // -H: blocks read, once the superblock is known
+    struct vsfs_task task;      // fleet mode: the check, as a task
+    int opened;                 // fleet mode: the first run opened the image
+    int prefetch_slot;          // fleet mode: holds a prefetch slot until its check starts
+};
+
+/* Bounds reads in flight across every image being checked; NULL when unbounded. */
+static sem_t *io_slots;
+
+/*
+ * Fleet mode: bounds the images opened and read ahead but not checked yet,
+ * and with them the open descriptors and the readahead outstanding.
+ */
+static sem_t prefetch_slots;
+
+/* -P: report hardware counters for each phase of every check. */
+static int perf_phases;
+
+/* -A: add a fragmentation and free-space analysis to each report. */
+static int analyze;
+
+/* -H: count the blocks each check reads, in at most this many ranges. */
+static uint32_t heat_buckets;
+
+/* -s: check the tree of this snapshot instead of the current root. */
+static const char *view_snapshot;
+
+/* -o and -m: report format and detailed messages per category and image (0 = all). */
+static enum report_format report_format = FORMAT_TEXT;
+static uint32_t report_cap = DEFAULT_REPORT_CAP;
+
+/* Keeps reports of concurrent checks from interleaving. */
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void die(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
-static void report_error(const char *fmt, ...) {
+static void out_reserve(struct outbuf *ob, size_t more) {
+    if (ob->len + more + 1 <= ob->cap) {
+        return;
+    }
+    size_t cap = ob->cap ? ob->cap : 4096;
+    while (cap < ob->len + more + 1) {
+        cap *= 2;
+    }
+    char *data = realloc(ob->data, cap);
+    if (!data) {
+        die("realloc report");
+    }
+    ob->data = data;
+    ob->cap = cap;
+}
+
+static void out_vprintf(struct outbuf *ob, const char *fmt, va_list ap) {
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (n <= 0) {
+        return;
+    }
+    out_reserve(ob, (size_t)n);
+    vsnprintf(ob->data + ob->len, (size_t)n + 1, fmt, ap);
+    ob->len += (size_t)n;
+}
+
+static void out_printf(struct outbuf *ob, const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    fputs("ERROR: ", stderr);
-    vfprintf(stderr, fmt, ap);
-    fputc('\n', stderr);
+    out_vprintf(ob, fmt, ap);
     va_end(ap);
-    error_count++;
 }
 
-static void pread_block(int fd, uint32_t block_index, void *buf) {
+/* Appends `text` as a JSON string, quotes included. */
+static void out_json_string(struct outbuf *ob, const char *text) {
+    out_reserve(ob, strlen(text) * 6 + 2);
+    char *p = ob->data + ob->len;
+    *p++ = '"';
+    for (const unsigned char *c = (const unsigned char *)text; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)*c;
+        } else if (*c < 0x20) {
+            p += sprintf(p, "\\u%04x", *c);
+        } else {
+            *p++ = (char)*c;
+        }
+    }
+    *p++ = '"';
+    ob->len = (size_t)(p - ob->data);
+    ob->data[ob->len] = '\0';
+}
+
+/* Writes out and empties a report buffer; text goes to stderr, JSON to stdout. */
+static void out_flush(struct outbuf *ob) {
+    if (ob->len == 0) {
+        return;
+    }
+    FILE *stream = report_format == FORMAT_TEXT ? stderr : stdout;
+    pthread_mutex_lock(&out_lock);
+    fwrite(ob->data, 1, ob->len, stream);
+    fflush(stream);
+    pthread_mutex_unlock(&out_lock);
+    ob->len = 0;
+}
+
+/*
+ * Counts an inconsistency and, while its category is under the cap, adds
+ * the message to the image's report.  Messages past the cap are not even
+ * formatted.  Text and NDJSON reports are written out whenever enough has
+ * piled up; a JSON report is kept whole until the image is done.
+ */
+static void report_error(struct check *chk, enum err_category category, const char *fmt, ...) {
+    chk->error_count++;
+    chk->counts[category]++;
+    if (report_cap && chk->counts[category] > report_cap) {
+        return;
+    }
+    char msg[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    struct outbuf *ob = &chk->out;
+    if (report_format == FORMAT_TEXT) {
+        out_printf(ob, "%s%sERROR: %s\n", chk->tag_messages ? chk->image_path : "", chk->tag_messages ? ": " : "", msg);
+    } else if (report_format == FORMAT_NDJSON) {
+        out_printf(ob, "{\"image\":");
+        out_json_string(ob, chk->image_path);
+        out_printf(ob, ",\"category\":\"%s\",\"message\":", err_names[category]);
+        out_json_string(ob, msg);
+        out_printf(ob, "}\n");
+    } else {
+        out_printf(ob, "%s{\"category\":\"%s\",\"message\":", chk->shown ? "," : "", err_names[category]);
+        out_json_string(ob, msg);
+        out_printf(ob, "}");
+    }
+    chk->shown++;
+    if (report_format != FORMAT_JSON && ob->len >= OUT_FLUSH_BYTES) {
+        out_flush(ob);
+    }
+}
+
+static const char *check_status(const struct check *chk) {
+    return chk->failed ? "unchecked" : chk->error_count ? "inconsistent" : "consistent";
+}
+
+/* `{"inode":2,...}` with the categories that have errors. */
+static void out_json_counts(struct outbuf *ob, const struct check *chk) {
+    int first = 1;
+    out_printf(ob, "{");
+    for (int c = 0; c < ERR_CATEGORIES; ++c) {
+        if (chk->counts[c]) {
+            out_printf(ob, "%s\"%s\":%u", first ? "" : ",", err_names[c], chk->counts[c]);
+            first = 0;
+        }
+    }
+    out_printf(ob, "}");
+}
+
+/*
+ * Completes an image's report.  Text reports note what the cap held back
+ * and are written out; NDJSON gets a summary line per image.  A JSON
+ * report becomes one object, left in `out` for main() to print in order.
+ */
+static void report_finish(struct check *chk) {
+    struct outbuf *ob = &chk->out;
+    uint32_t held = 0;
+    for (int c = 0; c < ERR_CATEGORIES; ++c) {
+        if (report_cap && chk->counts[c] > report_cap) {
+            held += chk->counts[c] - report_cap;
+            if (report_format == FORMAT_TEXT) {
+                out_printf(ob, "%s%sERROR: ... %u more %s errors not shown\n", chk->tag_messages ? chk->image_path : "",
+                           chk->tag_messages ? ": " : "", chk->counts[c] - report_cap, err_names[c]);
+            }
+        }
+    }
+    if (report_format == FORMAT_TEXT) {
+        out_flush(ob);
+        // The analysis is JSON whatever the report format: one object per image on stdout.
+        if (chk->analysis.len) {
+            pthread_mutex_lock(&out_lock);
+            printf("{\"image\":");
+            struct outbuf name = { 0 };
+            out_json_string(&name, chk->image_path);
+            printf("%s,\"analysis\":%s}\n", name.data, chk->analysis.data);
+            fflush(stdout);
+            pthread_mutex_unlock(&out_lock);
+            free(name.data);
+        }
+        free(chk->analysis.data);
+        memset(&chk->analysis, 0, sizeof(chk->analysis));
+        return;
+    }
+
+    struct outbuf head = { 0 };
+    out_printf(&head, "{\"image\":");
+    out_json_string(&head, chk->image_path);
+    out_printf(&head, ",\"status\":\"%s\",\"errors\":%d,\"categories\":", check_status(chk), chk->error_count);
+    out_json_counts(&head, chk);
+    out_printf(&head, ",\"not_shown\":%u", held);
+    if (chk->analysis.len) {
+        out_printf(&head, ",\"analysis\":%s", chk->analysis.data);
+    }
+    free(chk->analysis.data);
+    memset(&chk->analysis, 0, sizeof(chk->analysis));
+    if (report_format == FORMAT_NDJSON) {
+        out_printf(&head, "}\n");
+        out_reserve(ob, head.len);
+        memcpy(ob->data + ob->len, head.data, head.len + 1);
+        ob->len += head.len;
+        free(head.data);
+        out_flush(ob);
+        return;
+    }
+    out_printf(&head, ",\"messages\":[");
+    out_reserve(&head, ob->len + 2);
+    memcpy(head.data + head.len, ob->data ? ob->data : "", ob->len);
+    head.len += ob->len;
+    out_printf(&head, "]}");
+    free(ob->data);
+    *ob = head;
+}
+
+/*
+ * Progress and diagnostic lines.  In a text report they stay in order
+ * with the errors around them; otherwise they go straight to stderr.
+ */
+static void report_note(struct check *chk, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (report_format == FORMAT_TEXT) {
+        out_vprintf(&chk->out, fmt, ap);
+    } else {
+        vfprintf(stderr, fmt, ap);
+    }
+    va_end(ap);
+}
+
+/* Gives up on the current image; the caller of check_image() cleans up. */
+static void abort_check(struct check *chk, const char *what) {
+    int saved = errno;
+    if (report_format == FORMAT_TEXT) {
+        out_flush(&chk->out);
+    }
+    if (chk->tag_messages) {
+        fprintf(stderr, "%s: %s: %s\n", chk->image_path, what, strerror(saved));
+    } else {
+        errno = saved;
+        perror(what);
+    }
+    chk->failed = 1;
+    longjmp(chk->abort, 1);
+}
+
+static void io_begin(void) {
+    if (io_slots) {
+        while (sem_wait(io_slots) != 0 && errno == EINTR) {
+        }
+    }
+}
+
+static void io_end(void) {
+    if (io_slots) {
+        sem_post(io_slots);
+    }
+}
+
+/* Reads one block; `data` is its heatmap class if it is in the data area. */
+static void pread_block_as(struct check *chk, uint32_t block_index, void *buf, enum vsfs_heat_class data) {
     off_t offset = (off_t)block_index * BLOCK_SIZE;
-    ssize_t n = pread(fd, buf, BLOCK_SIZE, offset);
+    io_begin();
+    ssize_t n = vsfs_image_pread(&chk->img, buf, BLOCK_SIZE, offset);
+    io_end();
     if (n != (ssize_t)BLOCK_SIZE) {
-        die("pread");
+        if (n >= 0) {
+            errno = EIO;
+        }
+        abort_check(chk, "pread");
+    }
+    if (chk->heat.count) {
+        vsfs_heat_note(&chk->heat, block_index, 1, data, 0);
+    }
+}
+
+static void pread_block(struct check *chk, uint32_t block_index, void *buf) {
+    pread_block_as(chk, block_index, buf, VSFS_HEAT_DIR);
+}
+
+static void pread_blocks(struct check *chk, uint32_t first, uint32_t count, void *buf) {
+    size_t want = (size_t)count * BLOCK_SIZE;
+    size_t done = 0;
+    while (done < want) {
+        io_begin();
+        ssize_t n = vsfs_image_pread(&chk->img, (uint8_t *)buf + done, want - done,
+                                     (off_t)first * BLOCK_SIZE + (off_t)done);
+        io_end();
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            abort_check(chk, "pread");
+        }
+        done += (size_t)n;
+    }
+    if (chk->heat.count) {
+        vsfs_heat_note(&chk->heat, first, count, VSFS_HEAT_DIR, 0);
+    }
+}
+
+/*
+ * Position of a block in a copy-on-write map: the metadata blocks come
+ * first, then in a snapshot image the snapshot and refcount tables.
+ */
+static uint32_t map_index(const struct superblock *sb, uint32_t block) {
+    if (block >= sb->data_start) {
+        return sb->data_start - sb->inode_bitmap + block - (sb->refcount_start - 1);
+    }
+    return block - sb->inode_bitmap;
+}
+
+/*
+ * Reads `count` metadata blocks starting at `first`.  In a copy-on-write
+ * image each one is looked up in the given map.
+ */
+static void read_meta(struct check *chk, const struct superblock *sb, const uint32_t *map,
+                      uint32_t first, uint32_t count, uint8_t *buf) {
+    if (!map) {
+        pread_blocks(chk, first, count, buf);
+        return;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        pread_block(chk, map[map_index(sb, first + i)], buf + (size_t)i * BLOCK_SIZE);
+    }
+}
+
+static void phase_begin(struct check *chk) {
+    if (perf_phases) {
+        perfctr_read(&chk->pc, &chk->phase_start);
+    }
+}
+
+static void phase_end(struct check *chk, const char *phase) {
+    if (!perf_phases) {
+        return;
+    }
+    struct perfctr_values now;
+    perfctr_read(&chk->pc, &now);
+    perfctr_delta(&chk->phase_start, &now);
+    char buf[256];
+    perfctr_format(&chk->phase_start, buf, sizeof(buf));
+    report_note(chk, "%s%sperf %-6s %s\n", chk->tag_messages ? chk->image_path : "", chk->tag_messages ? ": " : "",
+                phase, buf);
+}
+
+static void *check_alloc(struct check *chk, size_t n, size_t size, const char *what) {
+    void *p = calloc(n ? n : 1, size);
+    if (!p) {
+        abort_check(chk, what);
     }
+    return p;
 }
 
 static int bitmap_test(const uint8_t *bitmap, uint32_t index) {
     return (bitmap[index / 8] >> (index % 8)) & 0x1;
 }
 
-static void bitmap_check_zero_tail(const uint8_t *bitmap, uint32_t valid_bits, const char *name) {
-    uint32_t total_bits = BLOCK_SIZE * 8;
+static void bitmap_check_zero_tail(struct check *chk,
+                                   const uint8_t *bitmap, uint32_t valid_bits, uint32_t bitmap_blocks,
+                                   enum err_category category, const char *name) {
+    uint32_t total_bits = bitmap_blocks * BITS_PER_BLOCK;
     for (uint32_t bit = valid_bits; bit < total_bits; ++bit) {
         if (bitmap_test(bitmap, bit)) {
-            report_error("%s bitmap has stray bit set at %u", name, bit);
+            report_error(chk, category, "%s bitmap has stray bit set at %u", name, bit);
             return;
         }
     }
 }
 
-static void validate_superblock(const struct superblock *sb) {
+static int validate_superblock(struct check *chk, const struct superblock *sb, off_t image_size,
+                               struct layout *lay) {
+    int before = chk->error_count;
     if (sb->magic != FS_MAGIC) {
-        report_error("invalid superblock magic 0x%08x", sb->magic);
+        report_error(chk, ERR_SUPERBLOCK, "invalid superblock magic 0x%08x", sb->magic);
     }
     if (sb->block_size != BLOCK_SIZE) {
-        report_error("unexpected block size %u", sb->block_size);
+        report_error(chk, ERR_SUPERBLOCK, "unexpected block size %u", sb->block_size);
+    }
+    if (sb->journal_block != JOURNAL_BLOCK_IDX) {
+        report_error(chk, ERR_SUPERBLOCK, "journal block index mismatch %u", sb->journal_block);
     }
-    if (sb->total_blocks != TOTAL_BLOCKS) {
-        report_error("unexpected total blocks %u", sb->total_blocks);
+    if (sb->inode_bitmap <= sb->journal_block) {
+        report_error(chk, ERR_SUPERBLOCK, "inode bitmap index mismatch %u", sb->inode_bitmap);
     }
-    uint32_t expected_inodes = INODE_BLOCKS * (BLOCK_SIZE / INODE_SIZE);
-    if (sb->inode_count != expected_inodes) {
-        report_error("unexpected inode count %u", sb->inode_count);
+    if (sb->data_bitmap <= sb->inode_bitmap) {
+        report_error(chk, ERR_SUPERBLOCK, "data bitmap index mismatch %u", sb->data_bitmap);
     }
-    if (sb->journal_block != JOURNAL_BLOCK_IDX) {
-        report_error("journal block index mismatch %u", sb->journal_block);
+    if (sb->inode_start <= sb->data_bitmap) {
+        report_error(chk, ERR_SUPERBLOCK, "inode start index mismatch %u", sb->inode_start);
+    }
+    if (sb->data_start <= sb->inode_start) {
+        report_error(chk, ERR_SUPERBLOCK, "data start index mismatch %u", sb->data_start);
+    }
+    if (sb->total_blocks <= sb->data_start) {
+        report_error(chk, ERR_SUPERBLOCK, "unexpected total blocks %u", sb->total_blocks);
+    }
+    if (sb->mode != FS_MODE_JOURNAL && sb->mode != FS_MODE_COW) {
+        report_error(chk, ERR_SUPERBLOCK, "unknown metadata mode %u", sb->mode);
+    }
+    if (sb->features & ~FS_FEATURES) {
+        report_error(chk, ERR_SUPERBLOCK, "unknown feature bits 0x%x", sb->features & ~FS_FEATURES);
+    }
+    if ((sb->features & FS_FEAT_DEDUP) && sb->mode != FS_MODE_JOURNAL) {
+        report_error(chk, ERR_SUPERBLOCK, "deduplication requires journaled metadata");
+    }
+    if ((sb->features & FS_FEAT_SNAPSHOT) && sb->mode != FS_MODE_COW) {
+        report_error(chk, ERR_SUPERBLOCK, "snapshots require copy-on-write metadata");
+    }
+    if ((sb->features & FS_FEATURES) == FS_FEATURES) {
+        report_error(chk, ERR_SUPERBLOCK, "deduplication and snapshots cannot be combined");
+    }
+    if (chk->error_count != before) {
+        return -1;
+    }
+
+    lay->journal_blocks = sb->inode_bitmap - sb->journal_block;
+    lay->inode_bmap_blocks = sb->data_bitmap - sb->inode_bitmap;
+    lay->data_bmap_blocks = sb->inode_start - sb->data_bitmap;
+    lay->inode_blocks = sb->data_start - sb->inode_start;
+    lay->data_blocks = sb->total_blocks - sb->data_start;
+    lay->refcount_blocks = 0;
+    lay->tail_blocks = 0;
+    if (sb->features & FS_FEATURES) {
+        uint32_t snap = (sb->features & FS_FEAT_SNAPSHOT) ? 1U : 0U;
+        if (sb->refcount_start <= sb->data_start + snap || sb->refcount_start >= sb->total_blocks ||
+            (uint64_t)(sb->total_blocks - sb->refcount_start) * REFS_PER_BLOCK < lay->data_blocks) {
+            report_error(chk, ERR_SUPERBLOCK, "refcount table at block %u does not fit the data region",
+                         sb->refcount_start);
+            return -1;
+        }
+        lay->refcount_blocks = sb->total_blocks - sb->refcount_start;
+        lay->tail_blocks = lay->refcount_blocks + snap;
+    }
+    lay->map_count = sb->data_start - sb->inode_bitmap;
+    if (sb->features & FS_FEAT_SNAPSHOT) {
+        lay->map_count += lay->tail_blocks;
+    }
+
+    if (sb->inode_count == 0 ||
+        (uint64_t)sb->inode_count > (uint64_t)lay->inode_blocks * (BLOCK_SIZE / INODE_SIZE) ||
+        (uint64_t)sb->inode_count > (uint64_t)lay->inode_bmap_blocks * BITS_PER_BLOCK) {
+        report_error(chk, ERR_SUPERBLOCK, "unexpected inode count %u", sb->inode_count);
+    }
+    if ((uint64_t)lay->data_blocks > (uint64_t)lay->data_bmap_blocks * BITS_PER_BLOCK) {
+        report_error(chk, ERR_SUPERBLOCK, "data bitmap too small for %u data blocks", lay->data_blocks);
+    }
+    if (image_size < (off_t)sb->total_blocks * BLOCK_SIZE) {
+        report_error(chk, ERR_SUPERBLOCK, "image is %lld bytes, superblock claims %u blocks", (long long)image_size,
+                     sb->total_blocks);
     }
-    if (sb->inode_bitmap != INODE_BMAP_IDX) {
-        report_error("inode bitmap index mismatch %u", sb->inode_bitmap);
+    return chk->error_count == before ? 0 : -1;
+}
+
+static uint32_t fnv1a(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 16777619U;
+    }
+    return h;
+}
+
+/* Whether a map block read from disk is intact and belongs to generation `gen`. */
+static int cow_map_valid(const uint8_t *block, uint32_t gen, const struct layout *lay) {
+    const struct cow_map_header *mh = (const struct cow_map_header *)block;
+    const uint32_t *map = (const uint32_t *)(block + sizeof(*mh));
+    uint32_t csum = fnv1a(mh, offsetof(struct cow_map_header, csum)) ^
+                    fnv1a(map, (mh->count <= COW_MAP_MAX ? mh->count : 0) * sizeof(uint32_t));
+    return mh->magic == COW_MAP_MAGIC && mh->gen == gen && mh->count == lay->map_count && mh->csum == csum;
+}
+
+/*
+ * Checks that a map only sends blocks to their home location or to the
+ * shadow pool.  `pool_role` remembers, across the maps of every root, what
+ * each pool block holds: roots may share a shadow block, but only for the
+ * same metadata block, and never a map block.
+ */
+static void check_cow_map(struct check *chk, const struct superblock *sb, const struct layout *lay,
+                          uint32_t map_block, const uint32_t *map, uint32_t *pool_role, const char *root) {
+    uint32_t meta = sb->data_start - sb->inode_bitmap;
+    if (pool_role[map_block - sb->journal_block] != 0) {
+        report_error(chk, ERR_COW_MAP, "%s map block %u is also used by another root", root, map_block);
+    }
+    pool_role[map_block - sb->journal_block] = UINT32_MAX;
+    for (uint32_t i = 0; i < lay->map_count; ++i) {
+        uint32_t home = i < meta ? sb->inode_bitmap + i : sb->total_blocks - lay->tail_blocks + (i - meta);
+        uint32_t phys = map[i];
+        if (phys == home) {
+            continue;
+        }
+        if (phys < sb->journal_block || phys >= sb->inode_bitmap) {
+            report_error(chk, ERR_COW_MAP,
+                         "%s map sends metadata block %u outside the shadow pool (block %u)", root, home, phys);
+            continue;
+        }
+        uint32_t role = pool_role[phys - sb->journal_block];
+        if (role == i + 1) {
+            continue;
+        }
+        if (role != 0) {
+            report_error(chk, ERR_COW_MAP, "%s map reuses shadow block %u", root, phys);
+        }
+        pool_role[phys - sb->journal_block] = i + 1;
+    }
+}
+
+/*
+ * Finds the current root of a copy-on-write image, the newer of the two
+ * root slots whose pointer and map block both verify, and checks its map.
+ * Returns the map entries, or NULL if no root is usable.
+ */
+static const uint32_t *load_cow_map(struct check *chk, const struct superblock *sb, const struct layout *lay,
+                                    uint32_t *pool_role) {
+    if (lay->map_count > COW_MAP_MAX) {
+        report_error(chk, ERR_COW_MAP, "%u metadata blocks do not fit a copy-on-write map", lay->map_count);
+        return NULL;
+    }
+    uint8_t *block = chk->cow_map_block = check_alloc(chk, 1, BLOCK_SIZE, "malloc cow map");
+    const uint32_t *map = (const uint32_t *)(block + sizeof(struct cow_map_header));
+
+    int first = sb->roots[1].gen > sb->roots[0].gen ? 1 : 0;
+    int found = -1;
+    for (int k = 0; k < 2 && found < 0; ++k) {
+        const struct cow_root *r = &sb->roots[k == 0 ? first : 1 - first];
+        if (r->gen == 0 || r->csum != fnv1a(r, offsetof(struct cow_root, csum)) ||
+            r->map_block < sb->journal_block || r->map_block >= sb->inode_bitmap) {
+            continue;
+        }
+        pread_block(chk, r->map_block, block);
+        if (cow_map_valid(block, r->gen, lay)) {
+            found = k == 0 ? first : 1 - first;
+        }
+    }
+    if (found < 0) {
+        report_error(chk, ERR_COW_MAP, "no valid copy-on-write root");
+        return NULL;
     }
-    if (sb->data_bitmap != DATA_BMAP_IDX) {
-        report_error("data bitmap index mismatch %u", sb->data_bitmap);
+    check_cow_map(chk, sb, lay, sb->roots[found].map_block, map, pool_role, "current");
+    return map;
+}
+
+/*
+ * Reads the snapshot table through the current map, then each snapshot's
+ * map.  Returns the number of snapshots whose maps are usable; their
+ * entries are copied to the front of the table so that index i of the
+ * returned table goes with map i.
+ */
+static uint32_t load_snapshots(struct check *chk, const struct superblock *sb, const struct layout *lay,
+                               const uint32_t *map, uint32_t *pool_role, struct snap_entry **table,
+                               uint8_t **maps) {
+    uint8_t *area = chk->snap_area = check_alloc(chk, 1 + SNAP_MAX, BLOCK_SIZE, "malloc snapshots");
+    read_meta(chk, sb, map, sb->refcount_start - 1, 1, area);
+    const struct snap_table_header *th = (const struct snap_table_header *)area;
+    struct snap_entry *ents = (struct snap_entry *)(area + sizeof(*th));
+    *table = ents;
+    *maps = area + BLOCK_SIZE;
+    if (th->magic != SNAP_MAGIC || th->count > SNAP_MAX) {
+        report_error(chk, ERR_SNAPSHOT, "snapshot table is damaged");
+        return 0;
     }
-    if (sb->inode_start != INODE_START_IDX) {
-        report_error("inode start index mismatch %u", sb->inode_start);
+    uint32_t usable = 0;
+    for (uint32_t s = 0; s < th->count; ++s) {
+        struct snap_entry e = ents[s];
+        char name[SNAP_NAME_LEN + 1];
+        memcpy(name, e.name, SNAP_NAME_LEN);
+        name[SNAP_NAME_LEN] = '\0';
+        if (memchr(e.name, '\0', SNAP_NAME_LEN) == NULL || e.name[0] == '\0') {
+            report_error(chk, ERR_SNAPSHOT, "snapshot %u has a malformed name", s);
+        }
+        for (uint32_t k = 0; k < usable; ++k) {
+            if (strncmp(ents[k].name, e.name, SNAP_NAME_LEN) == 0) {
+                report_error(chk, ERR_SNAPSHOT, "snapshot name '%s' is used twice", name);
+            }
+        }
+        uint8_t *block = *maps + (size_t)usable * BLOCK_SIZE;
+        if (e.map_block < sb->journal_block || e.map_block >= sb->inode_bitmap) {
+            report_error(chk, ERR_SNAPSHOT, "snapshot '%s' map block %u lies outside the shadow pool", name,
+                         e.map_block);
+            continue;
+        }
+        pread_block(chk, e.map_block, block);
+        if (!cow_map_valid(block, e.gen, lay)) {
+            report_error(chk, ERR_SNAPSHOT, "snapshot '%s' map block %u is damaged", name, e.map_block);
+            continue;
+        }
+        check_cow_map(chk, sb, lay, e.map_block, (const uint32_t *)(block + sizeof(struct cow_map_header)),
+                      pool_role, name);
+        ents[usable++] = e;
     }
-    if (sb->data_start != DATA_START_IDX) {
-        report_error("data start index mismatch %u", sb->data_start);
+    return usable;
+}
+
+/*
+ * In a snapshot image a data block's count is the number of pointers to it
+ * from the distinct inode table blocks of every root: blocks shared by the
+ * current root and its snapshots are counted once.
+ */
+static void count_shared_refs(struct check *chk, const struct superblock *sb, const struct layout *lay,
+                              const uint32_t **maps, uint32_t nmaps, uint32_t *refs) {
+    uint8_t block[BLOCK_SIZE];
+    uint32_t table_first = lay->data_blocks - lay->tail_blocks;
+    for (uint32_t b = sb->inode_start; b < sb->data_start; ++b) {
+        uint32_t idx = map_index(sb, b);
+        for (uint32_t m = 0; m < nmaps; ++m) {
+            uint32_t phys = maps[m][idx];
+            int seen = 0;
+            for (uint32_t k = 0; k < m && !seen; ++k) {
+                seen = maps[k][idx] == phys;
+            }
+            if (seen) {
+                continue;
+            }
+            pread_block(chk, phys, block);
+            const struct inode *inodes = (const struct inode *)block;
+            for (uint32_t i = 0; i < BLOCK_SIZE / INODE_SIZE; ++i) {
+                for (uint32_t d = 0; inodes[i].type != 0 && d < DIRECT_POINTERS; ++d) {
+                    uint32_t blk = inodes[i].direct[d];
+                    if (blk >= sb->data_start && blk - sb->data_start < table_first) {
+                        refs[blk - sb->data_start]++;
+                    }
+                }
+            }
+        }
     }
 }
 
-static void check_directory(int fd,
+static void check_directory(struct check *chk,
                             const struct inode *inode,
                             uint32_t inode_index,
                             const uint8_t *inode_used,
                             uint32_t inode_count,
                             uint32_t *link_refs) {
     if (inode->size % sizeof(struct dirent) != 0) {
-        report_error("inode %u directory size %u is not dirent-aligned", inode_index, inode->size);
+        report_error(chk, ERR_DIRECTORY, "inode %u directory size %u is not dirent-aligned", inode_index, inode->size);
         return;
     }
 
     uint32_t bytes_remaining = inode->size;
     uint8_t block[BLOCK_SIZE];
     int saw_dot = 0;
+    if (chk->dir_slots) {
+        chk->dir_slots[inode_index] = inode->size / sizeof(struct dirent);
+    }
     int saw_dotdot = 0;
 
     for (uint32_t i = 0; i < DIRECT_POINTERS && bytes_remaining > 0; ++i) {
         uint32_t blk = inode->direct[i];
         if (blk == 0) {
-            report_error("inode %u directory missing data block for bytes still remaining", inode_index);
+            report_error(chk, ERR_DIRECTORY, "inode %u directory missing data block for bytes still remaining",
+                         inode_index);
             return;
         }
-        pread_block(fd, blk, block);
+        pread_block(chk, blk, block);
         uint32_t chunk = bytes_remaining > BLOCK_SIZE ? BLOCK_SIZE : bytes_remaining;
         uint32_t entries = chunk / sizeof(struct dirent);
         const struct dirent *entries_ptr = (const struct dirent *)block;
@@ -161,25 +873,30 @@ static void check_directory(int fd,
             if (de->inode == 0 && de->name[0] == '\0') {
                 continue;
             }
+            if (chk->dir_live) {
+                chk->dir_live[inode_index]++;
+            }
             if (de->inode >= inode_count) {
-                report_error("inode %u directory entry points to out-of-range inode %u", inode_index, de->inode);
+                report_error(chk, ERR_DIRECTORY, "inode %u directory entry points to out-of-range inode %u",
+                             inode_index, de->inode);
                 continue;
             }
             if (!inode_used[de->inode]) {
-                report_error("inode %u directory entry references free inode %u", inode_index, de->inode);
+                report_error(chk, ERR_DIRECTORY, "inode %u directory entry references free inode %u", inode_index,
+                             de->inode);
             }
             if (memchr(de->name, '\0', sizeof(de->name)) == NULL) {
-                report_error("inode %u directory entry has unterminated name", inode_index);
+                report_error(chk, ERR_DIRECTORY, "inode %u directory entry has unterminated name", inode_index);
                 continue;
             }
             if (de->name[0] == '\0') {
-                report_error("inode %u directory entry has empty name", inode_index);
+                report_error(chk, ERR_DIRECTORY, "inode %u directory entry has empty name", inode_index);
                 continue;
             }
             link_refs[de->inode]++;
             if (strcmp(de->name, ".") == 0) {
                 if (de->inode != inode_index) {
-                    report_error("inode %u '.' entry points to %u", inode_index, de->inode);
+                    report_error(chk, ERR_DIRECTORY, "inode %u '.' entry points to %u", inode_index, de->inode);
                 }
                 saw_dot = 1;
             } else if (strcmp(de->name, "..") == 0) {
@@ -190,66 +907,429 @@ static void check_directory(int fd,
     }
 
     if (bytes_remaining != 0) {
-        report_error("inode %u directory uses more data than direct pointers cover", inode_index);
+        report_error(chk, ERR_DIRECTORY, "inode %u directory uses more data than direct pointers cover", inode_index);
     }
     if (inode->size > 0) {
         if (!saw_dot) {
-            report_error("inode %u directory missing '.' entry", inode_index);
+            report_error(chk, ERR_DIRECTORY, "inode %u directory missing '.' entry", inode_index);
         }
         if (!saw_dotdot) {
-            report_error("inode %u directory missing '..' entry", inode_index);
+            report_error(chk, ERR_DIRECTORY, "inode %u directory missing '..' entry", inode_index);
         }
     }
 }
 
-int main(int argc, char *argv[]) {
-    const char *image_path = (argc > 1) ? argv[1] : DEFAULT_IMAGE;
+/*
+ * A compressed file stores each cluster in as many of its direct pointers
+ * as the cluster map says, and every stored cluster must decompress to no
+ * more than the file holds at that point.
+ */
+static void check_compressed(struct check *chk, const struct inode *inode, uint32_t inode_index,
+                             uint32_t data_start, uint32_t data_blocks) {
+    static _Thread_local uint8_t stored_buf[CLUSTER_SIZE];
+    static _Thread_local uint8_t plain[CLUSTER_SIZE];
+    for (uint32_t c = 0; c < CLUSTERS; ++c) {
+        uint32_t stored = inode->cmap[c] & CLUSTER_LEN_MASK;
+        uint32_t base = c * CLUSTER_SIZE;
+        if (stored > CLUSTER_SIZE) {
+            report_error(chk, ERR_CLUSTER, "inode %u cluster %u claims %u stored bytes", inode_index, c, stored);
+            continue;
+        }
+        if (inode->cmap[c] != 0 && base >= inode->size) {
+            report_error(chk, ERR_CLUSTER, "inode %u cluster %u lies past the end of the file", inode_index, c);
+        }
+        uint32_t need = (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int readable = 1;
+        for (uint32_t k = 0; k < CLUSTER_BLOCKS; ++k) {
+            uint32_t blk = inode->direct[c * CLUSTER_BLOCKS + k];
+            if ((blk != 0) != (k < need)) {
+                report_error(chk, ERR_CLUSTER, "inode %u cluster %u stores %u bytes but pointer %u is %s", inode_index,
+                             c, stored,
+                             c * CLUSTER_BLOCKS + k, blk ? "set" : "missing");
+                readable = 0;
+            } else if (blk != 0 && blk >= data_start && blk - data_start < data_blocks) {
+                pread_block_as(chk, blk, stored_buf + (size_t)k * BLOCK_SIZE, VSFS_HEAT_DATA);
+            } else if (blk != 0) {
+                readable = 0;
+            }
+        }
+        if (!readable || stored == 0) {
+            continue;
+        }
+        int64_t plain_len = stored;
+        if (!(inode->cmap[c] & CLUSTER_RAW)) {
+            plain_len = vsfs_lz_decompress(stored_buf, stored, plain, CLUSTER_SIZE);
+        }
+        if (plain_len < 0) {
+            report_error(chk, ERR_CLUSTER, "inode %u cluster %u does not decompress", inode_index, c);
+        } else if (base < inode->size && (uint64_t)plain_len > inode->size - base) {
+            report_error(chk, ERR_CLUSTER, "inode %u cluster %u holds %lld bytes, past the end of the file",
+                         inode_index, c,
+                         (long long)plain_len);
+        }
+    }
+}
+
+/* ---- analysis (-A) ---- */
 
-    int fd = open(image_path, O_RDONLY);
-    if (fd < 0) {
-        die("open");
+struct free_space {
+    uint64_t free;
+    uint64_t extents;
+    uint64_t largest;
+    uint64_t count[FREE_BUCKETS];
+    uint64_t blocks[FREE_BUCKETS];
+};
+
+static void free_extent(struct free_space *fs, uint64_t len) {
+    if (len == 0) {
+        return;
     }
+    uint32_t k = 63U - (uint32_t)__builtin_clzll(len);
+    if (k >= FREE_BUCKETS) {
+        k = FREE_BUCKETS - 1;
+    }
+    fs->free += len;
+    fs->extents++;
+    fs->count[k]++;
+    fs->blocks[k] += len;
+    if (len > fs->largest) {
+        fs->largest = len;
+    }
+}
 
+/*
+ * Free extents among the first `nbits` bits of a bitmap, a 64-bit word at
+ * a time: a word with every bit set or clear is taken whole, and a mixed
+ * one is walked from transition to transition with count-trailing-zeros.
+ */
+static void scan_free_extents(const uint8_t *bitmap, uint32_t nbits, struct free_space *fs) {
+    uint64_t run = 0;
+    uint32_t bit = 0;
+    for (; bit + 64 <= nbits; bit += 64) {
+        uint64_t used;
+        memcpy(&used, bitmap + bit / 8, sizeof(used));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        used = __builtin_bswap64(used);   // bit i lives in byte i / 8
+#endif
+        if (used == 0) {
+            run += 64;
+            continue;
+        }
+        if (used == ~0ULL) {
+            free_extent(fs, run);
+            run = 0;
+            continue;
+        }
+        uint32_t pos = 0;
+        while (pos < 64) {
+            uint64_t rest = used >> pos;
+            if (rest & 1U) {
+                // The bits shifted in are clear, so ~rest always has a set bit.
+                free_extent(fs, run);
+                run = 0;
+                pos += (uint32_t)__builtin_ctzll(~rest);
+            } else {
+                uint32_t n = rest ? (uint32_t)__builtin_ctzll(rest) : 64 - pos;
+                run += n;
+                pos += n;
+            }
+        }
+    }
+    for (; bit < nbits; ++bit) {
+        if (bitmap_test(bitmap, bit)) {
+            free_extent(fs, run);
+            run = 0;
+        } else {
+            run++;
+        }
+    }
+    free_extent(fs, run);
+}
+
+/* Runs of adjacent blocks among a file's direct pointers, in file order. */
+static uint32_t file_fragments(const struct inode *inode, uint32_t *blocks) {
+    uint32_t fragments = 0;
+    uint32_t prev = 0;
+    *blocks = 0;
+    for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
+        uint32_t blk = inode->direct[d];
+        if (blk == 0) {
+            continue;
+        }
+        if (prev == 0 || blk != prev + 1) {
+            fragments++;
+        }
+        prev = blk;
+        (*blocks)++;
+    }
+    return fragments;
+}
+
+/* Keeps the `WORST_SHOWN` largest keys seen, largest first. */
+struct worst {
+    uint32_t n;
+    uint32_t key[WORST_SHOWN];
+    uint32_t ino[WORST_SHOWN];
+    uint32_t a[WORST_SHOWN];
+    uint32_t b[WORST_SHOWN];
+};
+
+static void worst_add(struct worst *w, uint32_t key, uint32_t ino, uint32_t a, uint32_t b) {
+    uint32_t at = w->n < WORST_SHOWN ? w->n : WORST_SHOWN;
+    while (at > 0 && w->key[at - 1] < key) {
+        if (at < WORST_SHOWN) {
+            w->key[at] = w->key[at - 1];
+            w->ino[at] = w->ino[at - 1];
+            w->a[at] = w->a[at - 1];
+            w->b[at] = w->b[at - 1];
+        }
+        at--;
+    }
+    if (at >= WORST_SHOWN) {
+        return;
+    }
+    w->key[at] = key;
+    w->ino[at] = ino;
+    w->a[at] = a;
+    w->b[at] = b;
+    if (w->n < WORST_SHOWN) {
+        w->n++;
+    }
+}
+
+static double ratio(uint64_t part, uint64_t whole) {
+    return whole ? (double)part / (double)whole : 0.0;
+}
+
+/*
+ * Builds the image's analysis object: fragments per inode (directories
+ * included), free extents of the data bitmap, directory fill and
+ * tombstones (empty slots inside a directory's size), and inodes in use
+ * per inode-table block.
+ */
+static void analyze_image(struct check *chk, const struct inode *inodes, uint32_t inode_count,
+                          const uint8_t *inode_bitmap, const uint8_t *data_bitmap, uint32_t data_bits) {
+    struct outbuf *ob = &chk->analysis;
+
+    uint64_t files = 0, fragmented = 0, fragments = 0, file_blocks = 0;
+    uint64_t by_fragments[DIRECT_POINTERS + 1] = { 0 };
+    struct worst worst_files = { 0 };
+    uint64_t dirs = 0, slots = 0, live = 0;
+    struct worst worst_dirs = { 0 };
+    for (uint32_t i = 0; i < inode_count; ++i) {
+        const struct inode *ino = &inodes[i];
+        if (ino->type == 0) {
+            continue;
+        }
+        uint32_t blocks;
+        uint32_t f = file_fragments(ino, &blocks);
+        files++;
+        fragments += f;
+        file_blocks += blocks;
+        by_fragments[f]++;
+        if (f > 1) {
+            fragmented++;
+            worst_add(&worst_files, f, i, f, blocks);
+        }
+        if (ino->type == 2) {
+            uint32_t tomb = chk->dir_slots[i] - chk->dir_live[i];
+            dirs++;
+            slots += chk->dir_slots[i];
+            live += chk->dir_live[i];
+            if (tomb) {
+                worst_add(&worst_dirs, tomb, i, chk->dir_slots[i], tomb);
+            }
+        }
+    }
+
+    out_printf(ob, "{\"files\":{\"count\":%llu,\"fragmented\":%llu,\"fragments\":%llu,\"blocks\":%llu,"
+               "\"fragments_per_file\":%.3f,\"by_fragments\":[",
+               (unsigned long long)files, (unsigned long long)fragmented, (unsigned long long)fragments,
+               (unsigned long long)file_blocks, ratio(fragments, files));
+    for (uint32_t f = 0; f <= DIRECT_POINTERS; ++f) {
+        out_printf(ob, "%s%llu", f ? "," : "", (unsigned long long)by_fragments[f]);
+    }
+    out_printf(ob, "],\"worst\":[");
+    for (uint32_t k = 0; k < worst_files.n; ++k) {
+        out_printf(ob, "%s{\"inode\":%u,\"fragments\":%u,\"blocks\":%u}", k ? "," : "", worst_files.ino[k],
+                   worst_files.a[k], worst_files.b[k]);
+    }
+
+    struct free_space fs;
+    memset(&fs, 0, sizeof(fs));
+    scan_free_extents(data_bitmap, data_bits, &fs);
+    out_printf(ob, "]},\"free_space\":{\"blocks\":%u,\"free\":%llu,\"extents\":%llu,\"largest\":%llu,"
+               "\"fragmentation\":%.3f,\"by_size\":[",
+               data_bits, (unsigned long long)fs.free, (unsigned long long)fs.extents,
+               (unsigned long long)fs.largest, fs.free ? 1.0 - ratio(fs.largest, fs.free) : 0.0);
+    int first = 1;
+    for (uint32_t k = 0; k < FREE_BUCKETS; ++k) {
+        if (fs.count[k] == 0) {
+            continue;
+        }
+        out_printf(ob, "%s{\"min\":%llu,\"max\":%llu,\"extents\":%llu,\"blocks\":%llu}", first ? "" : ",",
+                   1ULL << k, (2ULL << k) - 1, (unsigned long long)fs.count[k], (unsigned long long)fs.blocks[k]);
+        first = 0;
+    }
+
+    out_printf(ob, "]},\"directories\":{\"count\":%llu,\"slots\":%llu,\"live\":%llu,\"tombstones\":%llu,"
+               "\"fill\":%.3f,\"tombstone_ratio\":%.3f,\"worst\":[",
+               (unsigned long long)dirs, (unsigned long long)slots, (unsigned long long)live,
+               (unsigned long long)(slots - live), ratio(live, slots), ratio(slots - live, slots));
+    for (uint32_t k = 0; k < worst_dirs.n; ++k) {
+        out_printf(ob, "%s{\"inode\":%u,\"slots\":%u,\"tombstones\":%u}", k ? "," : "", worst_dirs.ino[k],
+                   worst_dirs.a[k], worst_dirs.b[k]);
+    }
+
+    // One 32-bit word of the inode bitmap covers one inode-table block.
+    _Static_assert(INODES_PER_BLOCK == 32, "a bitmap word per inode block");
+    uint32_t table_blocks = (inode_count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    uint32_t by_used[INODES_PER_BLOCK + 1] = { 0 };
+    uint64_t used = 0;
+    for (uint32_t b = 0; b < table_blocks; ++b) {
+        uint32_t word;
+        memcpy(&word, inode_bitmap + (size_t)b * 4, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap32(word);
+#endif
+        uint32_t valid = inode_count - b * INODES_PER_BLOCK;
+        if (valid < INODES_PER_BLOCK) {
+            word &= (1U << valid) - 1;
+        }
+        uint32_t n = (uint32_t)__builtin_popcount(word);
+        by_used[n]++;
+        used += n;
+    }
+    out_printf(ob, "]},\"inode_table\":{\"blocks\":%u,\"inodes\":%u,\"used\":%llu,\"occupancy\":%.3f,"
+               "\"empty_blocks\":%u,\"full_blocks\":%u,\"by_used\":[",
+               table_blocks, inode_count, (unsigned long long)used, ratio(used, inode_count), by_used[0],
+               by_used[INODES_PER_BLOCK]);
+    for (uint32_t n = 0; n <= INODES_PER_BLOCK; ++n) {
+        out_printf(ob, "%s%u", n ? "," : "", by_used[n]);
+    }
+    out_printf(ob, "]}}");
+}
+
+static void check_image(struct check *chk) {
+    const char *image_path = chk->image_path;
+
+    off_t image_size = vsfs_image_size(&chk->img);
+    if (image_size < 0) {
+        abort_check(chk, "fstat");
+    }
+    // An overlay holds no blocks past the end of its base.
+    for (uint64_t b = chk->img.nblocks; b < (uint64_t)chk->img.bitmap_blocks * BITS_PER_BLOCK; ++b) {
+        if (vsfs_image_has(&chk->img, b)) {
+            report_error(chk, ERR_SUPERBLOCK, "overlay holds block %llu past the end of the image",
+                         (unsigned long long)b);
+            break;
+        }
+    }
+
+    uint8_t sb_block[BLOCK_SIZE];
+    pread_block(chk, 0, sb_block);
     struct superblock sb;
-    pread_block(fd, 0, &sb);
-    validate_superblock(&sb);
+    memcpy(&sb, sb_block, sizeof(sb));
+
+    phase_begin(chk);
+    struct layout lay;
+    if (validate_superblock(chk, &sb, image_size, &lay) != 0) {
+        report_note(chk, "Superblock unusable, cannot check '%s' further.\n", image_path);
+        chk->failed = 1;
+        return;
+    }
+    if (heat_buckets) {
+        struct vsfs_heat_layout hl = {
+            sb.total_blocks, sb.journal_block, sb.inode_bitmap, sb.inode_start, sb.data_start,
+            sb.refcount_start > sb.data_start ? sb.refcount_start : 0,
+        };
+        if (vsfs_heat_init(&chk->heat, &hl, heat_buckets) < 0) {
+            abort_check(chk, "malloc heatmap");
+        }
+        vsfs_heat_note(&chk->heat, 0, 1, VSFS_HEAT_DIR, 0);   // the superblock, read above
+    }
 
-    uint8_t inode_bitmap[BLOCK_SIZE];
-    uint8_t data_bitmap[BLOCK_SIZE];
-    pread_block(fd, INODE_BMAP_IDX, inode_bitmap);
-    pread_block(fd, DATA_BMAP_IDX, data_bitmap);
+    const uint32_t *map = NULL;
+    uint32_t *pool_role = NULL;
+    if (sb.mode == FS_MODE_COW) {
+        pool_role = chk->pool_role = check_alloc(chk, lay.journal_blocks, sizeof(uint32_t), "malloc cow pool");
+        map = load_cow_map(chk, &sb, &lay, pool_role);
+        if (!map) {
+            report_note(chk, "No usable copy-on-write root, cannot check '%s' further.\n", image_path);
+            chk->failed = 1;
+            return;
+        }
+    }
 
-    uint32_t inode_count = sb.inode_count;
-    uint32_t total_inode_bytes = INODE_BLOCKS * BLOCK_SIZE;
-    uint8_t *inode_area = malloc(total_inode_bytes);
-    if (!inode_area) {
-        die("malloc inode area");
+    // A snapshot image is checked as a whole: every snapshot's map, and the
+    // data references of all roots together.  -s picks the tree whose
+    // inodes, directories and bitmaps are checked.
+    int snap = (sb.features & FS_FEAT_SNAPSHOT) != 0;
+    const uint32_t *live_map = map;
+    const uint32_t *roots[1 + SNAP_MAX];
+    uint32_t nroots = 1;
+    roots[0] = map;
+    if (snap) {
+        struct snap_entry *table;
+        uint8_t *maps;
+        uint32_t nsnaps = load_snapshots(chk, &sb, &lay, map, pool_role, &table, &maps);
+        for (uint32_t s = 0; s < nsnaps; ++s) {
+            roots[nroots++] = (const uint32_t *)(maps + (size_t)s * BLOCK_SIZE + sizeof(struct cow_map_header));
+            if (view_snapshot && strncmp(table[s].name, view_snapshot, SNAP_NAME_LEN) == 0) {
+                map = roots[nroots - 1];
+            }
+        }
     }
-    for (uint32_t i = 0; i < INODE_BLOCKS; ++i) {
-        pread_block(fd, INODE_START_IDX + i, inode_area + (i * BLOCK_SIZE));
+    if (view_snapshot && map == live_map) {
+        report_note(chk, "No snapshot '%s' in '%s'.\n", view_snapshot, image_path);
+        chk->failed = 1;
+        return;
     }
+
+    uint8_t *inode_bitmap = chk->inode_bitmap =
+        check_alloc(chk, lay.inode_bmap_blocks, BLOCK_SIZE, "malloc bitmaps");
+    uint8_t *data_bitmap = chk->data_bitmap =
+        check_alloc(chk, lay.data_bmap_blocks, BLOCK_SIZE, "malloc bitmaps");
+    read_meta(chk, &sb, map, sb.inode_bitmap, lay.inode_bmap_blocks, inode_bitmap);
+    read_meta(chk, &sb, map, sb.data_bitmap, lay.data_bmap_blocks, data_bitmap);
+
+    uint32_t inode_count = sb.inode_count;
+    uint8_t *inode_area = chk->inode_area =
+        check_alloc(chk, lay.inode_blocks, BLOCK_SIZE, "malloc inode area");
+    read_meta(chk, &sb, map, sb.inode_start, lay.inode_blocks, inode_area);
     struct inode *inodes = (struct inode *)inode_area;
 
-    uint8_t inode_used[inode_count];
+    uint8_t *inode_used = chk->inode_used = check_alloc(chk, inode_count, 1, "malloc inode used");
     for (uint32_t i = 0; i < inode_count; ++i) {
         inode_used[i] = (inodes[i].type != 0);
     }
-    uint32_t *link_refs = calloc(inode_count, sizeof(uint32_t));
-    if (!link_refs) {
-        die("calloc link refs");
-    }
+    uint32_t *link_refs = chk->link_refs = check_alloc(chk, inode_count, sizeof(uint32_t), "calloc link refs");
 
-    int data_owner[DATA_BLOCKS];
-    memset(data_owner, -1, sizeof(data_owner));
-    uint8_t data_blocks_referenced[DATA_BLOCKS];
-    memset(data_blocks_referenced, 0, sizeof(data_blocks_referenced));
+    uint32_t data_start = sb.data_start;
+    uint32_t data_blocks = lay.data_blocks;
+    int *data_owner = chk->data_owner = check_alloc(chk, data_blocks, sizeof(int), "malloc data ownership");
+    uint32_t *data_refs = chk->data_refs = check_alloc(chk, data_blocks, sizeof(uint32_t), "malloc data ownership");
+    memset(data_owner, -1, (size_t)data_blocks * sizeof(int));
+    int dedup = (sb.features & FS_FEAT_DEDUP) != 0;
+    uint32_t table_first = data_blocks - lay.tail_blocks;   // data index of the snapshot or refcount table
+    uint16_t *refcounts = NULL;
+    if (dedup || snap) {
+        refcounts = chk->refcounts = check_alloc(chk, lay.refcount_blocks, BLOCK_SIZE, "malloc refcounts");
+        read_meta(chk, &sb, live_map, sb.refcount_start, lay.refcount_blocks, (uint8_t *)refcounts);
+    }
+    if (analyze) {
+        chk->dir_slots = check_alloc(chk, inode_count, sizeof(uint32_t), "malloc directory stats");
+        chk->dir_live = check_alloc(chk, inode_count, sizeof(uint32_t), "malloc directory stats");
+    }
+    phase_end(chk, "load");
 
+    phase_begin(chk);
     for (uint32_t i = 0; i < inode_count; ++i) {
         struct inode *ino = &inodes[i];
         int allocated = ino->type != 0;
         int bitmap_bit = bitmap_test(inode_bitmap, i);
         if (allocated != bitmap_bit) {
-            report_error("inode %u allocation mismatch (inode vs bitmap)", i);
+            report_error(chk, ERR_INODE_BITMAP, "inode %u allocation mismatch (inode vs bitmap)", i);
         }
         inode_used[i] = allocated;
         if (!allocated) {
@@ -257,86 +1337,517 @@ int main(int argc, char *argv[]) {
         }
 
         if (ino->type > 2) {
-            report_error("inode %u has invalid type %u", i, ino->type);
+            report_error(chk, ERR_INODE, "inode %u has invalid type %u", i, ino->type);
+        }
+        if (ino->flags & ~(INODE_COMPRESSED | INODE_JOURNAL_DATA)) {
+            report_error(chk, ERR_INODE, "inode %u has unknown flags 0x%x", i,
+                         ino->flags & ~(INODE_COMPRESSED | INODE_JOURNAL_DATA));
+        }
+        int compressed = (ino->flags & INODE_COMPRESSED) != 0;
+        if (compressed && ino->type != 1) {
+            report_error(chk, ERR_INODE, "inode %u is compressed but not a regular file", i);
+            compressed = 0;
+        }
+        if (ino->unwritten && (ino->type != 1 || compressed)) {
+            report_error(chk, ERR_INODE, "inode %u has unwritten blocks but is not an uncompressed file", i);
         }
 
         uint32_t required_blocks = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
         if (required_blocks > DIRECT_POINTERS) {
-            report_error("inode %u size %u exceeds direct pointers", i, ino->size);
+            report_error(chk, ERR_INODE, "inode %u size %u exceeds direct pointers", i, ino->size);
         }
 
+        // Preallocated (unwritten) blocks may lie past the size.
         uint32_t seen_blocks = 0;
+        uint32_t reserved = 0;
         for (uint32_t d = 0; d < DIRECT_POINTERS; ++d) {
             uint32_t blk = ino->direct[d];
+            int unwritten = (ino->unwritten >> d) & 1U;
             if (blk == 0) {
+                if (unwritten) {
+                    report_error(chk, ERR_INODE, "inode %u marks empty pointer %u unwritten", i, d);
+                }
                 continue;
             }
             seen_blocks++;
-            if (blk < DATA_START_IDX || blk >= DATA_START_IDX + DATA_BLOCKS) {
-                report_error("inode %u points outside data region (block %u)", i, blk);
+            if (unwritten && d >= required_blocks) {
+                reserved++;
+            } else if (d >= required_blocks && ino->type == 1 && !compressed) {
+                report_error(chk, ERR_INODE, "inode %u has written block %u past its size", i, d);
+            }
+            if (blk < data_start || blk - data_start >= data_blocks) {
+                report_error(chk, ERR_BLOCK_REF, "inode %u points outside data region (block %u)", i, blk);
+                continue;
+            }
+            uint32_t data_idx = blk - data_start;
+            if (data_idx >= table_first) {
+                report_error(chk, ERR_BLOCK_REF, "inode %u points into the %s table (block %u)", i,
+                             data_idx == table_first && snap ? "snapshot" : "refcount", blk);
                 continue;
             }
-            uint32_t data_idx = blk - DATA_START_IDX;
-            if (data_owner[data_idx] != -1 && data_owner[data_idx] != (int)i) {
-                report_error("data block %u referenced by both inode %d and inode %u", blk, data_owner[data_idx], i);
+            // Deduplicated images let regular files share blocks; a
+            // directory block always has exactly one owner.
+            int owner = data_owner[data_idx];
+            if (owner == -1) {
+                data_owner[data_idx] = (int)i;
+            } else if (!dedup || ino->type != 1 || inodes[owner].type != 1) {
+                report_error(chk, ERR_BLOCK_REF, "data block %u referenced by both inode %d and inode %u", blk, owner,
+                             i);
             }
-            data_owner[data_idx] = (int)i;
-            data_blocks_referenced[data_idx] = 1;
+            data_refs[data_idx]++;
         }
 
-        if (seen_blocks < required_blocks) {
-            report_error("inode %u lacks blocks for declared size (need %u have %u)", i, required_blocks, seen_blocks);
+        // A compressed file needs fewer blocks than its size; the cluster
+        // map says how many.
+        if (compressed) {
+            check_compressed(chk, ino, i, data_start, data_blocks);
+        } else if (seen_blocks < required_blocks) {
+            report_error(chk, ERR_INODE, "inode %u lacks blocks for declared size (need %u have %u)", i,
+                         required_blocks, seen_blocks);
         }
-        if (required_blocks == 0 && seen_blocks > 0) {
-            report_error("inode %u has data blocks but zero size", i);
+        if (required_blocks == 0 && seen_blocks > reserved) {
+            report_error(chk, ERR_INODE, "inode %u has data blocks but zero size", i);
         }
 
         if (ino->type == 2) {
-            check_directory(fd, ino, i, inode_used, inode_count, link_refs);
+            check_directory(chk, ino, i, inode_used, inode_count, link_refs);
         }
     }
 
+    phase_end(chk, "inodes");
+
+    phase_begin(chk);
     for (uint32_t i = 0; i < inode_count; ++i) {
         if (!inode_used[i]) {
             continue;
         }
         if (inodes[i].links != link_refs[i]) {
-            report_error("inode %u link count %u disagrees with directory refs %u", i, inodes[i].links, link_refs[i]);
+            report_error(chk, ERR_LINKS, "inode %u link count %u disagrees with directory refs %u", i, inodes[i].links,
+                         link_refs[i]);
         }
     }
 
     for (uint32_t bit = 0; bit < inode_count; ++bit) {
         int bit_val = bitmap_test(inode_bitmap, bit);
         if (bit_val && !inode_used[bit]) {
-            report_error("inode bitmap marks %u used but inode is free", bit);
+            report_error(chk, ERR_INODE_BITMAP, "inode bitmap marks %u used but inode is free", bit);
         }
         if (!bit_val && inode_used[bit]) {
-            report_error("inode bitmap misses allocated inode %u", bit);
+            report_error(chk, ERR_INODE_BITMAP, "inode bitmap misses allocated inode %u", bit);
         }
     }
-    bitmap_check_zero_tail(inode_bitmap, inode_count, "inode");
+    bitmap_check_zero_tail(chk, inode_bitmap, inode_count, lay.inode_bmap_blocks, ERR_INODE_BITMAP, "inode");
 
-    for (uint32_t bit = 0; bit < DATA_BLOCKS; ++bit) {
+    // The current data bitmap of a snapshot image keeps every block some
+    // root references; a snapshot's own bitmap may still mark blocks freed
+    // since it was taken.
+    uint32_t *expected = data_refs;
+    if (snap) {
+        expected = chk->shared_refs = check_alloc(chk, data_blocks, sizeof(uint32_t), "malloc shared refs");
+        count_shared_refs(chk, &sb, &lay, roots, nroots, expected);
+    }
+    for (uint32_t bit = 0; bit < data_blocks; ++bit) {
         int bit_val = bitmap_test(data_bitmap, bit);
-        if (bit_val && !data_blocks_referenced[bit]) {
-            report_error("data bitmap marks block %u used but no inode references it", bit + DATA_START_IDX);
+        if (bit >= table_first) {
+            if (!bit_val) {
+                report_error(chk, ERR_DATA_BITMAP, "data bitmap does not reserve %s table block %u",
+                             bit == table_first && snap ? "snapshot" : "refcount", bit + data_start);
+            }
+            continue;
+        }
+        if (bit_val && !expected[bit] && map == live_map) {
+            report_error(chk, ERR_DATA_BITMAP, "data bitmap marks block %u used but no inode references it",
+                         bit + data_start);
+        }
+        if (!bit_val && (data_refs[bit] || (map == live_map && expected[bit]))) {
+            report_error(chk, ERR_DATA_BITMAP, "data block %u referenced but bitmap is clear", bit + data_start);
         }
-        if (!bit_val && data_blocks_referenced[bit]) {
-            report_error("data block %u referenced but bitmap is clear", bit + DATA_START_IDX);
+        if (refcounts && refcounts[bit] != expected[bit]) {
+            report_error(chk, ERR_REFCOUNT, "data block %u refcount %u but %u references", bit + data_start,
+                         refcounts[bit],
+                         expected[bit]);
         }
     }
 
-    bitmap_check_zero_tail(data_bitmap, DATA_BLOCKS, "data");
+    bitmap_check_zero_tail(chk, data_bitmap, data_blocks, lay.data_bmap_blocks, ERR_DATA_BITMAP, "data");
+    phase_end(chk, "cross");
 
-    if (close(fd) < 0) {
-        die("close");
+    if (analyze) {
+        phase_begin(chk);
+        analyze_image(chk, inodes, inode_count, inode_bitmap, data_bitmap, table_first);
+        phase_end(chk, "analyze");
     }
+}
 
-    if (error_count == 0) {
-        printf("Filesystem '%s' is consistent.\n", image_path);
-        return 0;
+static void release_check(struct check *chk) {
+    free(chk->dir_slots);
+    free(chk->dir_live);
+    chk->dir_slots = NULL;
+    chk->dir_live = NULL;
+    free(chk->shared_refs);
+    free(chk->snap_area);
+    free(chk->pool_role);
+    free(chk->refcounts);
+    free(chk->data_refs);
+    free(chk->data_owner);
+    free(chk->link_refs);
+    free(chk->inode_used);
+    free(chk->inode_area);
+    free(chk->data_bitmap);
+    free(chk->inode_bitmap);
+    free(chk->cow_map_block);
+    chk->refcounts = NULL;
+    chk->data_refs = NULL;
+    chk->data_owner = NULL;
+    chk->link_refs = NULL;
+    chk->inode_used = NULL;
+    chk->inode_area = NULL;
+    chk->data_bitmap = NULL;
+    chk->inode_bitmap = NULL;
+    chk->cow_map_block = NULL;
+    chk->snap_area = NULL;
+    chk->pool_role = NULL;
+    chk->shared_refs = NULL;
+}
+
+/* Opens the image; if it cannot be, reports that and returns -1. */
+static int open_check(struct check *chk) {
+    if (vsfs_image_open(&chk->img, chk->image_path, O_RDONLY) < 0) {
+        if (chk->tag_messages) {
+            fprintf(stderr, "%s: open: %s\n", chk->image_path, vsfs_image_strerror(errno));
+        } else {
+            fprintf(stderr, "open: %s\n", vsfs_image_strerror(errno));
+        }
+        chk->failed = 1;
+        report_finish(chk);
+        return -1;
+    }
+    return 0;
+}
+
+/* Checks an image open_check() opened, then closes it. */
+static void check_opened(struct check *chk) {
+    memset(&chk->pc, -1, sizeof(chk->pc));
+    if (perf_phases) {
+        perfctr_open(&chk->pc, 0, 0);
+        perfctr_enable(&chk->pc);
+    }
+    if (setjmp(chk->abort) == 0) {
+        check_image(chk);
     }
+    if (chk->heat.count) {
+        pthread_mutex_lock(&out_lock);
+        fprintf(stderr, "heatmap of %s, %u block(s) per range\n", chk->image_path, 1U << chk->heat.shift);
+        vsfs_heat_dump(&chk->heat, stderr);
+        pthread_mutex_unlock(&out_lock);
+        vsfs_heat_free(&chk->heat);
+    }
+    perfctr_close(&chk->pc);
+    release_check(chk);
+    vsfs_image_close(&chk->img);
+    report_finish(chk);
+}
+
+static void run_check(struct check *chk) {
+    if (open_check(chk) == 0) {
+        check_opened(chk);
+    }
+}
 
-    fprintf(stderr, "%d inconsistencies found.\n", error_count);
+/*
+ * Starts reading an image's metadata (superblock to the end of the inode
+ * table) into the page cache without waiting for it.  Returns whether
+ * anything was asked for.
+ */
+static int prefetch_check(struct check *chk) {
+    uint8_t sb_block[BLOCK_SIZE];
+    if (vsfs_image_pread(&chk->img, sb_block, BLOCK_SIZE, 0) != (ssize_t)BLOCK_SIZE) {
+        return 0;
+    }
+    struct superblock sb;
+    memcpy(&sb, sb_block, sizeof(sb));
+    if (sb.magic != FS_MAGIC || sb.data_start == 0 || sb.data_start > sb.total_blocks) {
+        return 0;
+    }
+    off_t len = (off_t)sb.data_start * BLOCK_SIZE;
+    posix_fadvise(chk->img.fd, chk->img.data_off, len, POSIX_FADV_WILLNEED);
+    if (chk->img.base_fd >= 0) {
+        posix_fadvise(chk->img.base_fd, 0, len, POSIX_FADV_WILLNEED);
+    }
     return 1;
 }
+
+/*
+ * Fleet mode: each image is a task on the shared scheduler.  A check
+ * first opens its image and starts the metadata readahead, then yields
+ * so the worker can do the same for other images, or check one whose
+ * metadata has arrived, while the reads are outstanding.  Only -q images
+ * wait like that at once; with none of the slots free, the image is
+ * checked straight away.
+ */
+static int fleet_task(struct vsfs_task *t) {
+    struct check *chk = (struct check *)((char *)t - offsetof(struct check, task));
+    if (!chk->opened) {
+        chk->opened = 1;
+        if (open_check(chk) < 0) {
+            return VSFS_TASK_DONE;
+        }
+        if (sem_trywait(&prefetch_slots) == 0) {
+            if (prefetch_check(chk)) {
+                chk->prefetch_slot = 1;
+                return VSFS_TASK_YIELD;
+            }
+            sem_post(&prefetch_slots);
+        }
+    }
+    if (chk->prefetch_slot) {
+        chk->prefetch_slot = 0;
+        sem_post(&prefetch_slots);
+    }
+    check_opened(chk);
+    if (report_format != FORMAT_TEXT) {
+        return VSFS_TASK_DONE;
+    }
+    if (chk->failed) {
+        printf("%s: unchecked\n", chk->image_path);
+    } else if (chk->error_count == 0) {
+        printf("%s: consistent\n", chk->image_path);
+    } else {
+        printf("%s: %d inconsistencies\n", chk->image_path, chk->error_count);
+    }
+    return VSFS_TASK_DONE;
+}
+
+static void add_path(char ***paths, size_t *count, size_t *cap, const char *path) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *paths = realloc(*paths, *cap * sizeof(char *));
+        if (!*paths) {
+            die("realloc image list");
+        }
+    }
+    (*paths)[(*count)++] = strdup(path);
+}
+
+static void read_list(const char *list, char ***paths, size_t *count, size_t *cap) {
+    FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (!fp) {
+        die("open image list");
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        add_path(paths, count, cap, line);
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+}
+
+/*
+ * Ends a JSON or NDJSON report with totals over all images; a JSON report
+ * also carries every image's object, in command-line order.
+ */
+static void emit_summary(struct check *checks, size_t count) {
+    struct check total;
+    memset(&total, 0, sizeof(total));
+    size_t consistent = 0, inconsistent = 0, unchecked = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total.error_count += checks[i].error_count;
+        for (int c = 0; c < ERR_CATEGORIES; ++c) {
+            total.counts[c] += checks[i].counts[c];
+        }
+        if (checks[i].failed) {
+            unchecked++;
+        } else if (checks[i].error_count == 0) {
+            consistent++;
+        } else {
+            inconsistent++;
+        }
+    }
+
+    struct outbuf ob = { 0 };
+    if (report_format == FORMAT_JSON) {
+        out_printf(&ob, "{\"images\":[");
+        for (size_t i = 0; i < count; ++i) {
+            out_printf(&ob, "%s%.*s", i ? "," : "", (int)checks[i].out.len,
+                       checks[i].out.data ? checks[i].out.data : "");
+        }
+        out_printf(&ob, "],");
+    } else {
+        out_printf(&ob, "{");
+    }
+    out_printf(&ob, "\"summary\":{\"images\":%zu,\"consistent\":%zu,\"inconsistent\":%zu,\"unchecked\":%zu,"
+               "\"errors\":%d,\"categories\":", count, consistent, inconsistent, unchecked, total.error_count);
+    out_json_counts(&ob, &total);
+    out_printf(&ob, "}}\n");
+    out_flush(&ob);
+    free(ob.data);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-P] [-A] [-H buckets] [-o format] [-m max] [-s snapshot] [image]\n"
+            "       %s [-P] [-A] [-H buckets] [-o format] [-m max] [-s snapshot] [-j threads] [-q depth]\n"
+            "          [-l list] image...\n"
+            "  -j threads  images checked concurrently (default: $VSFS_THREADS, else online CPUs)\n"
+            "  -q depth    reads in flight across all images, and images opened and read ahead\n"
+            "              before their check (default: 2 x threads)\n"
+            "  -l list     read image paths from a file, one per line ('-' for stdin)\n"
+            "  -P          print cycles, instructions, cache/branch misses and syscalls per check phase\n"
+            "  -A          analyze fragmentation: fragments per file, free extent sizes, directory\n"
+            "              fill and tombstones, inode-table occupancy; added to a JSON report as\n"
+            "              \"analysis\", printed on stdout as one JSON object per image otherwise\n"
+            "  -H buckets  print on stderr the blocks each check read, per range of blocks (at most\n"
+            "              this many) and subsystem\n"
+            "  -o format   report as text (default, on stderr), json (one document) or ndjson (one\n"
+            "              object per line), both on stdout\n"
+            "  -m max      detailed messages per error category and image (default: %u, 0 = all);\n"
+            "              every error is still counted\n"
+            "  -s name     check the tree of a snapshot, read-only, instead of the current one;\n"
+            "              snapshot maps and shared reference counts are checked either way\n"
+            "Exit status: 0 all consistent, 1 inconsistencies found, 2 some images could not be checked.\n",
+            prog, prog, DEFAULT_REPORT_CAP);
+    exit(2);
+}
+
+static enum report_format parse_format(const char *name, const char *prog) {
+    if (strcmp(name, "text") == 0) {
+        return FORMAT_TEXT;
+    }
+    if (strcmp(name, "json") == 0) {
+        return FORMAT_JSON;
+    }
+    if (strcmp(name, "ndjson") == 0) {
+        return FORMAT_NDJSON;
+    }
+    fprintf(stderr, "Unknown report format: %s\n", name);
+    usage(prog);
+    return FORMAT_TEXT;
+}
+
+int main(int argc, char *argv[]) {
+    long threads = 0;
+    long depth = 0;
+    int fleet_mode = 0;
+    char **paths = NULL;
+    size_t path_count = 0, path_cap = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "j:q:l:o:m:s:H:PAh")) != -1) {
+        switch (c) {
+        case 'j': threads = strtol(optarg, NULL, 10); fleet_mode = 1; break;
+        case 'q': depth = strtol(optarg, NULL, 10); fleet_mode = 1; break;
+        case 'l': read_list(optarg, &paths, &path_count, &path_cap); fleet_mode = 1; break;
+        case 'P': perf_phases = 1; break;
+        case 'A': analyze = 1; break;
+        case 'H': heat_buckets = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'o': report_format = parse_format(optarg, argv[0]); break;
+        case 'm': report_cap = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 's': view_snapshot = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    for (int i = optind; i < argc; ++i) {
+        add_path(&paths, &path_count, &path_cap, argv[i]);
+    }
+    if (path_count > 1) {
+        fleet_mode = 1;
+    }
+
+    if (!fleet_mode) {
+        struct check chk;
+        memset(&chk, 0, sizeof(chk));
+        chk.image_path = path_count ? paths[0] : DEFAULT_IMAGE;
+        run_check(&chk);
+        if (report_format != FORMAT_TEXT) {
+            emit_summary(&chk, 1);
+        }
+        free(chk.out.data);
+        if (chk.failed) {
+            return 2;
+        }
+        if (report_format != FORMAT_TEXT) {
+            return chk.error_count ? 1 : 0;
+        }
+        if (chk.error_count == 0) {
+            printf("Filesystem '%s' is consistent.\n", chk.image_path);
+            return 0;
+        }
+        fprintf(stderr, "%d inconsistencies found.\n", chk.error_count);
+        return 1;
+    }
+
+    if (path_count == 0) {
+        usage(argv[0]);
+    }
+    threads = (long)vsfs_sched_threads(threads > 0 ? (uint32_t)threads : 0);
+    if ((size_t)threads > path_count) {
+        threads = (long)path_count;
+    }
+    if (depth <= 0) {
+        depth = threads * 2;
+    }
+
+    sem_t slots;
+    if (sem_init(&slots, 0, (unsigned)depth) != 0 || sem_init(&prefetch_slots, 0, (unsigned)depth) != 0) {
+        die("sem_init");
+    }
+    io_slots = &slots;
+
+    struct check *checks = calloc(path_count, sizeof(struct check));
+    if (!checks) {
+        die("calloc checks");
+    }
+    // This thread checks images too while it waits, so it is one of the threads.
+    struct vsfs_sched sched;
+    if (vsfs_sched_init(&sched, (uint32_t)threads - 1) != 0) {
+        die("vsfs_sched_init");
+    }
+    struct vsfs_group all = { 0 };
+    for (size_t i = 0; i < path_count; ++i) {
+        checks[i].image_path = paths[i];
+        checks[i].img.fd = -1;
+        checks[i].tag_messages = 1;
+        checks[i].task.run = fleet_task;
+        vsfs_spawn(&sched, &all, &checks[i].task);
+    }
+    vsfs_group_wait(&sched, &all);
+    vsfs_sched_destroy(&sched);
+
+    size_t consistent = 0, inconsistent = 0, unchecked = 0;
+    long total_errors = 0;
+    for (size_t i = 0; i < path_count; ++i) {
+        total_errors += checks[i].error_count;
+        if (checks[i].failed) {
+            unchecked++;
+        } else if (checks[i].error_count == 0) {
+            consistent++;
+        } else {
+            inconsistent++;
+        }
+    }
+    if (report_format == FORMAT_TEXT) {
+        printf("%zu images: %zu consistent, %zu inconsistent, %zu unchecked (%ld inconsistencies total)\n",
+               path_count, consistent, inconsistent, unchecked, total_errors);
+    } else {
+        emit_summary(checks, path_count);
+    }
+    for (size_t i = 0; i < path_count; ++i) {
+        free(checks[i].out.data);
+        free(paths[i]);
+    }
+
+    free(checks);
+    free(paths);
+    sem_destroy(&slots);
+    sem_destroy(&prefetch_slots);
+
+    if (unchecked) {
+        return 2;
+    }
+    return inconsistent ? 1 : 0;
+}
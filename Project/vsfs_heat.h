@@ -0,0 +1,215 @@
+#ifndef VSFS_HEAT_H
+#define VSFS_HEAT_H
+
+/*
+ * Block access heatmaps.
+ *
+ * A heatmap counts the blocks read from and written to an image, per range
+ * of blocks and per subsystem.  An image with no more blocks than the map
+ * has buckets gets one bucket per block; a larger one puts 1 << shift
+ * blocks in each.  The subsystem is where the block lives in the layout,
+ * except in the data area, where the caller says whether it reads or
+ * writes file data or metadata (directories, and the data of files
+ * journaled with their metadata).  In a copy-on-write image that is the
+ * physical block, so remapped metadata shows up in the journal area.
+ *
+ * Counters are relaxed atomics: any thread may count while another one
+ * takes a copy.  vsfsd -H keeps a heatmap per image and hands it out
+ * through VSFS_OP_HEATMAP; journal (VSFS_HEAT=<buckets>) and the
+ * validator (-H) print theirs when they are done.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum vsfs_heat_class {
+    VSFS_HEAT_SUPER,
+    VSFS_HEAT_JOURNAL,
+    VSFS_HEAT_BITMAP,
+    VSFS_HEAT_INODES,
+    VSFS_HEAT_DIR,       // metadata in the data area
+    VSFS_HEAT_DATA,      // file data
+    VSFS_HEAT_REFS,      // refcount table of a deduplicating image
+    VSFS_HEAT_CLASSES
+};
+
+static inline const char *vsfs_heat_name(enum vsfs_heat_class cls) {
+    static const char *const names[VSFS_HEAT_CLASSES] = {
+        "super", "journal", "bitmap", "inodes", "dir", "data", "refs",
+    };
+    return cls < VSFS_HEAT_CLASSES ? names[cls] : "?";
+}
+
+/* Where each area starts, from the superblock. */
+struct vsfs_heat_layout {
+    uint32_t total_blocks;
+    uint32_t journal;        // first journal block
+    uint32_t bitmaps;        // inode bitmap, then the data bitmap
+    uint32_t inodes;
+    uint32_t data;
+    uint32_t refs;           // first refcount block, 0 without one
+};
+
+static inline enum vsfs_heat_class vsfs_heat_class(const struct vsfs_heat_layout *l, uint32_t blk,
+                                                   enum vsfs_heat_class data) {
+    if (blk < l->journal) {
+        return VSFS_HEAT_SUPER;
+    }
+    if (blk < l->bitmaps) {
+        return VSFS_HEAT_JOURNAL;
+    }
+    if (blk < l->inodes) {
+        return VSFS_HEAT_BITMAP;
+    }
+    if (blk < l->data) {
+        return VSFS_HEAT_INODES;
+    }
+    if (l->refs && blk >= l->refs) {
+        return VSFS_HEAT_REFS;
+    }
+    return data;
+}
+
+/* One bucket as VSFS_OP_HEATMAP returns it. */
+struct vsfs_heat_bucket {
+    uint32_t first;          // first block of the range
+    uint32_t blocks;
+    uint64_t reads[VSFS_HEAT_CLASSES];
+    uint64_t writes[VSFS_HEAT_CLASSES];
+};
+
+struct vsfs_heat {
+    struct vsfs_heat_layout layout;
+    uint32_t shift;
+    uint32_t nbuckets;
+    _Atomic uint64_t (*count)[2][VSFS_HEAT_CLASSES];   // [bucket][write][class]
+};
+
+/* Returns 0, or -ENOMEM. */
+static inline int vsfs_heat_init(struct vsfs_heat *h, const struct vsfs_heat_layout *l, uint32_t max_buckets) {
+    memset(h, 0, sizeof(*h));
+    h->layout = *l;
+    if (max_buckets == 0) {
+        max_buckets = 1;
+    }
+    while (l->total_blocks && ((l->total_blocks - 1) >> h->shift) >= max_buckets) {
+        h->shift++;
+    }
+    h->nbuckets = l->total_blocks ? ((l->total_blocks - 1) >> h->shift) + 1 : 1;
+    h->count = calloc(h->nbuckets, sizeof(*h->count));
+    return h->count ? 0 : -ENOMEM;
+}
+
+static inline void vsfs_heat_free(struct vsfs_heat *h) {
+    free(h->count);
+    h->count = NULL;
+}
+
+/*
+ * Counts `n` blocks from `blk` as read or written.  `data` is the class of
+ * those in the data area.  Blocks past the end of the image are not
+ * counted.
+ */
+static inline void vsfs_heat_note(struct vsfs_heat *h, uint32_t blk, uint32_t n, enum vsfs_heat_class data,
+                                  int write) {
+    for (uint32_t i = 0; i < n && blk + i < h->layout.total_blocks; ++i) {
+        enum vsfs_heat_class cls = vsfs_heat_class(&h->layout, blk + i, data);
+        atomic_fetch_add_explicit(&h->count[(blk + i) >> h->shift][write != 0][cls], 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * Copies bucket `idx`, zeroing its counters if `reset` is set.  Returns
+ * whether the bucket counted anything.
+ */
+static inline int vsfs_heat_get(struct vsfs_heat *h, uint32_t idx, struct vsfs_heat_bucket *b, int reset) {
+    memset(b, 0, sizeof(*b));
+    b->first = idx << h->shift;
+    b->blocks = 1U << h->shift;
+    if (b->first + b->blocks > h->layout.total_blocks) {
+        b->blocks = h->layout.total_blocks - b->first;
+    }
+    uint64_t any = 0;
+    for (int c = 0; c < VSFS_HEAT_CLASSES; ++c) {
+        _Atomic uint64_t *r = &h->count[idx][0][c];
+        _Atomic uint64_t *w = &h->count[idx][1][c];
+        b->reads[c] = reset ? atomic_exchange_explicit(r, 0, memory_order_relaxed)
+                            : atomic_load_explicit(r, memory_order_relaxed);
+        b->writes[c] = reset ? atomic_exchange_explicit(w, 0, memory_order_relaxed)
+                             : atomic_load_explicit(w, memory_order_relaxed);
+        any |= b->reads[c] | b->writes[c];
+    }
+    return any != 0;
+}
+
+static inline uint64_t vsfs_heat_total(const struct vsfs_heat_bucket *b) {
+    uint64_t n = 0;
+    for (int c = 0; c < VSFS_HEAT_CLASSES; ++c) {
+        n += b->reads[c] + b->writes[c];
+    }
+    return n;
+}
+
+/*
+ * Prints the buckets that counted anything as a histogram: the reads and
+ * writes of each class over all of them, then one line per bucket with its
+ * range, its total, a bar scaled to the busiest bucket, and its reads and
+ * writes per class.
+ */
+static inline void vsfs_heat_print(FILE *f, const struct vsfs_heat_bucket *b, uint32_t n) {
+    uint64_t reads[VSFS_HEAT_CLASSES] = { 0 };
+    uint64_t writes[VSFS_HEAT_CLASSES] = { 0 };
+    uint64_t max = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        for (int c = 0; c < VSFS_HEAT_CLASSES; ++c) {
+            reads[c] += b[i].reads[c];
+            writes[c] += b[i].writes[c];
+        }
+        uint64_t t = vsfs_heat_total(&b[i]);
+        max = t > max ? t : max;
+    }
+    fprintf(f, "totals:");
+    for (int c = 0; c < VSFS_HEAT_CLASSES; ++c) {
+        if (reads[c] | writes[c]) {
+            fprintf(f, " %s r %llu w %llu", vsfs_heat_name((enum vsfs_heat_class)c), (unsigned long long)reads[c],
+                    (unsigned long long)writes[c]);
+        }
+    }
+    fputc('\n', f);
+    for (uint32_t i = 0; i < n; ++i) {
+        uint64_t t = vsfs_heat_total(&b[i]);
+        char bar[21];
+        uint32_t w = max ? (uint32_t)((t * 20 + max - 1) / max) : 0;
+        memset(bar, '#', w);
+        memset(bar + w, ' ', 20 - w);
+        bar[20] = '\0';
+        fprintf(f, "%8u-%-8u %10llu |%s|", b[i].first, b[i].first + b[i].blocks - 1, (unsigned long long)t, bar);
+        for (int c = 0; c < VSFS_HEAT_CLASSES; ++c) {
+            if (b[i].reads[c] | b[i].writes[c]) {
+                fprintf(f, " %s r %llu w %llu", vsfs_heat_name((enum vsfs_heat_class)c),
+                        (unsigned long long)b[i].reads[c], (unsigned long long)b[i].writes[c]);
+            }
+        }
+        fputc('\n', f);
+    }
+}
+
+/* Prints a whole heatmap with vsfs_heat_print(). */
+static inline void vsfs_heat_dump(struct vsfs_heat *h, FILE *f) {
+    struct vsfs_heat_bucket *b = calloc(h->nbuckets, sizeof(*b));
+    if (!b) {
+        return;
+    }
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < h->nbuckets; ++i) {
+        n += (uint32_t)vsfs_heat_get(h, i, &b[n], 0);
+    }
+    vsfs_heat_print(f, b, n);
+    free(b);
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef VSFS_LZ_H
+#define VSFS_LZ_H
+
+/*
+ * Small LZ77 codec for compressed file clusters.
+ *
+ * The stream is a series of sequences, each a token byte (literal count in
+ * the high nibble, match length - 4 in the low one; 15 means more length
+ * bytes follow, each adding up to 255), the literals, then a 2-byte
+ * little-endian match offset and the extra match length bytes.  The last
+ * sequence carries literals only.  Inputs are at most 64 KiB, so offsets
+ * always fit.
+ *
+ * Compression is a greedy single pass over a 4-byte hash table, quick to
+ * give up on incompressible runs.  Decompression checks every length and
+ * offset against both buffers, so a damaged cluster is reported rather
+ * than overrunning anything.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define VSFS_LZ_MIN_MATCH 4U
+#define VSFS_LZ_HASH_BITS 12U
+
+static inline uint32_t vsfs_lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t vsfs_lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32U - VSFS_LZ_HASH_BITS);
+}
+
+/* Appends a length continuation (the part above 15); 0 if it does not fit. */
+static inline int vsfs_lz_put_len(uint8_t **op, const uint8_t *oend, uint32_t len) {
+    for (; len >= 255; len -= 255) {
+        if (*op >= oend) {
+            return 0;
+        }
+        *(*op)++ = 255;
+    }
+    if (*op >= oend) {
+        return 0;
+    }
+    *(*op)++ = (uint8_t)len;
+    return 1;
+}
+
+/* Emits one sequence; a match length of 0 ends the stream.  0 if it does not fit. */
+static inline int vsfs_lz_emit(uint8_t **op, const uint8_t *oend, const uint8_t *lit, uint32_t nlit,
+                               uint32_t offset, uint32_t mlen) {
+    if (*op >= oend) {
+        return 0;
+    }
+    uint8_t *token = (*op)++;
+    uint32_t mcode = mlen ? mlen - VSFS_LZ_MIN_MATCH : 0;
+    *token = (uint8_t)(((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15));
+    if (nlit >= 15 && !vsfs_lz_put_len(op, oend, nlit - 15)) {
+        return 0;
+    }
+    if ((uint32_t)(oend - *op) < nlit) {
+        return 0;
+    }
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+    if (!mlen) {
+        return 1;
+    }
+    if (oend - *op < 2) {
+        return 0;
+    }
+    *(*op)++ = (uint8_t)offset;
+    *(*op)++ = (uint8_t)(offset >> 8);
+    return mcode < 15 || vsfs_lz_put_len(op, oend, mcode - 15);
+}
+
+/*
+ * Compresses `n` bytes (n <= 65536) into at most `cap` bytes.  Returns the
+ * compressed size, or 0 if it would not fit.
+ */
+static inline uint32_t vsfs_lz_compress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t cap) {
+    uint32_t table[1U << VSFS_LZ_HASH_BITS];   // position + 1, 0 = empty
+    memset(table, 0, sizeof(table));
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+    uint32_t anchor = 0;
+    uint32_t ip = 0;
+    // Leave a few literals at the end so matching never reads past it.
+    uint32_t limit = n > 12 ? n - 12 : 0;
+    uint32_t mlimit = n > 5 ? n - 5 : 0;
+
+    while (ip < limit) {
+        uint32_t seq = vsfs_lz_read32(src + ip);
+        uint32_t h = vsfs_lz_hash(seq);
+        uint32_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > 0xFFFFU || vsfs_lz_read32(src + ref - 1) != seq) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        ref--;
+        uint32_t mlen = VSFS_LZ_MIN_MATCH;
+        while (ip + mlen < mlimit && src[ref + mlen] == src[ip + mlen]) {
+            mlen++;
+        }
+        if (!vsfs_lz_emit(&op, oend, src + anchor, ip - anchor, ip - ref, mlen)) {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!vsfs_lz_emit(&op, oend, src + anchor, n - anchor, 0, 0)) {
+        return 0;
+    }
+    return (uint32_t)(op - dst);
+}
+
+/* Reads a length continuation; -1 if the stream ends inside it. */
+static inline int64_t vsfs_lz_get_len(const uint8_t **ip, const uint8_t *iend) {
+    int64_t len = 0;
+    for (;;) {
+        if (*ip >= iend) {
+            return -1;
+        }
+        uint8_t b = *(*ip)++;
+        len += b;
+        if (b != 255) {
+            return len;
+        }
+    }
+}
+
+/*
+ * Decompresses `n` bytes into at most `cap` bytes.  Returns the
+ * decompressed size, or -1 if the stream is damaged.
+ */
+static inline int64_t vsfs_lz_decompress(const uint8_t *src, uint32_t n, uint8_t *dst, uint32_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + n;
+    uint32_t op = 0;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        int64_t nlit = token >> 4;
+        if (nlit == 15) {
+            int64_t more = vsfs_lz_get_len(&ip, iend);
+            if (more < 0) {
+                return -1;
+            }
+            nlit += more;
+        }
+        if (nlit > iend - ip || nlit > (int64_t)(cap - op)) {
+            return -1;
+        }
+        memcpy(dst + op, ip, (size_t)nlit);
+        ip += nlit;
+        op += (uint32_t)nlit;
+        if (ip == iend) {
+            return op;
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        uint32_t offset = (uint32_t)ip[0] | ((uint32_t)ip[1] << 8);
+        ip += 2;
+        int64_t mlen = (token & 15) + VSFS_LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            int64_t more = vsfs_lz_get_len(&ip, iend);
+            if (more < 0) {
+                return -1;
+            }
+            mlen += more;
+        }
+        if (offset == 0 || offset > op || mlen > (int64_t)(cap - op)) {
+            return -1;
+        }
+        // Byte by byte: the match may overlap what it produces.
+        const uint8_t *from = dst + op - offset;
+        for (int64_t k = 0; k < mlen; ++k) {
+            dst[op + k] = from[k];
+        }
+        op += (uint32_t)mlen;
+    }
+    // Every stream ends with a literal-only sequence, even an empty one.
+    return -1;
+}
+
+#endif
@@ -0,0 +1,517 @@
+#ifndef VSFS_OVERLAY_H
+#define VSFS_OVERLAY_H
+
+/*
+ * Thin overlay images.
+ *
+ * An overlay is a file standing in for a whole image: it names a read-only
+ * base image and holds only the blocks written since it was made.  Block 0
+ * is a header, then comes a bitmap with one bit per image block, then the
+ * blocks themselves, each at a fixed place (header and bitmap size plus
+ * block * 4096), so the file stays sparse and a run of image blocks is a
+ * run in the file.  A block whose bit is clear is read from the base.
+ *
+ * The bitmap is made durable only in vsfs_image_sync(), after the blocks
+ * it covers: a crash before that leaves those blocks reading as the base,
+ * as if the writes had not happened.  A partial write to a block still in
+ * the base first copies it up.  Reads check a bit before touching the
+ * block and writers set it after writing one, so threads may share an
+ * image; copy-ups and bitmap bookkeeping take a lock.
+ *
+ * Every tool goes through struct vsfs_image, which passes plain images
+ * straight to the file.  The base is identified by size, inode and
+ * modification time when the overlay is made, and an overlay whose base
+ * has changed since is refused (ESTALE).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define VSFS_OVERLAY_MAGIC    0x564F564CU   // "VOVL"
+#define VSFS_OVERLAY_VERSION  1U
+#define VSFS_OVERLAY_BLOCK    4096U
+#define VSFS_OVERLAY_PATH_MAX 3072U
+
+struct vsfs_overlay_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t bitmap_blocks;
+    uint64_t nblocks;          // image size in blocks, that of the base
+    uint64_t base_size;
+    int64_t base_mtime_ns;
+    uint64_t base_ino;
+    uint32_t csum;             // FNV-1a of the header with this field zero
+    uint32_t _reserved;
+    char base_path[VSFS_OVERLAY_PATH_MAX];   // absolute
+};
+
+_Static_assert(sizeof(struct vsfs_overlay_header) <= VSFS_OVERLAY_BLOCK, "overlay header must fit a block");
+
+struct vsfs_image {
+    int fd;                 // the image, or the overlay file
+    int base_fd;            // -1 for a plain image
+    uint64_t nblocks;
+    off_t data_off;         // where block 0 sits in the overlay file
+    uint32_t bitmap_blocks;
+    uint8_t *present;       // blocks held by the overlay
+    uint8_t *dirty;         // bitmap blocks not written out yet
+    pthread_mutex_t lock;
+};
+
+static inline uint32_t vsfs_overlay_csum(const struct vsfs_overlay_header *h) {
+    struct vsfs_overlay_header copy = *h;
+    copy.csum = 0;
+    const uint8_t *p = (const uint8_t *)&copy;
+    uint32_t x = 2166136261U;
+    for (size_t i = 0; i < sizeof(copy); ++i) {
+        x = (x ^ p[i]) * 16777619U;
+    }
+    return x;
+}
+
+static inline int vsfs_image_has(const struct vsfs_image *im, uint64_t blk) {
+    return (__atomic_load_n(&im->present[blk / 8], __ATOMIC_ACQUIRE) >> (blk % 8)) & 1;
+}
+
+/* Marks blocks first..last as held by the overlay; their data is already written. */
+static inline void vsfs_image_mark(struct vsfs_image *im, uint64_t first, uint64_t last) {
+    for (uint64_t b = first; b <= last; ++b) {
+        if (vsfs_image_has(im, b)) {
+            continue;
+        }
+        pthread_mutex_lock(&im->lock);
+        __atomic_fetch_or(&im->present[b / 8], (uint8_t)(1U << (b % 8)), __ATOMIC_RELEASE);
+        im->dirty[b / (VSFS_OVERLAY_BLOCK * 8)] = 1;
+        pthread_mutex_unlock(&im->lock);
+    }
+}
+
+static inline int vsfs_full_pread(int fd, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (uint8_t *)buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+static inline int vsfs_full_pwrite(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const uint8_t *)buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/* Brings a block into the overlay before only part of it is written. */
+static inline int vsfs_image_copy_up(struct vsfs_image *im, uint64_t blk) {
+    uint8_t buf[VSFS_OVERLAY_BLOCK];
+    int rc = 0;
+    pthread_mutex_lock(&im->lock);
+    if (!vsfs_image_has(im, blk)) {
+        off_t off = (off_t)blk * VSFS_OVERLAY_BLOCK;
+        rc = vsfs_full_pread(im->base_fd, buf, sizeof(buf), off);
+        if (rc == 0) {
+            rc = vsfs_full_pwrite(im->fd, buf, sizeof(buf), im->data_off + off);
+        }
+        if (rc == 0) {
+            __atomic_fetch_or(&im->present[blk / 8], (uint8_t)(1U << (blk % 8)), __ATOMIC_RELEASE);
+            im->dirty[blk / (VSFS_OVERLAY_BLOCK * 8)] = 1;
+        }
+    }
+    pthread_mutex_unlock(&im->lock);
+    return rc;
+}
+
+/*
+ * Opens an image or an overlay with open(2) flags; the base is always
+ * opened read-only.  Returns 0, or -1 with errno set.
+ */
+static inline int vsfs_image_open(struct vsfs_image *im, const char *path, int flags) {
+    memset(im, 0, sizeof(*im));
+    im->base_fd = -1;
+    im->fd = open(path, flags);
+    if (im->fd < 0) {
+        return -1;
+    }
+    struct vsfs_overlay_header h;
+    ssize_t n = pread(im->fd, &h, sizeof(h), 0);
+    if (n != (ssize_t)sizeof(h) || h.magic != VSFS_OVERLAY_MAGIC) {
+        return 0;
+    }
+
+    int err = EINVAL;
+    if (h.version != VSFS_OVERLAY_VERSION || h.block_size != VSFS_OVERLAY_BLOCK || h.csum != vsfs_overlay_csum(&h) ||
+        (uint64_t)h.bitmap_blocks * VSFS_OVERLAY_BLOCK * 8 < h.nblocks ||
+        memchr(h.base_path, '\0', sizeof(h.base_path)) == NULL) {
+        goto fail;
+    }
+    im->base_fd = open(h.base_path, O_RDONLY);
+    struct stat st;
+    if (im->base_fd < 0 || fstat(im->base_fd, &st) < 0) {
+        err = errno;
+        goto fail;
+    }
+    if ((uint64_t)st.st_size != h.base_size || (uint64_t)st.st_ino != h.base_ino ||
+        (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec != h.base_mtime_ns) {
+        err = ESTALE;
+        goto fail;
+    }
+    im->nblocks = h.nblocks;
+    im->bitmap_blocks = h.bitmap_blocks;
+    im->data_off = (off_t)(1 + h.bitmap_blocks) * VSFS_OVERLAY_BLOCK;
+    im->present = calloc(h.bitmap_blocks, VSFS_OVERLAY_BLOCK);
+    im->dirty = calloc(h.bitmap_blocks, 1);
+    if (!im->present || !im->dirty) {
+        err = ENOMEM;
+        goto fail;
+    }
+    // A bitmap block never written is a hole and reads as zeros.
+    if (vsfs_full_pread(im->fd, im->present, (size_t)h.bitmap_blocks * VSFS_OVERLAY_BLOCK,
+                        VSFS_OVERLAY_BLOCK) < 0) {
+        err = errno;
+        goto fail;
+    }
+    pthread_mutex_init(&im->lock, NULL);
+    return 0;
+
+fail:
+    free(im->present);
+    free(im->dirty);
+    if (im->base_fd >= 0) {
+        close(im->base_fd);
+    }
+    close(im->fd);
+    im->fd = -1;
+    im->base_fd = -1;
+    errno = err;
+    return -1;
+}
+
+static inline ssize_t vsfs_image_pread(struct vsfs_image *im, void *buf, size_t len, off_t off) {
+    if (im->base_fd < 0) {
+        return pread(im->fd, buf, len, off);
+    }
+    uint64_t end = (uint64_t)off + len;
+    uint64_t limit = im->nblocks * VSFS_OVERLAY_BLOCK;
+    if (end > limit) {
+        end = limit;
+    }
+    size_t done = 0;
+    while ((uint64_t)off + done < end) {
+        uint64_t pos = (uint64_t)off + done;
+        uint64_t blk = pos / VSFS_OVERLAY_BLOCK;
+        int in = vsfs_image_has(im, blk);
+        uint64_t stop = (blk + 1) * VSFS_OVERLAY_BLOCK;
+        while (stop < end && vsfs_image_has(im, stop / VSFS_OVERLAY_BLOCK) == in) {
+            stop += VSFS_OVERLAY_BLOCK;
+        }
+        if (stop > end) {
+            stop = end;
+        }
+        ssize_t n = in ? pread(im->fd, (uint8_t *)buf + done, stop - pos, im->data_off + (off_t)pos)
+                       : pread(im->base_fd, (uint8_t *)buf + done, stop - pos, (off_t)pos);
+        if (n < 0) {
+            return done ? (ssize_t)done : -1;
+        }
+        done += (size_t)n;
+        if ((uint64_t)n < stop - pos) {
+            break;
+        }
+    }
+    return (ssize_t)done;
+}
+
+static inline ssize_t vsfs_image_pwrite(struct vsfs_image *im, const void *buf, size_t len, off_t off) {
+    if (im->base_fd < 0) {
+        return pwrite(im->fd, buf, len, off);
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if ((uint64_t)off + len > im->nblocks * VSFS_OVERLAY_BLOCK) {
+        errno = ENOSPC;
+        return -1;
+    }
+    uint64_t first = (uint64_t)off / VSFS_OVERLAY_BLOCK;
+    uint64_t last = ((uint64_t)off + len - 1) / VSFS_OVERLAY_BLOCK;
+    if (off % VSFS_OVERLAY_BLOCK && vsfs_image_copy_up(im, first) < 0) {
+        return -1;
+    }
+    if ((off + len) % VSFS_OVERLAY_BLOCK && vsfs_image_copy_up(im, last) < 0) {
+        return -1;
+    }
+    if (vsfs_full_pwrite(im->fd, buf, len, im->data_off + off) < 0) {
+        return -1;
+    }
+    vsfs_image_mark(im, first, last);
+    return (ssize_t)len;
+}
+
+/* Vectored forms; every vector but the last must be whole blocks. */
+static inline ssize_t vsfs_image_preadv(struct vsfs_image *im, const struct iovec *iov, int cnt, off_t off) {
+    if (im->base_fd < 0) {
+        return preadv(im->fd, iov, cnt, off);
+    }
+    size_t len = 0;
+    for (int i = 0; i < cnt; ++i) {
+        len += iov[i].iov_len;
+    }
+    uint64_t first = (uint64_t)off / VSFS_OVERLAY_BLOCK;
+    uint64_t last = len ? ((uint64_t)off + len - 1) / VSFS_OVERLAY_BLOCK : first;
+    int in = first < im->nblocks && vsfs_image_has(im, first);
+    uint64_t b = first;
+    while (b <= last && b < im->nblocks && vsfs_image_has(im, b) == in) {
+        ++b;
+    }
+    if (b > last) {
+        return in ? preadv(im->fd, iov, cnt, im->data_off + off) : preadv(im->base_fd, iov, cnt, off);
+    }
+    size_t done = 0;
+    for (int i = 0; i < cnt; ++i) {
+        ssize_t n = vsfs_image_pread(im, iov[i].iov_base, iov[i].iov_len, off + (off_t)done);
+        if (n < 0) {
+            return done ? (ssize_t)done : -1;
+        }
+        done += (size_t)n;
+        if ((size_t)n < iov[i].iov_len) {
+            break;
+        }
+    }
+    return (ssize_t)done;
+}
+
+static inline ssize_t vsfs_image_pwritev(struct vsfs_image *im, const struct iovec *iov, int cnt, off_t off) {
+    if (im->base_fd < 0) {
+        return pwritev(im->fd, iov, cnt, off);
+    }
+    size_t len = 0;
+    for (int i = 0; i < cnt; ++i) {
+        len += iov[i].iov_len;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if ((uint64_t)off + len > im->nblocks * VSFS_OVERLAY_BLOCK) {
+        errno = ENOSPC;
+        return -1;
+    }
+    uint64_t first = (uint64_t)off / VSFS_OVERLAY_BLOCK;
+    uint64_t last = ((uint64_t)off + len - 1) / VSFS_OVERLAY_BLOCK;
+    if (off % VSFS_OVERLAY_BLOCK && vsfs_image_copy_up(im, first) < 0) {
+        return -1;
+    }
+    if ((off + len) % VSFS_OVERLAY_BLOCK && vsfs_image_copy_up(im, last) < 0) {
+        return -1;
+    }
+    ssize_t n = pwritev(im->fd, iov, cnt, im->data_off + off);
+    if (n != (ssize_t)len) {
+        return n < 0 ? -1 : n;   // callers retry block by block; nothing is marked
+    }
+    vsfs_image_mark(im, first, last);
+    return n;
+}
+
+/*
+ * Makes everything written so far durable.  For an overlay the blocks go
+ * first, then the bitmap blocks as they stood before that, so a bit never
+ * reaches the disk ahead of its block.
+ */
+static inline int vsfs_image_sync(struct vsfs_image *im) {
+    if (im->base_fd < 0) {
+        return fdatasync(im->fd);
+    }
+    uint32_t nbm = im->bitmap_blocks;
+    uint8_t *copy = NULL;
+    uint8_t *which = calloc(nbm, 1);
+    uint32_t ndirty = 0;
+    if (!which) {
+        return -1;
+    }
+    pthread_mutex_lock(&im->lock);
+    for (uint32_t i = 0; i < nbm; ++i) {
+        ndirty += im->dirty[i];
+    }
+    if (ndirty) {
+        copy = malloc((size_t)ndirty * VSFS_OVERLAY_BLOCK);
+        for (uint32_t i = 0, k = 0; copy && i < nbm; ++i) {
+            if (im->dirty[i]) {
+                memcpy(copy + (size_t)k++ * VSFS_OVERLAY_BLOCK, im->present + (size_t)i * VSFS_OVERLAY_BLOCK,
+                       VSFS_OVERLAY_BLOCK);
+                which[i] = 1;
+                im->dirty[i] = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&im->lock);
+    int rc = fdatasync(im->fd);
+    if (ndirty && !copy) {
+        errno = ENOMEM;
+        rc = -1;
+    }
+    for (uint32_t i = 0, k = 0; rc == 0 && ndirty && i < nbm; ++i) {
+        if (which[i]) {
+            rc = vsfs_full_pwrite(im->fd, copy + (size_t)k++ * VSFS_OVERLAY_BLOCK, VSFS_OVERLAY_BLOCK,
+                                  (off_t)(1 + i) * VSFS_OVERLAY_BLOCK);
+        }
+    }
+    if (rc == 0 && ndirty) {
+        rc = fdatasync(im->fd);
+    }
+    if (rc != 0 && ndirty) {
+        // Leave the blocks dirty so a later sync tries again.
+        pthread_mutex_lock(&im->lock);
+        for (uint32_t i = 0; i < nbm; ++i) {
+            im->dirty[i] |= which[i];
+        }
+        pthread_mutex_unlock(&im->lock);
+    }
+    free(copy);
+    free(which);
+    return rc;
+}
+
+/* strerror() with the overlay's own failures spelled out. */
+static inline const char *vsfs_image_strerror(int err) {
+    if (err == ESTALE) {
+        return "base image has changed since the overlay was made";
+    }
+    if (err == EINVAL) {
+        return "damaged overlay header";
+    }
+    return strerror(err);
+}
+
+/* Size of the image in bytes, whatever the file holding it. */
+static inline off_t vsfs_image_size(const struct vsfs_image *im) {
+    if (im->base_fd >= 0) {
+        return (off_t)(im->nblocks * VSFS_OVERLAY_BLOCK);
+    }
+    struct stat st;
+    return fstat(im->fd, &st) == 0 ? st.st_size : -1;
+}
+
+/* Blocks the overlay holds; 0 for a plain image. */
+static inline uint64_t vsfs_image_overlay_blocks(const struct vsfs_image *im) {
+    uint64_t n = 0;
+    for (uint64_t b = 0; im->base_fd >= 0 && b < im->nblocks; ++b) {
+        n += vsfs_image_has(im, b);
+    }
+    return n;
+}
+
+/*
+ * Closes an image.  An overlay's bitmap is written out so later opens see
+ * every block written, but not flushed: only vsfs_image_sync() orders it
+ * behind the blocks.
+ */
+static inline void vsfs_image_close(struct vsfs_image *im) {
+    if (im->base_fd >= 0) {
+        for (uint32_t i = 0; i < im->bitmap_blocks; ++i) {
+            if (im->dirty[i]) {
+                vsfs_full_pwrite(im->fd, im->present + (size_t)i * VSFS_OVERLAY_BLOCK, VSFS_OVERLAY_BLOCK,
+                                 (off_t)(1 + i) * VSFS_OVERLAY_BLOCK);
+            }
+        }
+        close(im->base_fd);
+        pthread_mutex_destroy(&im->lock);
+    }
+    if (im->fd >= 0) {
+        close(im->fd);
+    }
+    free(im->present);
+    free(im->dirty);
+    im->fd = -1;
+    im->base_fd = -1;
+    im->present = NULL;
+    im->dirty = NULL;
+}
+
+/*
+ * Makes an empty overlay of `base_path` at `path`: a header and a sparse
+ * bitmap, whatever the size of the base.  Overlays of overlays are not
+ * supported.  Returns 0, or -1 with errno set.
+ */
+static inline int vsfs_overlay_create(const char *path, const char *base_path) {
+    struct vsfs_overlay_header h;
+    memset(&h, 0, sizeof(h));
+    char resolved[PATH_MAX];
+    if (!realpath(base_path, resolved)) {
+        return -1;
+    }
+    if (strlen(resolved) >= sizeof(h.base_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int base = open(resolved, O_RDONLY);
+    if (base < 0) {
+        return -1;
+    }
+    struct stat st;
+    uint32_t magic = 0;
+    if (fstat(base, &st) < 0 || pread(base, &magic, sizeof(magic), 0) != (ssize_t)sizeof(magic)) {
+        int err = errno ? errno : EINVAL;
+        close(base);
+        errno = err;
+        return -1;
+    }
+    close(base);
+    if (magic == VSFS_OVERLAY_MAGIC || st.st_size % VSFS_OVERLAY_BLOCK != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    h.magic = VSFS_OVERLAY_MAGIC;
+    h.version = VSFS_OVERLAY_VERSION;
+    h.block_size = VSFS_OVERLAY_BLOCK;
+    h.nblocks = (uint64_t)st.st_size / VSFS_OVERLAY_BLOCK;
+    h.bitmap_blocks = (uint32_t)((h.nblocks + VSFS_OVERLAY_BLOCK * 8 - 1) / (VSFS_OVERLAY_BLOCK * 8));
+    h.base_size = (uint64_t)st.st_size;
+    h.base_mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    h.base_ino = (uint64_t)st.st_ino;
+    memcpy(h.base_path, resolved, strlen(resolved) + 1);
+    h.csum = vsfs_overlay_csum(&h);
+
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    uint8_t block[VSFS_OVERLAY_BLOCK];
+    memset(block, 0, sizeof(block));
+    memcpy(block, &h, sizeof(h));
+    if (vsfs_full_pwrite(fd, block, sizeof(block), 0) < 0 ||
+        ftruncate(fd, (off_t)(1 + h.bitmap_blocks) * VSFS_OVERLAY_BLOCK) < 0 || fsync(fd) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return close(fd);
+}
+
+#endif
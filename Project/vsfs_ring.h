@@ -0,0 +1,380 @@
+#ifndef VSFS_RING_H
+#define VSFS_RING_H
+
+/*
+ * Shared-memory transport between vsfsd and its clients.
+ *
+ * The daemon creates one POSIX shared memory object holding a header and a
+ * fixed number of client slots.  A client claims a slot and from then on
+ * talks to the daemon through two single-producer/single-consumer rings:
+ * the submission queue (client -> daemon) and the completion queue
+ * (daemon -> client).  Posting an operation is a store into shared memory;
+ * a futex wake is only issued when the other side has announced it is
+ * idle, so a busy client and a busy daemon exchange work with no syscalls.
+ *
+ * One daemon may serve several images; every operation names the image
+ * it targets by its index in the daemon's command line.
+ *
+ * Each ring entry owns a 4 KiB buffer that carries write payloads in and
+ * read results out.  The client hands out buffers from a bitmask, which
+ * also bounds the operations in flight to the ring size so the completion
+ * queue can never overflow.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VSFS_RING_MAGIC    0x52494E47U  // "RING"
+#define VSFS_RING_VERSION  8U
+#define VSFS_RING_ENTRIES  64U          // power of two, one bit per buffer
+#define VSFS_RING_BUF      4096U
+#define VSFS_PATH_MAX      128U
+#define VSFS_DEFAULT_SHM   "vsfs"
+#define VSFS_MAX_VOLS      16U
+
+enum vsfs_op {
+    VSFS_OP_NOP = 0,
+    VSFS_OP_CREATE,   // path -> ino
+    VSFS_OP_MKDIR,    // path -> ino
+    VSFS_OP_LOOKUP,   // path -> ino, size
+    VSFS_OP_SYNC,     // completes once everything before it is durable
+    VSFS_OP_WRITE,    // path or ino, off, len bytes from the buffer -> size = bytes written
+    VSFS_OP_READ,     // path or ino, off, len -> len bytes in the buffer, size = file size
+    VSFS_OP_UNLINK,   // path; removes a file or an empty directory
+    VSFS_OP_READDIR,  // path, off = first slot -> vsfs_dirent array in the buffer, size = next slot
+    VSFS_OP_FSYNC,    // path or ino; completes once the file's data and its last change are durable
+    VSFS_OP_PREALLOC, // path or ino, off, len; reserves the file's blocks up to off + len, size unchanged
+    VSFS_OP_HEATMAP,  // off = first bucket -> vsfs_heat_bucket array in the buffer, size = next bucket
+};
+
+/* sqe.flags of VSFS_OP_CREATE */
+#define VSFS_CREATE_COMPRESS 0x1U   // store the file's data compressed
+#define VSFS_CREATE_JOURNAL  0x2U   // log the file's data in the journal with its metadata
+
+/*
+ * sqe.flags of CREATE, MKDIR and UNLINK: when the operation completes
+ * relative to its transaction reaching the disk.  VSFS_OP_SYNC always
+ * waits, and makes everything before it durable whatever its level.
+ */
+#define VSFS_DURABLE_MASK    0x0300U
+#define VSFS_DURABLE_DEFAULT 0x0000U   // the daemon's -d level
+#define VSFS_DURABLE_SYNC    0x0100U   // once it is committed
+#define VSFS_DURABLE_GROUP   0x0200U   // at once; committed within the commit interval or batch
+#define VSFS_DURABLE_NONE    0x0300U   // at once; committed by a later sync or a full transaction
+
+/*
+ * sqe.flags of any operation: a bulk scan that will not come back to the
+ * metadata it reads.  Blocks it reads in are the first to be evicted and
+ * blocks it finds cached are not promoted, so it does not displace the
+ * working set of other clients.
+ */
+#define VSFS_NOCACHE         0x0400U
+
+/*
+ * sqe.flags of VSFS_OP_HEATMAP: zero the counters of the buckets returned,
+ * so the next dump covers only what happened since.
+ */
+#define VSFS_HEAT_RESET      0x0001U
+
+/* "sync", "group" or "none" to its VSFS_DURABLE_* level; -1 if unknown. */
+static inline int vsfs_durable_level(const char *name) {
+    if (strcmp(name, "sync") == 0) {
+        return VSFS_DURABLE_SYNC;
+    }
+    if (strcmp(name, "group") == 0) {
+        return VSFS_DURABLE_GROUP;
+    }
+    if (strcmp(name, "none") == 0) {
+        return VSFS_DURABLE_NONE;
+    }
+    return -1;
+}
+
+/* One entry of a READDIR result; an empty result means the end of the directory. */
+struct vsfs_dirent {
+    uint32_t ino;
+    char name[28];
+};
+
+struct vsfs_sqe {
+    uint64_t user_data;
+    uint16_t op;
+    uint16_t flags;
+    uint32_t buf;      // index of the entry buffer owned by this operation
+    uint32_t ino;
+    uint32_t len;
+    uint32_t vol;      // image index
+    uint64_t off;
+    char path[VSFS_PATH_MAX];
+};
+
+struct vsfs_cqe {
+    uint64_t user_data;
+    int32_t result;    // 0 or a negative errno
+    uint32_t ino;
+    uint32_t len;      // bytes returned in the entry buffer
+    uint32_t buf;
+    uint64_t size;     // file size, for operations that report one
+};
+
+struct vsfs_ring_slot {
+    _Atomic uint32_t state;           // 0 = free, 1 = attached
+    _Atomic int32_t owner_pid;
+
+    _Alignas(64) _Atomic uint32_t sq_tail;   // written by client
+    _Alignas(64) _Atomic uint32_t sq_head;   // written by daemon
+    _Alignas(64) _Atomic uint32_t cq_tail;   // written by daemon, futex word
+    _Alignas(64) _Atomic uint32_t cq_head;   // written by client
+    _Alignas(64) _Atomic uint32_t client_waiting;
+
+    struct vsfs_sqe sq[VSFS_RING_ENTRIES];
+    struct vsfs_cqe cq[VSFS_RING_ENTRIES];
+    _Alignas(4096) uint8_t bufs[VSFS_RING_ENTRIES][VSFS_RING_BUF];
+};
+
+/* Counters the daemon publishes for monitoring tools. */
+struct vsfs_ring_stats {
+    _Atomic uint64_t ops;
+    _Atomic uint64_t commits;
+    _Atomic uint64_t journal_bytes;
+    _Atomic uint64_t checkpoints;
+    _Atomic uint64_t checkpoint_blocks;
+    _Atomic uint64_t data_blocks;     // file data blocks written back
+    _Atomic uint64_t dedup_blocks;    // whole-block writes served by an existing block
+    _Atomic uint64_t bg_delayed;      // background writes held back for foreground I/O
+    _Atomic uint64_t meta_reads;      // metadata blocks read into the cache
+};
+
+struct vsfs_ring_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slot_size;
+    uint32_t nvols;
+    _Atomic int32_t daemon_pid;
+
+    _Alignas(64) _Atomic uint32_t doorbell;     // futex word idle daemon threads sleep on
+    _Atomic uint32_t daemon_idle;               // number of daemon threads asleep
+
+    _Alignas(64) struct vsfs_ring_stats stats;  // totals over every image
+    struct vsfs_ring_stats vol_stats[VSFS_MAX_VOLS];
+};
+
+static inline size_t vsfs_ring_hdr_size(void) {
+    return (sizeof(struct vsfs_ring_hdr) + 4095U) & ~(size_t)4095U;
+}
+
+static inline size_t vsfs_ring_region_size(uint32_t nslots) {
+    return vsfs_ring_hdr_size() + (size_t)nslots * sizeof(struct vsfs_ring_slot);
+}
+
+static inline struct vsfs_ring_slot *vsfs_ring_slot_at(struct vsfs_ring_hdr *hdr, uint32_t idx) {
+    return (struct vsfs_ring_slot *)((uint8_t *)hdr + vsfs_ring_hdr_size() + (size_t)idx * hdr->slot_size);
+}
+
+static inline void vsfs_shm_path(char *out, size_t len, const char *name) {
+    snprintf(out, len, "/%s", name);
+}
+
+static inline int vsfs_futex_wait(_Atomic uint32_t *word, uint32_t expected, const struct timespec *timeout) {
+    return (int)syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static inline void vsfs_futex_wake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline void vsfs_futex_wake_all(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 0x7fffffff, NULL, NULL, 0);
+}
+
+/* ---- client side ---- */
+
+struct vsfs_client {
+    struct vsfs_ring_hdr *hdr;
+    struct vsfs_ring_slot *slot;
+    size_t map_len;
+    uint64_t free_bufs;
+    uint32_t inflight;
+    uint32_t vol;      // image vsfs_client_call() targets
+};
+
+static inline int vsfs_client_attach(struct vsfs_client *cli, const char *name) {
+    char path[256];
+    vsfs_shm_path(path, sizeof(path), name ? name : VSFS_DEFAULT_SHM);
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -errno;
+    }
+    struct vsfs_ring_hdr *hdr = map;
+    if (hdr->magic != VSFS_RING_MAGIC || hdr->version != VSFS_RING_VERSION ||
+        hdr->slot_size != sizeof(struct vsfs_ring_slot) ||
+        vsfs_ring_region_size(hdr->nslots) > (size_t)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return -EPROTO;
+    }
+    for (uint32_t i = 0; i < hdr->nslots; ++i) {
+        struct vsfs_ring_slot *slot = vsfs_ring_slot_at(hdr, i);
+        uint32_t expected = 0;
+        if (atomic_compare_exchange_strong(&slot->state, &expected, 1)) {
+            atomic_store(&slot->owner_pid, (int32_t)getpid());
+            cli->hdr = hdr;
+            cli->slot = slot;
+            cli->map_len = (size_t)st.st_size;
+            cli->free_bufs = ~0ULL >> (64 - VSFS_RING_ENTRIES);
+            cli->inflight = 0;
+            cli->vol = 0;
+            return 0;
+        }
+    }
+    munmap(map, (size_t)st.st_size);
+    return -EBUSY;
+}
+
+static inline void vsfs_client_detach(struct vsfs_client *cli) {
+    if (!cli->slot) {
+        return;
+    }
+    atomic_store(&cli->slot->owner_pid, 0);
+    atomic_store_explicit(&cli->slot->state, 0, memory_order_release);
+    munmap(cli->hdr, cli->map_len);
+    cli->hdr = NULL;
+    cli->slot = NULL;
+}
+
+/* Claims an entry buffer; returns -EAGAIN when every entry is in flight. */
+static inline int vsfs_client_get_buf(struct vsfs_client *cli, uint32_t *buf) {
+    if (cli->free_bufs == 0) {
+        return -EAGAIN;
+    }
+    *buf = (uint32_t)__builtin_ctzll(cli->free_bufs);
+    cli->free_bufs &= cli->free_bufs - 1;
+    return 0;
+}
+
+static inline void vsfs_client_put_buf(struct vsfs_client *cli, uint32_t buf) {
+    cli->free_bufs |= 1ULL << buf;
+}
+
+static inline uint8_t *vsfs_client_buf(struct vsfs_client *cli, uint32_t buf) {
+    return cli->slot->bufs[buf];
+}
+
+/*
+ * Queues one operation.  sqe->buf must come from vsfs_client_get_buf().
+ * The daemon is only woken if it has gone idle; which of its threads
+ * serves this slot is its business, so every sleeping one is woken.
+ */
+static inline void vsfs_client_submit(struct vsfs_client *cli, const struct vsfs_sqe *sqe) {
+    struct vsfs_ring_slot *slot = cli->slot;
+    uint32_t tail = atomic_load_explicit(&slot->sq_tail, memory_order_relaxed);
+    slot->sq[tail & (VSFS_RING_ENTRIES - 1)] = *sqe;
+    atomic_store_explicit(&slot->sq_tail, tail + 1, memory_order_release);
+    cli->inflight++;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&cli->hdr->daemon_idle, memory_order_relaxed)) {
+        atomic_fetch_add(&cli->hdr->doorbell, 1);
+        vsfs_futex_wake_all(&cli->hdr->doorbell);
+    }
+}
+
+/*
+ * Takes the next completion.  With wait set, sleeps on the completion
+ * queue until one arrives.  Returns -EAGAIN if none is ready and wait is 0,
+ * -ESHUTDOWN if the daemon went away.
+ */
+static inline int vsfs_client_reap(struct vsfs_client *cli, struct vsfs_cqe *cqe, int wait) {
+    struct vsfs_ring_slot *slot = cli->slot;
+    uint32_t head = atomic_load_explicit(&slot->cq_head, memory_order_relaxed);
+    for (;;) {
+        uint32_t tail = atomic_load_explicit(&slot->cq_tail, memory_order_acquire);
+        if (tail != head) {
+            *cqe = slot->cq[head & (VSFS_RING_ENTRIES - 1)];
+            atomic_store_explicit(&slot->cq_head, head + 1, memory_order_release);
+            cli->inflight--;
+            return 0;
+        }
+        if (!wait) {
+            return -EAGAIN;
+        }
+        atomic_store(&slot->client_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&slot->cq_tail, memory_order_acquire) == head) {
+            int32_t pid = atomic_load(&cli->hdr->daemon_pid);
+            if (pid <= 0 || (kill(pid, 0) < 0 && errno == ESRCH)) {
+                atomic_store(&slot->client_waiting, 0);
+                return -ESHUTDOWN;
+            }
+            struct timespec ts = { 1, 0 };
+            vsfs_futex_wait(&slot->cq_tail, head, &ts);
+        }
+        atomic_store(&slot->client_waiting, 0);
+    }
+}
+
+/*
+ * Synchronous helper: one operation, wait for its completion.  Only for
+ * clients that have nothing else in flight on this slot.
+ */
+static inline int vsfs_client_call(struct vsfs_client *cli, uint16_t op, uint16_t flags, const char *path,
+                                   uint32_t ino, uint64_t off, const void *data, uint32_t len,
+                                   struct vsfs_cqe *out, void *result_buf) {
+    struct vsfs_sqe sqe;
+    memset(&sqe, 0, sizeof(sqe));
+    int rc = vsfs_client_get_buf(cli, &sqe.buf);
+    if (rc < 0) {
+        return rc;
+    }
+    sqe.op = op;
+    sqe.flags = flags;
+    sqe.ino = ino;
+    sqe.off = off;
+    sqe.len = len;
+    sqe.vol = cli->vol;
+    if (path) {
+        strncpy(sqe.path, path, VSFS_PATH_MAX - 1);
+    }
+    if (data && len) {
+        memcpy(vsfs_client_buf(cli, sqe.buf), data, len > VSFS_RING_BUF ? VSFS_RING_BUF : len);
+    }
+    vsfs_client_submit(cli, &sqe);
+
+    struct vsfs_cqe cqe;
+    rc = vsfs_client_reap(cli, &cqe, 1);
+    if (rc < 0) {
+        return rc;
+    }
+    if (result_buf && cqe.result >= 0 && cqe.len) {
+        memcpy(result_buf, vsfs_client_buf(cli, cqe.buf), cqe.len > VSFS_RING_BUF ? VSFS_RING_BUF : cqe.len);
+    }
+    vsfs_client_put_buf(cli, cqe.buf);
+    if (out) {
+        *out = cqe;
+    }
+    return cqe.result;
+}
+
+#endif
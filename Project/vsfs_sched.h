@@ -0,0 +1,309 @@
+#ifndef VSFS_SCHED_H
+#define VSFS_SCHED_H
+
+/*
+ * Work-stealing task runtime shared by the parallel tools.
+ *
+ * A scheduler owns a fixed pool of worker threads, each with a deque of
+ * tasks.  A task spawned by a worker goes onto the back of that worker's
+ * deque and is taken back from there (LIFO, so it finds its data still in
+ * cache); one spawned by any other thread goes into a FIFO injection
+ * queue.  A worker that runs dry takes from the injection queue, then
+ * steals from the front of the other workers' deques.  Idle workers sleep
+ * on a condition variable.
+ *
+ * Tasks are embedded in the caller's own structures and carry a group.
+ * vsfs_group_wait() returns once every task spawned into the group has
+ * finished; until then the waiting thread runs queued tasks itself, so
+ * waiting never idles a CPU while there is work, and a scheduler with no
+ * workers of its own still makes progress.
+ *
+ * A task that has started reads it does not want to block on (readahead,
+ * or background I/O held back for foreground work) returns
+ * VSFS_TASK_YIELD; it goes to the back of the injection queue and runs
+ * again once the work queued before it has had its turn.
+ *
+ * vsfs_sched_threads() is where every tool gets its thread count from:
+ * the one asked for, else $VSFS_THREADS, else the online CPUs.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define VSFS_TASK_DONE  0
+#define VSFS_TASK_YIELD 1
+
+struct vsfs_group {
+    _Atomic uint32_t pending;    // tasks spawned and not finished
+};
+
+struct vsfs_task {
+    int (*run)(struct vsfs_task *);   // VSFS_TASK_DONE or VSFS_TASK_YIELD
+    struct vsfs_group *group;
+};
+
+/* A ring of task pointers that grows as needed; guarded by `lock`. */
+struct vsfs_deque {
+    pthread_mutex_t lock;
+    struct vsfs_task **ring;
+    uint32_t cap;                // power of two, or 0 before the first push
+    uint32_t head;               // front: the oldest task
+    uint32_t tail;
+};
+
+struct vsfs_sched;
+
+struct vsfs_worker {
+    struct vsfs_sched *s;
+    uint32_t idx;
+    pthread_t thread;
+    struct vsfs_deque dq;
+};
+
+struct vsfs_sched {
+    uint32_t nworkers;
+    struct vsfs_worker *workers;
+    struct vsfs_deque inject;
+    _Atomic uint32_t queued;     // tasks in any deque or the injection queue
+    _Atomic uint32_t nidle;      // workers asleep, or about to be
+    int stop;
+    pthread_mutex_t lock;        // sleeping, waking and `stop`
+    pthread_cond_t work;         // a task was queued
+    pthread_cond_t done;         // some group's last task finished
+};
+
+/* The worker the calling thread is, NULL for any other thread. */
+static _Thread_local struct vsfs_worker *vsfs_sched_self;
+
+static inline uint32_t vsfs_sched_threads(uint32_t requested) {
+    if (requested) {
+        return requested;
+    }
+    const char *env = getenv("VSFS_THREADS");
+    long n = env ? strtol(env, NULL, 10) : 0;
+    if (n <= 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return n > 0 ? (uint32_t)n : 4U;
+}
+
+static inline void vsfs_deque_init(struct vsfs_deque *q) {
+    pthread_mutex_init(&q->lock, NULL);
+    q->ring = NULL;
+    q->cap = 0;
+    q->head = 0;
+    q->tail = 0;
+}
+
+/* Returns 0, or -1 if the ring could not grow. */
+static inline int vsfs_deque_push(struct vsfs_deque *q, struct vsfs_task *t) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail - q->head == q->cap) {
+        uint32_t cap = q->cap ? q->cap * 2 : 64;
+        struct vsfs_task **ring = malloc(cap * sizeof(*ring));
+        if (!ring) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        for (uint32_t i = 0; i < q->tail - q->head; ++i) {
+            ring[i] = q->ring[(q->head + i) & (q->cap - 1)];
+        }
+        free(q->ring);
+        q->tail -= q->head;
+        q->head = 0;
+        q->ring = ring;
+        q->cap = cap;
+    }
+    q->ring[q->tail++ & (q->cap - 1)] = t;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* Takes the newest task (`back`) or the oldest one; NULL if empty. */
+static inline struct vsfs_task *vsfs_deque_take(struct vsfs_deque *q, int back) {
+    struct vsfs_task *t = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail) {
+        t = back ? q->ring[--q->tail & (q->cap - 1)] : q->ring[q->head++ & (q->cap - 1)];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return t;
+}
+
+static inline void vsfs_deque_destroy(struct vsfs_deque *q) {
+    free(q->ring);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static inline void vsfs_sched_push(struct vsfs_sched *s, struct vsfs_deque *q, struct vsfs_task *t) {
+    // Counted first, so `queued` never drops below the tasks a finder can see.
+    atomic_fetch_add(&s->queued, 1);
+    if (vsfs_deque_push(q, t) < 0) {
+        atomic_fetch_sub(&s->queued, 1);
+        // Out of memory: run it here rather than lose it.
+        while (t->run(t) == VSFS_TASK_YIELD) {
+            sched_yield();
+        }
+        if (atomic_fetch_sub(&t->group->pending, 1) == 1) {
+            pthread_mutex_lock(&s->lock);
+            pthread_cond_broadcast(&s->done);
+            pthread_mutex_unlock(&s->lock);
+        }
+        return;
+    }
+    if (atomic_load(&s->nidle)) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->work);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* Queues `t` as part of `g`. */
+static inline void vsfs_spawn(struct vsfs_sched *s, struct vsfs_group *g, struct vsfs_task *t) {
+    // A task may be queued again while it is still running; it keeps its group.
+    if (t->group != g) {
+        t->group = g;
+    }
+    atomic_fetch_add(&g->pending, 1);
+    struct vsfs_worker *self = vsfs_sched_self;
+    vsfs_sched_push(s, self && self->s == s ? &self->dq : &s->inject, t);
+}
+
+/* Finds a task: the caller's own deque, the injection queue, then the other workers' deques. */
+static inline struct vsfs_task *vsfs_sched_find(struct vsfs_sched *s) {
+    if (atomic_load(&s->queued) == 0) {
+        return NULL;
+    }
+    struct vsfs_worker *self = vsfs_sched_self;
+    if (self && self->s != s) {
+        self = NULL;
+    }
+    struct vsfs_task *t = self ? vsfs_deque_take(&self->dq, 1) : NULL;
+    if (!t) {
+        t = vsfs_deque_take(&s->inject, 0);
+    }
+    uint32_t start = self ? self->idx + 1 : 0;
+    for (uint32_t i = 0; !t && i < s->nworkers; ++i) {
+        struct vsfs_worker *victim = &s->workers[(start + i) % s->nworkers];
+        if (victim != self) {
+            t = vsfs_deque_take(&victim->dq, 0);
+        }
+    }
+    if (t) {
+        atomic_fetch_sub(&s->queued, 1);
+    }
+    return t;
+}
+
+static inline void vsfs_sched_run(struct vsfs_sched *s, struct vsfs_task *t) {
+    if (t->run(t) == VSFS_TASK_YIELD) {
+        vsfs_sched_push(s, &s->inject, t);
+        sched_yield();
+        return;
+    }
+    if (atomic_fetch_sub(&t->group->pending, 1) == 1) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_broadcast(&s->done);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static inline void *vsfs_worker_main(void *arg) {
+    struct vsfs_worker *w = arg;
+    struct vsfs_sched *s = w->s;
+    vsfs_sched_self = w;
+    for (;;) {
+        struct vsfs_task *t = vsfs_sched_find(s);
+        if (t) {
+            vsfs_sched_run(s, t);
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        atomic_fetch_add(&s->nidle, 1);
+        while (atomic_load(&s->queued) == 0 && !s->stop) {
+            pthread_cond_wait(&s->work, &s->lock);
+        }
+        atomic_fetch_sub(&s->nidle, 1);
+        int stop = s->stop && atomic_load(&s->queued) == 0;
+        pthread_mutex_unlock(&s->lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+/* Waits for every task of `g`, running queued tasks meanwhile. */
+static inline void vsfs_group_wait(struct vsfs_sched *s, struct vsfs_group *g) {
+    while (atomic_load(&g->pending)) {
+        struct vsfs_task *t = vsfs_sched_find(s);
+        if (t) {
+            vsfs_sched_run(s, t);
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        if (atomic_load(&g->pending) && atomic_load(&s->queued) == 0) {
+            pthread_cond_wait(&s->done, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* Starts `nworkers` threads, which may be 0.  Returns 0, or -1 with errno set. */
+static inline int vsfs_sched_init(struct vsfs_sched *s, uint32_t nworkers) {
+    s->nworkers = 0;
+    s->workers = calloc(nworkers ? nworkers : 1, sizeof(*s->workers));
+    if (!s->workers) {
+        return -1;
+    }
+    vsfs_deque_init(&s->inject);
+    atomic_store(&s->queued, 0);
+    atomic_store(&s->nidle, 0);
+    s->stop = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->work, NULL);
+    pthread_cond_init(&s->done, NULL);
+    for (uint32_t i = 0; i < nworkers; ++i) {
+        struct vsfs_worker *w = &s->workers[i];
+        w->s = s;
+        w->idx = i;
+        vsfs_deque_init(&w->dq);
+    }
+    for (uint32_t i = 0; i < nworkers; ++i) {
+        int err = pthread_create(&s->workers[i].thread, NULL, vsfs_worker_main, &s->workers[i]);
+        if (err) {
+            errno = err;
+            return -1;
+        }
+        s->nworkers = i + 1;
+    }
+    return 0;
+}
+
+/* Runs whatever is still queued, then stops the workers. */
+static inline void vsfs_sched_destroy(struct vsfs_sched *s) {
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    for (uint32_t i = 0; i < s->nworkers; ++i) {
+        pthread_join(s->workers[i].thread, NULL);
+    }
+    for (struct vsfs_task *t; (t = vsfs_sched_find(s));) {
+        vsfs_sched_run(s, t);
+    }
+    for (uint32_t i = 0; i < s->nworkers; ++i) {
+        vsfs_deque_destroy(&s->workers[i].dq);
+    }
+    vsfs_deque_destroy(&s->inject);
+    free(s->workers);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->work);
+    pthread_cond_destroy(&s->done);
+}
+
+#endif
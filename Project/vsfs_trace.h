@@ -0,0 +1,129 @@
+#ifndef VSFS_TRACE_H
+#define VSFS_TRACE_H
+
+/*
+ * Operation traces.
+ *
+ * vsfsd -R writes one record per operation it completes, in completion
+ * order, behind a header.  A record holds what was asked (operation,
+ * flags, image, inode, offset, length and path, but not write payloads),
+ * when the daemon picked it up relative to the start of the trace, how
+ * long it took and what it returned.  It also holds how many operations
+ * had completed when it was picked up: all of them happened before it,
+ * so a replay that waits for that many earlier records before issuing
+ * one keeps every ordering a client could have relied on, whatever the
+ * interleaving of the rest.
+ *
+ * loadgen -R replays a trace; vsfs_trace_load() reads one back.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vsfs_ring.h"
+
+#define VSFS_TRACE_MAGIC   0x43525456U  // "VTRC"
+#define VSFS_TRACE_VERSION 1U
+
+struct vsfs_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nvols;          // images the daemon served
+    uint32_t nslots;         // client slots
+    int64_t start_ns;        // CLOCK_REALTIME when the trace began
+};
+
+/* Followed by path_len bytes of path, not NUL-terminated. */
+struct vsfs_trace_rec {
+    uint64_t start_ns;       // since the trace began
+    uint64_t after;          // records completed before this one started
+    uint32_t latency_ns;     // saturates at UINT32_MAX
+    int32_t result;
+    uint64_t off;
+    uint32_t ino;
+    uint32_t len;
+    uint16_t op;
+    uint16_t flags;
+    uint16_t slot;
+    uint8_t vol;
+    uint8_t path_len;
+};
+
+_Static_assert(sizeof(struct vsfs_trace_rec) == 48, "trace records are packed by hand");
+_Static_assert(VSFS_PATH_MAX <= 256, "path_len is one byte");
+
+struct vsfs_trace {
+    struct vsfs_trace_header hdr;
+    struct vsfs_trace_rec *recs;
+    char (*paths)[VSFS_PATH_MAX];
+    uint64_t count;
+};
+
+/*
+ * Reads a whole trace.  Returns 0, or a negative errno; -EPROTO for a
+ * file that is not a trace and -EIO for one cut short in a record.
+ */
+static inline int vsfs_trace_load(struct vsfs_trace *t, const char *path) {
+    memset(t, 0, sizeof(*t));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return -errno;
+    }
+    int rc = 0;
+    uint64_t cap = 0;
+    if (fread(&t->hdr, sizeof(t->hdr), 1, f) != 1 || t->hdr.magic != VSFS_TRACE_MAGIC ||
+        t->hdr.version != VSFS_TRACE_VERSION) {
+        rc = -EPROTO;
+        goto out;
+    }
+    for (;;) {
+        struct vsfs_trace_rec rec;
+        size_t n = fread(&rec, 1, sizeof(rec), f);
+        if (n == 0) {
+            break;
+        }
+        if (n != sizeof(rec) || rec.path_len >= VSFS_PATH_MAX) {
+            rc = -EIO;
+            goto out;
+        }
+        if (t->count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            void *recs = realloc(t->recs, cap * sizeof(*t->recs));
+            void *paths = recs ? realloc(t->paths, cap * sizeof(*t->paths)) : NULL;
+            if (recs) {
+                t->recs = recs;
+            }
+            if (!paths) {
+                rc = -ENOMEM;
+                goto out;
+            }
+            t->paths = paths;
+        }
+        char *p = t->paths[t->count];
+        if (fread(p, 1, rec.path_len, f) != rec.path_len) {
+            rc = -EIO;
+            goto out;
+        }
+        p[rec.path_len] = '\0';
+        t->recs[t->count++] = rec;
+    }
+out:
+    fclose(f);
+    if (rc < 0) {
+        free(t->recs);
+        free(t->paths);
+        memset(t, 0, sizeof(*t));
+    }
+    return rc;
+}
+
+static inline void vsfs_trace_free(struct vsfs_trace *t) {
+    free(t->recs);
+    free(t->paths);
+    memset(t, 0, sizeof(*t));
+}
+
+#endif
@@ -0,0 +1,250 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vsfs_heat.h"
+#include "vsfs_ring.h"
+
+/*
+ * vsfsctl: issue single operations to a running vsfsd.
+ */
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s name] [-v image] [-z | -j] [-d level] [-N] <command> [args]\n"
+            "  -v image         index of the image to operate on (default 0)\n"
+            "  -z               create files whose data is stored compressed\n"
+            "  -j               create files whose data is journaled with their metadata\n"
+            "  -d level         durability of create, mkdir and unlink: sync, group or none\n"
+            "                   (default: the daemon's)\n"
+            "  -N               do not keep the metadata the command reads cached (bulk scans)\n"
+            "Commands:\n"
+            "  create <path>    create an empty file\n"
+            "  mkdir <path>     create a directory\n"
+            "  lookup <path>    print inode number and size\n"
+            "  write <path> <offset> <text>\n"
+            "                   write text into a file at offset\n"
+            "  read <path> <offset> <length>\n"
+            "                   print up to length bytes of a file\n"
+            "  unlink <path>    remove a file or an empty directory\n"
+            "  ls <path>        list a directory\n"
+            "  prealloc <path> <offset> <length>\n"
+            "                   reserve a file's blocks up to offset + length, contiguous if possible\n"
+            "  fsync <path>     wait until a file's data and its last change are durable\n"
+            "  sync             wait until all earlier operations are durable\n"
+            "  stats            print daemon counters, in total and per image\n"
+            "  heat [reset]     print the image's block access heatmap (vsfsd -H); with reset,\n"
+            "                   also start counting afresh\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+static int report(const char *what, const char *path, int rc) {
+    if (rc < 0) {
+        fprintf(stderr, "%s %s: %s\n", what, path ? path : "", strerror(-rc));
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *shm_name = VSFS_DEFAULT_SHM;
+    uint32_t vol = 0;
+    uint16_t create_flags = 0;
+    uint16_t durable = VSFS_DURABLE_DEFAULT;
+    uint16_t nocache = 0;
+    int c;
+    while ((c = getopt(argc, argv, "s:v:zjd:Nh")) != -1) {
+        switch (c) {
+        case 's': shm_name = optarg; break;
+        case 'v': vol = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'z': create_flags |= VSFS_CREATE_COMPRESS; break;
+        case 'j': create_flags |= VSFS_CREATE_JOURNAL; break;
+        case 'N': nocache = VSFS_NOCACHE; break;
+        case 'd': {
+            int level = vsfs_durable_level(optarg);
+            if (level < 0) {
+                usage(argv[0]);
+            }
+            durable = (uint16_t)level;
+            break;
+        }
+        default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+    }
+    const char *cmd = argv[optind];
+    const char *arg = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+    struct vsfs_client cli;
+    int rc = vsfs_client_attach(&cli, shm_name);
+    if (rc < 0) {
+        fprintf(stderr, "cannot attach to vsfsd '%s': %s\n", shm_name, strerror(-rc));
+        return 1;
+    }
+    if (vol >= cli.hdr->nvols) {
+        fprintf(stderr, "vsfsd '%s' serves %u image(s); there is no image %u\n", shm_name, cli.hdr->nvols, vol);
+        vsfs_client_detach(&cli);
+        return 1;
+    }
+    cli.vol = vol;
+
+    struct vsfs_cqe cqe;
+    int status = 0;
+    if (strcmp(cmd, "create") == 0 || strcmp(cmd, "mkdir") == 0) {
+        if (!arg) {
+            usage(argv[0]);
+        }
+        uint16_t op = strcmp(cmd, "mkdir") == 0 ? VSFS_OP_MKDIR : VSFS_OP_CREATE;
+        uint16_t flags = durable | nocache | (op == VSFS_OP_CREATE ? create_flags : 0);
+        rc = vsfs_client_call(&cli, op, flags, arg, 0, 0, NULL, 0, &cqe, NULL);
+        status = report(cmd, arg, rc);
+        if (!status) {
+            printf("%s -> inode %u\n", arg, cqe.ino);
+        }
+    } else if (strcmp(cmd, "lookup") == 0) {
+        if (!arg) {
+            usage(argv[0]);
+        }
+        rc = vsfs_client_call(&cli, VSFS_OP_LOOKUP, nocache, arg, 0, 0, NULL, 0, &cqe, NULL);
+        status = report(cmd, arg, rc);
+        if (!status) {
+            printf("%s: inode %u size %llu\n", arg, cqe.ino, (unsigned long long)cqe.size);
+        }
+    } else if (strcmp(cmd, "write") == 0) {
+        if (!arg || optind + 3 >= argc) {
+            usage(argv[0]);
+        }
+        uint64_t off = strtoull(argv[optind + 2], NULL, 0);
+        const char *text = argv[optind + 3];
+        size_t len = strlen(text);
+        if (len > VSFS_RING_BUF) {
+            len = VSFS_RING_BUF;
+        }
+        rc = vsfs_client_call(&cli, VSFS_OP_WRITE, nocache, arg, 0, off, text, (uint32_t)len, &cqe, NULL);
+        status = report(cmd, arg, rc);
+        if (!status) {
+            printf("%s: wrote %llu bytes at %llu\n", arg, (unsigned long long)cqe.size, (unsigned long long)off);
+        }
+    } else if (strcmp(cmd, "read") == 0) {
+        if (!arg || optind + 3 >= argc) {
+            usage(argv[0]);
+        }
+        uint64_t off = strtoull(argv[optind + 2], NULL, 0);
+        uint32_t len = (uint32_t)strtoul(argv[optind + 3], NULL, 0);
+        if (len > VSFS_RING_BUF) {
+            len = VSFS_RING_BUF;
+        }
+        static uint8_t data[VSFS_RING_BUF];
+        rc = vsfs_client_call(&cli, VSFS_OP_READ, nocache, arg, 0, off, NULL, len, &cqe, data);
+        status = report(cmd, arg, rc);
+        if (!status) {
+            fwrite(data, 1, cqe.len, stdout);
+            putchar('\n');
+        }
+    } else if (strcmp(cmd, "unlink") == 0) {
+        if (!arg) {
+            usage(argv[0]);
+        }
+        rc = vsfs_client_call(&cli, VSFS_OP_UNLINK, durable | nocache, arg, 0, 0, NULL, 0, &cqe, NULL);
+        status = report(cmd, arg, rc);
+    } else if (strcmp(cmd, "ls") == 0) {
+        const char *dir = arg ? arg : "/";
+        static struct vsfs_dirent ents[VSFS_RING_BUF / sizeof(struct vsfs_dirent)];
+        uint64_t next = 0;
+        for (;;) {
+            rc = vsfs_client_call(&cli, VSFS_OP_READDIR, nocache, dir, 0, next, NULL, 0, &cqe, ents);
+            status = report(cmd, dir, rc);
+            if (status || cqe.len == 0) {
+                break;
+            }
+            for (uint32_t i = 0; i < cqe.len / sizeof(ents[0]); ++i) {
+                printf("%8u  %s\n", ents[i].ino, ents[i].name);
+            }
+            next = cqe.size;
+        }
+    } else if (strcmp(cmd, "prealloc") == 0) {
+        if (!arg || optind + 3 >= argc) {
+            usage(argv[0]);
+        }
+        uint64_t off = strtoull(argv[optind + 2], NULL, 0);
+        uint32_t len = (uint32_t)strtoul(argv[optind + 3], NULL, 0);
+        rc = vsfs_client_call(&cli, VSFS_OP_PREALLOC, nocache, arg, 0, off, NULL, len, &cqe, NULL);
+        status = report(cmd, arg, rc);
+    } else if (strcmp(cmd, "fsync") == 0) {
+        if (!arg) {
+            usage(argv[0]);
+        }
+        rc = vsfs_client_call(&cli, VSFS_OP_FSYNC, nocache, arg, 0, 0, NULL, 0, &cqe, NULL);
+        status = report(cmd, arg, rc);
+    } else if (strcmp(cmd, "sync") == 0) {
+        rc = vsfs_client_call(&cli, VSFS_OP_SYNC, 0, NULL, 0, 0, NULL, 0, &cqe, NULL);
+        status = report(cmd, NULL, rc);
+    } else if (strcmp(cmd, "stats") == 0) {
+        const struct vsfs_ring_stats *st = &cli.hdr->stats;
+        printf("ops %llu\ncommits %llu\njournal_bytes %llu\ncheckpoints %llu\ncheckpoint_blocks %llu\n"
+               "data_blocks %llu\ndedup_blocks %llu\nbg_delayed %llu\nmeta_reads %llu\n",
+               (unsigned long long)st->ops, (unsigned long long)st->commits,
+               (unsigned long long)st->journal_bytes, (unsigned long long)st->checkpoints,
+               (unsigned long long)st->checkpoint_blocks, (unsigned long long)st->data_blocks,
+               (unsigned long long)st->dedup_blocks, (unsigned long long)st->bg_delayed,
+               (unsigned long long)st->meta_reads);
+        for (uint32_t i = 0; cli.hdr->nvols > 1 && i < cli.hdr->nvols; ++i) {
+            st = &cli.hdr->vol_stats[i];
+            printf("image %u: ops %llu commits %llu journal_bytes %llu checkpoints %llu checkpoint_blocks %llu "
+                   "data_blocks %llu dedup_blocks %llu bg_delayed %llu meta_reads %llu\n", i,
+                   (unsigned long long)st->ops, (unsigned long long)st->commits,
+                   (unsigned long long)st->journal_bytes, (unsigned long long)st->checkpoints,
+                   (unsigned long long)st->checkpoint_blocks, (unsigned long long)st->data_blocks,
+                   (unsigned long long)st->dedup_blocks, (unsigned long long)st->bg_delayed,
+                   (unsigned long long)st->meta_reads);
+        }
+    } else if (strcmp(cmd, "heat") == 0) {
+        uint16_t flags = arg && strcmp(arg, "reset") == 0 ? VSFS_HEAT_RESET : 0;
+        if (arg && !flags) {
+            usage(argv[0]);
+        }
+        static struct vsfs_heat_bucket got[VSFS_RING_BUF / sizeof(struct vsfs_heat_bucket)];
+        struct vsfs_heat_bucket *all = NULL;
+        uint32_t n = 0;
+        uint64_t next = 0;
+        for (;;) {
+            rc = vsfs_client_call(&cli, VSFS_OP_HEATMAP, flags, NULL, 0, next, NULL, 0, &cqe, got);
+            if (rc == -EOPNOTSUPP) {
+                fprintf(stderr, "heat: vsfsd keeps no heatmap; start it with -H\n");
+                status = 1;
+                break;
+            }
+            status = report(cmd, NULL, rc);
+            if (status || cqe.len == 0) {
+                break;
+            }
+            uint32_t k = cqe.len / sizeof(got[0]);
+            void *grown = realloc(all, (n + k) * sizeof(*all));
+            if (!grown) {
+                perror("realloc");
+                status = 1;
+                break;
+            }
+            all = grown;
+            memcpy(all + n, got, k * sizeof(*all));
+            n += k;
+            next = cqe.size;
+        }
+        if (!status) {
+            vsfs_heat_print(stdout, all, n);
+        }
+        free(all);
+    } else {
+        fprintf(stderr, "Unknown command: %s\n", cmd);
+        status = 1;
+    }
+
+    vsfs_client_detach(&cli);
+    return status;
+}
@@ -0,0 +1,4356 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+#include "vsfs_heat.h"
+#include "vsfs_lz.h"
+#include "vsfs_overlay.h"
+#include "vsfs_ring.h"
+#include "vsfs_sched.h"
+#include "vsfs_trace.h"
+
+/*
+ * vsfsd: long-running metadata server for one or more VSFS images.
+ *
+ * Clients post operations through the shared-memory rings in vsfs_ring.h.
+ * A pool of worker threads drains the rings, each owning a fixed subset of
+ * the slots, and applies the operations to the in-memory metadata cache of
+ * the image they target.  Everything applied to an image since its last
+ * commit goes into one journal transaction (group commit), written by a
+ * pool of background threads shared by all images (vsfs_sched.h).  Each
+ * image has at most one commit in flight, so the journal flushes of
+ * different images overlap.
+ *
+ * All images share one I/O scheduler.  Commit I/O and reads for
+ * operations go out at once; background I/O (checkpoints and write-back
+ * by the flusher) is issued a vectored write or flush at a time and holds
+ * back while foreground I/O is in flight, for at most BG_MAX_WAIT_US per
+ * piece.  A checkpoint starts in the background once the journal is
+ * CKPT_START_PCT full and runs without the image lock; only a commit that
+ * finds the journal full finishes one itself, at commit priority.
+ *
+ * Namespace operations carry a durability level.  A synchronous one
+ * completes once its transaction is durable and has a commit started at
+ * once.  A grouped one completes straight away; its transaction commits
+ * when the -I interval has passed since the first grouped operation in it
+ * or -b of them have piled up.  One with no durability completes straight
+ * away and waits for the next sync, or for the transaction to fill.
+ *
+ * The on-disk journal format is the one journal.c writes and replays, so
+ * an image left behind by a crashed daemon is recovered by
+ * `journal install` or by the next daemon start.
+ *
+ * File data goes through a write-back page cache.  Writes complete once
+ * they are in memory; a background flusher writes dirty pages out in
+ * block order, and a commit first writes the data of every block it
+ * allocates, so metadata never points at blocks whose contents have not
+ * reached the disk (ordered mode).
+ *
+ * On images made with `mkfs -d` files may share data blocks.  Every
+ * block's references are counted in a journaled table; written-back pages
+ * are fingerprinted, and a whole-block write whose content is already on
+ * disk (verified byte for byte) takes a reference to that block instead
+ * of writing a new one.  Writes into a shared block first give the file a
+ * private copy.
+ *
+ * Files created with VSFS_CREATE_COMPRESS store their data in clusters of
+ * four blocks, each compressed on its own; the inode's cluster map gives
+ * the bytes stored per cluster, which occupy as many of the cluster's
+ * direct pointers as they need.  Decompressed clusters are cached, and a
+ * write recompresses the clusters it touches into newly allocated blocks.
+ *
+ * VSFS_OP_PREALLOC reserves a file's blocks ahead of its writes, in one
+ * contiguous run where the image has room.  The inode marks them
+ * unwritten, so they read as zeros until a write fills them, which then
+ * allocates nothing.
+ *
+ * Files created with VSFS_CREATE_JOURNAL (or every file, with -j) have
+ * their data journaled too: their blocks live in the metadata cache, go
+ * into the running transaction with the inode, and reach their home
+ * location at the next checkpoint.  A small write followed by an fsync is
+ * then one sequential journal append instead of a data write plus a
+ * commit.
+ *
+ * With -T (lazytime), a write that changes nothing but an inode's mtime
+ * does not log the inode block.  The change waits in the cached block and
+ * goes out with the next transaction that logs the block anyway, or is
+ * logged once it is older than the -T limit, at a sync, or when the
+ * journal is checkpointed.
+ *
+ * At a clean shutdown the daemon saves its in-memory indexes (directory
+ * entries, data block fingerprints, allocation hints and the list of hot
+ * metadata blocks) next to the image as `<image>.snap`, stamped with the
+ * superblock's journal sequence number and the image file's timestamps.
+ * The next start maps the file and, if nothing has touched the image
+ * since, takes the indexes from it instead of rebuilding them on demand.
+ */
+
+#define FS_MAGIC 0x56534653U
+#define FS_MODE_JOURNAL 0U
+#define FS_FEAT_DEDUP   0x1U
+#define JOURNAL_MAGIC 0x4A524E4CU
+
+#define BLOCK_SIZE        4096U
+#define INODE_SIZE         128U
+#define DIRECT_POINTERS     8U
+#define NAME_LEN           28U
+#define BITS_PER_BLOCK     (BLOCK_SIZE * 8U)
+#define INODES_PER_BLOCK   (BLOCK_SIZE / INODE_SIZE)
+#define DIRENTS_PER_BLOCK  (BLOCK_SIZE / 32U)
+#define REFS_PER_BLOCK     (BLOCK_SIZE / 2U)
+#define REF_MAX            UINT16_MAX
+#define INODE_COMPRESSED   0x1U
+#define INODE_JOURNAL_DATA 0x2U   // data blocks are logged like metadata
+#define CLUSTER_BLOCKS      4U
+#define CLUSTER_SIZE       (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define CLUSTERS           (DIRECT_POINTERS / CLUSTER_BLOCKS)
+#define CLUSTER_RAW        0x8000U   // cluster map: stored uncompressed
+#define CLUSTER_LEN_MASK   0x7FFFU
+#define DEFAULT_IMAGE "vsfs.img"
+
+#define DEFAULT_CLIENTS      64U
+#define DEFAULT_WORKERS       2U
+#define DEFAULT_CACHE_BLOCKS 4096U
+#define DEFAULT_BATCH        1024U
+#define DEFAULT_PAGES        8192U
+#define DEFAULT_CLUSTERS      256U
+#define DEFAULT_DIRTY_PCT      40U
+#define DEFAULT_DIRTY_BG_PCT   10U
+#define DEFAULT_EXPIRE_MS    5000U
+#define DEFAULT_INTERVAL_MS  1000U
+#define DEFAULT_COMMIT_MS    5000U
+#define DEFAULT_BG_INFLIGHT     2U
+#define BG_MAX_WAIT_US       2000U   // longest a background write waits for foreground I/O
+#define CKPT_START_PCT         50U   // journal use at which a background checkpoint starts
+#define FLUSH_BATCH          1024U
+#define OP_MAX_BLOCKS        6U   // most distinct blocks one operation dirties, besides refcounts
+#define SNAP_MAGIC   0x504E5356U   // "VSNP"
+#define SNAP_VERSION 2U
+
+enum RecordType { REC_DATA = 1, REC_COMMIT = 2 };
+
+struct cow_root {
+    uint32_t map_block;
+    uint32_t gen;
+    uint32_t csum;
+};
+
+struct superblock {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+
+    uint32_t journal_block;
+    uint32_t inode_bitmap;
+    uint32_t data_bitmap;
+    uint32_t inode_start;
+    uint32_t data_start;
+
+    uint32_t mode;
+    struct cow_root roots[2];
+    uint32_t features;
+    uint32_t refcount_start;   // first block of the refcount table (dedup)
+    uint64_t journal_seq;      // last transaction committed, as of the last clean shutdown
+
+    uint8_t  _pad[128 - 12 * 4 - 2 * 12 - 8];
+};
+
+struct inode {
+    uint16_t type;
+    uint16_t links;
+    uint32_t size;
+
+    uint32_t direct[DIRECT_POINTERS];
+
+    uint32_t ctime;
+    uint32_t mtime;
+
+    uint16_t flags;
+    uint16_t cmap[CLUSTERS];   // bytes stored per cluster of a compressed file
+    uint8_t unwritten;         // bit k: direct[k] is preallocated and reads as zeros
+
+    uint8_t _pad[128 - (2 + 2 + 4 + DIRECT_POINTERS * 4 + 4 + 4 + 2 + CLUSTERS * 2 + 1)];
+};
+
+struct dirent {
+    uint32_t inode;
+    char name[NAME_LEN];
+};
+
+struct journal_header {
+    uint32_t magic;
+    uint32_t nbytes_used;
+} __attribute__((packed));
+
+struct rec_header {
+    uint16_t type;
+    uint16_t size;
+} __attribute__((packed));
+
+struct data_record {
+    struct rec_header hdr;
+    uint32_t block_no;
+    uint8_t data[BLOCK_SIZE];
+} __attribute__((packed));
+
+struct commit_record {
+    struct rec_header hdr;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct superblock) == 128, "superblock must be 128 bytes");
+_Static_assert(sizeof(struct inode) == 128, "inode must be 128 bytes");
+_Static_assert(sizeof(struct dirent) == 32, "dirent must be 32 bytes");
+
+/*
+ * Cached metadata block.  A block dirtied by the running transaction is on
+ * the transaction list; once committed, the committed image is kept in
+ * `committed` until a checkpoint pass takes it as `ckpt_buf` and writes it
+ * to its home location.  A block holding timestamp changes not logged yet
+ * is on the lazy list.  Blocks in any of these states are never evicted.
+ */
+struct cblock {
+    uint32_t blkno;
+    uint32_t last_op;
+    uint8_t queue;                // Q_A1IN or Q_AM
+    uint8_t nocache;              // read in by a VSFS_NOCACHE operation and not used since
+    uint64_t txn;
+    uint8_t *committed;
+    uint8_t *ckpt_buf;            // being written home by a checkpoint pass
+    struct cblock *hnext;
+    struct cblock *lru_prev;
+    struct cblock *lru_next;
+    struct cblock *txn_next;
+    struct cblock *ckpt_next;
+    struct cblock *lazy_next;
+    struct cblock **lazy_pprev;   // NULL when not on the lazy list
+    uint8_t data[BLOCK_SIZE];
+};
+
+/*
+ * The metadata cache is replaced with 2Q, so a scan through the image
+ * does not push out the bitmaps, inode-table and directory blocks that
+ * every operation uses.  A block read in goes to A1in, a FIFO; hits there
+ * leave it in place, since most are from the same operation.  A block
+ * evicted from A1in leaves its number in A1out, a FIFO of ghosts; one
+ * read again while still remembered there goes to Am, an LRU.  A1in is
+ * evicted first once it holds more than a quarter of the blocks the image
+ * has cached (or Am has nothing left to give), so a scan only ever
+ * replaces what it read itself.  A VSFS_NOCACHE operation reads blocks in
+ * at the old end of A1in and leaves no ghosts.
+ */
+enum { Q_A1IN, Q_AM };
+
+struct ghost {
+    uint32_t blkno;               // GHOST_NONE for an unused slot
+    uint32_t hnext;               // index + 1 of the next ghost in the chain, 0 at the end
+};
+
+#define GHOST_NONE UINT32_MAX
+
+/* Directory entry index: (directory inode, name) -> inode and slot. */
+struct dentry {
+    uint32_t dir;
+    uint32_t ino;
+    uint32_t slot;
+    char name[NAME_LEN];
+    struct dentry *next;
+};
+
+/*
+ * A freed data block is not handed out again until the transaction that
+ * freed it is durable: a crash before then brings back the file that owned
+ * it, which must not find another file's data there.  A freed directory
+ * block or journaled data block may still be replayed from the journal or
+ * written home by a checkpoint, so it stays pinned until the checkpoint
+ * after that transaction.
+ */
+struct pinned {
+    uint32_t blkno;
+    uint32_t hnext;               // index + 1 of the next pin in the chain, 0 at the end
+    uint64_t tid;
+    int logged;                   // held until a checkpoint, not only the commit
+};
+
+/* Directories whose entries are in the index. */
+struct dirinfo {
+    uint32_t ino;
+    uint32_t free_hint;
+    struct dirinfo *next;
+};
+
+/*
+ * Cached file data block.  `order_tid` names the transaction whose metadata
+ * (allocation or size) depends on this page; that transaction may not
+ * commit before the page is on disk.  `gen` counts modifications so a
+ * flush can tell whether the page changed while it was being written.
+ */
+struct page {
+    uint32_t ino;
+    uint32_t index;
+    uint32_t blkno;
+    uint8_t dirty;
+    uint64_t order_tid;
+    uint64_t gen;
+    uint64_t dirty_since;
+    uint64_t dirty_seq;    // pcache write count when its oldest unwritten change was made
+    struct page *hnext;
+    struct page *lru_prev;
+    struct page *lru_next;
+    struct page *dirty_prev;
+    struct page *dirty_next;
+    uint8_t data[BLOCK_SIZE];
+};
+
+/*
+ * Decompressed cluster of a compressed file; bytes past what was stored
+ * are zero.  Protected by the image lock.
+ */
+struct zcluster {
+    uint32_t ino;
+    uint32_t cluster;
+    struct zcluster *hnext;
+    struct zcluster *lru_prev;
+    struct zcluster *lru_next;
+    uint8_t data[CLUSTER_SIZE];
+};
+
+/*
+ * Cache limits shared by every image.  An image may grow its caches up to
+ * the whole budget while the others are idle; once the total is over
+ * budget, images holding more than their fair share give blocks back
+ * first.  Dirty page thresholds apply to the total as well.  `lock` and
+ * `wake` put the background flusher to sleep.
+ */
+struct budget {
+    _Atomic uint32_t meta_used;
+    uint32_t meta_limit;
+    _Atomic uint32_t pages_used;
+    uint32_t pages_limit;
+    _Atomic uint32_t clusters_used;
+    uint32_t clusters_limit;
+    _Atomic uint32_t dirty;
+    uint32_t dirty_max;
+    uint32_t dirty_bg;
+    uint32_t expire_ms;
+    uint32_t interval_ms;
+    uint32_t nvols;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+};
+
+enum io_class {
+    IO_COMMIT,       // journal writes and the pages a commit depends on
+    IO_READ,         // reads on behalf of an operation
+    IO_BACKGROUND,   // checkpoints and write-back
+    IO_CLASSES
+};
+
+/*
+ * I/O in flight per class, shared by every image.  Foreground counts are
+ * updated without the lock; background writers sleep on `cv`, and
+ * `bg_waiting` tells a finishing foreground I/O to wake them.
+ */
+struct iosched {
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    _Atomic uint32_t inflight[IO_CLASSES];
+    _Atomic uint32_t bg_waiting;
+    uint32_t bg_max;             // background pieces in flight at once
+};
+
+/*
+ * Page cache of one image.  `lock` protects every field and page;
+ * `flush_lock` serializes writers of dirty pages so a page is never in two
+ * flushes.  `urgent` counts foreground threads waiting for flush_lock; a
+ * background flush holding it stops deferring to foreground I/O.
+ */
+struct pcache {
+    pthread_mutex_t lock;
+    pthread_mutex_t flush_lock;
+    _Atomic uint32_t urgent;
+    struct budget *budget;
+    struct page **hash;
+    uint32_t hash_mask;
+    struct page lru;       // clean and dirty pages, most recent first
+    struct page dirty;     // dirty pages, oldest first
+    uint32_t count;
+    uint32_t ndirty;
+    uint64_t seq;          // page writes so far
+    uint8_t *staging;
+};
+
+/*
+ * Fingerprints of data blocks whose current content is on disk, chained
+ * per hash bucket through per-block links (data index + 1, 0 ends a
+ * chain).  A block is added when a flush writes it and dropped before its
+ * content changes or it is freed.  `lock` nests inside every other lock.
+ */
+struct fpindex {
+    pthread_mutex_t lock;
+    uint32_t *heads;
+    uint32_t mask;
+    uint32_t *next;
+    uint64_t *hash;
+    uint8_t *indexed;
+};
+
+struct config {
+    uint32_t cache_blocks;
+    uint32_t pages;
+    uint32_t clusters;
+    uint32_t dirty_pct;
+    uint32_t dirty_bg_pct;
+    uint32_t expire_ms;
+    uint32_t interval_ms;
+};
+
+/* An operation being traced, from when it is picked up until it completes. */
+struct trace_op {
+    struct vsfs_trace_rec rec;
+    char path[VSFS_PATH_MAX];
+};
+
+/* A completion held back until the transaction holding its changes commits. */
+struct waiter {
+    uint32_t slot;
+    struct vsfs_cqe cqe;
+    struct trace_op *trace;     // a copy owned by the waiter, when tracing
+    uint64_t tid;               // an fsync: the transaction it waits for
+};
+
+/*
+ * One served image.  `lock` protects the metadata cache, the running
+ * transaction, the directory index and the allocators.  A commit drops it
+ * while its I/O runs; `committing` keeps a second commit from starting
+ * until the first has finished.
+ */
+struct vol {
+    const char *path;
+    struct vsfs_image img;      // the image file, or an overlay over a read-only base
+    uint32_t idx;
+    pthread_mutex_t lock;
+    pthread_cond_t commit_done;
+    int committing;
+    int recommit;
+    int queued;
+    struct daemon *d;
+    struct vsfs_task commit_task;   // queued while `queued` is set
+    struct vsfs_task flush_task;    // the flusher's write-back of expired pages
+    struct vsfs_task ckpt_task;     // background checkpoint, queued while `ckpt_queued` is set
+    int ckpt_queued;
+    int ckpt_running;               // a checkpoint pass or journal reset is under way
+    pthread_cond_t ckpt_done;
+    _Atomic uint32_t ckpt_urgent;   // a commit waits for the background checkpoint
+    uint64_t flush_cutoff;          // pages dirty since before this (ms) are expired
+    uint64_t flush_deadline;        // us; the write-back stops yielding to foreground I/O
+    struct vsfs_ring_stats *stats;
+    struct vsfs_ring_stats *totals;
+    struct budget *budget;
+    struct iosched *io;
+    struct superblock sb;
+    struct vsfs_heat heat;      // -H: block accesses, else heat.count is NULL
+    uint32_t journal_blocks;
+    uint32_t inode_bmap_blocks;
+    uint32_t data_bmap_blocks;
+    uint32_t inode_blocks;
+    uint32_t data_blocks;
+    int dedup;
+    uint32_t op_max_blocks;
+
+    struct cblock **chash;
+    uint32_t chash_mask;
+    struct cblock a1in;           // 2Q: blocks seen once, newest first
+    struct cblock am;             // 2Q: blocks seen again, most recent first
+    uint32_t cached;
+    uint32_t a1in_count;
+    struct ghost *ghosts;         // A1out, a ring of `nghosts`
+    uint32_t nghosts;
+    uint32_t ghost_next;          // the oldest ghost, replaced next
+    uint32_t *ghash;              // blkno -> index + 1 of the first ghost in its chain
+    uint32_t ghash_mask;
+    int nocache;                  // the running operation asked not to be cached
+    uint32_t op_seq;
+
+    uint32_t jused;
+    uint32_t jcap;
+    uint32_t max_txn_blocks;
+    uint64_t tid;
+    struct cblock *txn_blocks;
+    uint32_t txn_nblocks;
+    struct waiter *waiters;
+    uint32_t nwaiters;
+    uint32_t waiters_cap;
+    struct waiter *posting;      // completions of the commit in flight
+    uint32_t posting_cap;
+    uint64_t durable_tid;        // every transaction up to this one is on disk
+    uint64_t *ino_tid;           // per inode: the last transaction that changed it or its entry
+    struct waiter *fsyncs;       // fsyncs waiting for a commit in flight
+    uint32_t nfsyncs;
+    uint32_t fsyncs_cap;
+    struct cblock *ckpt_list;
+    uint32_t ckpt_count;
+    struct cblock *lazy_head;
+    uint32_t nlazy;
+    uint64_t lazy_since;         // when the lazy list last became non-empty
+    uint32_t lazy_ms;            // 0: log timestamp changes at once
+    int lazy_flush;              // log every lazy block, over several commits if need be
+    uint32_t ngroup;             // grouped operations in the running transaction
+    uint64_t group_since;        // when the first of them ran
+    uint8_t *jbuf;
+
+    struct dentry **dhash;
+    uint32_t dhash_mask;
+    uint32_t dcount;
+    struct dirinfo **dirs;
+    uint32_t dirs_mask;
+
+    uint32_t inode_hint;
+    uint32_t data_hint;
+    struct pinned *pinned;
+    uint32_t npinned;
+    uint32_t pinned_cap;
+    uint32_t *phash;              // blkno -> index + 1 of the first pin in its chain
+    uint32_t phash_mask;
+
+    struct pcache pc;
+    struct fpindex fp;
+
+    struct zcluster **zhash;
+    uint32_t zhash_mask;
+    struct zcluster zlru;
+    uint32_t zcount;
+    uint8_t *zstage;             // stored bytes of the cluster being read
+    uint8_t *zwork;              // per touched cluster: plain and packed halves
+    int sync_requested;
+};
+
+/*
+ * Operation trace (-R, see vsfs_trace.h).  Records are appended in
+ * completion order under `lock`, and written out whenever the buffer
+ * fills, so a traced daemon pays a write() per buffer on the completion
+ * path.
+ */
+#define TRACE_BUF (1U << 20)
+
+struct tracer {
+    int fd;
+    pthread_mutex_t lock;
+    uint8_t *buf;
+    size_t used;
+    off_t off;                   // where the buffer goes in the file
+    uint64_t t0;                 // CLOCK_MONOTONIC ns when the trace began
+    _Atomic uint64_t completed;  // records appended so far
+};
+
+struct daemon {
+    struct vsfs_ring_hdr *hdr;
+    size_t map_len;
+    char shm_path[256];
+    uint32_t batch_max;
+    struct vol *vols;
+    uint32_t nvols;
+    struct budget budget;
+    struct iosched io;
+    pthread_mutex_t *cq_locks;   // one per slot: workers and commit threads both post
+    uint32_t nworkers;
+    pthread_t *workers;
+    struct vsfs_sched sched;     // background threads: commits and write-back
+    struct vsfs_group commits;   // commit tasks not finished yet
+    pthread_t flusher;
+    uint32_t lazy_ms;
+    uint16_t durable;            // level of operations that do not pick one
+    int journal_data;            // -j: journal the data of files created without VSFS_CREATE_COMPRESS
+    uint32_t commit_ms;          // commit interval of grouped operations
+    int snapshots;
+    struct tracer *trace;        // -R, else NULL
+    uint32_t heat_buckets;       // -H, 0 without heatmaps
+};
+
+static volatile sig_atomic_t stop_requested;
+
+static void die(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void fail(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fputs("vsfsd: ", stderr);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n ? n : 1, size);
+    if (!p) {
+        die("calloc");
+    }
+    return p;
+}
+
+static uint32_t round_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+static void pwrite_full(int fd, const void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, (const uint8_t *)buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            die("pwrite");
+        }
+        done += (size_t)n;
+    }
+}
+
+static void read_image(struct vol *v, void *buf, size_t len, off_t off) {
+    if (vsfs_image_pread(&v->img, buf, len, off) != (ssize_t)len) {
+        die("pread");
+    }
+}
+
+static void write_image(struct vol *v, const void *buf, size_t len, off_t off) {
+    if (vsfs_image_pwrite(&v->img, buf, len, off) != (ssize_t)len) {
+        die("pwrite");
+    }
+}
+
+static void flush_image(struct vol *v) {
+    if (vsfs_image_sync(&v->img) < 0) {
+        die("fdatasync");
+    }
+}
+
+/*
+ * Counts `len` bytes at `off` in the heatmap, as every block they touch.
+ * `data` is the class of blocks in the data area: VSFS_HEAT_DATA for the
+ * page cache, VSFS_HEAT_DIR for the metadata cache.
+ */
+static void heat_note(struct vol *v, off_t off, size_t len, enum vsfs_heat_class data, int write) {
+    if (!v->heat.count || len == 0) {
+        return;
+    }
+    uint32_t first = (uint32_t)(off / BLOCK_SIZE);
+    uint32_t last = (uint32_t)((off + (off_t)len - 1) / BLOCK_SIZE);
+    vsfs_heat_note(&v->heat, first, last - first + 1, data, write);
+}
+
+/* ---- I/O scheduling ---- */
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + (uint64_t)ts.tv_nsec / 1000U;
+}
+
+static void io_wake(struct iosched *s) {
+    if (atomic_load(&s->bg_waiting)) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_broadcast(&s->cv);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/*
+ * Brackets a piece of I/O.  Foreground classes never wait.  A background
+ * piece waits until no foreground I/O is in flight, BG_MAX_WAIT_US has
+ * passed, or a foreground thread is waiting for the flush it belongs to,
+ * and in any case until fewer than bg_max background pieces are running.
+ */
+static void io_begin(struct vol *v, enum io_class cls) {
+    struct iosched *s = v->io;
+    if (cls != IO_BACKGROUND) {
+        atomic_fetch_add(&s->inflight[cls], 1);
+        return;
+    }
+    uint64_t deadline = now_us() + BG_MAX_WAIT_US;
+    int delayed = 0;
+    pthread_mutex_lock(&s->lock);
+    atomic_fetch_add(&s->bg_waiting, 1);
+    for (;;) {
+        uint64_t now = now_us();
+        int fg = atomic_load(&s->inflight[IO_COMMIT]) + atomic_load(&s->inflight[IO_READ]) > 0;
+        if (atomic_load(&s->inflight[IO_BACKGROUND]) < s->bg_max &&
+            (!fg || now >= deadline || atomic_load(&v->pc.urgent))) {
+            break;
+        }
+        delayed = 1;
+        uint64_t until = now < deadline ? deadline : now + BG_MAX_WAIT_US;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = (uint64_t)ts.tv_nsec + (until - now) * 1000U;
+        ts.tv_sec += (time_t)(ns / 1000000000U);
+        ts.tv_nsec = (long)(ns % 1000000000U);
+        pthread_cond_timedwait(&s->cv, &s->lock, &ts);
+    }
+    atomic_fetch_sub(&s->bg_waiting, 1);
+    atomic_fetch_add(&s->inflight[IO_BACKGROUND], 1);
+    pthread_mutex_unlock(&s->lock);
+    if (delayed) {
+        atomic_fetch_add(&v->stats->bg_delayed, 1);
+        atomic_fetch_add(&v->totals->bg_delayed, 1);
+    }
+}
+
+static void io_end(struct vol *v, enum io_class cls) {
+    struct iosched *s = v->io;
+    uint32_t left = atomic_fetch_sub(&s->inflight[cls], 1) - 1;
+    if (cls == IO_BACKGROUND || (left == 0 && atomic_load(&s->inflight[cls == IO_COMMIT ? IO_READ : IO_COMMIT]) == 0)) {
+        io_wake(s);
+    }
+}
+
+/* Takes flush_lock for foreground work, hurrying along a background flush that holds it. */
+static void flush_lock_urgent(struct vol *v) {
+    struct pcache *pc = &v->pc;
+    atomic_fetch_add(&pc->urgent, 1);
+    io_wake(v->io);
+    pthread_mutex_lock(&pc->flush_lock);
+    atomic_fetch_sub(&pc->urgent, 1);
+}
+
+/* ---- metadata block cache ---- */
+
+static uint32_t block_hash(const struct vol *v, uint32_t blkno) {
+    return (blkno * 2654435761U) & v->chash_mask;
+}
+
+static void lru_unlink(struct vol *v, struct cblock *cb) {
+    cb->lru_prev->lru_next = cb->lru_next;
+    cb->lru_next->lru_prev = cb->lru_prev;
+    if (cb->queue == Q_A1IN) {
+        v->a1in_count--;
+    }
+}
+
+/* Puts a block at the new end of a queue, or at the old end with `old` set. */
+static void lru_push(struct vol *v, struct cblock *cb, uint8_t queue, int old) {
+    struct cblock *head = queue == Q_AM ? &v->am : &v->a1in;
+    struct cblock *prev = old ? head->lru_prev : head;
+    cb->lru_prev = prev;
+    cb->lru_next = prev->lru_next;
+    prev->lru_next->lru_prev = cb;
+    prev->lru_next = cb;
+    cb->queue = queue;
+    if (queue == Q_A1IN) {
+        v->a1in_count++;
+    }
+}
+
+static uint32_t ghost_hash(const struct vol *v, uint32_t blkno) {
+    return (blkno * 2654435761U) & v->ghash_mask;
+}
+
+static void ghost_unlink(struct vol *v, uint32_t idx) {
+    uint32_t *pp = &v->ghash[ghost_hash(v, v->ghosts[idx].blkno)];
+    while (*pp != idx + 1) {
+        pp = &v->ghosts[*pp - 1].hnext;
+    }
+    *pp = v->ghosts[idx].hnext;
+    v->ghosts[idx].blkno = GHOST_NONE;
+}
+
+/* Remembers a block evicted from A1in, forgetting the oldest ghost. */
+static void ghost_add(struct vol *v, uint32_t blkno) {
+    uint32_t idx = v->ghost_next;
+    v->ghost_next = (idx + 1) % v->nghosts;
+    if (v->ghosts[idx].blkno != GHOST_NONE) {
+        ghost_unlink(v, idx);
+    }
+    uint32_t h = ghost_hash(v, blkno);
+    v->ghosts[idx].blkno = blkno;
+    v->ghosts[idx].hnext = v->ghash[h];
+    v->ghash[h] = idx + 1;
+}
+
+/* Whether a block is remembered in A1out; it is forgotten there either way. */
+static int ghost_take(struct vol *v, uint32_t blkno) {
+    for (uint32_t i = v->ghash[ghost_hash(v, blkno)]; i; i = v->ghosts[i - 1].hnext) {
+        if (v->ghosts[i - 1].blkno == blkno) {
+            ghost_unlink(v, i - 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Whether an image holding `mine` of a shared `used`/`limit` budget should give some back. */
+static int over_budget(const struct budget *b, uint32_t mine, _Atomic uint32_t *used, uint32_t limit) {
+    if (mine > limit) {
+        return 1;
+    }
+    return atomic_load_explicit(used, memory_order_relaxed) > limit && mine > limit / b->nvols;
+}
+
+/* The first block from `cb` towards the new end of its queue that may be evicted, or the queue head. */
+static struct cblock *evictable(const struct vol *v, struct cblock *cb, const struct cblock *head) {
+    while (cb != head && (cb->txn || cb->committed || cb->ckpt_buf || cb->lazy_pprev || cb->last_op == v->op_seq)) {
+        cb = cb->lru_prev;
+    }
+    return cb;
+}
+
+static void cache_evict(struct vol *v) {
+    struct budget *b = v->budget;
+    struct cblock *in = v->a1in.lru_prev;
+    struct cblock *am = v->am.lru_prev;
+    while (over_budget(b, v->cached, &b->meta_used, b->meta_limit)) {
+        in = evictable(v, in, &v->a1in);
+        am = evictable(v, am, &v->am);
+        struct cblock *cb;
+        if (in != &v->a1in && (v->a1in_count > v->cached / 4 || am == &v->am)) {
+            cb = in;
+            in = in->lru_prev;
+            if (!cb->nocache) {
+                ghost_add(v, cb->blkno);
+            }
+        } else if (am != &v->am) {
+            cb = am;
+            am = am->lru_prev;
+        } else {
+            break;
+        }
+        struct cblock **pp = &v->chash[block_hash(v, cb->blkno)];
+        while (*pp != cb) {
+            pp = &(*pp)->hnext;
+        }
+        *pp = cb->hnext;
+        lru_unlink(v, cb);
+        free(cb);
+        v->cached--;
+        atomic_fetch_sub_explicit(&b->meta_used, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * Returns the cached copy of a block, reading it in if needed.  With
+ * `fresh` set the block is about to be fully overwritten, so it is zeroed
+ * instead of read.
+ */
+static struct cblock *cache_get(struct vol *v, uint32_t blkno, int fresh) {
+    struct cblock *cb = v->chash[block_hash(v, blkno)];
+    while (cb && cb->blkno != blkno) {
+        cb = cb->hnext;
+    }
+    if (cb) {
+        if (cb->queue == Q_AM && !v->nocache) {
+            lru_unlink(v, cb);
+            lru_push(v, cb, Q_AM, 0);
+        } else if (cb->nocache && !v->nocache) {
+            // First use by an operation that wants it cached.
+            cb->nocache = 0;
+            lru_unlink(v, cb);
+            lru_push(v, cb, Q_A1IN, 0);
+        }
+        cb->last_op = v->op_seq;
+        if (fresh) {
+            memset(cb->data, 0, BLOCK_SIZE);
+        }
+        return cb;
+    }
+
+    cb = xcalloc(1, sizeof(*cb));
+    cb->blkno = blkno;
+    cb->last_op = v->op_seq;
+    if (!fresh) {
+        io_begin(v, IO_READ);
+        read_image(v, cb->data, BLOCK_SIZE, (off_t)blkno * BLOCK_SIZE);
+        io_end(v, IO_READ);
+        heat_note(v, (off_t)blkno * BLOCK_SIZE, BLOCK_SIZE, VSFS_HEAT_DIR, 0);
+        atomic_fetch_add_explicit(&v->stats->meta_reads, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&v->totals->meta_reads, 1, memory_order_relaxed);
+    }
+    uint32_t h = block_hash(v, blkno);
+    cb->hnext = v->chash[h];
+    v->chash[h] = cb;
+    if (v->nocache) {
+        cb->nocache = 1;
+        lru_push(v, cb, Q_A1IN, 1);
+    } else {
+        lru_push(v, cb, ghost_take(v, blkno) ? Q_AM : Q_A1IN, 0);
+    }
+    v->cached++;
+    atomic_fetch_add_explicit(&v->budget->meta_used, 1, memory_order_relaxed);
+    cache_evict(v);
+    return cb;
+}
+
+/* Adds a block to the running transaction. */
+static void txn_add(struct vol *v, struct cblock *cb) {
+    if (cb->txn == v->tid) {
+        return;
+    }
+    if (cb->lazy_pprev) {
+        *cb->lazy_pprev = cb->lazy_next;
+        if (cb->lazy_next) {
+            cb->lazy_next->lazy_pprev = cb->lazy_pprev;
+        }
+        cb->lazy_pprev = NULL;
+        v->nlazy--;
+    }
+    cb->txn = v->tid;
+    cb->txn_next = v->txn_blocks;
+    v->txn_blocks = cb;
+    v->txn_nblocks++;
+}
+
+static struct inode *inode_get(struct vol *v, uint32_t ino, struct cblock **out) {
+    struct cblock *cb = cache_get(v, v->sb.inode_start + ino / INODES_PER_BLOCK, 0);
+    if (out) {
+        *out = cb;
+    }
+    return (struct inode *)cb->data + (ino % INODES_PER_BLOCK);
+}
+
+/* ---- allocation ---- */
+
+/*
+ * First zero bit at or after `hint` in a bitmap spread over `nblocks`
+ * cached blocks, limited to `limit` valid bits.  Sets it and logs the
+ * bitmap block.  Returns the bit or -1.
+ */
+static int64_t bitmap_alloc(struct vol *v, uint32_t first_block, uint32_t limit, uint32_t hint) {
+    for (uint32_t pass = 0; pass < 2; ++pass) {
+        uint32_t start = pass == 0 ? hint : 0;
+        uint32_t end = pass == 0 ? limit : hint;
+        uint32_t bit = start;
+        while (bit < end) {
+            struct cblock *cb = cache_get(v, first_block + bit / BITS_PER_BLOCK, 0);
+            uint32_t block_end = (bit / BITS_PER_BLOCK + 1) * BITS_PER_BLOCK;
+            if (block_end > end) {
+                block_end = end;
+            }
+            while (bit < block_end) {
+                uint32_t in_block = bit % BITS_PER_BLOCK;
+                if ((in_block % 64) == 0 && bit + 64 <= block_end) {
+                    uint64_t word;
+                    memcpy(&word, cb->data + in_block / 8, sizeof(word));
+                    if (word == ~0ULL) {
+                        bit += 64;
+                        continue;
+                    }
+                }
+                uint8_t mask = (uint8_t)(1U << (in_block % 8));
+                if ((cb->data[in_block / 8] & mask) == 0) {
+                    cb->data[in_block / 8] |= mask;
+                    txn_add(v, cb);
+                    return bit;
+                }
+                bit++;
+            }
+        }
+    }
+    return -1;
+}
+
+static void bitmap_release(struct vol *v, uint32_t first_block, uint32_t bit) {
+    struct cblock *cb = cache_get(v, first_block + bit / BITS_PER_BLOCK, 0);
+    uint32_t in_block = bit % BITS_PER_BLOCK;
+    cb->data[in_block / 8] &= (uint8_t)~(1U << (in_block % 8));
+    txn_add(v, cb);
+}
+
+static int alloc_inode(struct vol *v, uint32_t *ino) {
+    int64_t bit = bitmap_alloc(v, v->sb.inode_bitmap, v->sb.inode_count, v->inode_hint);
+    if (bit < 0) {
+        return -ENOSPC;
+    }
+    v->inode_hint = (uint32_t)bit + 1;
+    *ino = (uint32_t)bit;
+    return 0;
+}
+
+static void free_inode(struct vol *v, uint32_t ino) {
+    bitmap_release(v, v->sb.inode_bitmap, ino);
+    if (ino < v->inode_hint) {
+        v->inode_hint = ino;
+    }
+}
+
+/* References to a data block, from the refcount table of a deduplicating image. */
+static uint16_t *ref_slot(struct vol *v, uint32_t blkno, struct cblock **out) {
+    uint32_t i = blkno - v->sb.data_start;
+    struct cblock *cb = cache_get(v, v->sb.refcount_start + i / REFS_PER_BLOCK, 0);
+    *out = cb;
+    return (uint16_t *)cb->data + i % REFS_PER_BLOCK;
+}
+
+static uint16_t ref_get(struct vol *v, uint32_t blkno) {
+    struct cblock *cb;
+    return *ref_slot(v, blkno, &cb);
+}
+
+static uint16_t ref_add(struct vol *v, uint32_t blkno, int delta) {
+    struct cblock *cb;
+    uint16_t *ref = ref_slot(v, blkno, &cb);
+    *ref = (uint16_t)(*ref + delta);
+    txn_add(v, cb);
+    return *ref;
+}
+
+static void fp_remove(struct vol *v, uint32_t blkno);
+
+static uint32_t pin_hash(const struct vol *v, uint32_t blkno) {
+    return (blkno * 2654435761U) & v->phash_mask;
+}
+
+static int is_pinned(const struct vol *v, uint32_t blkno) {
+    if (!v->npinned) {
+        return 0;
+    }
+    for (uint32_t i = v->phash[pin_hash(v, blkno)]; i; i = v->pinned[i - 1].hnext) {
+        if (v->pinned[i - 1].blkno == blkno) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Chains every pin again, after the array grew or was compacted. */
+static void pin_rehash(struct vol *v) {
+    memset(v->phash, 0, ((size_t)v->phash_mask + 1) * sizeof(*v->phash));
+    for (uint32_t i = 0; i < v->npinned; ++i) {
+        uint32_t h = pin_hash(v, v->pinned[i].blkno);
+        v->pinned[i].hnext = v->phash[h];
+        v->phash[h] = i + 1;
+    }
+}
+
+static void pin_block(struct vol *v, uint32_t blkno, int logged) {
+    if (v->npinned == v->pinned_cap) {
+        v->pinned_cap = v->pinned_cap ? v->pinned_cap * 2 : 64;
+        v->pinned = realloc(v->pinned, v->pinned_cap * sizeof(*v->pinned));
+        free(v->phash);
+        v->phash_mask = v->pinned_cap - 1;
+        v->phash = malloc(v->pinned_cap * sizeof(*v->phash));
+        if (!v->pinned || !v->phash) {
+            die("realloc");
+        }
+        pin_rehash(v);
+    }
+    uint32_t h = pin_hash(v, blkno);
+    v->pinned[v->npinned].blkno = blkno;
+    v->pinned[v->npinned].hnext = v->phash[h];
+    v->pinned[v->npinned].tid = v->tid;
+    v->pinned[v->npinned].logged = logged;
+    v->phash[h] = ++v->npinned;
+}
+
+/* Drops the pins that `done` says are no longer needed. */
+static void unpin(struct vol *v, int (*done)(const struct vol *, const struct pinned *)) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < v->npinned; ++i) {
+        if (!done(v, &v->pinned[i])) {
+            v->pinned[kept++] = v->pinned[i];
+        }
+    }
+    if (kept != v->npinned) {
+        v->npinned = kept;
+        pin_rehash(v);
+    }
+}
+
+static int pin_checkpointed(const struct vol *v, const struct pinned *p) {
+    return p->tid < v->tid;
+}
+
+static int pin_durable(const struct vol *v, const struct pinned *p) {
+    return !p->logged && p->tid <= v->durable_tid;
+}
+
+static int alloc_data(struct vol *v, uint32_t *blkno) {
+    uint32_t hint = v->data_hint;
+    for (uint32_t tries = 0; tries <= v->npinned; ++tries) {
+        int64_t bit = bitmap_alloc(v, v->sb.data_bitmap, v->data_blocks, hint);
+        if (bit < 0) {
+            return -ENOSPC;
+        }
+        uint32_t blk = v->sb.data_start + (uint32_t)bit;
+        if (is_pinned(v, blk)) {
+            bitmap_release(v, v->sb.data_bitmap, (uint32_t)bit);
+            hint = (uint32_t)bit + 1 < v->data_blocks ? (uint32_t)bit + 1 : 0;
+            continue;
+        }
+        v->data_hint = (uint32_t)bit + 1;
+        if (v->dedup) {
+            ref_add(v, blk, 1);
+        }
+        *blkno = blk;
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+/*
+ * Drops one reference to a data block and frees it once none are left,
+ * pinned until the transaction is durable, or with `logged` until the
+ * checkpoint after it.
+ */
+static void release_data(struct vol *v, uint32_t blkno, int logged) {
+    if (v->dedup) {
+        if (ref_add(v, blkno, -1) > 0) {
+            return;
+        }
+        fp_remove(v, blkno);
+    }
+    pin_block(v, blkno, logged);
+    uint32_t bit = blkno - v->sb.data_start;
+    bitmap_release(v, v->sb.data_bitmap, bit);
+    if (bit < v->data_hint) {
+        v->data_hint = bit;
+    }
+}
+
+static void free_data(struct vol *v, uint32_t blkno) {
+    release_data(v, blkno, 0);
+}
+
+/* A directory block, or a block of a file whose data is journaled. */
+static void free_logged_block(struct vol *v, uint32_t blkno) {
+    release_data(v, blkno, 1);
+}
+
+/*
+ * Allocates `n` adjacent data blocks, the first free run at or after the
+ * allocation hint (runs do not wrap around the end of the region).
+ * Returns the first block in `*first`, or -ENOSPC if no run is that long.
+ */
+static int alloc_data_run(struct vol *v, uint32_t n, uint32_t *first) {
+    uint32_t run = 0;
+    struct cblock *cb = NULL;
+    uint32_t i = 0;
+    while (i < v->data_blocks) {
+        uint32_t bit = (v->data_hint + i) % v->data_blocks;
+        if (bit == 0) {
+            run = 0;
+        }
+        if (!cb || bit % BITS_PER_BLOCK == 0) {
+            cb = cache_get(v, v->sb.data_bitmap + bit / BITS_PER_BLOCK, 0);
+        }
+        uint32_t in_block = bit % BITS_PER_BLOCK;
+        if ((in_block % 64) == 0 && bit + 64 <= v->data_blocks) {
+            uint64_t word;
+            memcpy(&word, cb->data + in_block / 8, sizeof(word));
+            if (word == ~0ULL) {
+                run = 0;
+                i += 64;
+                continue;
+            }
+        }
+        i++;
+        if ((cb->data[in_block / 8] >> (in_block % 8)) & 1U || is_pinned(v, v->sb.data_start + bit)) {
+            run = 0;
+            continue;
+        }
+        if (++run < n) {
+            continue;
+        }
+        uint32_t start = bit + 1 - n;
+        for (uint32_t b = start; b <= bit; ++b) {
+            struct cblock *bcb = cache_get(v, v->sb.data_bitmap + b / BITS_PER_BLOCK, 0);
+            bcb->data[(b % BITS_PER_BLOCK) / 8] |= (uint8_t)(1U << (b % 8));
+            txn_add(v, bcb);
+            if (v->dedup) {
+                ref_add(v, v->sb.data_start + b, 1);
+            }
+        }
+        v->data_hint = bit + 1 < v->data_blocks ? bit + 1 : 0;
+        *first = v->sb.data_start + start;
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+
+/* ---- directory index ---- */
+
+static uint32_t name_hash(uint32_t dir, const char *name) {
+    uint32_t h = 2166136261U ^ dir;
+    for (const char *p = name; *p; ++p) {
+        h = (h ^ (uint8_t)*p) * 16777619U;
+    }
+    return h;
+}
+
+static void dindex_insert(struct vol *v, uint32_t dir, const char *name, uint32_t ino, uint32_t slot) {
+    if (v->dcount >= v->dhash_mask) {
+        uint32_t new_mask = v->dhash_mask * 2 + 1;
+        struct dentry **nh = xcalloc((size_t)new_mask + 1, sizeof(*nh));
+        for (uint32_t b = 0; b <= v->dhash_mask; ++b) {
+            struct dentry *de = v->dhash[b];
+            while (de) {
+                struct dentry *next = de->next;
+                uint32_t h = name_hash(de->dir, de->name) & new_mask;
+                de->next = nh[h];
+                nh[h] = de;
+                de = next;
+            }
+        }
+        free(v->dhash);
+        v->dhash = nh;
+        v->dhash_mask = new_mask;
+    }
+    struct dentry *de = xcalloc(1, sizeof(*de));
+    de->dir = dir;
+    de->ino = ino;
+    de->slot = slot;
+    memcpy(de->name, name, NAME_LEN);
+    de->name[NAME_LEN - 1] = '\0';
+    uint32_t h = name_hash(dir, de->name) & v->dhash_mask;
+    de->next = v->dhash[h];
+    v->dhash[h] = de;
+    v->dcount++;
+}
+
+static void dindex_remove(struct vol *v, struct dentry *victim) {
+    struct dentry **pp = &v->dhash[name_hash(victim->dir, victim->name) & v->dhash_mask];
+    while (*pp != victim) {
+        pp = &(*pp)->next;
+    }
+    *pp = victim->next;
+    free(victim);
+    v->dcount--;
+}
+
+static struct dirinfo *dir_info(struct vol *v, uint32_t ino) {
+    struct dirinfo *di = v->dirs[ino & v->dirs_mask];
+    while (di && di->ino != ino) {
+        di = di->next;
+    }
+    return di;
+}
+
+/* Loads a directory's entries into the index the first time it is used. */
+static struct dirinfo *dir_open(struct vol *v, uint32_t dir) {
+    struct dirinfo *di = dir_info(v, dir);
+    if (di) {
+        return di;
+    }
+    struct inode node = *inode_get(v, dir, NULL);
+    di = xcalloc(1, sizeof(*di));
+    di->ino = dir;
+    di->free_hint = UINT32_MAX;
+
+    uint32_t slots = node.size / sizeof(struct dirent);
+    for (uint32_t s = 0; s < slots; ++s) {
+        uint32_t blk = node.direct[s / DIRENTS_PER_BLOCK];
+        if (blk == 0) {
+            break;
+        }
+        struct cblock *cb = cache_get(v, blk, 0);
+        const struct dirent *de = (const struct dirent *)cb->data + (s % DIRENTS_PER_BLOCK);
+        if (de->inode == 0 && de->name[0] == '\0') {
+            if (s < di->free_hint) {
+                di->free_hint = s;
+            }
+            continue;
+        }
+        dindex_insert(v, dir, de->name, de->inode, s);
+    }
+    di->next = v->dirs[dir & v->dirs_mask];
+    v->dirs[dir & v->dirs_mask] = di;
+    return di;
+}
+
+static struct dentry *dir_lookup(struct vol *v, uint32_t dir, const char *name) {
+    dir_open(v, dir);
+    struct dentry *de = v->dhash[name_hash(dir, name) & v->dhash_mask];
+    while (de && (de->dir != dir || strcmp(de->name, name) != 0)) {
+        de = de->next;
+    }
+    return de;
+}
+
+/*
+ * Adds `name -> ino` to a directory, reusing the first free slot or
+ * appending, and growing the directory by one block when needed.
+ */
+static int dir_add(struct vol *v, uint32_t dir, const char *name, uint32_t ino, uint32_t now) {
+    struct dirinfo *di = dir_open(v, dir);
+    struct cblock *dir_icb;
+    struct inode *dnode = inode_get(v, dir, &dir_icb);
+    uint32_t slots = dnode->size / sizeof(struct dirent);
+
+    uint32_t slot = UINT32_MAX;
+    if (di->free_hint < slots) {
+        for (uint32_t s = di->free_hint; s < slots; ++s) {
+            struct cblock *cb = cache_get(v, dnode->direct[s / DIRENTS_PER_BLOCK], 0);
+            const struct dirent *de = (const struct dirent *)cb->data + (s % DIRENTS_PER_BLOCK);
+            if (de->inode == 0 && de->name[0] == '\0') {
+                slot = s;
+                break;
+            }
+        }
+    }
+    if (slot == UINT32_MAX) {
+        slot = slots;
+    }
+    di->free_hint = slot + 1 < slots ? slot + 1 : UINT32_MAX;
+
+    uint32_t dslot = slot / DIRENTS_PER_BLOCK;
+    if (dslot >= DIRECT_POINTERS) {
+        return -ENOSPC;
+    }
+    struct cblock *dcb;
+    if (dnode->direct[dslot] == 0) {
+        uint32_t blk;
+        int rc = alloc_data(v, &blk);
+        if (rc < 0) {
+            return rc;
+        }
+        dnode->direct[dslot] = blk;
+        dcb = cache_get(v, blk, 1);
+    } else {
+        dcb = cache_get(v, dnode->direct[dslot], 0);
+    }
+
+    struct dirent *de = (struct dirent *)dcb->data + (slot % DIRENTS_PER_BLOCK);
+    memset(de, 0, sizeof(*de));
+    de->inode = ino;
+    memcpy(de->name, name, strlen(name));
+    txn_add(v, dcb);
+
+    if (slot >= slots) {
+        dnode->size = (slot + 1) * (uint32_t)sizeof(struct dirent);
+    }
+    dnode->mtime = now;
+    txn_add(v, dir_icb);
+
+    dindex_insert(v, dir, name, ino, slot);
+    return 0;
+}
+
+/* ---- namespace operations ---- */
+
+static int valid_name(const char *name) {
+    size_t len = strlen(name);
+    return len > 0 && len < NAME_LEN && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/* Walks `path` from the root, one component at a time. */
+static int resolve(struct vol *v, const char *path, uint32_t *out) {
+    char buf[VSFS_PATH_MAX];
+    memcpy(buf, path, VSFS_PATH_MAX);
+    buf[VSFS_PATH_MAX - 1] = '\0';
+
+    uint32_t cur = 0;
+    char *save = NULL;
+    for (char *comp = strtok_r(buf, "/", &save); comp; comp = strtok_r(NULL, "/", &save)) {
+        if (inode_get(v, cur, NULL)->type != 2) {
+            return -ENOTDIR;
+        }
+        if (strlen(comp) >= NAME_LEN) {
+            return -ENAMETOOLONG;
+        }
+        struct dentry *de = dir_lookup(v, cur, comp);
+        if (!de) {
+            return -ENOENT;
+        }
+        cur = de->ino;
+    }
+    *out = cur;
+    return 0;
+}
+
+/* Splits "a/b/c" into the inode of "a/b" and the leaf name "c". */
+static int resolve_parent(struct vol *v, const char *path, uint32_t *parent, char *leaf) {
+    char buf[VSFS_PATH_MAX];
+    memcpy(buf, path, VSFS_PATH_MAX);
+    buf[VSFS_PATH_MAX - 1] = '\0';
+
+    size_t len = strlen(buf);
+    while (len > 0 && buf[len - 1] == '/') {
+        buf[--len] = '\0';
+    }
+    char *slash = strrchr(buf, '/');
+    const char *name = slash ? slash + 1 : buf;
+    if (strlen(name) >= NAME_LEN) {
+        return -ENAMETOOLONG;
+    }
+    if (!valid_name(name)) {
+        return -EINVAL;
+    }
+    strcpy(leaf, name);
+    if (slash) {
+        *slash = '\0';
+    }
+    int rc = resolve(v, slash ? buf : "", parent);
+    if (rc < 0) {
+        return rc;
+    }
+    if (inode_get(v, *parent, NULL)->type != 2) {
+        return -ENOTDIR;
+    }
+    return 0;
+}
+
+static int op_create(struct vol *v, const char *path, uint16_t type, uint16_t flags, uint32_t *out) {
+    uint32_t parent;
+    char leaf[NAME_LEN];
+    int rc = resolve_parent(v, path, &parent, leaf);
+    if (rc < 0) {
+        return rc;
+    }
+    if (dir_lookup(v, parent, leaf)) {
+        return -EEXIST;
+    }
+
+    uint32_t ino;
+    rc = alloc_inode(v, &ino);
+    if (rc < 0) {
+        return rc;
+    }
+    uint32_t now = (uint32_t)time(NULL);
+
+    uint32_t dir_blk = 0;
+    if (type == 2) {
+        rc = alloc_data(v, &dir_blk);
+        if (rc < 0) {
+            free_inode(v, ino);
+            return rc;
+        }
+        struct cblock *dcb = cache_get(v, dir_blk, 1);
+        struct dirent *de = (struct dirent *)dcb->data;
+        de[0].inode = ino;
+        strcpy(de[0].name, ".");
+        de[1].inode = parent;
+        strcpy(de[1].name, "..");
+        txn_add(v, dcb);
+    }
+
+    struct cblock *icb;
+    struct inode *node = inode_get(v, ino, &icb);
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->links = type == 2 ? 2 : 1;
+    node->flags = flags;
+    node->ctime = now;
+    node->mtime = now;
+    if (type == 2) {
+        node->size = 2 * sizeof(struct dirent);
+        node->direct[0] = dir_blk;
+    }
+    txn_add(v, icb);
+
+    // dir_add() changes nothing when it fails, so only our allocations need undoing.
+    rc = dir_add(v, parent, leaf, ino, now);
+    if (rc < 0) {
+        memset(node, 0, sizeof(*node));
+        free_inode(v, ino);
+        if (dir_blk) {
+            free_data(v, dir_blk);
+        }
+        return rc;
+    }
+    if (type == 2) {
+        struct cblock *pcb;
+        inode_get(v, parent, &pcb)->links++;
+        txn_add(v, pcb);
+    }
+    v->ino_tid[ino] = v->tid;
+    v->ino_tid[parent] = v->tid;
+    *out = ino;
+    return 0;
+}
+
+/* ---- file data cache ---- */
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000U + (uint64_t)ts.tv_nsec / 1000000U;
+}
+
+static uint32_t page_hash(const struct pcache *pc, uint32_t ino, uint32_t index) {
+    return ((ino * 2654435761U) ^ (index * 40503U)) & pc->hash_mask;
+}
+
+static void plist_unlink_lru(struct page *pg) {
+    pg->lru_prev->lru_next = pg->lru_next;
+    pg->lru_next->lru_prev = pg->lru_prev;
+}
+
+static void plist_push_lru(struct pcache *pc, struct page *pg) {
+    pg->lru_next = pc->lru.lru_next;
+    pg->lru_prev = &pc->lru;
+    pc->lru.lru_next->lru_prev = pg;
+    pc->lru.lru_next = pg;
+}
+
+static void page_mark_dirty(struct pcache *pc, struct page *pg) {
+    pg->gen++;
+    pc->seq++;
+    if (pg->dirty) {
+        return;
+    }
+    pg->dirty = 1;
+    pg->dirty_since = now_ms();
+    pg->dirty_seq = pc->seq;
+    pg->dirty_prev = pc->dirty.dirty_prev;
+    pg->dirty_next = &pc->dirty;
+    pc->dirty.dirty_prev->dirty_next = pg;
+    pc->dirty.dirty_prev = pg;
+    pc->ndirty++;
+    struct budget *b = pc->budget;
+    if (atomic_fetch_add_explicit(&b->dirty, 1, memory_order_relaxed) + 1 == b->dirty_bg) {
+        pthread_mutex_lock(&b->lock);
+        pthread_cond_signal(&b->wake);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+static void page_mark_clean(struct pcache *pc, struct page *pg) {
+    if (!pg->dirty) {
+        return;
+    }
+    pg->dirty = 0;
+    pg->order_tid = 0;
+    pg->dirty_prev->dirty_next = pg->dirty_next;
+    pg->dirty_next->dirty_prev = pg->dirty_prev;
+    pc->ndirty--;
+    atomic_fetch_sub_explicit(&pc->budget->dirty, 1, memory_order_relaxed);
+}
+
+/* Drops clean pages from the cold end until the cache is within its budget. */
+static void page_evict(struct pcache *pc) {
+    struct budget *b = pc->budget;
+    struct page *pg = pc->lru.lru_prev;
+    while (over_budget(b, pc->count, &b->pages_used, b->pages_limit) && pg != &pc->lru) {
+        struct page *prev = pg->lru_prev;
+        if (!pg->dirty) {
+            struct page **pp = &pc->hash[page_hash(pc, pg->ino, pg->index)];
+            while (*pp != pg) {
+                pp = &(*pp)->hnext;
+            }
+            *pp = pg->hnext;
+            plist_unlink_lru(pg);
+            free(pg);
+            pc->count--;
+            atomic_fetch_sub_explicit(&b->pages_used, 1, memory_order_relaxed);
+        }
+        pg = prev;
+    }
+}
+
+/*
+ * Removes the page `*pp` points to from its hash chain and the cache,
+ * dirty or not.  Caller holds flush_lock, so no flush is using it.
+ */
+static void page_drop(struct pcache *pc, struct page **pp) {
+    struct page *pg = *pp;
+    *pp = pg->hnext;
+    page_mark_clean(pc, pg);
+    plist_unlink_lru(pg);
+    free(pg);
+    pc->count--;
+    atomic_fetch_sub_explicit(&pc->budget->pages_used, 1, memory_order_relaxed);
+}
+
+static struct page *page_lookup(struct pcache *pc, uint32_t ino, uint32_t index) {
+    struct page *pg = pc->hash[page_hash(pc, ino, index)];
+    while (pg && (pg->ino != ino || pg->index != index)) {
+        pg = pg->hnext;
+    }
+    return pg;
+}
+
+/*
+ * Finds or creates the page for (ino, index) backed by `blkno`.  Existing
+ * blocks are read in unless the caller is about to overwrite all of it.
+ * Called with pc->lock held.
+ */
+static struct page *page_get(struct vol *v, uint32_t ino, uint32_t index, uint32_t blkno, int fill) {
+    struct pcache *pc = &v->pc;
+    struct page *pg = page_lookup(pc, ino, index);
+    if (pg) {
+        plist_unlink_lru(pg);
+        plist_push_lru(pc, pg);
+        return pg;
+    }
+    pg = xcalloc(1, sizeof(*pg));
+    pg->ino = ino;
+    pg->index = index;
+    pg->blkno = blkno;
+    if (fill) {
+        io_begin(v, IO_READ);
+        read_image(v, pg->data, BLOCK_SIZE, (off_t)blkno * BLOCK_SIZE);
+        io_end(v, IO_READ);
+        heat_note(v, (off_t)blkno * BLOCK_SIZE, BLOCK_SIZE, VSFS_HEAT_DATA, 0);
+    }
+    uint32_t h = page_hash(pc, ino, index);
+    pg->hnext = pc->hash[h];
+    pc->hash[h] = pg;
+    plist_push_lru(pc, pg);
+    pc->count++;
+    atomic_fetch_add_explicit(&pc->budget->pages_used, 1, memory_order_relaxed);
+    page_evict(pc);
+    return pg;
+}
+
+static uint32_t zc_hash(const struct vol *v, uint32_t ino, uint32_t cluster) {
+    return ((ino * 2654435761U) ^ (cluster * 40503U)) & v->zhash_mask;
+}
+
+static struct zcluster *zc_lookup(struct vol *v, uint32_t ino, uint32_t cluster) {
+    struct zcluster *zc = v->zhash[zc_hash(v, ino, cluster)];
+    while (zc && (zc->ino != ino || zc->cluster != cluster)) {
+        zc = zc->hnext;
+    }
+    return zc;
+}
+
+static void zc_unlink_lru(struct zcluster *zc) {
+    zc->lru_prev->lru_next = zc->lru_next;
+    zc->lru_next->lru_prev = zc->lru_prev;
+}
+
+static void zc_push_lru(struct vol *v, struct zcluster *zc) {
+    zc->lru_next = v->zlru.lru_next;
+    zc->lru_prev = &v->zlru;
+    v->zlru.lru_next->lru_prev = zc;
+    v->zlru.lru_next = zc;
+}
+
+static void zc_drop(struct vol *v, struct zcluster *zc) {
+    struct zcluster **pp = &v->zhash[zc_hash(v, zc->ino, zc->cluster)];
+    while (*pp != zc) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = zc->hnext;
+    zc_unlink_lru(zc);
+    free(zc);
+    v->zcount--;
+    atomic_fetch_sub_explicit(&v->budget->clusters_used, 1, memory_order_relaxed);
+}
+
+static void zc_evict(struct vol *v) {
+    struct budget *b = v->budget;
+    while (over_budget(b, v->zcount, &b->clusters_used, b->clusters_limit) && v->zlru.lru_prev != &v->zlru) {
+        zc_drop(v, v->zlru.lru_prev);
+    }
+}
+
+/* A zeroed cache entry for a cluster that is not cached yet. */
+static struct zcluster *zc_insert(struct vol *v, uint32_t ino, uint32_t cluster) {
+    zc_evict(v);
+    struct zcluster *zc = xcalloc(1, sizeof(*zc));
+    zc->ino = ino;
+    zc->cluster = cluster;
+    uint32_t h = zc_hash(v, ino, cluster);
+    zc->hnext = v->zhash[h];
+    v->zhash[h] = zc;
+    zc_push_lru(v, zc);
+    v->zcount++;
+    atomic_fetch_add_explicit(&v->budget->clusters_used, 1, memory_order_relaxed);
+    return zc;
+}
+
+/* Discards the cached clusters of a file that is being removed. */
+static void zc_forget(struct vol *v, uint32_t ino) {
+    for (uint32_t c = 0; c < CLUSTERS; ++c) {
+        struct zcluster *zc = zc_lookup(v, ino, c);
+        if (zc) {
+            zc_drop(v, zc);
+        }
+    }
+}
+
+/*
+ * Cluster `c` of a compressed file, decompressed.  Stored blocks are read
+ * through the page cache, which may hold some not yet written back.  The
+ * result is only valid until the next call.  Called with v->lock held.
+ */
+static int cluster_get(struct vol *v, uint32_t ino, const struct inode *node, uint32_t c, struct zcluster **out) {
+    struct zcluster *zc = zc_lookup(v, ino, c);
+    if (zc) {
+        zc_unlink_lru(zc);
+        zc_push_lru(v, zc);
+        *out = zc;
+        return 0;
+    }
+    uint32_t stored = node->cmap[c] & CLUSTER_LEN_MASK;
+    if (stored > CLUSTER_SIZE) {
+        return -EIO;
+    }
+    struct pcache *pc = &v->pc;
+    pthread_mutex_lock(&pc->lock);
+    for (uint32_t k = 0; k * BLOCK_SIZE < stored; ++k) {
+        uint32_t idx = c * CLUSTER_BLOCKS + k;
+        if (node->direct[idx] == 0) {
+            pthread_mutex_unlock(&pc->lock);
+            return -EIO;
+        }
+        struct page *pg = page_get(v, ino, idx, node->direct[idx], 1);
+        memcpy(v->zstage + (size_t)k * BLOCK_SIZE, pg->data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    zc = zc_insert(v, ino, c);
+    if (node->cmap[c] & CLUSTER_RAW) {
+        memcpy(zc->data, v->zstage, stored);
+    } else if (stored && vsfs_lz_decompress(v->zstage, stored, zc->data, CLUSTER_SIZE) < 0) {
+        zc_drop(v, zc);
+        return -EIO;
+    }
+    *out = zc;
+    return 0;
+}
+
+static uint64_t fp_hash(const uint8_t *data) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    for (uint32_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+static void fp_insert(struct vol *v, uint32_t blkno, uint64_t hash) {
+    struct fpindex *fp = &v->fp;
+    uint32_t i = blkno - v->sb.data_start;
+    pthread_mutex_lock(&fp->lock);
+    if (!fp->indexed[i]) {
+        uint32_t b = (uint32_t)hash & fp->mask;
+        fp->hash[i] = hash;
+        fp->next[i] = fp->heads[b];
+        fp->heads[b] = i + 1;
+        fp->indexed[i] = 1;
+    }
+    pthread_mutex_unlock(&fp->lock);
+}
+
+static void fp_remove(struct vol *v, uint32_t blkno) {
+    struct fpindex *fp = &v->fp;
+    uint32_t i = blkno - v->sb.data_start;
+    pthread_mutex_lock(&fp->lock);
+    if (fp->indexed[i]) {
+        uint32_t *link = &fp->heads[(uint32_t)fp->hash[i] & fp->mask];
+        while (*link != i + 1) {
+            link = &fp->next[*link - 1];
+        }
+        *link = fp->next[i];
+        fp->indexed[i] = 0;
+    }
+    pthread_mutex_unlock(&fp->lock);
+}
+
+/*
+ * A data block holding exactly `data`, or 0.  Fingerprint matches are
+ * confirmed against the block on disk, which indexed blocks are known to
+ * hold.  Called with v->lock held, so no candidate can change meanwhile.
+ */
+static uint32_t fp_find(struct vol *v, const uint8_t *data) {
+    struct fpindex *fp = &v->fp;
+    uint64_t hash = fp_hash(data);
+    uint32_t cand[8];
+    uint32_t n = 0;
+    pthread_mutex_lock(&fp->lock);
+    for (uint32_t i = fp->heads[(uint32_t)hash & fp->mask]; i && n < 8; i = fp->next[i - 1]) {
+        if (fp->hash[i - 1] == hash) {
+            cand[n++] = v->sb.data_start + i - 1;
+        }
+    }
+    pthread_mutex_unlock(&fp->lock);
+
+    uint8_t block[BLOCK_SIZE];
+    for (uint32_t k = 0; k < n; ++k) {
+        io_begin(v, IO_READ);
+        read_image(v, block, BLOCK_SIZE, (off_t)cand[k] * BLOCK_SIZE);
+        io_end(v, IO_READ);
+        heat_note(v, (off_t)cand[k] * BLOCK_SIZE, BLOCK_SIZE, VSFS_HEAT_DATA, 0);
+        if (memcmp(block, data, BLOCK_SIZE) == 0 && ref_get(v, cand[k]) < REF_MAX) {
+            return cand[k];
+        }
+    }
+    return 0;
+}
+
+static int cmp_page(const void *a, const void *b) {
+    uint32_t x = (*(struct page *const *)a)->blkno;
+    uint32_t y = (*(struct page *const *)b)->blkno;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Writes a batch of dirty pages chosen by `pick`, sorted by block and
+ * merged into vectored writes.  Page contents and blocks are staged under
+ * the lock so writers can keep dirtying (or moving) pages during the I/O;
+ * a page that changed in the meantime stays dirty.  On a deduplicating
+ * image the pages written are fingerprinted.  Each vectored write is
+ * scheduled as `cls`.  Caller holds flush_lock but not lock.  Returns the
+ * number of pages written.
+ */
+static uint32_t flush_pages(struct vol *v, int (*pick)(const struct page *, uint64_t), uint64_t arg,
+                            enum io_class cls) {
+    struct pcache *pc = &v->pc;
+    struct page *batch[FLUSH_BATCH];
+    uint64_t gens[FLUSH_BATCH];
+    uint32_t blks[FLUSH_BATCH];
+    uint64_t hashes[FLUSH_BATCH];
+    uint32_t n = 0;
+
+    pthread_mutex_lock(&pc->lock);
+    uint64_t staged = pc->seq;
+    for (struct page *pg = pc->dirty.dirty_next; pg != &pc->dirty && n < FLUSH_BATCH; pg = pg->dirty_next) {
+        if (pick(pg, arg)) {
+            batch[n++] = pg;
+        }
+    }
+    qsort(batch, n, sizeof(batch[0]), cmp_page);
+    for (uint32_t i = 0; i < n; ++i) {
+        memcpy(pc->staging + (size_t)i * BLOCK_SIZE, batch[i]->data, BLOCK_SIZE);
+        gens[i] = batch[i]->gen;
+        blks[i] = batch[i]->blkno;
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    struct iovec iov[64];
+    uint32_t i = 0;
+    while (i < n) {
+        uint32_t run = 0;
+        while (i + run < n && run < 64 && blks[i + run] == blks[i] + run) {
+            iov[run].iov_base = pc->staging + (size_t)(i + run) * BLOCK_SIZE;
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        }
+        off_t off = (off_t)blks[i] * BLOCK_SIZE;
+        io_begin(v, cls);
+        if (vsfs_image_pwritev(&v->img, iov, (int)run, off) != (ssize_t)run * BLOCK_SIZE) {
+            for (uint32_t k = 0; k < run; ++k) {
+                write_image(v, iov[k].iov_base, BLOCK_SIZE, (off_t)blks[i + k] * BLOCK_SIZE);
+            }
+        }
+        io_end(v, cls);
+        heat_note(v, off, (size_t)run * BLOCK_SIZE, VSFS_HEAT_DATA, 1);
+        i += run;
+    }
+    for (uint32_t k = 0; v->dedup && k < n; ++k) {
+        hashes[k] = fp_hash(pc->staging + (size_t)k * BLOCK_SIZE);
+    }
+    atomic_fetch_add(&v->stats->data_blocks, n);
+    atomic_fetch_add(&v->totals->data_blocks, n);
+
+    // Indexing under the lock orders it against writers, which drop a
+    // block from the index while holding the lock too.
+    pthread_mutex_lock(&pc->lock);
+    for (uint32_t k = 0; k < n; ++k) {
+        if (batch[k]->gen == gens[k]) {
+            page_mark_clean(pc, batch[k]);
+            if (v->dedup) {
+                fp_insert(v, blks[k], hashes[k]);
+            }
+        } else {
+            batch[k]->dirty_seq = staged + 1;   // what is left was written after staging
+        }
+    }
+    page_evict(pc);
+    pthread_mutex_unlock(&pc->lock);
+    return n;
+}
+
+static int pick_any(const struct page *pg, uint64_t arg) {
+    (void)pg;
+    (void)arg;
+    return 1;
+}
+
+static int pick_expired(const struct page *pg, uint64_t cutoff) {
+    return pg->dirty_since <= cutoff;
+}
+
+static int pick_ordered(const struct page *pg, uint64_t tid) {
+    return pg->order_tid != 0 && pg->order_tid <= tid;
+}
+
+static int pick_ino(const struct page *pg, uint64_t ino) {
+    return pg->ino == ino;
+}
+
+static int pick_before(const struct page *pg, uint64_t seq) {
+    return pg->dirty_seq <= seq;
+}
+
+/* Writes every page the given transaction's metadata depends on. */
+static void flush_ordered(struct vol *v, uint64_t tid) {
+    struct pcache *pc = &v->pc;
+    flush_lock_urgent(v);
+    while (flush_pages(v, pick_ordered, tid, IO_COMMIT) == FLUSH_BATCH) {
+    }
+    pthread_mutex_unlock(&pc->flush_lock);
+}
+
+/*
+ * Writes every page changed by the time the page cache had seen `seq`
+ * writes.  Pages dirtied later, even during the flush, are left for the
+ * next one, so writers cannot keep a sync from finishing.
+ */
+static void flush_all(struct vol *v, uint64_t seq) {
+    struct pcache *pc = &v->pc;
+    flush_lock_urgent(v);
+    while (flush_pages(v, pick_before, seq, IO_COMMIT) == FLUSH_BATCH) {
+    }
+    pthread_mutex_unlock(&pc->flush_lock);
+}
+
+/* The image with the most dirty pages, or NULL if none has any. */
+static struct vol *dirtiest(struct daemon *d) {
+    struct vol *best = NULL;
+    uint32_t most = 0;
+    for (uint32_t i = 0; i < d->nvols; ++i) {
+        struct pcache *pc = &d->vols[i].pc;
+        pthread_mutex_lock(&pc->lock);
+        if (pc->ndirty > most) {
+            most = pc->ndirty;
+            best = &d->vols[i];
+        }
+        pthread_mutex_unlock(&pc->lock);
+    }
+    return best;
+}
+
+/*
+ * Evicts from images above their share of an overcommitted budget.  A busy
+ * image does this itself on every miss; an idle one only gets here.
+ */
+static void trim_caches(struct daemon *d) {
+    for (uint32_t i = 0; i < d->nvols; ++i) {
+        struct vol *v = &d->vols[i];
+        if (pthread_mutex_trylock(&v->lock) == 0) {
+            cache_evict(v);
+            zc_evict(v);
+            pthread_mutex_unlock(&v->lock);
+        }
+        pthread_mutex_lock(&v->pc.lock);
+        page_evict(&v->pc);
+        pthread_mutex_unlock(&v->pc.lock);
+    }
+}
+
+static void queue_commit(struct daemon *d, struct vol *v);
+
+/*
+ * Writes back an image's expired pages, as a task.  While foreground I/O
+ * is in flight it yields rather than hold a background thread in
+ * io_begin(), until flush_deadline, so commits queued behind it go first.
+ */
+static int flush_task(struct vsfs_task *t) {
+    struct vol *v = (struct vol *)((char *)t - offsetof(struct vol, flush_task));
+    struct iosched *s = v->io;
+    if (atomic_load(&s->inflight[IO_COMMIT]) + atomic_load(&s->inflight[IO_READ]) > 0 &&
+        now_us() < v->flush_deadline) {
+        return VSFS_TASK_YIELD;
+    }
+    pthread_mutex_lock(&v->pc.flush_lock);
+    while (flush_pages(v, pick_expired, v->flush_cutoff, IO_BACKGROUND) == FLUSH_BATCH) {
+    }
+    pthread_mutex_unlock(&v->pc.flush_lock);
+    return VSFS_TASK_DONE;
+}
+
+/*
+ * Background flusher, one for all images: wakes on its interval or when
+ * the dirty count crosses the background threshold, has the background
+ * threads write the pages of every image that have been dirty for longer
+ * than the expiry, then keeps writing from the dirtiest image while above
+ * the threshold.  It also has images commit grouped operations older than
+ * the commit interval and timestamp changes deferred for longer than the
+ * lazytime limit.
+ */
+static void *flusher_main(void *arg) {
+    struct daemon *d = arg;
+    struct budget *b = &d->budget;
+    uint32_t wait_ms = b->interval_ms;
+    if (d->commit_ms && d->commit_ms < wait_ms) {
+        wait_ms = d->commit_ms;
+    }
+    pthread_mutex_lock(&b->lock);
+    while (!b->stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait_ms / 1000U;
+        ts.tv_nsec += (long)(wait_ms % 1000U) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (atomic_load(&b->dirty) < b->dirty_bg) {
+            pthread_cond_timedwait(&b->wake, &b->lock, &ts);
+        }
+        if (b->stop) {
+            break;
+        }
+        pthread_mutex_unlock(&b->lock);
+
+        uint64_t cutoff = now_ms() - b->expire_ms;
+        struct vsfs_group expired = { 0 };
+        for (uint32_t i = 0; i < d->nvols; ++i) {
+            struct vol *v = &d->vols[i];
+            v->flush_cutoff = cutoff;
+            v->flush_deadline = now_us() + BG_MAX_WAIT_US;
+            vsfs_spawn(&d->sched, &expired, &v->flush_task);
+        }
+        vsfs_group_wait(&d->sched, &expired);
+        while (atomic_load(&b->dirty) >= b->dirty_bg) {
+            struct vol *v = dirtiest(d);
+            if (!v) {
+                break;
+            }
+            pthread_mutex_lock(&v->pc.flush_lock);
+            uint32_t n = flush_pages(v, pick_any, 0, IO_BACKGROUND);
+            pthread_mutex_unlock(&v->pc.flush_lock);
+            if (n == 0) {
+                break;
+            }
+        }
+        trim_caches(d);
+
+        uint64_t now = now_ms();
+        for (uint32_t i = 0; i < d->nvols; ++i) {
+            struct vol *v = &d->vols[i];
+            pthread_mutex_lock(&v->lock);
+            if (v->ngroup && now - v->group_since >= d->commit_ms) {
+                queue_commit(d, v);
+            }
+            if (v->lazy_head && now - v->lazy_since >= v->lazy_ms) {
+                v->lazy_flush = 1;
+                queue_commit(d, v);
+            }
+            pthread_mutex_unlock(&v->lock);
+        }
+
+        pthread_mutex_lock(&b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+/*
+ * Like txn_add for a block whose only change is an inode timestamp.  In
+ * lazytime mode the block is put on the lazy list instead of being logged.
+ */
+static void txn_add_lazy(struct vol *v, struct cblock *cb) {
+    if (v->lazy_ms == 0) {
+        txn_add(v, cb);
+        return;
+    }
+    if (cb->txn == v->tid || cb->lazy_pprev) {
+        return;
+    }
+    if (!v->lazy_head) {
+        v->lazy_since = now_ms();
+    }
+    cb->lazy_next = v->lazy_head;
+    cb->lazy_pprev = &v->lazy_head;
+    if (v->lazy_head) {
+        v->lazy_head->lazy_pprev = &cb->lazy_next;
+    }
+    v->lazy_head = cb;
+    v->nlazy++;
+}
+
+/* Resolves the target of a data operation: a path if one is given, else the inode number. */
+static int data_target(struct vol *v, const struct vsfs_sqe *sqe, uint32_t *ino) {
+    if (sqe->path[0] != '\0') {
+        int rc = resolve(v, sqe->path, ino);
+        if (rc < 0) {
+            return rc;
+        }
+    } else {
+        *ino = sqe->ino;
+    }
+    if (*ino >= v->sb.inode_count) {
+        return -EINVAL;
+    }
+    uint16_t type = inode_get(v, *ino, NULL)->type;
+    if (type == 0) {
+        return -ENOENT;
+    }
+    return type == 1 ? 0 : -EISDIR;
+}
+
+/*
+ * Resolves the target of an fsync, which may also be a directory.  A
+ * timestamp change of its inode waiting on the lazy list goes into the
+ * running transaction, since the fsync has to make that durable too.
+ */
+static int fsync_target(struct vol *v, const struct vsfs_sqe *sqe, uint32_t *ino) {
+    if (sqe->path[0] != '\0') {
+        int rc = resolve(v, sqe->path, ino);
+        if (rc < 0) {
+            return rc;
+        }
+    } else {
+        *ino = sqe->ino;
+    }
+    if (*ino >= v->sb.inode_count) {
+        return -EINVAL;
+    }
+    struct cblock *icb;
+    if (inode_get(v, *ino, &icb)->type == 0) {
+        return -ENOENT;
+    }
+    if (icb->lazy_pprev) {
+        txn_add(v, icb);
+        v->ino_tid[*ino] = v->tid;
+    }
+    return 0;
+}
+
+static uint32_t blocks_for(uint32_t bytes) {
+    return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*
+ * Writes into a compressed file.  Each cluster the write touches is
+ * decompressed, patched and compressed again (or kept raw when that saves
+ * no block), and goes to newly allocated blocks; the old ones are freed in
+ * the same transaction.  Never rewriting stored blocks in place means the
+ * cluster map on disk always describes blocks holding what it says.
+ */
+static int write_compressed(struct vol *v, uint32_t ino, struct inode *node, uint32_t pos, const uint8_t *src,
+                            uint32_t len) {
+    uint32_t end = pos + len;
+    uint32_t size = end > node->size ? end : node->size;
+    uint32_t first = pos / CLUSTER_SIZE;
+    uint32_t last = (end - 1) / CLUSTER_SIZE;
+    uint16_t map[CLUSTERS];
+    int shrinks = 0;
+
+    for (uint32_t c = first; c <= last; ++c) {
+        uint8_t *plain = v->zwork + (size_t)(c - first) * 2 * CLUSTER_SIZE;
+        uint8_t *packed = plain + CLUSTER_SIZE;
+        struct zcluster *zc;
+        int rc = cluster_get(v, ino, node, c, &zc);
+        if (rc < 0) {
+            return rc;
+        }
+        memcpy(plain, zc->data, CLUSTER_SIZE);
+        uint32_t lo = pos > c * CLUSTER_SIZE ? pos : c * CLUSTER_SIZE;
+        uint32_t hi = end < (c + 1) * CLUSTER_SIZE ? end : (c + 1) * CLUSTER_SIZE;
+        memcpy(plain + (lo - c * CLUSTER_SIZE), src + (lo - pos), hi - lo);
+
+        // Trailing zeros need not be stored: they read back as zeros.
+        uint32_t n = size - c * CLUSTER_SIZE < CLUSTER_SIZE ? size - c * CLUSTER_SIZE : CLUSTER_SIZE;
+        while (n && plain[n - 1] == 0) {
+            n--;
+        }
+        uint32_t z = n ? vsfs_lz_compress(plain, n, packed, n) : 0;
+        if (n && (z == 0 || blocks_for(z) >= blocks_for(n))) {
+            memcpy(packed, plain, n);
+            map[c - first] = (uint16_t)(n | CLUSTER_RAW);
+        } else {
+            map[c - first] = (uint16_t)z;
+        }
+        if (blocks_for(map[c - first] & CLUSTER_LEN_MASK) < blocks_for(node->cmap[c] & CLUSTER_LEN_MASK)) {
+            shrinks = 1;
+        }
+    }
+
+    // Allocate first so a full device leaves the file untouched.
+    uint32_t fresh[DIRECT_POINTERS] = { 0 };
+    for (uint32_t c = first; c <= last; ++c) {
+        for (uint32_t k = 0; k < blocks_for(map[c - first] & CLUSTER_LEN_MASK); ++k) {
+            int rc = alloc_data(v, &fresh[c * CLUSTER_BLOCKS + k]);
+            if (rc < 0) {
+                for (uint32_t i = 0; i < DIRECT_POINTERS; ++i) {
+                    if (fresh[i]) {
+                        free_data(v, fresh[i]);
+                    }
+                }
+                return rc;
+            }
+        }
+    }
+
+    // Pages beyond a cluster's new length are dropped, which needs every
+    // flush out of the way.
+    struct pcache *pc = &v->pc;
+    if (shrinks) {
+        flush_lock_urgent(v);
+    }
+    pthread_mutex_lock(&pc->lock);
+    uint32_t old[DIRECT_POINTERS];
+    memcpy(old, node->direct, sizeof(old));
+    for (uint32_t c = first; c <= last; ++c) {
+        const uint8_t *packed = v->zwork + (size_t)(c - first) * 2 * CLUSTER_SIZE + CLUSTER_SIZE;
+        uint32_t stored = map[c - first] & CLUSTER_LEN_MASK;
+        for (uint32_t k = 0; k < CLUSTER_BLOCKS; ++k) {
+            uint32_t idx = c * CLUSTER_BLOCKS + k;
+            node->direct[idx] = fresh[idx];
+            if (!fresh[idx]) {
+                struct page **pp = &pc->hash[page_hash(pc, ino, idx)];
+                while (*pp && ((*pp)->ino != ino || (*pp)->index != idx)) {
+                    pp = &(*pp)->hnext;
+                }
+                if (*pp) {
+                    page_drop(pc, pp);
+                }
+                continue;
+            }
+            struct page *pg = page_get(v, ino, idx, fresh[idx], 0);
+            pg->blkno = fresh[idx];
+            uint32_t chunk = stored - k * BLOCK_SIZE < BLOCK_SIZE ? stored - k * BLOCK_SIZE : BLOCK_SIZE;
+            memcpy(pg->data, packed + (size_t)k * BLOCK_SIZE, chunk);
+            memset(pg->data + chunk, 0, BLOCK_SIZE - chunk);
+            page_mark_dirty(pc, pg);
+            if (pg->order_tid == 0) {
+                pg->order_tid = v->tid;
+            }
+        }
+        node->cmap[c] = map[c - first];
+    }
+    pthread_mutex_unlock(&pc->lock);
+    if (shrinks) {
+        pthread_mutex_unlock(&pc->flush_lock);
+    }
+
+    for (uint32_t c = first; c <= last; ++c) {
+        for (uint32_t k = 0; k < CLUSTER_BLOCKS; ++k) {
+            if (old[c * CLUSTER_BLOCKS + k]) {
+                free_data(v, old[c * CLUSTER_BLOCKS + k]);
+            }
+        }
+        struct zcluster *zc = zc_lookup(v, ino, c);
+        if (!zc) {
+            zc = zc_insert(v, ino, c);
+        }
+        memcpy(zc->data, v->zwork + (size_t)(c - first) * 2 * CLUSTER_SIZE, CLUSTER_SIZE);
+    }
+    node->size = size;
+    return (int)len;
+}
+
+/*
+ * Writes into a file whose data is journaled.  Its blocks go through the
+ * metadata cache into the running transaction; they are never in the page
+ * cache, and never shared, so an overwrite changes them in place.  Blocks
+ * are allocated up front so a full image leaves the file untouched, and,
+ * as files have no holes, a write past the end also fills the gap.  A
+ * preallocated block is zeroed rather than read when first written.
+ */
+static int write_journaled(struct vol *v, struct inode *node, uint32_t pos, const uint8_t *src, uint32_t len) {
+    uint32_t last = (pos + len - 1) / BLOCK_SIZE;
+    uint32_t fresh[DIRECT_POINTERS] = { 0 };
+    for (uint32_t idx = 0; idx <= last; ++idx) {
+        if (node->direct[idx] == 0) {
+            int rc = alloc_data(v, &fresh[idx]);
+            if (rc < 0) {
+                for (uint32_t k = 0; k < idx; ++k) {
+                    if (fresh[k]) {
+                        free_data(v, fresh[k]);
+                    }
+                }
+                return rc;
+            }
+        }
+    }
+    for (uint32_t idx = 0; idx < pos / BLOCK_SIZE; ++idx) {
+        if (fresh[idx]) {
+            txn_add(v, cache_get(v, fresh[idx], 1));
+            node->direct[idx] = fresh[idx];
+        }
+    }
+    for (uint32_t done = 0; done < len;) {
+        uint32_t idx = (pos + done) / BLOCK_SIZE;
+        uint32_t in_blk = (pos + done) % BLOCK_SIZE;
+        uint32_t chunk = BLOCK_SIZE - in_blk < len - done ? BLOCK_SIZE - in_blk : len - done;
+        struct cblock *cb;
+        if (fresh[idx]) {
+            cb = cache_get(v, fresh[idx], 1);
+            node->direct[idx] = fresh[idx];
+        } else {
+            cb = cache_get(v, node->direct[idx], (node->unwritten >> idx) & 1U);
+            node->unwritten &= (uint8_t)~(1U << idx);
+        }
+        memcpy(cb->data + in_blk, src + done, chunk);
+        txn_add(v, cb);
+        done += chunk;
+    }
+    return (int)len;
+}
+
+static int op_write(struct vol *v, const struct vsfs_sqe *sqe, const uint8_t *src, uint32_t *ino_out) {
+    uint32_t ino;
+    int rc = data_target(v, sqe, &ino);
+    if (rc < 0) {
+        return rc;
+    }
+    *ino_out = ino;
+    uint32_t len = sqe->len > VSFS_RING_BUF ? VSFS_RING_BUF : sqe->len;
+    if (sqe->off + len > (uint64_t)DIRECT_POINTERS * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+
+    struct cblock *icb;
+    struct inode *node = inode_get(v, ino, &icb);
+    uint32_t size = node->size;
+    uint32_t pos = (uint32_t)sqe->off;
+    uint32_t end = pos + len;
+    if ((node->flags & INODE_COMPRESSED) && len) {
+        rc = write_compressed(v, ino, node, pos, src, len);
+        if (rc >= 0) {
+            node->mtime = (uint32_t)time(NULL);
+            txn_add(v, icb);
+            v->ino_tid[ino] = v->tid;
+        }
+        return rc;
+    }
+    if ((node->flags & INODE_JOURNAL_DATA) && len) {
+        rc = write_journaled(v, node, pos, src, len);
+        if (rc >= 0) {
+            node->mtime = (uint32_t)time(NULL);
+            if (end > size) {
+                node->size = end;
+                txn_add(v, icb);
+            } else {
+                txn_add_lazy(v, icb);
+            }
+            v->ino_tid[ino] = v->tid;
+        }
+        return rc;
+    }
+    uint32_t orig[DIRECT_POINTERS];
+    memcpy(orig, node->direct, sizeof(orig));
+
+    // A whole block whose content is already on disk shares that block.
+    uint32_t dup_idx = UINT32_MAX;
+    uint32_t dup_blk = 0;
+    if (v->dedup && len == BLOCK_SIZE && pos % BLOCK_SIZE == 0) {
+        dup_blk = fp_find(v, src);
+        if (dup_blk) {
+            dup_idx = pos / BLOCK_SIZE;
+        }
+    }
+
+    // Allocate first so a full device leaves the file untouched.  Files
+    // have no holes, so writing past the end also allocates the gap, and a
+    // shared block about to be written gets a private copy.
+    uint32_t fresh = 0;
+    uint32_t copied = 0;
+    for (uint32_t idx = 0; len && idx <= (end - 1) / BLOCK_SIZE; ++idx) {
+        if (idx == dup_idx) {
+            continue;
+        }
+        int shared = node->direct[idx] != 0 && v->dedup && idx >= pos / BLOCK_SIZE &&
+                     ref_get(v, node->direct[idx]) > 1;
+        if (node->direct[idx] != 0 && !shared) {
+            continue;
+        }
+        rc = alloc_data(v, &node->direct[idx]);
+        if (rc < 0) {
+            for (uint32_t k = 0; k < DIRECT_POINTERS; ++k) {
+                if ((fresh | copied) & (1U << k)) {
+                    free_data(v, node->direct[k]);
+                    node->direct[k] = orig[k];
+                }
+            }
+            return rc;
+        }
+        if (shared) {
+            copied |= 1U << idx;
+        } else {
+            fresh |= 1U << idx;
+        }
+    }
+    for (uint32_t k = 0; k < DIRECT_POINTERS; ++k) {
+        if (copied & (1U << k)) {
+            free_data(v, orig[k]);   // still referenced elsewhere, only drops ours
+        }
+    }
+    if (dup_blk && dup_blk != orig[dup_idx]) {
+        ref_add(v, dup_blk, 1);
+        node->direct[dup_idx] = dup_blk;
+    }
+    // Preallocated blocks the write lands in start out as zeros, like new
+    // ones; those in the gap stay unwritten.
+    uint32_t filling = len ? node->unwritten & ((2U << ((end - 1) / BLOCK_SIZE)) - (1U << (pos / BLOCK_SIZE))) : 0;
+    node->unwritten &= (uint8_t)~filling;
+
+    struct pcache *pc = &v->pc;
+    pthread_mutex_lock(&pc->lock);
+    for (uint32_t idx = 0; idx < pos / BLOCK_SIZE; ++idx) {
+        if ((fresh >> idx) & 1U) {
+            struct page *pg = page_get(v, ino, idx, node->direct[idx], 0);
+            page_mark_dirty(pc, pg);
+            if (pg->order_tid == 0) {
+                pg->order_tid = v->tid;
+            }
+        }
+    }
+    while (pos < end) {
+        uint32_t idx = pos / BLOCK_SIZE;
+        uint32_t in_blk = pos % BLOCK_SIZE;
+        uint32_t chunk = BLOCK_SIZE - in_blk;
+        if (chunk > end - pos) {
+            chunk = end - pos;
+        }
+        if (idx == dup_idx) {
+            // Nothing to write.  A cached page follows the file to the
+            // shared block; a dirty one is bumped so that a flush of its
+            // old block already under way is not indexed.
+            struct page *pg = page_lookup(pc, ino, idx);
+            if (pg) {
+                pg->blkno = dup_blk;
+                memcpy(pg->data, src, BLOCK_SIZE);
+                if (pg->dirty) {
+                    page_mark_dirty(pc, pg);
+                }
+            }
+            pos += chunk;
+            continue;
+        }
+        int whole = in_blk == 0 && chunk == BLOCK_SIZE;
+        int is_fresh = ((fresh | filling) >> idx) & 1U;
+        int is_copy = (copied >> idx) & 1U;
+        struct page *pg = page_get(v, ino, idx, is_copy ? orig[idx] : node->direct[idx], !is_fresh && !whole);
+        pg->blkno = node->direct[idx];
+        if (v->dedup && !is_fresh && !is_copy) {
+            fp_remove(v, pg->blkno);   // overwritten in place
+        }
+        memcpy(pg->data + in_blk, src + (pos - (uint32_t)sqe->off), chunk);
+        page_mark_dirty(pc, pg);
+        // A commit in flight may still need this page for an older
+        // transaction, so the oldest dependency is the one kept.
+        if ((is_fresh || is_copy || end > size) && pg->order_tid == 0) {
+            pg->order_tid = v->tid;
+        }
+        pos += chunk;
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    if (dup_blk) {
+        if (orig[dup_idx] && orig[dup_idx] != dup_blk) {
+            free_data(v, orig[dup_idx]);
+        }
+        atomic_fetch_add(&v->stats->dedup_blocks, 1);
+        atomic_fetch_add(&v->totals->dedup_blocks, 1);
+    }
+    node->mtime = (uint32_t)time(NULL);
+    if (end > size || fresh || copied || filling || dup_blk) {
+        node->size = end > size ? end : size;
+        txn_add(v, icb);
+    } else {
+        txn_add_lazy(v, icb);   // an overwrite in place changes nothing else
+    }
+    if (icb->txn == v->tid) {
+        v->ino_tid[ino] = v->tid;
+    }
+    return (int)len;
+}
+
+/*
+ * Reserves a file's blocks up to `off + len` without changing its size.
+ * The blocks it lacks below that point are allocated as one run where the
+ * image has a long enough one, one by one otherwise, and are marked
+ * unwritten: they read as zeros, and a later write fills them without
+ * allocating.
+ */
+static int op_prealloc(struct vol *v, const struct vsfs_sqe *sqe, uint32_t *ino_out) {
+    uint32_t ino;
+    int rc = data_target(v, sqe, &ino);
+    if (rc < 0) {
+        return rc;
+    }
+    *ino_out = ino;
+    if (sqe->off + sqe->len > (uint64_t)DIRECT_POINTERS * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+    struct cblock *icb;
+    struct inode *node = inode_get(v, ino, &icb);
+    if (node->flags & INODE_COMPRESSED) {
+        return -EOPNOTSUPP;
+    }
+    uint32_t want = blocks_for((uint32_t)(sqe->off + sqe->len));
+    uint32_t missing = 0;
+    uint32_t n = 0;
+    for (uint32_t idx = 0; idx < want; ++idx) {
+        if (node->direct[idx] == 0) {
+            missing |= 1U << idx;
+            n++;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    uint32_t blk;
+    if (alloc_data_run(v, n, &blk) == 0) {
+        for (uint32_t idx = 0; idx < want; ++idx) {
+            if ((missing >> idx) & 1U) {
+                node->direct[idx] = blk++;
+            }
+        }
+    } else {
+        for (uint32_t idx = 0; idx < want; ++idx) {
+            if (!((missing >> idx) & 1U)) {
+                continue;
+            }
+            rc = alloc_data(v, &node->direct[idx]);
+            if (rc < 0) {
+                for (uint32_t k = 0; k < idx; ++k) {
+                    if ((missing >> k) & 1U) {
+                        free_data(v, node->direct[k]);
+                        node->direct[k] = 0;
+                    }
+                }
+                return rc;
+            }
+        }
+    }
+    node->unwritten |= (uint8_t)missing;
+    txn_add(v, icb);
+    v->ino_tid[ino] = v->tid;
+    return 0;
+}
+
+static int op_read(struct vol *v, const struct vsfs_sqe *sqe, uint8_t *dst, uint32_t *ino_out, uint64_t *size_out) {
+    uint32_t ino;
+    int rc = data_target(v, sqe, &ino);
+    if (rc < 0) {
+        return rc;
+    }
+    *ino_out = ino;
+    struct inode node = *inode_get(v, ino, NULL);
+    *size_out = node.size;
+    if (sqe->off >= node.size) {
+        return 0;
+    }
+    uint32_t pos = (uint32_t)sqe->off;
+    uint32_t len = sqe->len > VSFS_RING_BUF ? VSFS_RING_BUF : sqe->len;
+    uint32_t end = pos + len > node.size ? node.size : pos + len;
+
+    if (node.flags & INODE_COMPRESSED) {
+        while (pos < end) {
+            uint32_t c = pos / CLUSTER_SIZE;
+            uint32_t in_cl = pos % CLUSTER_SIZE;
+            uint32_t chunk = CLUSTER_SIZE - in_cl < end - pos ? CLUSTER_SIZE - in_cl : end - pos;
+            struct zcluster *zc;
+            rc = cluster_get(v, ino, &node, c, &zc);
+            if (rc < 0) {
+                return rc;
+            }
+            memcpy(dst + (pos - (uint32_t)sqe->off), zc->data + in_cl, chunk);
+            pos += chunk;
+        }
+        return (int)(end - (uint32_t)sqe->off);
+    }
+    if (node.flags & INODE_JOURNAL_DATA) {
+        while (pos < end) {
+            uint32_t idx = pos / BLOCK_SIZE;
+            uint32_t in_blk = pos % BLOCK_SIZE;
+            uint32_t chunk = BLOCK_SIZE - in_blk < end - pos ? BLOCK_SIZE - in_blk : end - pos;
+            uint8_t *out = dst + (pos - (uint32_t)sqe->off);
+            if (node.direct[idx] == 0 || ((node.unwritten >> idx) & 1U)) {
+                memset(out, 0, chunk);
+            } else {
+                memcpy(out, cache_get(v, node.direct[idx], 0)->data + in_blk, chunk);
+            }
+            pos += chunk;
+        }
+        return (int)(end - (uint32_t)sqe->off);
+    }
+
+    struct pcache *pc = &v->pc;
+    pthread_mutex_lock(&pc->lock);
+    while (pos < end) {
+        uint32_t idx = pos / BLOCK_SIZE;
+        uint32_t in_blk = pos % BLOCK_SIZE;
+        uint32_t chunk = BLOCK_SIZE - in_blk;
+        if (chunk > end - pos) {
+            chunk = end - pos;
+        }
+        uint8_t *out = dst + (pos - (uint32_t)sqe->off);
+        if (node.direct[idx] == 0 || ((node.unwritten >> idx) & 1U)) {
+            memset(out, 0, chunk);
+        } else {
+            struct page *pg = page_get(v, ino, idx, node.direct[idx], 1);
+            memcpy(out, pg->data + in_blk, chunk);
+        }
+        pos += chunk;
+    }
+    pthread_mutex_unlock(&pc->lock);
+    return (int)(end - (uint32_t)sqe->off);
+}
+
+static void pcache_init(struct vol *v, struct budget *b) {
+    struct pcache *pc = &v->pc;
+    pthread_mutex_init(&pc->lock, NULL);
+    pthread_mutex_init(&pc->flush_lock, NULL);
+    pc->budget = b;
+    pc->hash_mask = round_pow2(b->pages_limit) - 1;
+    pc->hash = xcalloc((size_t)pc->hash_mask + 1, sizeof(*pc->hash));
+    pc->lru.lru_next = pc->lru.lru_prev = &pc->lru;
+    pc->dirty.dirty_next = pc->dirty.dirty_prev = &pc->dirty;
+    pc->staging = xcalloc(FLUSH_BATCH, BLOCK_SIZE);
+}
+
+static void budget_init(struct budget *b, const struct config *cfg, uint32_t nvols) {
+    atomic_init(&b->meta_used, 0);
+    atomic_init(&b->pages_used, 0);
+    atomic_init(&b->clusters_used, 0);
+    atomic_init(&b->dirty, 0);
+    b->meta_limit = cfg->cache_blocks;
+    b->pages_limit = cfg->pages;
+    b->clusters_limit = cfg->clusters;
+    b->dirty_max = cfg->pages / 100U * cfg->dirty_pct;
+    b->dirty_bg = cfg->pages / 100U * cfg->dirty_bg_pct;
+    if (b->dirty_max == 0) {
+        b->dirty_max = 1;
+    }
+    if (b->dirty_bg == 0 || b->dirty_bg > b->dirty_max) {
+        b->dirty_bg = b->dirty_max;
+    }
+    b->expire_ms = cfg->expire_ms;
+    b->interval_ms = cfg->interval_ms ? cfg->interval_ms : 1;
+    b->nvols = nvols;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->wake, NULL);
+}
+
+/* Discards every cached page of a file that is being removed. */
+static void pcache_forget(struct vol *v, uint32_t ino, uint32_t nblocks) {
+    struct pcache *pc = &v->pc;
+    flush_lock_urgent(v);
+    pthread_mutex_lock(&pc->lock);
+    for (uint32_t idx = 0; idx < nblocks; ++idx) {
+        struct page **pp = &pc->hash[page_hash(pc, ino, idx)];
+        while (*pp && ((*pp)->ino != ino || (*pp)->index != idx)) {
+            pp = &(*pp)->hnext;
+        }
+        if (*pp) {
+            page_drop(pc, pp);
+        }
+    }
+    pthread_mutex_unlock(&pc->lock);
+    pthread_mutex_unlock(&pc->flush_lock);
+}
+
+/* ---- removal and listing ---- */
+
+static int dir_is_empty(struct vol *v, const struct inode *node) {
+    uint32_t slots = node->size / sizeof(struct dirent);
+    for (uint32_t s = 2; s < slots; ++s) {
+        struct cblock *cb = cache_get(v, node->direct[s / DIRENTS_PER_BLOCK], 0);
+        const struct dirent *de = (const struct dirent *)cb->data + (s % DIRENTS_PER_BLOCK);
+        if (de->inode != 0 || de->name[0] != '\0') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Drops a removed directory's own entries and its index bookkeeping. */
+static void dir_forget(struct vol *v, uint32_t dir) {
+    struct dentry *de;
+    while ((de = dir_lookup(v, dir, ".")) != NULL) {
+        dindex_remove(v, de);
+    }
+    while ((de = dir_lookup(v, dir, "..")) != NULL) {
+        dindex_remove(v, de);
+    }
+    struct dirinfo **pp = &v->dirs[dir & v->dirs_mask];
+    while (*pp && (*pp)->ino != dir) {
+        pp = &(*pp)->next;
+    }
+    if (*pp) {
+        struct dirinfo *di = *pp;
+        *pp = di->next;
+        free(di);
+    }
+}
+
+static int op_unlink(struct vol *v, const char *path, uint32_t *out) {
+    uint32_t parent;
+    char leaf[NAME_LEN];
+    int rc = resolve_parent(v, path, &parent, leaf);
+    if (rc < 0) {
+        return rc;
+    }
+    struct dentry *dent = dir_lookup(v, parent, leaf);
+    if (!dent) {
+        return -ENOENT;
+    }
+    uint32_t ino = dent->ino;
+    uint32_t slot = dent->slot;
+
+    struct cblock *icb;
+    struct inode *node = inode_get(v, ino, &icb);
+    int is_dir = node->type == 2;
+    if (is_dir && !dir_is_empty(v, node)) {
+        return -ENOTEMPTY;
+    }
+
+    struct cblock *pcb;
+    struct inode *pnode = inode_get(v, parent, &pcb);
+    struct cblock *dcb = cache_get(v, pnode->direct[slot / DIRENTS_PER_BLOCK], 0);
+    memset((struct dirent *)dcb->data + (slot % DIRENTS_PER_BLOCK), 0, sizeof(struct dirent));
+    txn_add(v, dcb);
+    dindex_remove(v, dent);
+    struct dirinfo *di = dir_open(v, parent);
+    if (slot < di->free_hint) {
+        di->free_hint = slot;
+    }
+
+    pnode = inode_get(v, parent, &pcb);
+    pnode->mtime = (uint32_t)time(NULL);
+    if (is_dir) {
+        pnode->links--;
+    }
+    txn_add(v, pcb);
+
+    node = inode_get(v, ino, &icb);
+    struct inode old = *node;
+    memset(node, 0, sizeof(*node));
+    txn_add(v, icb);
+    if (is_dir) {
+        dir_forget(v, ino);
+    } else {
+        pcache_forget(v, ino, DIRECT_POINTERS);
+        zc_forget(v, ino);
+    }
+    for (uint32_t k = 0; k < DIRECT_POINTERS; ++k) {
+        if (old.direct[k] == 0) {
+            continue;
+        }
+        if (is_dir || (old.flags & INODE_JOURNAL_DATA)) {
+            free_logged_block(v, old.direct[k]);
+        } else {
+            free_data(v, old.direct[k]);
+        }
+    }
+    free_inode(v, ino);
+    v->ino_tid[ino] = v->tid;
+    v->ino_tid[parent] = v->tid;
+    *out = ino;
+    return 0;
+}
+
+/*
+ * Copies live entries of a directory, starting at slot `sqe->off`, into
+ * `dst`.  `*next` is the slot to continue from.  Returns bytes copied.
+ */
+static int op_readdir(struct vol *v, const struct vsfs_sqe *sqe, uint8_t *dst, uint32_t *ino_out, uint64_t *next) {
+    uint32_t dir;
+    int rc = resolve(v, sqe->path, &dir);
+    if (rc < 0) {
+        return rc;
+    }
+    struct inode node = *inode_get(v, dir, NULL);
+    if (node.type != 2) {
+        return -ENOTDIR;
+    }
+    *ino_out = dir;
+    uint32_t slots = node.size / sizeof(struct dirent);
+    uint32_t max = VSFS_RING_BUF / sizeof(struct vsfs_dirent);
+    uint32_t n = 0;
+    uint32_t s = sqe->off < slots ? (uint32_t)sqe->off : slots;
+    for (; s < slots && n < max; ++s) {
+        struct cblock *cb = cache_get(v, node.direct[s / DIRENTS_PER_BLOCK], 0);
+        const struct dirent *de = (const struct dirent *)cb->data + (s % DIRENTS_PER_BLOCK);
+        if (de->inode == 0 && de->name[0] == '\0') {
+            continue;
+        }
+        struct vsfs_dirent out;
+        out.ino = de->inode;
+        memcpy(out.name, de->name, sizeof(out.name));
+        out.name[sizeof(out.name) - 1] = '\0';
+        memcpy(dst + (size_t)n * sizeof(out), &out, sizeof(out));
+        n++;
+    }
+    *next = s;
+    return (int)(n * sizeof(struct vsfs_dirent));
+}
+
+/*
+ * Copies the heatmap buckets from sqe->off on that counted anything, as
+ * many as the buffer holds; *next is the bucket to ask for next.  Needs
+ * no lock: the counters are atomic.
+ */
+static int op_heatmap(struct vol *v, const struct vsfs_sqe *sqe, uint8_t *dst, uint64_t *next) {
+    if (!v->heat.count) {
+        return -EOPNOTSUPP;
+    }
+    uint32_t max = VSFS_RING_BUF / sizeof(struct vsfs_heat_bucket);
+    uint32_t n = 0;
+    uint32_t i = sqe->off < v->heat.nbuckets ? (uint32_t)sqe->off : v->heat.nbuckets;
+    for (; i < v->heat.nbuckets && n < max; ++i) {
+        struct vsfs_heat_bucket b;
+        if (vsfs_heat_get(&v->heat, i, &b, (sqe->flags & VSFS_HEAT_RESET) != 0)) {
+            memcpy(dst + (size_t)n * sizeof(b), &b, sizeof(b));
+            n++;
+        }
+    }
+    *next = i;
+    return (int)(n * sizeof(struct vsfs_heat_bucket));
+}
+
+/* ---- journal ---- */
+
+/* Replays committed transactions left in the journal, like `journal install`; returns how many. */
+static uint32_t journal_recover(struct vol *v) {
+    size_t jsize = (size_t)v->journal_blocks * BLOCK_SIZE;
+    uint8_t *jbuf = xcalloc(1, jsize);
+    read_image(v, jbuf, jsize, (off_t)v->sb.journal_block * BLOCK_SIZE);
+    heat_note(v, (off_t)v->sb.journal_block * BLOCK_SIZE, jsize, VSFS_HEAT_DIR, 0);
+
+    // VSFS_PERF=1 reports hardware counters for the replay.
+    struct perfctr pc;
+    memset(&pc, -1, sizeof(pc));
+    if (getenv("VSFS_PERF")) {
+        perfctr_open(&pc, 0, 0);
+        perfctr_enable(&pc);
+    }
+
+    struct journal_header *jh = (struct journal_header *)jbuf;
+    uint32_t replayed = 0;
+    if (jh->magic == JOURNAL_MAGIC && jh->nbytes_used > sizeof(*jh) && jh->nbytes_used <= jsize) {
+        size_t pos = sizeof(*jh);
+        size_t txn_start = pos;
+        while (pos + sizeof(struct rec_header) <= jh->nbytes_used) {
+            struct rec_header *rh = (struct rec_header *)(jbuf + pos);
+            if (rh->size < sizeof(struct rec_header) || pos + rh->size > jh->nbytes_used) {
+                break;
+            }
+            if (rh->type == REC_COMMIT) {
+                for (size_t p = txn_start; p < pos;) {
+                    struct data_record *r = (struct data_record *)(jbuf + p);
+                    if (r->hdr.type == REC_DATA && r->hdr.size == sizeof(*r) && r->block_no < v->sb.total_blocks) {
+                        write_image(v, r->data, BLOCK_SIZE, (off_t)r->block_no * BLOCK_SIZE);
+                        heat_note(v, (off_t)r->block_no * BLOCK_SIZE, BLOCK_SIZE, VSFS_HEAT_DIR, 1);
+                    }
+                    p += r->hdr.size;
+                }
+                replayed++;
+                txn_start = pos + rh->size;
+            }
+            pos += rh->size;
+        }
+        flush_image(v);
+    }
+
+    jh->magic = JOURNAL_MAGIC;
+    jh->nbytes_used = sizeof(*jh);
+    write_image(v, jh, sizeof(*jh), (off_t)v->sb.journal_block * BLOCK_SIZE);
+    heat_note(v, (off_t)v->sb.journal_block * BLOCK_SIZE, sizeof(*jh), VSFS_HEAT_DIR, 1);
+    flush_image(v);
+    free(jbuf);
+    if (replayed) {
+        printf("vsfsd: replayed %u journal transactions\n", replayed);
+    }
+    if (getenv("VSFS_PERF")) {
+        struct perfctr_values pv;
+        char line[256];
+        perfctr_read(&pc, &pv);
+        perfctr_format(&pv, line, sizeof(line));
+        printf("vsfsd: replay perf %s\n", line);
+        perfctr_close(&pc);
+    }
+    return replayed;
+}
+
+static int cmp_cblock(const void *a, const void *b) {
+    uint32_t x = (*(struct cblock *const *)a)->blkno;
+    uint32_t y = (*(struct cblock *const *)b)->blkno;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Takes the committed image of every block logged since the last pass and
+ * writes them home in block order, coalescing adjacent blocks into one
+ * vectored write, then flushes.  Called with v->lock held and no commit in
+ * flight, so every image taken is durable in the journal; the lock is
+ * dropped for the I/O, and commits logging the same blocks again meanwhile
+ * leave them for the next pass.  A background pass goes at commit priority
+ * once a commit is waiting for it.  Returns the number of blocks written.
+ */
+static uint32_t ckpt_pass(struct daemon *d, struct vol *v, enum io_class cls) {
+    if (v->ckpt_count == 0) {
+        return 0;
+    }
+    struct cblock **list = xcalloc(v->ckpt_count, sizeof(*list));
+    uint32_t n = 0;
+    for (struct cblock *cb = v->ckpt_list, *next; cb; cb = next) {
+        next = cb->ckpt_next;
+        cb->ckpt_next = NULL;
+        cb->ckpt_buf = cb->committed;
+        cb->committed = NULL;
+        list[n++] = cb;
+    }
+    v->ckpt_list = NULL;
+    v->ckpt_count = 0;
+    pthread_mutex_unlock(&v->lock);
+    qsort(list, n, sizeof(*list), cmp_cblock);
+
+    struct iovec iov[64];
+    uint32_t i = 0;
+    while (i < n) {
+        uint32_t run = 0;
+        while (i + run < n && run < sizeof(iov) / sizeof(iov[0]) &&
+               list[i + run]->blkno == list[i]->blkno + run) {
+            iov[run].iov_base = list[i + run]->ckpt_buf;
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        }
+        off_t off = (off_t)list[i]->blkno * BLOCK_SIZE;
+        ssize_t want = (ssize_t)run * BLOCK_SIZE;
+        enum io_class c = atomic_load(&v->ckpt_urgent) ? IO_COMMIT : cls;
+        io_begin(v, c);
+        if (vsfs_image_pwritev(&v->img, iov, (int)run, off) != want) {
+            for (uint32_t k = 0; k < run; ++k) {
+                write_image(v, list[i + k]->ckpt_buf, BLOCK_SIZE, (off_t)list[i + k]->blkno * BLOCK_SIZE);
+            }
+        }
+        io_end(v, c);
+        heat_note(v, off, (size_t)want, VSFS_HEAT_DIR, 1);
+        i += run;
+    }
+    enum io_class c = atomic_load(&v->ckpt_urgent) ? IO_COMMIT : cls;
+    io_begin(v, c);
+    flush_image(v);
+    io_end(v, c);
+
+    pthread_mutex_lock(&v->lock);
+    for (uint32_t k = 0; k < n; ++k) {
+        free(list[k]->ckpt_buf);
+        list[k]->ckpt_buf = NULL;
+    }
+    free(list);
+    atomic_fetch_add(&d->hdr->stats.checkpoint_blocks, n);
+    atomic_fetch_add(&v->stats->checkpoint_blocks, n);
+    cache_evict(v);
+    return n;
+}
+
+/*
+ * Empties the journal once every block it holds is home.  The caller has
+ * set v->committing, so no commit appends meanwhile; commits wait for this
+ * write, so it goes at commit priority, with the lock dropped.
+ */
+static void ckpt_reset(struct daemon *d, struct vol *v) {
+    pthread_mutex_unlock(&v->lock);
+    struct journal_header jh = { JOURNAL_MAGIC, sizeof(struct journal_header) };
+    io_begin(v, IO_COMMIT);
+    write_image(v, &jh, sizeof(jh), (off_t)v->sb.journal_block * BLOCK_SIZE);
+    flush_image(v);
+    io_end(v, IO_COMMIT);
+    heat_note(v, (off_t)v->sb.journal_block * BLOCK_SIZE, sizeof(jh), VSFS_HEAT_DIR, 1);
+    pthread_mutex_lock(&v->lock);
+    v->jused = sizeof(jh);
+    unpin(v, pin_checkpointed);
+    atomic_fetch_add(&d->hdr->stats.checkpoints, 1);
+    atomic_fetch_add(&v->stats->checkpoints, 1);
+}
+
+/*
+ * Writes every committed-but-not-installed block home and empties the
+ * journal, at commit priority: for a commit that found the journal full,
+ * and at shutdown.  A background checkpoint under way is hurried along and
+ * waited for first.  Called with v->lock held; v->committing is set
+ * throughout, and the lock is dropped for the I/O.
+ */
+static void checkpoint(struct daemon *d, struct vol *v) {
+    while (v->committing) {
+        pthread_cond_wait(&v->commit_done, &v->lock);
+    }
+    v->committing = 1;
+    atomic_fetch_add(&v->ckpt_urgent, 1);
+    while (v->ckpt_running) {
+        pthread_cond_wait(&v->ckpt_done, &v->lock);
+    }
+    atomic_fetch_sub(&v->ckpt_urgent, 1);
+    v->ckpt_running = 1;
+    ckpt_pass(d, v, IO_COMMIT);
+    ckpt_reset(d, v);
+    v->ckpt_running = 0;
+    pthread_cond_broadcast(&v->ckpt_done);
+    v->committing = 0;
+}
+
+/* ---- operation trace ---- */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void trace_flush(struct tracer *t) {
+    pwrite_full(t->fd, t->buf, t->used, t->off);
+    t->off += (off_t)t->used;
+    t->used = 0;
+}
+
+static struct tracer *trace_open(const char *path, uint32_t nvols, uint32_t nslots) {
+    struct tracer *t = xcalloc(1, sizeof(*t));
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (t->fd < 0) {
+        die("open trace");
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->buf = xcalloc(1, TRACE_BUF);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct vsfs_trace_header h = {
+        .magic = VSFS_TRACE_MAGIC,
+        .version = VSFS_TRACE_VERSION,
+        .nvols = nvols,
+        .nslots = nslots,
+        .start_ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec,
+    };
+    memcpy(t->buf, &h, sizeof(h));
+    t->used = sizeof(h);
+    t->t0 = now_ns();
+    return t;
+}
+
+static void trace_close(struct tracer *t) {
+    trace_flush(t);
+    if (fsync(t->fd) < 0 || close(t->fd) < 0) {
+        die("close trace");
+    }
+    printf("vsfsd: traced %llu operations\n", (unsigned long long)atomic_load(&t->completed));
+    free(t->buf);
+    free(t);
+}
+
+/* Notes an operation as it is picked up: all records appended so far happened before it. */
+static void trace_begin(struct tracer *t, uint32_t slot_idx, const struct vsfs_sqe *sqe, struct trace_op *top) {
+    memset(&top->rec, 0, sizeof(top->rec));
+    top->rec.after = atomic_load(&t->completed);
+    top->rec.start_ns = now_ns() - t->t0;
+    top->rec.off = sqe->off;
+    top->rec.ino = sqe->ino;
+    top->rec.len = sqe->len;
+    top->rec.op = sqe->op;
+    top->rec.flags = sqe->flags;
+    top->rec.slot = (uint16_t)slot_idx;
+    top->rec.vol = (uint8_t)sqe->vol;
+    top->rec.path_len = (uint8_t)strnlen(sqe->path, VSFS_PATH_MAX - 1);
+    memcpy(top->path, sqe->path, top->rec.path_len);
+}
+
+/* Appends the record of a completed operation; before the client can see the completion. */
+static void trace_end(struct tracer *t, struct trace_op *top, const struct vsfs_cqe *cqe) {
+    uint64_t took = now_ns() - t->t0 - top->rec.start_ns;
+    top->rec.latency_ns = took > UINT32_MAX ? UINT32_MAX : (uint32_t)took;
+    top->rec.result = cqe->result;
+    size_t len = sizeof(top->rec) + top->rec.path_len;
+    pthread_mutex_lock(&t->lock);
+    if (t->used + len > TRACE_BUF) {
+        trace_flush(t);
+    }
+    memcpy(t->buf + t->used, &top->rec, sizeof(top->rec));
+    memcpy(t->buf + t->used + sizeof(top->rec), top->path, top->rec.path_len);
+    t->used += len;
+    atomic_fetch_add(&t->completed, 1);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void post_completion(struct daemon *d, uint32_t slot_idx, const struct vsfs_cqe *cqe, struct trace_op *top) {
+    if (top) {
+        trace_end(d->trace, top, cqe);
+    }
+    struct vsfs_ring_slot *slot = vsfs_ring_slot_at(d->hdr, slot_idx);
+    pthread_mutex_lock(&d->cq_locks[slot_idx]);
+    uint32_t tail = atomic_load_explicit(&slot->cq_tail, memory_order_relaxed);
+    slot->cq[tail & (VSFS_RING_ENTRIES - 1)] = *cqe;
+    atomic_store_explicit(&slot->cq_tail, tail + 1, memory_order_release);
+    pthread_mutex_unlock(&d->cq_locks[slot_idx]);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&slot->client_waiting, memory_order_relaxed)) {
+        vsfs_futex_wake(&slot->cq_tail);
+    }
+}
+
+/* Hands an image to the background threads unless it is already waiting for one.  Called with v->lock held. */
+static void queue_commit(struct daemon *d, struct vol *v) {
+    if (v->queued) {
+        return;
+    }
+    v->queued = 1;
+    vsfs_spawn(&d->sched, &d->commits, &v->commit_task);
+}
+
+/* Starts a background checkpoint unless one is already queued.  Called with v->lock held. */
+static void queue_checkpoint(struct daemon *d, struct vol *v) {
+    if (v->ckpt_queued) {
+        return;
+    }
+    v->ckpt_queued = 1;
+    vsfs_spawn(&d->sched, &d->commits, &v->ckpt_task);
+}
+
+static void add_waiter(struct waiter **list, uint32_t *n, uint32_t *cap, uint32_t slot, const struct vsfs_cqe *cqe,
+                       const struct trace_op *top, uint64_t tid) {
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *list = realloc(*list, *cap * sizeof(**list));
+        if (!*list) {
+            die("realloc");
+        }
+    }
+    struct waiter *w = &(*list)[(*n)++];
+    w->slot = slot;
+    w->cqe = *cqe;
+    w->tid = tid;
+    w->trace = NULL;
+    if (top) {
+        w->trace = xcalloc(1, sizeof(*top));
+        *w->trace = *top;
+    }
+}
+
+static void hold_completion(struct vol *v, uint32_t slot, const struct vsfs_cqe *cqe, const struct trace_op *top) {
+    add_waiter(&v->waiters, &v->nwaiters, &v->waiters_cap, slot, cqe, top, 0);
+}
+
+/* Releases the fsyncs whose transaction is now durable.  Called with v->lock held. */
+static void post_fsyncs(struct daemon *d, struct vol *v) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < v->nfsyncs; ++i) {
+        struct waiter *w = &v->fsyncs[i];
+        if (w->tid > v->durable_tid) {
+            v->fsyncs[kept++] = *w;
+            continue;
+        }
+        post_completion(d, w->slot, &w->cqe, w->trace);
+        free(w->trace);
+    }
+    v->nfsyncs = kept;
+}
+
+/*
+ * Moves lazy blocks into the running transaction, as many as it has room
+ * for.  Called with v->lock held.
+ */
+static void lazy_fold(struct vol *v) {
+    while (v->lazy_head && v->txn_nblocks < v->max_txn_blocks) {
+        txn_add(v, v->lazy_head);
+    }
+    if (!v->lazy_head) {
+        v->lazy_flush = 0;
+    }
+}
+
+/*
+ * Commits the running transaction: all records plus a commit record go
+ * into the journal in one write, the header update that publishes them
+ * follows a flush, and held-back completions are released.
+ *
+ * Called with v->lock held.  The transaction is closed and serialized
+ * under the lock, which is then dropped for the data flush and the journal
+ * I/O so operations keep filling the next transaction.  Returns once the
+ * commit is durable, with the lock held again.
+ */
+static void commit(struct daemon *d, struct vol *v) {
+    while (v->committing) {
+        pthread_cond_wait(&v->commit_done, &v->lock);
+    }
+    int sync = v->sync_requested;
+    uint64_t dirty_seq = 0;
+    if (sync) {
+        // Writers hold v->lock, so this covers every write the sync follows.
+        pthread_mutex_lock(&v->pc.lock);
+        dirty_seq = v->pc.seq;
+        pthread_mutex_unlock(&v->pc.lock);
+    }
+    if (sync && v->lazy_head) {
+        v->lazy_flush = 1;
+    }
+    if (v->lazy_flush) {
+        lazy_fold(v);
+    }
+    if (v->txn_nblocks == 0 && v->nwaiters == 0 && !sync) {
+        return;
+    }
+    v->sync_requested = 0;
+    v->ngroup = 0;
+
+    size_t bytes = 0;
+    uint32_t jpos = v->jused;
+    uint64_t tid = v->tid;
+    if (v->txn_nblocks > 0) {
+        bytes = (size_t)v->txn_nblocks * sizeof(struct data_record) + sizeof(struct commit_record);
+        if (v->jused + bytes > v->jcap) {
+            checkpoint(d, v);
+            // Operations ran meanwhile; a sync among them is answered by
+            // this commit too.
+            if (v->sync_requested) {
+                sync = 1;
+                v->sync_requested = 0;
+            }
+            if (sync) {
+                pthread_mutex_lock(&v->pc.lock);
+                dirty_seq = v->pc.seq;
+                pthread_mutex_unlock(&v->pc.lock);
+            }
+            v->ngroup = 0;
+            // The journal starts over, so deferred timestamps go in now.
+            lazy_fold(v);
+            bytes = (size_t)v->txn_nblocks * sizeof(struct data_record) + sizeof(struct commit_record);
+        }
+        jpos = v->jused;
+
+        uint8_t *p = v->jbuf;
+        struct cblock *cb = v->txn_blocks;
+        while (cb) {
+            struct cblock *next = cb->txn_next;
+            struct data_record *r = (struct data_record *)p;
+            r->hdr.type = REC_DATA;
+            r->hdr.size = sizeof(struct data_record);
+            r->block_no = cb->blkno;
+            memcpy(r->data, cb->data, BLOCK_SIZE);
+            p += sizeof(struct data_record);
+
+            // A checkpoint pass writes home the images it took before, so
+            // this one is only read by the next pass.
+            if (!cb->committed) {
+                cb->committed = malloc(BLOCK_SIZE);
+                if (!cb->committed) {
+                    die("malloc");
+                }
+                cb->ckpt_next = v->ckpt_list;
+                v->ckpt_list = cb;
+                v->ckpt_count++;
+            }
+            memcpy(cb->committed, cb->data, BLOCK_SIZE);
+            cb->txn = 0;
+            cb->txn_next = NULL;
+            cb = next;
+        }
+        struct commit_record *c = (struct commit_record *)p;
+        c->hdr.type = REC_COMMIT;
+        c->hdr.size = sizeof(struct commit_record);
+
+        v->txn_blocks = NULL;
+        v->txn_nblocks = 0;
+        v->tid++;
+        v->jused += (uint32_t)bytes;
+    }
+
+    struct waiter *posting = v->waiters;
+    uint32_t nposting = v->nwaiters;
+    uint32_t posting_cap = v->waiters_cap;
+    v->waiters = v->posting;
+    v->waiters_cap = v->posting_cap;
+    v->nwaiters = 0;
+    v->committing = 1;
+    pthread_mutex_unlock(&v->lock);
+
+    io_begin(v, IO_COMMIT);
+    if (sync) {
+        flush_all(v, dirty_seq);
+    }
+    if (bytes > 0) {
+        flush_ordered(v, tid);
+        off_t jstart = (off_t)v->sb.journal_block * BLOCK_SIZE;
+        write_image(v, v->jbuf, bytes, jstart + jpos);
+        flush_image(v);
+        struct journal_header jh = { JOURNAL_MAGIC, jpos + (uint32_t)bytes };
+        write_image(v, &jh, sizeof(jh), jstart);
+        flush_image(v);
+        heat_note(v, jstart + jpos, bytes, VSFS_HEAT_DIR, 1);
+        heat_note(v, jstart, sizeof(jh), VSFS_HEAT_DIR, 1);
+        atomic_fetch_add(&d->hdr->stats.commits, 1);
+        atomic_fetch_add(&d->hdr->stats.journal_bytes, bytes);
+        atomic_fetch_add(&v->stats->commits, 1);
+        atomic_fetch_add(&v->stats->journal_bytes, bytes);
+    }
+    io_end(v, IO_COMMIT);
+    for (uint32_t i = 0; i < nposting; ++i) {
+        post_completion(d, posting[i].slot, &posting[i].cqe, posting[i].trace);
+        free(posting[i].trace);
+    }
+
+    pthread_mutex_lock(&v->lock);
+    v->posting = posting;
+    v->posting_cap = posting_cap;
+    v->committing = 0;
+    if (bytes > 0) {
+        v->durable_tid = tid;
+        unpin(v, pin_durable);
+        post_fsyncs(d, v);
+    }
+    pthread_cond_broadcast(&v->commit_done);
+    if (v->recommit || v->lazy_flush) {
+        v->recommit = 0;
+        queue_commit(d, v);
+    }
+    if (v->jused > (uint64_t)v->jcap * CKPT_START_PCT / 100U) {
+        queue_checkpoint(d, v);
+    }
+}
+
+/*
+ * Commit task of an image.  An image whose previous commit is still in
+ * flight is marked so that commit requeues it when done, leaving this
+ * thread free for other images.
+ */
+static int commit_task(struct vsfs_task *t) {
+    struct vol *v = (struct vol *)((char *)t - offsetof(struct vol, commit_task));
+    pthread_mutex_lock(&v->lock);
+    v->queued = 0;
+    if (v->committing) {
+        v->recommit = 1;
+    } else {
+        commit(v->d, v);
+    }
+    pthread_mutex_unlock(&v->lock);
+    return VSFS_TASK_DONE;
+}
+
+/*
+ * Background checkpoint of an image, started once the journal is past
+ * CKPT_START_PCT: passes at background priority, without the image lock,
+ * until a pass finds nothing new, then the journal is emptied.  It stops
+ * whenever a commit is in flight, whose blocks it may not write home yet;
+ * that commit queues it again when done.
+ */
+static int ckpt_task(struct vsfs_task *t) {
+    struct vol *v = (struct vol *)((char *)t - offsetof(struct vol, ckpt_task));
+    struct daemon *d = v->d;
+    pthread_mutex_lock(&v->lock);
+    v->ckpt_queued = 0;
+    if (!v->ckpt_running) {
+        v->ckpt_running = 1;
+        while (!v->committing && v->jused > sizeof(struct journal_header)) {
+            if (v->ckpt_count == 0) {
+                v->committing = 1;
+                ckpt_reset(d, v);
+                v->committing = 0;
+                pthread_cond_broadcast(&v->commit_done);
+                if (v->recommit) {
+                    v->recommit = 0;
+                    queue_commit(d, v);
+                }
+                break;
+            }
+            ckpt_pass(d, v, IO_BACKGROUND);
+        }
+        v->ckpt_running = 0;
+        pthread_cond_broadcast(&v->ckpt_done);
+    }
+    pthread_mutex_unlock(&v->lock);
+    return VSFS_TASK_DONE;
+}
+
+/* ---- request dispatch ---- */
+
+/*
+ * Past the hard dirty limit a worker writes the oldest pages of the image
+ * it just wrote to itself; the background threshold alone only wakes the
+ * flusher.
+ */
+static void throttle_dirty(struct vol *v) {
+    struct pcache *pc = &v->pc;
+    if (atomic_load_explicit(&pc->budget->dirty, memory_order_relaxed) < pc->budget->dirty_max) {
+        return;
+    }
+    pthread_mutex_lock(&pc->flush_lock);
+    flush_pages(v, pick_any, 0, IO_BACKGROUND);
+    pthread_mutex_unlock(&pc->flush_lock);
+}
+
+/*
+ * Completes an fsync once the file's data and the last transaction that
+ * changed its inode or directory entry are durable.  The file's dirty
+ * pages go out first.  If that transaction is still running it is
+ * committed now, and the commit's flush covers the pages; if it is in
+ * flight the fsync flushes the pages itself and waits for it; later
+ * transactions are never waited for.  Called without v->lock.
+ */
+static void finish_fsync(struct daemon *d, struct vol *v, uint32_t slot_idx, const struct vsfs_cqe *cqe,
+                         struct trace_op *tp) {
+    struct pcache *pc = &v->pc;
+    flush_lock_urgent(v);
+    while (flush_pages(v, pick_ino, cqe->ino, IO_COMMIT) == FLUSH_BATCH) {
+    }
+    pthread_mutex_unlock(&pc->flush_lock);
+
+    pthread_mutex_lock(&v->lock);
+    uint64_t need = v->ino_tid[cqe->ino];
+    if (need == v->tid) {
+        hold_completion(v, slot_idx, cqe, tp);
+        queue_commit(d, v);
+        pthread_mutex_unlock(&v->lock);
+        return;
+    }
+    pthread_mutex_unlock(&v->lock);
+
+    io_begin(v, IO_COMMIT);
+    flush_image(v);
+    io_end(v, IO_COMMIT);
+
+    pthread_mutex_lock(&v->lock);
+    if (need > v->durable_tid) {
+        add_waiter(&v->fsyncs, &v->nfsyncs, &v->fsyncs_cap, slot_idx, cqe, tp, need);
+        pthread_mutex_unlock(&v->lock);
+        return;
+    }
+    pthread_mutex_unlock(&v->lock);
+    post_completion(d, slot_idx, cqe, tp);
+}
+
+static void handle(struct daemon *d, uint32_t slot_idx, const struct vsfs_sqe *sqe) {
+    struct vsfs_cqe cqe;
+    memset(&cqe, 0, sizeof(cqe));
+    cqe.user_data = sqe->user_data;
+    cqe.buf = sqe->buf;
+    struct trace_op top, *tp = NULL;
+    if (d->trace) {
+        tp = &top;
+        trace_begin(d->trace, slot_idx, sqe, tp);
+    }
+    if (sqe->vol >= d->nvols) {
+        cqe.result = -EINVAL;
+        atomic_fetch_add(&d->hdr->stats.ops, 1);
+        post_completion(d, slot_idx, &cqe, tp);
+        return;
+    }
+    struct vol *v = &d->vols[sqe->vol];
+    pthread_mutex_lock(&v->lock);
+
+    // Leave room so no single operation can overflow the transaction.
+    while (v->txn_nblocks + v->op_max_blocks > v->max_txn_blocks) {
+        commit(d, v);
+    }
+    v->op_seq++;
+    v->nocache = (sqe->flags & VSFS_NOCACHE) != 0;
+
+    int modifies = 0;
+    switch (sqe->op) {
+    case VSFS_OP_NOP:
+        break;
+    case VSFS_OP_CREATE:
+    case VSFS_OP_MKDIR: {
+        uint16_t iflags = 0;
+        if (sqe->op == VSFS_OP_CREATE) {
+            if (sqe->flags & VSFS_CREATE_COMPRESS) {
+                iflags = INODE_COMPRESSED;
+            } else if ((sqe->flags & VSFS_CREATE_JOURNAL) || d->journal_data) {
+                iflags = INODE_JOURNAL_DATA;
+            }
+        }
+        if ((sqe->flags & VSFS_CREATE_COMPRESS) && (sqe->flags & VSFS_CREATE_JOURNAL)) {
+            cqe.result = -EINVAL;
+        } else {
+            cqe.result = op_create(v, sqe->path, sqe->op == VSFS_OP_MKDIR ? 2 : 1, iflags, &cqe.ino);
+        }
+        modifies = 1;
+        break;
+    }
+    case VSFS_OP_LOOKUP:
+        cqe.result = resolve(v, sqe->path, &cqe.ino);
+        if (cqe.result == 0) {
+            cqe.size = inode_get(v, cqe.ino, NULL)->size;
+        }
+        break;
+    case VSFS_OP_WRITE: {
+        struct vsfs_ring_slot *slot = vsfs_ring_slot_at(d->hdr, slot_idx);
+        int n = op_write(v, sqe, slot->bufs[sqe->buf % VSFS_RING_ENTRIES], &cqe.ino);
+        cqe.result = n < 0 ? n : 0;
+        cqe.size = n < 0 ? 0 : (uint64_t)n;
+        break;
+    }
+    case VSFS_OP_READ: {
+        struct vsfs_ring_slot *slot = vsfs_ring_slot_at(d->hdr, slot_idx);
+        int n = op_read(v, sqe, slot->bufs[sqe->buf % VSFS_RING_ENTRIES], &cqe.ino, &cqe.size);
+        cqe.result = n < 0 ? n : 0;
+        cqe.len = n < 0 ? 0 : (uint32_t)n;
+        break;
+    }
+    case VSFS_OP_UNLINK:
+        cqe.result = op_unlink(v, sqe->path, &cqe.ino);
+        modifies = 1;
+        break;
+    case VSFS_OP_READDIR: {
+        struct vsfs_ring_slot *slot = vsfs_ring_slot_at(d->hdr, slot_idx);
+        int n = op_readdir(v, sqe, slot->bufs[sqe->buf % VSFS_RING_ENTRIES], &cqe.ino, &cqe.size);
+        cqe.result = n < 0 ? n : 0;
+        cqe.len = n < 0 ? 0 : (uint32_t)n;
+        break;
+    }
+    case VSFS_OP_SYNC:
+        v->sync_requested = 1;
+        modifies = 1;
+        break;
+    case VSFS_OP_FSYNC:
+        cqe.result = fsync_target(v, sqe, &cqe.ino);
+        break;
+    case VSFS_OP_PREALLOC:
+        cqe.result = op_prealloc(v, sqe, &cqe.ino);
+        break;
+    case VSFS_OP_HEATMAP: {
+        struct vsfs_ring_slot *slot = vsfs_ring_slot_at(d->hdr, slot_idx);
+        int n = op_heatmap(v, sqe, slot->bufs[sqe->buf % VSFS_RING_ENTRIES], &cqe.size);
+        cqe.result = n < 0 ? n : 0;
+        cqe.len = n < 0 ? 0 : (uint32_t)n;
+        break;
+    }
+    default:
+        cqe.result = -EOPNOTSUPP;
+        break;
+    }
+    atomic_fetch_add(&d->hdr->stats.ops, 1);
+    atomic_fetch_add(&v->stats->ops, 1);
+
+    int held = 0;
+    if (modifies) {
+        uint16_t durable = sqe->flags & VSFS_DURABLE_MASK;
+        if (durable == VSFS_DURABLE_DEFAULT) {
+            durable = d->durable;
+        }
+        if (sqe->op == VSFS_OP_SYNC || durable == VSFS_DURABLE_SYNC) {
+            hold_completion(v, slot_idx, &cqe, tp);
+            held = 1;
+            if (v->nwaiters >= d->batch_max) {
+                commit(d, v);
+            } else {
+                queue_commit(d, v);
+            }
+        } else if (durable == VSFS_DURABLE_GROUP) {
+            if (v->ngroup++ == 0) {
+                v->group_since = now_ms();
+            }
+            if (v->ngroup >= d->batch_max) {
+                queue_commit(d, v);
+            }
+        }
+    }
+    v->nocache = 0;
+    pthread_mutex_unlock(&v->lock);
+    if (sqe->op == VSFS_OP_FSYNC && cqe.result == 0) {
+        finish_fsync(d, v, slot_idx, &cqe, tp);
+    } else if (!held) {
+        post_completion(d, slot_idx, &cqe, tp);
+    }
+    if (sqe->op == VSFS_OP_WRITE) {
+        throttle_dirty(v);
+    }
+}
+
+/*
+ * Pulls up to `budget` operations from every attached client served by
+ * worker `w` (slots w, w + nworkers, ...).  Returns how many ran.
+ */
+static uint32_t drain_rings(struct daemon *d, uint32_t w, uint32_t budget) {
+    uint32_t done = 0;
+    for (uint32_t i = w; i < d->hdr->nslots; i += d->nworkers) {
+        struct vsfs_ring_slot *slot = vsfs_ring_slot_at(d->hdr, i);
+        if (atomic_load_explicit(&slot->state, memory_order_acquire) == 0) {
+            continue;
+        }
+        uint32_t head = atomic_load_explicit(&slot->sq_head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&slot->sq_tail, memory_order_acquire);
+        uint32_t n = 0;
+        while (head != tail && n < budget) {
+            struct vsfs_sqe sqe = slot->sq[head & (VSFS_RING_ENTRIES - 1)];
+            head++;
+            atomic_store_explicit(&slot->sq_head, head, memory_order_release);
+            handle(d, i, &sqe);
+            n++;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int rings_pending(struct daemon *d, uint32_t w) {
+    for (uint32_t i = w; i < d->hdr->nslots; i += d->nworkers) {
+        struct vsfs_ring_slot *slot = vsfs_ring_slot_at(d->hdr, i);
+        if (atomic_load_explicit(&slot->state, memory_order_acquire) &&
+            atomic_load_explicit(&slot->sq_head, memory_order_relaxed) !=
+                atomic_load_explicit(&slot->sq_tail, memory_order_acquire)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Frees slots whose client exited without detaching. */
+static void reap_dead_clients(struct daemon *d, uint32_t w) {
+    for (uint32_t i = w; i < d->hdr->nslots; i += d->nworkers) {
+        struct vsfs_ring_slot *slot = vsfs_ring_slot_at(d->hdr, i);
+        if (atomic_load(&slot->state) == 0) {
+            continue;
+        }
+        int32_t pid = atomic_load(&slot->owner_pid);
+        if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+            atomic_store(&slot->sq_head, atomic_load(&slot->sq_tail));
+            atomic_store(&slot->cq_head, atomic_load(&slot->cq_tail));
+            atomic_store(&slot->client_waiting, 0);
+            atomic_store(&slot->owner_pid, 0);
+            atomic_store_explicit(&slot->state, 0, memory_order_release);
+        }
+    }
+}
+
+/* Worker `w`: serves its slots until shutdown, sleeping on the doorbell when they are empty. */
+static void serve(struct daemon *d, uint32_t w) {
+    while (!stop_requested) {
+        if (drain_rings(d, w, d->batch_max) > 0) {
+            continue;
+        }
+
+        // Announce idleness, then look once more before sleeping so a
+        // submission racing with us is not missed.
+        uint32_t bell = atomic_load(&d->hdr->doorbell);
+        atomic_fetch_add(&d->hdr->daemon_idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!rings_pending(d, w)) {
+            struct timespec ts = { 1, 0 };
+            if (vsfs_futex_wait(&d->hdr->doorbell, bell, &ts) < 0 && errno == ETIMEDOUT) {
+                reap_dead_clients(d, w);
+            }
+        }
+        atomic_fetch_sub(&d->hdr->daemon_idle, 1);
+    }
+}
+
+struct worker_arg {
+    struct daemon *d;
+    uint32_t w;
+};
+
+static void *worker_main(void *arg) {
+    struct worker_arg *wa = arg;
+    serve(wa->d, wa->w);
+    return NULL;
+}
+
+/* Makes every image durable and empties its journal. */
+static void shutdown_vols(struct daemon *d) {
+    for (uint32_t i = 0; i < d->nvols; ++i) {
+        struct vol *v = &d->vols[i];
+        pthread_mutex_lock(&v->lock);
+        do {
+            v->sync_requested = 1;
+            commit(d, v);
+        } while (v->lazy_head);
+        checkpoint(d, v);
+        pthread_mutex_unlock(&v->lock);
+    }
+}
+
+/* ---- metadata snapshot ---- */
+
+/*
+ * Snapshot file layout: the header, then `ndirs` snap_dir, `ndentries`
+ * snap_dentry, `nfp` snap_fp records and `nblocks` block numbers (hot
+ * metadata blocks, most recently used first).  It is only valid for an
+ * image whose superblock carries the same journal sequence number and
+ * whose file has not changed since the snapshot was taken.
+ */
+struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t journal_seq;
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t data_start;
+    uint32_t features;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    int64_t size;
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t inode_hint;
+    uint32_t data_hint;
+    uint32_t ndirs;
+    uint32_t ndentries;
+    uint32_t nfp;
+    uint32_t nblocks;
+    uint32_t nhot;   // of the blocks, the first this many were in the hot (Am) queue
+    uint64_t csum;   // of everything after the header
+};
+
+struct snap_dir {
+    uint32_t ino;
+    uint32_t free_hint;
+};
+
+struct snap_dentry {
+    uint32_t dir;
+    uint32_t ino;
+    uint32_t slot;
+    char name[NAME_LEN];
+};
+
+struct snap_fp {
+    uint32_t index;
+    uint32_t pad;
+    uint64_t hash;
+};
+
+static uint64_t snap_sum(const uint8_t *p, size_t n) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
+    }
+    for (; i < n; ++i) {
+        h = (h ^ p[i]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/* What identifies the image file as it is now; any write changes it. */
+static void snap_stamp(struct vol *v, struct snap_header *h) {
+    struct stat st;
+    if (fstat(v->img.fd, &st) < 0) {
+        die("fstat");
+    }
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+    h->ctime_sec = st.st_ctim.tv_sec;
+    h->ctime_nsec = st.st_ctim.tv_nsec;
+    h->size = st.st_size;
+    h->dev = st.st_dev;
+    h->ino = st.st_ino;
+}
+
+/*
+ * Saves the indexes of an image that has just been shut down: every
+ * transaction is checkpointed and every dirty page written, so nothing
+ * changes the image after this.  The superblock records the journal
+ * sequence number first, so the stamp taken afterwards covers it.
+ */
+static void snapshot_save(struct vol *v) {
+    char path[4096], tmp[4096 + 8];
+    snprintf(path, sizeof(path), "%s.snap", v->path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    v->sb.journal_seq = v->tid - 1;
+    uint8_t block[BLOCK_SIZE];
+    read_image(v, block, BLOCK_SIZE, 0);
+    memcpy(block, &v->sb, sizeof(v->sb));
+    write_image(v, block, BLOCK_SIZE, 0);
+    heat_note(v, 0, BLOCK_SIZE, VSFS_HEAT_DIR, 0);
+    heat_note(v, 0, BLOCK_SIZE, VSFS_HEAT_DIR, 1);
+    flush_image(v);
+
+    struct snap_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAP_MAGIC;
+    h.version = SNAP_VERSION;
+    h.journal_seq = v->sb.journal_seq;
+    h.total_blocks = v->sb.total_blocks;
+    h.inode_count = v->sb.inode_count;
+    h.data_start = v->sb.data_start;
+    h.features = v->sb.features;
+    snap_stamp(v, &h);
+    h.inode_hint = v->inode_hint;
+    h.data_hint = v->data_hint;
+    for (uint32_t b = 0; b <= v->dirs_mask; ++b) {
+        for (struct dirinfo *di = v->dirs[b]; di; di = di->next) {
+            h.ndirs++;
+        }
+    }
+    h.ndentries = v->dcount;
+    for (uint32_t i = 0; v->dedup && i < v->data_blocks; ++i) {
+        h.nfp += v->fp.indexed[i];
+    }
+    h.nblocks = v->cached;
+    h.nhot = v->cached - v->a1in_count;
+
+    size_t len = sizeof(h) + (size_t)h.ndirs * sizeof(struct snap_dir) +
+                 (size_t)h.ndentries * sizeof(struct snap_dentry) + (size_t)h.nfp * sizeof(struct snap_fp) +
+                 (size_t)h.nblocks * sizeof(uint32_t);
+    uint8_t *buf = xcalloc(1, len);
+    struct snap_dir *sd = (struct snap_dir *)(buf + sizeof(h));
+    for (uint32_t b = 0; b <= v->dirs_mask; ++b) {
+        for (struct dirinfo *di = v->dirs[b]; di; di = di->next) {
+            sd->ino = di->ino;
+            sd->free_hint = di->free_hint;
+            sd++;
+        }
+    }
+    struct snap_dentry *se = (struct snap_dentry *)sd;
+    for (uint32_t b = 0; b <= v->dhash_mask; ++b) {
+        for (struct dentry *de = v->dhash[b]; de; de = de->next) {
+            se->dir = de->dir;
+            se->ino = de->ino;
+            se->slot = de->slot;
+            memcpy(se->name, de->name, NAME_LEN);
+            se++;
+        }
+    }
+    struct snap_fp *sf = (struct snap_fp *)se;
+    for (uint32_t i = 0; v->dedup && i < v->data_blocks; ++i) {
+        if (v->fp.indexed[i]) {
+            sf->index = i;
+            sf->hash = v->fp.hash[i];
+            sf++;
+        }
+    }
+    uint32_t *blocks = (uint32_t *)sf;
+    for (struct cblock *cb = v->am.lru_next; cb != &v->am; cb = cb->lru_next) {
+        *blocks++ = cb->blkno;
+    }
+    for (struct cblock *cb = v->a1in.lru_next; cb != &v->a1in; cb = cb->lru_next) {
+        *blocks++ = cb->blkno;
+    }
+    h.csum = snap_sum(buf + sizeof(h), len - sizeof(h));
+    memcpy(buf, &h, sizeof(h));
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "vsfsd: cannot save metadata snapshot '%s': %s\n", tmp, strerror(errno));
+        free(buf);
+        return;
+    }
+    pwrite_full(fd, buf, len, 0);
+    if (fsync(fd) < 0 || close(fd) < 0 || rename(tmp, path) < 0) {
+        die("save metadata snapshot");
+    }
+    free(buf);
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Reads metadata blocks into the cache queue they were in, coalescing adjacent ones. */
+static void snapshot_prefetch(struct vol *v, const uint32_t *hot, uint32_t n, uint8_t queue) {
+    uint32_t *list = xcalloc(n ? n : 1, sizeof(*list));
+    uint32_t m = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        if (hot[i] < v->sb.total_blocks) {
+            list[m++] = hot[i];
+        }
+    }
+    qsort(list, m, sizeof(*list), cmp_u32);
+
+    struct iovec iov[64];
+    struct cblock *run_cb[64];
+    uint32_t i = 0;
+    while (i < m) {
+        uint32_t run = 0;
+        while (i + run < m && run < sizeof(iov) / sizeof(iov[0]) && list[i + run] == list[i] + run) {
+            run_cb[run] = cache_get(v, list[i + run], 1);
+            if (run_cb[run]->queue != queue) {
+                lru_unlink(v, run_cb[run]);
+                lru_push(v, run_cb[run], queue, 0);
+            }
+            iov[run].iov_base = run_cb[run]->data;
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        }
+        off_t off = (off_t)list[i] * BLOCK_SIZE;
+        if (vsfs_image_preadv(&v->img, iov, (int)run, off) != (ssize_t)run * BLOCK_SIZE) {
+            for (uint32_t k = 0; k < run; ++k) {
+                read_image(v, run_cb[k]->data, BLOCK_SIZE, (off_t)list[i + k] * BLOCK_SIZE);
+            }
+        }
+        heat_note(v, off, (size_t)run * BLOCK_SIZE, VSFS_HEAT_DIR, 0);
+        i += run;
+    }
+    free(list);
+}
+
+/*
+ * Takes an image's indexes from its snapshot if the snapshot matches the
+ * image as it was found (`found`, before recovery touched it).  The file
+ * is removed either way: once the daemon runs, the image moves on.
+ */
+static void snapshot_load(struct daemon *d, struct vol *v, const struct snap_header *found, uint32_t replayed) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.snap", v->path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    unlink(path);
+    uint64_t start = now_ms();
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct snap_header)) {
+        close(fd);
+        return;
+    }
+    size_t len = (size_t)st.st_size;
+    uint8_t *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    struct snap_header h;
+    memcpy(&h, map, sizeof(h));
+    size_t want = sizeof(h) + (size_t)h.ndirs * sizeof(struct snap_dir) +
+                  (size_t)h.ndentries * sizeof(struct snap_dentry) + (size_t)h.nfp * sizeof(struct snap_fp) +
+                  (size_t)h.nblocks * sizeof(uint32_t);
+    if (h.magic != SNAP_MAGIC || h.version != SNAP_VERSION || replayed || h.journal_seq != v->sb.journal_seq ||
+        h.total_blocks != v->sb.total_blocks || h.inode_count != v->sb.inode_count ||
+        h.data_start != v->sb.data_start || h.features != v->sb.features || h.mtime_sec != found->mtime_sec ||
+        h.mtime_nsec != found->mtime_nsec || h.ctime_sec != found->ctime_sec || h.ctime_nsec != found->ctime_nsec ||
+        h.size != found->size || h.dev != found->dev || h.ino != found->ino || len != want ||
+        snap_sum(map + sizeof(h), len - sizeof(h)) != h.csum) {
+        printf("vsfsd: image %u: metadata snapshot does not match the image, ignored\n", v->idx);
+        munmap(map, len);
+        return;
+    }
+
+    v->inode_hint = h.inode_hint;
+    v->data_hint = h.data_hint;
+    const struct snap_dir *sd = (const struct snap_dir *)(map + sizeof(h));
+    for (uint32_t i = 0; i < h.ndirs; ++i, ++sd) {
+        struct dirinfo *di = xcalloc(1, sizeof(*di));
+        di->ino = sd->ino;
+        di->free_hint = sd->free_hint;
+        di->next = v->dirs[di->ino & v->dirs_mask];
+        v->dirs[di->ino & v->dirs_mask] = di;
+    }
+    if (h.ndentries >= v->dhash_mask) {
+        free(v->dhash);
+        v->dhash_mask = round_pow2(h.ndentries * 2) - 1;
+        v->dhash = xcalloc((size_t)v->dhash_mask + 1, sizeof(*v->dhash));
+    }
+    const struct snap_dentry *se = (const struct snap_dentry *)sd;
+    for (uint32_t i = 0; i < h.ndentries; ++i, ++se) {
+        dindex_insert(v, se->dir, se->name, se->ino, se->slot);
+    }
+    const struct snap_fp *sf = (const struct snap_fp *)se;
+    for (uint32_t i = 0; v->dedup && i < h.nfp; ++i) {
+        if (sf[i].index < v->data_blocks) {
+            fp_insert(v, v->sb.data_start + sf[i].index, sf[i].hash);
+        }
+    }
+    uint32_t hot = h.nblocks;
+    uint32_t share = d->budget.meta_limit / d->budget.nvols;
+    if (hot > share) {
+        hot = share;
+    }
+    uint32_t nhot = h.nhot < hot ? h.nhot : hot;
+    snapshot_prefetch(v, (const uint32_t *)(sf + h.nfp) + nhot, hot - nhot, Q_A1IN);
+    snapshot_prefetch(v, (const uint32_t *)(sf + h.nfp), nhot, Q_AM);
+    munmap(map, len);
+    printf("vsfsd: image %u: warm start from metadata snapshot (%u directories, %u entries, %u fingerprints, "
+           "%u blocks) in %llu ms\n", v->idx, h.ndirs, h.ndentries, v->dedup ? h.nfp : 0, hot,
+           (unsigned long long)(now_ms() - start));
+}
+
+/* ---- setup ---- */
+
+/*
+ * Opens the file of image `idx`.  Every image is attached before any is
+ * recovered, so one listed as the base of a later overlay is refused
+ * before its journal is replayed into it.
+ */
+static void vol_attach(struct daemon *d, uint32_t idx, const char *path) {
+    struct vol *v = &d->vols[idx];
+    memset(v, 0, sizeof(*v));
+    v->path = path;
+    v->idx = idx;
+    if (vsfs_image_open(&v->img, path, O_RDWR) < 0) {
+        fail("open image '%s': %s", path, vsfs_image_strerror(errno));
+    }
+    struct stat st, base;
+    if (fstat(v->img.fd, &st) < 0 || (v->img.base_fd >= 0 && fstat(v->img.base_fd, &base) < 0)) {
+        die("fstat");
+    }
+    for (uint32_t k = 0; k < idx; ++k) {
+        const struct vsfs_image *im = &d->vols[k].img;
+        struct stat other;
+        if (fstat(im->fd, &other) == 0 && other.st_dev == st.st_dev && other.st_ino == st.st_ino) {
+            fail("'%s' and '%s' are the same image", d->vols[k].path, path);
+        }
+        // Writing the base of an overlay would corrupt the overlay.
+        if (v->img.base_fd >= 0 && other.st_dev == base.st_dev && other.st_ino == base.st_ino) {
+            fail("'%s' is the base of overlay '%s'", d->vols[k].path, path);
+        }
+        if (im->base_fd >= 0 && fstat(im->base_fd, &other) == 0 &&
+            other.st_dev == st.st_dev && other.st_ino == st.st_ino) {
+            fail("'%s' is the base of overlay '%s'", path, d->vols[k].path);
+        }
+    }
+}
+
+static void vol_open(struct daemon *d, uint32_t idx) {
+    struct vol *v = &d->vols[idx];
+    const char *path = v->path;
+    uint8_t block[BLOCK_SIZE];
+    read_image(v, block, BLOCK_SIZE, 0);
+    memcpy(&v->sb, block, sizeof(v->sb));
+    const struct superblock *sb = &v->sb;
+    if (sb->magic != FS_MAGIC || sb->block_size != BLOCK_SIZE ||
+        !(sb->journal_block < sb->inode_bitmap && sb->inode_bitmap < sb->data_bitmap &&
+          sb->data_bitmap < sb->inode_start && sb->inode_start < sb->data_start &&
+          sb->data_start < sb->total_blocks)) {
+        fail("'%s' is not a valid VSFS image", path);
+    }
+    if (sb->mode != FS_MODE_JOURNAL) {
+        fail("'%s' uses copy-on-write metadata; vsfsd only serves journaled images", path);
+    }
+    v->journal_blocks = sb->inode_bitmap - sb->journal_block;
+    v->inode_bmap_blocks = sb->data_bitmap - sb->inode_bitmap;
+    v->data_bmap_blocks = sb->inode_start - sb->data_bitmap;
+    v->inode_blocks = sb->data_start - sb->inode_start;
+    v->data_blocks = sb->total_blocks - sb->data_start;
+    if (sb->features & ~FS_FEAT_DEDUP) {
+        fail("'%s' uses unknown features 0x%x", path, sb->features & ~FS_FEAT_DEDUP);
+    }
+    // A write to a journaled file logs its inode, every block it fills
+    // and the bitmap blocks those came from.
+    uint32_t bmap_touched = v->data_bmap_blocks < DIRECT_POINTERS ? v->data_bmap_blocks : DIRECT_POINTERS;
+    v->op_max_blocks = 1 + DIRECT_POINTERS + bmap_touched;
+    if (v->op_max_blocks < OP_MAX_BLOCKS) {
+        v->op_max_blocks = OP_MAX_BLOCKS;
+    }
+    if (sb->features & FS_FEAT_DEDUP) {
+        if (sb->refcount_start <= sb->data_start || sb->refcount_start >= sb->total_blocks ||
+            (uint64_t)(sb->total_blocks - sb->refcount_start) * REFS_PER_BLOCK < v->data_blocks) {
+            fail("'%s' has a damaged refcount table location", path);
+        }
+        // A write touches the refcounts of up to two blocks per pointer.
+        uint32_t ref_blocks = sb->total_blocks - sb->refcount_start;
+        v->dedup = 1;
+        v->op_max_blocks += ref_blocks < 2 * DIRECT_POINTERS ? ref_blocks : 2 * DIRECT_POINTERS;
+        pthread_mutex_init(&v->fp.lock, NULL);
+        v->fp.mask = round_pow2(v->data_blocks) - 1;
+        v->fp.heads = xcalloc((size_t)v->fp.mask + 1, sizeof(*v->fp.heads));
+        v->fp.next = xcalloc(v->data_blocks, sizeof(*v->fp.next));
+        v->fp.hash = xcalloc(v->data_blocks, sizeof(*v->fp.hash));
+        v->fp.indexed = xcalloc(v->data_blocks, 1);
+    }
+    if (d->heat_buckets) {
+        struct vsfs_heat_layout hl = {
+            sb->total_blocks, sb->journal_block, sb->inode_bitmap, sb->inode_start, sb->data_start,
+            v->dedup ? sb->refcount_start : 0,
+        };
+        if (vsfs_heat_init(&v->heat, &hl, d->heat_buckets) < 0) {
+            die("calloc");
+        }
+        heat_note(v, 0, BLOCK_SIZE, VSFS_HEAT_DIR, 0);   // the superblock, read above
+    }
+
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->commit_done, NULL);
+    pthread_cond_init(&v->ckpt_done, NULL);
+    v->lazy_ms = d->lazy_ms;
+    v->stats = &d->hdr->vol_stats[idx];
+    v->totals = &d->hdr->stats;
+    v->budget = &d->budget;
+    v->d = d;
+    v->commit_task.run = commit_task;
+    v->flush_task.run = flush_task;
+    v->ckpt_task.run = ckpt_task;
+    v->io = &d->io;
+    v->chash_mask = round_pow2(d->budget.meta_limit) - 1;
+    v->chash = xcalloc((size_t)v->chash_mask + 1, sizeof(*v->chash));
+    v->a1in.lru_next = v->a1in.lru_prev = &v->a1in;
+    v->am.lru_next = v->am.lru_prev = &v->am;
+    v->nghosts = d->budget.meta_limit / 2;
+    v->ghosts = xcalloc(v->nghosts, sizeof(*v->ghosts));
+    for (uint32_t i = 0; i < v->nghosts; ++i) {
+        v->ghosts[i].blkno = GHOST_NONE;
+    }
+    v->ghash_mask = round_pow2(v->nghosts) - 1;
+    v->ghash = xcalloc((size_t)v->ghash_mask + 1, sizeof(*v->ghash));
+
+    v->jcap = v->journal_blocks * BLOCK_SIZE;
+    v->jused = sizeof(struct journal_header);
+    v->max_txn_blocks = (v->jcap - sizeof(struct journal_header) - sizeof(struct commit_record)) /
+                        sizeof(struct data_record);
+    if (v->max_txn_blocks < v->op_max_blocks) {
+        fail("journal of %u blocks is too small", v->journal_blocks);
+    }
+    v->jbuf = xcalloc(v->max_txn_blocks, sizeof(struct data_record) + sizeof(struct commit_record));
+    v->tid = sb->journal_seq + 1;
+    v->durable_tid = v->tid - 1;
+    v->ino_tid = xcalloc(sb->inode_count, sizeof(*v->ino_tid));
+
+    v->dhash_mask = 1023;
+    v->dhash = xcalloc((size_t)v->dhash_mask + 1, sizeof(*v->dhash));
+    v->dirs_mask = 1023;
+    v->dirs = xcalloc((size_t)v->dirs_mask + 1, sizeof(*v->dirs));
+
+    struct snap_header found;
+    snap_stamp(v, &found);
+    uint32_t replayed = journal_recover(v);
+    pcache_init(v, &d->budget);
+    v->zhash_mask = round_pow2(d->budget.clusters_limit) - 1;
+    v->zhash = xcalloc((size_t)v->zhash_mask + 1, sizeof(*v->zhash));
+    v->zlru.lru_next = v->zlru.lru_prev = &v->zlru;
+    v->zstage = xcalloc(1, CLUSTER_SIZE);
+    v->zwork = xcalloc(CLUSTERS * 2, CLUSTER_SIZE);
+    if (d->snapshots) {
+        snapshot_load(d, v, &found, replayed);
+    }
+}
+
+static void ring_create(struct daemon *d, const char *name, uint32_t nslots) {
+    vsfs_shm_path(d->shm_path, sizeof(d->shm_path), name);
+    int fd = shm_open(d->shm_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        // A previous daemon may have died; refuse to steal a live one.
+        int old = shm_open(d->shm_path, O_RDWR, 0);
+        if (old >= 0) {
+            struct vsfs_ring_hdr probe;
+            ssize_t n = pread(old, &probe, sizeof(probe), 0);
+            close(old);
+            if (n == (ssize_t)sizeof(probe) && probe.magic == VSFS_RING_MAGIC && probe.daemon_pid > 0 &&
+                kill(probe.daemon_pid, 0) == 0) {
+                fail("another daemon (pid %d) is serving '%s'", (int)probe.daemon_pid, name);
+            }
+        }
+        shm_unlink(d->shm_path);
+        fd = shm_open(d->shm_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0) {
+        die("shm_open");
+    }
+    d->map_len = vsfs_ring_region_size(nslots);
+    if (ftruncate(fd, (off_t)d->map_len) < 0) {
+        die("ftruncate");
+    }
+    void *map = mmap(NULL, d->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        die("mmap");
+    }
+    d->hdr = map;
+    d->hdr->version = VSFS_RING_VERSION;
+    d->hdr->nslots = nslots;
+    d->hdr->slot_size = sizeof(struct vsfs_ring_slot);
+    d->hdr->nvols = d->nvols;
+    atomic_store(&d->hdr->daemon_pid, (int32_t)getpid());
+    atomic_thread_fence(memory_order_release);
+    d->hdr->magic = VSFS_RING_MAGIC;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] [image...]\n"
+            "  -s name     shared memory name clients attach to (default %s)\n"
+            "  -c clients  client slots (default %u)\n"
+            "  -w threads  worker threads serving the client slots (default %u)\n"
+            "  -W threads  background threads (commits and write-back) shared by all images\n"
+            "              (default: $VSFS_THREADS, else online CPUs)\n"
+            "  -C blocks   metadata cache size in blocks, shared by all images (default %u)\n"
+            "  -b ops      most operations grouped into one commit (default %u)\n"
+            "  -d level    durability of namespace operations that do not pick one: sync (complete\n"
+            "              once committed), group (commit within -I ms or -b operations) or none\n"
+            "              (commit at the next sync) (default sync)\n"
+            "  -I ms       commit interval of grouped operations (default %u)\n"
+            "  -P pages    file data cache size in pages, shared by all images (default %u)\n"
+            "  -Z clusters decompressed cluster cache size, shared by all images (default %u)\n"
+            "  -D pct      dirty pages, in %% of the cache, at which writers flush themselves (default %u)\n"
+            "  -B pct      dirty pages at which the background flusher starts (default %u)\n"
+            "  -e ms       age after which a dirty page is written back (default %u)\n"
+            "  -i ms       background flusher interval (default %u)\n"
+            "  -q writes   checkpoint and write-back writes in flight at once, across images (default %u)\n"
+            "  -T ms       lazytime: defer logging mtime-only inode changes for up to this long\n"
+            "              (default 0, log them with the write)\n"
+            "  -j          journal the data of every file created, not only those asking for it\n"
+            "              (data=journal: a small write and fsync is one journal append)\n"
+            "  -n          neither load nor save metadata snapshots (<image>.snap)\n"
+            "  -R file     record every operation to a trace file, for loadgen -R to replay\n"
+            "  -H buckets  count block reads and writes per image, per range of blocks and subsystem,\n"
+            "              in at most this many ranges (vsfsctl heat prints them)\n",
+            prog, VSFS_DEFAULT_SHM, DEFAULT_CLIENTS, DEFAULT_WORKERS, DEFAULT_CACHE_BLOCKS,
+            DEFAULT_BATCH, DEFAULT_COMMIT_MS, DEFAULT_PAGES, DEFAULT_CLUSTERS, DEFAULT_DIRTY_PCT, DEFAULT_DIRTY_BG_PCT,
+            DEFAULT_EXPIRE_MS, DEFAULT_INTERVAL_MS, DEFAULT_BG_INFLIGHT);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    const char *shm_name = VSFS_DEFAULT_SHM;
+    uint32_t clients = DEFAULT_CLIENTS;
+    uint32_t batch = DEFAULT_BATCH;
+    uint32_t workers = DEFAULT_WORKERS;
+    uint32_t committers = 0;
+    uint32_t lazy_ms = 0;
+    int durable = VSFS_DURABLE_SYNC;
+    uint32_t commit_ms = DEFAULT_COMMIT_MS;
+    int snapshots = 1;
+    int journal_data = 0;
+    uint32_t bg_inflight = DEFAULT_BG_INFLIGHT;
+    const char *trace_path = NULL;
+    uint32_t heat_buckets = 0;
+    struct config cfg = {
+        .cache_blocks = DEFAULT_CACHE_BLOCKS,
+        .pages = DEFAULT_PAGES,
+        .clusters = DEFAULT_CLUSTERS,
+        .dirty_pct = DEFAULT_DIRTY_PCT,
+        .dirty_bg_pct = DEFAULT_DIRTY_BG_PCT,
+        .expire_ms = DEFAULT_EXPIRE_MS,
+        .interval_ms = DEFAULT_INTERVAL_MS,
+    };
+
+    int c;
+    while ((c = getopt(argc, argv, "s:c:w:W:C:b:d:I:P:Z:D:B:e:i:q:T:jnR:H:h")) != -1) {
+        switch (c) {
+        case 's': shm_name = optarg; break;
+        case 'c': clients = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'w': workers = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'W': committers = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'C': cfg.cache_blocks = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'b': batch = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'd': durable = vsfs_durable_level(optarg); break;
+        case 'I': commit_ms = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'P': cfg.pages = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'Z': cfg.clusters = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'D': cfg.dirty_pct = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'B': cfg.dirty_bg_pct = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'e': cfg.expire_ms = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'i': cfg.interval_ms = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'q': bg_inflight = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'T': lazy_ms = (uint32_t)strtoul(optarg, NULL, 0); break;
+        case 'j': journal_data = 1; break;
+        case 'n': snapshots = 0; break;
+        case 'R': trace_path = optarg; break;
+        case 'H': heat_buckets = (uint32_t)strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (clients == 0 || cfg.cache_blocks < 16 || batch == 0 || cfg.pages < 16 || cfg.clusters == 0 ||
+        cfg.dirty_pct == 0 || cfg.dirty_pct > 100 || workers == 0 || durable < 0 ||
+        commit_ms == 0 || bg_inflight == 0) {
+        usage(argv[0]);
+    }
+    uint32_t nvols = optind < argc ? (uint32_t)(argc - optind) : 1;
+    if (nvols > VSFS_MAX_VOLS) {
+        fail("at most %u images", VSFS_MAX_VOLS);
+    }
+    if (workers > clients) {
+        workers = clients;
+    }
+
+    static struct daemon d;
+    d.batch_max = batch;
+    d.nvols = nvols;
+    d.nworkers = workers;
+    committers = vsfs_sched_threads(committers);
+    d.lazy_ms = lazy_ms;
+    d.durable = (uint16_t)durable;
+    d.commit_ms = commit_ms;
+    d.snapshots = snapshots;
+    d.journal_data = journal_data;
+    d.heat_buckets = heat_buckets;
+    d.vols = xcalloc(nvols, sizeof(*d.vols));
+    d.cq_locks = xcalloc(clients, sizeof(*d.cq_locks));
+    for (uint32_t i = 0; i < clients; ++i) {
+        pthread_mutex_init(&d.cq_locks[i], NULL);
+    }
+    budget_init(&d.budget, &cfg, nvols);
+    pthread_mutex_init(&d.io.lock, NULL);
+    pthread_cond_init(&d.io.cv, NULL);
+    d.io.bg_max = bg_inflight;
+
+    // Claim the ring name first so a second daemon never touches the images.
+    ring_create(&d, shm_name, clients);
+    if (trace_path) {
+        d.trace = trace_open(trace_path, nvols, clients);
+    }
+    for (uint32_t i = 0; i < nvols; ++i) {
+        vol_attach(&d, i, optind < argc ? argv[optind + (int)i] : DEFAULT_IMAGE);
+    }
+    for (uint32_t i = 0; i < nvols; ++i) {
+        vol_open(&d, i);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Signals go to the main thread, which is worker 0.
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (vsfs_sched_init(&d.sched, committers) != 0) {
+        fail("cannot start background threads");
+    }
+    if (pthread_create(&d.flusher, NULL, flusher_main, &d) != 0) {
+        fail("cannot start flusher thread");
+    }
+    d.workers = xcalloc(workers, sizeof(*d.workers));
+    struct worker_arg *wargs = xcalloc(workers, sizeof(*wargs));
+    for (uint32_t i = 1; i < workers; ++i) {
+        wargs[i].d = &d;
+        wargs[i].w = i;
+        if (pthread_create(&d.workers[i], NULL, worker_main, &wargs[i]) != 0) {
+            fail("cannot start worker thread");
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    for (uint32_t i = 0; i < nvols; ++i) {
+        printf("vsfsd: image %u is '%s'\n", i, d.vols[i].path);
+    }
+    printf("vsfsd: serving %u image%s on shm '%s' (%u client slots, %u workers, %u background threads)\n", nvols,
+           nvols == 1 ? "" : "s", shm_name, clients, workers, committers);
+    fflush(stdout);
+    serve(&d, 0);
+
+    atomic_fetch_add(&d.hdr->doorbell, 1);
+    vsfs_futex_wake_all(&d.hdr->doorbell);
+    for (uint32_t i = 1; i < workers; ++i) {
+        pthread_join(d.workers[i], NULL);
+    }
+    vsfs_group_wait(&d.sched, &d.commits);
+    shutdown_vols(&d);
+    if (d.trace) {
+        trace_close(d.trace);
+    }
+    pthread_mutex_lock(&d.budget.lock);
+    d.budget.stop = 1;
+    pthread_cond_signal(&d.budget.wake);
+    pthread_mutex_unlock(&d.budget.lock);
+    pthread_join(d.flusher, NULL);
+    vsfs_sched_destroy(&d.sched);
+    for (uint32_t i = 0; d.snapshots && i < nvols; ++i) {
+        snapshot_save(&d.vols[i]);
+    }
+
+    atomic_store(&d.hdr->daemon_pid, 0);
+    shm_unlink(d.shm_path);
+    munmap(d.hdr, d.map_len);
+    for (uint32_t i = 0; i < nvols; ++i) {
+        vsfs_image_close(&d.vols[i].img);
+    }
+    free(wargs);
+    printf("vsfsd: clean shutdown\n");
+    return 0;
+}